@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 
 #include <pthread.h>
 
@@ -25,6 +26,61 @@ struct concurrent_queue {
 	struct queue queue;
 };
 
+/**
+ * @brief A bounded, lock-free multi-producer / single-consumer ring buffer.
+ * 
+ * Every slot carries a sequence number that tells producers and the consumer
+ * whether the slot is free to be written or ready to be read, so enqueueing
+ * from any number of threads never takes a lock. Only one thread may dequeue.
+ */
+struct mpsc_queue {
+	/**
+	 * @brief The number of slots. Always a power of two.
+	 */
+	size_t size;
+
+	size_t element_size;
+
+	/**
+	 * @brief The size of one slot (sequence number + element), in bytes.
+	 */
+	size_t slot_size;
+	void  *slots;
+
+	/// Keep the producer and consumer indices on separate cache lines,
+	/// so producers don't bounce the consumers cache line around.
+	char pad0[64];
+	atomic_size_t enqueue_index;
+	char pad1[64];
+	size_t dequeue_index;
+};
+
+/**
+ * @brief A bounded, lock-free single-producer / single-consumer ring buffer.
+ * 
+ * Cheaper than @ref mpsc_queue, since the producer owns the write index and the
+ * consumer owns the read index, so neither needs a compare-and-swap.
+ * Only one thread may enqueue and only one thread may dequeue.
+ */
+struct spsc_queue {
+	/**
+	 * @brief The number of elements. Always a power of two.
+	 */
+	size_t size;
+
+	size_t element_size;
+	void  *elements;
+
+	/// Written by the producer, read by the consumer.
+	char pad0[64];
+	atomic_size_t write_index;
+
+	/// Written by the consumer, read by the producer.
+	char pad1[64];
+	atomic_size_t read_index;
+	char pad2[64];
+};
+
 struct pointer_set {
 	/**
 	 * @brief The number of non-NULL pointers currently stored in @ref pointers. 
@@ -139,6 +195,16 @@ int queue_peek(
 	void **pelement_out
 );
 
+/**
+ * @brief Get a pointer to the element at position index, counted from the
+ * oldest element. Returns EAGAIN if the queue has less than index + 1 elements.
+ */
+int queue_peek_nth(
+	struct queue *queue,
+	size_t index,
+	void **pelement_out
+);
+
 
 int cqueue_init(
 	struct concurrent_queue *queue,
@@ -203,6 +269,78 @@ int cqueue_peek_locked(
 	void **pelement_out
 );
 
+int cqueue_peek_nth_locked(
+	struct concurrent_queue *queue,
+	size_t index,
+	void **pelement_out
+);
+
+/*
+ * multi-producer single-consumer queue
+ */
+int mpscq_init(
+	struct mpsc_queue *queue,
+	size_t element_size,
+	size_t size
+);
+
+void mpscq_deinit(
+	struct mpsc_queue *queue
+);
+
+/**
+ * @brief Enqueue a copy of the element at p_element. Can be called from any thread.
+ * 
+ * @returns 0 on success, ENOSPC if the queue is full.
+ */
+int mpscq_try_enqueue(
+	struct mpsc_queue *queue,
+	const void *p_element
+);
+
+/**
+ * @brief Dequeue the oldest element into element_out. Must only be called by the (single) consumer thread.
+ * 
+ * @returns 0 on success, EAGAIN if the queue is empty.
+ */
+int mpscq_try_dequeue(
+	struct mpsc_queue *queue,
+	void *element_out
+);
+
+/*
+ * single-producer single-consumer queue
+ */
+int spscq_init(
+	struct spsc_queue *queue,
+	size_t element_size,
+	size_t size
+);
+
+void spscq_deinit(
+	struct spsc_queue *queue
+);
+
+/**
+ * @brief Enqueue a copy of the element at p_element. Must only be called by the (single) producer thread.
+ * 
+ * @returns 0 on success, ENOSPC if the queue is full.
+ */
+int spscq_try_enqueue(
+	struct spsc_queue *queue,
+	const void *p_element
+);
+
+/**
+ * @brief Dequeue the oldest element into element_out. Must only be called by the (single) consumer thread.
+ * 
+ * @returns 0 on success, EAGAIN if the queue is empty.
+ */
+int spscq_try_dequeue(
+	struct spsc_queue *queue,
+	void *element_out
+);
+
 /*
  * pointer set
  */
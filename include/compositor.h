@@ -2,12 +2,65 @@
 #define _COMPOSITOR_H
 
 #include <stdint.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
 
 #include <gbm.h>
 #include <flutter_embedder.h>
 
 #include <collection.h>
 #include <modesetting.h>
+#include <frame_telemetry.h>
+#include <flutter-pi.h>
+
+/**
+ * @brief The maximum number of layers a frame can have for the compositor
+ * to remember which DRM plane each layer was presented on.
+ */
+#define PLANE_ASSIGNMENT_CACHE_MAX_LAYERS 16
+
+#define KMS_COMMIT_MAX_IN_FENCES 4
+
+/**
+ * @brief How many layer structures the plane allocator remembers the
+ * DRM_MODE_ATOMIC_TEST_ONLY results of.
+ */
+#define PLANE_CONFIG_CACHE_SIZE 8
+
+/**
+ * @brief How many DRM framebuffers a scanout view keeps for the buffers it was given,
+ * so a producer cycling through a fixed set of buffers doesn't create a new FB every frame.
+ */
+#define SCANOUT_VIEW_FB_CACHE_SIZE 8
+
+/**
+ * @brief A layer structure the plane allocator tested, and how many of its
+ * backing stores the hardware accepts on their own planes.
+ */
+struct plane_config {
+    size_t n_layers;
+    struct {
+        FlutterLayerContentType type;
+        bool is_gbm;
+        int width, height;
+
+        /// For platform views, the planes they used, as a bitmask of plane indices.
+        uint64_t platform_view_planes;
+    } layers[PLANE_ASSIGNMENT_CACHE_MAX_LAYERS];
+
+    int n_planes;
+};
+
+/**
+ * @brief Called on the main thread when a mode switch requested using
+ * @ref compositor_set_mode was applied (result 0) or failed.
+ * result is ECANCELED if the switch was replaced by a newer one before it was applied.
+ */
+typedef void (*compositor_mode_set_cb)(
+    int result,
+    void *userdata
+);
 
 typedef int (*platform_view_mount_cb)(
     int64_t view_id,
@@ -54,9 +107,28 @@ typedef int (*platform_view_present_cb)(
     void *userdata
 );
 
+/**
+ * @brief A CPU-mapped DRM dumb buffer with a framebuffer, used for presenting
+ * the frames of the software renderer.
+ */
+struct dumb_buffer {
+    uint32_t gem_handle;
+    uint32_t pitch;
+    size_t size;
+    uint32_t fb_id;
+    void *map;
+};
+
 struct compositor {
     struct drmdev *drmdev;
 
+    /**
+     * @brief The EGL_BUFFER_AGE_EXT of the window surface buffer that's presented with the current frame.
+     * 0 if the age is unknown. Queried before the buffer is swapped, since afterwards the age
+     * of the next back buffer would be returned. Only used on the raster thread.
+     */
+    int gbm_buffer_age;
+
     /**
      * @brief Contains a struct for each existing platform view, containing the view id
      * and platform view callbacks.
@@ -88,11 +160,29 @@ struct compositor {
      * @brief A cache of rendertargets that are not currently in use for
      * any flutter layers and can be reused.
      * 
-     * Make sure to destroy all stale rendertargets before presentation so all the DRM planes
-     * that are reserved by any stale rendertargets get freed.
+     * @ref on_create_backing_store only reuses rendertargets with the
+     * requested size and format. Rendertargets that weren't reused for
+     * RENDERTARGET_POOL_IDLE_TIMEOUT_NS are destroyed, except for the
+     * ones that were prewarmed. (see --prewarm-rendertargets)
      */
     struct concurrent_pointer_set stale_rendertargets;
 
+    /**
+     * @brief Whether the prewarmed rendertargets were already created.
+     * They're created the first time flutter creates a backing store,
+     * since that's the first time the flutter GL context is current on the raster thread.
+     */
+    bool has_prewarmed_rendertargets;
+
+    /**
+     * @brief How often @ref on_create_backing_store could reuse a stale rendertarget,
+     * how often it had to create a new one, and how many stale rendertargets were
+     * destroyed because they weren't used for a while.
+     */
+    atomic_uint_least64_t n_rendertarget_pool_hits;
+    atomic_uint_least64_t n_rendertarget_pool_misses;
+    atomic_uint_least64_t n_rendertargets_trimmed;
+
     /**
      * @brief Whether the mouse cursor is currently enabled and visible.
      */
@@ -117,15 +207,185 @@ struct compositor {
     } cursor;
 
     /**
-     * If true, @ref on_present_layers will commit blockingly.
+     * @brief Whether the last commit was done with a page flip event
+     * that didn't arrive yet.
+     * 
+     * There can only be one pending flip per CRTC, so the KMS commit thread
+     * waits for that page flip before committing the next frame.
+     * 
+     * Protected by @ref page_flip_mutex.
+     */
+    bool has_pending_page_flip;
+    pthread_mutex_t page_flip_mutex;
+    pthread_cond_t page_flip_cond;
+
+    /**
+     * @brief When @ref on_present_layers was entered for the last committed frame,
+     * and when its commit returned. (0 if it didn't return yet)
+     * 
+     * Protected by @ref page_flip_mutex.
+     */
+    uint64_t last_present_time;
+    uint64_t last_commit_time;
+
+    /**
+     * @brief Whether @ref on_present_layers synchronizes with the GPU and the display
+     * using explicit fences. True if --explicit-sync was given and EGL, the
+     * planes and the CRTC support it.
+     * 
+     * The GPU signals a native fence when it finished rendering a frame, which is
+     * passed to the planes as IN_FENCE_FD. The OUT_FENCE_PTR fence of the commit
+     * signals once the frame is on screen and the buffers of the frame before it
+     * are free again, so the GPU waits for it before rendering the next frame.
+     */
+    bool use_explicit_sync;
+
+    /**
+     * @brief The KMS commit thread. With atomic modesetting, @ref on_present_layers
+     * only builds the atomic request of a frame and puts it into the mailbox,
+     * so the raster thread never waits for the display.
+     * 
+     * The commit thread commits the request in the mailbox (nonblocking) as soon as
+     * the last commit was flipped to the screen. If the next frame is presented before that,
+     * it's merged into the request that's still in the mailbox, so the newest frame is shown
+     * with the next flip and the frame before it is dropped.
+     * 
+     * Everything in here is protected by @ref page_flip_mutex, @ref page_flip_cond
+     * is broadcast when the mailbox was emptied or a page flip arrived. The commit thread
+     * takes the request out of the mailbox and doesn't hold the mutex while committing it,
+     * so the raster thread and the page flip handler never wait for a commit.
+     */
+    struct {
+        pthread_t thread;
+
+        /// The request that's waiting to be committed, or NULL.
+        struct drmdev_atomic_req *mailbox;
+        uint32_t mailbox_flags;
+
+        /// When presenting the newest frame in the mailbox started, and its sequence number.
+        uint64_t mailbox_present_time;
+        uint64_t mailbox_frame_seq;
+
+        /// How many frames were merged into the mailbox request.
+        unsigned int n_mailbox_frames;
+
+        /// Whether one of the frames in the mailbox only updates the framebuffers of the
+        /// last plane assignment. Those can't be committed anymore if the commit before them failed.
+        bool is_mailbox_incremental;
+
+        /// The IN_FENCE_FDs of the mailbox request. They need to stay open until it's committed.
+        int mailbox_in_fence_fds[KMS_COMMIT_MAX_IN_FENCES];
+        int n_mailbox_in_fence_fds;
+
+        /// Requests the commit thread is done with, reused for the next frames.
+        struct drmdev_atomic_req *free_reqs[3];
+        int n_free_reqs;
+
+        /// The OUT_FENCE_PTR fence of the last commit, if @ref on_present_layers didn't wait for it yet.
+        int out_fence_fd;
+
+        /// Set when a commit failed, so the next frame doesn't build on the plane state it would have applied.
+        bool has_failed_commit;
+
+        /// The mode @ref compositor_set_mode staged. The commit thread selects it and
+        /// applies it with the next commit, so only it changes the selected mode of the drmdev.
+        drmModeModeInfo pending_mode;
+        bool has_pending_mode;
+        compositor_mode_set_cb pending_mode_cb;
+        void *pending_mode_userdata;
+
+        /// The storage of the mode the commit thread selected. It alternates between both,
+        /// so the mode the drmdev points to is never overwritten.
+        drmModeModeInfo selected_modes[2];
+
+        /// Set while the commit thread commits a request that applies a new mode.
+        /// If the commit fails, the previously selected mode is selected again.
+        bool is_committing_mode;
+        const drmModeModeInfo *previous_mode;
+        compositor_mode_set_cb committing_mode_cb;
+        void *committing_mode_userdata;
+
+        /// Set by @ref compositor_deinitialize to make the commit thread exit.
+        bool should_stop;
+    } kms_commit;
+
+    /**
+     * @brief The sequence number of the last frame @ref on_present_layers was called for.
+     * Only used on the raster thread.
+     */
+    uint64_t frame_seq;
+
+    /**
+     * @brief The sequence number of the frame that's waiting for its page flip,
+     * and of the last frame that was flipped to the screen.
+     * 
+     * Rendertargets use this to know which of their buffers are still scanned out.
+     * @ref pending_flip_frame_seq is protected by @ref page_flip_mutex.
+     */
+    uint64_t pending_flip_frame_seq;
+    atomic_uint_least64_t flipped_frame_seq;
+
+    /**
+     * @brief Which DRM plane each layer of the last frame was presented on.
      * 
-     * It will also schedule a simulated page flip event on the main thread
-     * afterwards so the frame queue works.
+     * If the next frame has the same layer structure (same layer types, same platform views,
+     * backing stores of the same kind and size), @ref on_present_layers reuses this assignment
+     * and only updates the framebuffers of the planes. DRM keeps all the other plane
+     * properties from the last commit.
      * 
-     * If false, @ref on_present_layers will commit nonblocking using page flip events,
-     * like usual.
+     * Only used with atomic modesetting.
      */
-    bool do_blocking_atomic_commits;
+    struct {
+        bool is_valid;
+        size_t n_layers;
+        struct {
+            FlutterLayerContentType type;
+            int64_t platform_view_id;
+            bool is_gbm;
+            int width, height;
+            struct drm_plane *plane;
+        } layers[PLANE_ASSIGNMENT_CACHE_MAX_LAYERS];
+        int64_t min_zpos;
+
+        /**
+         * @brief The primary & overlay planes that were disabled in the last frame,
+         * as a bitmask of their index in drmdev->planes.
+         */
+        uint64_t disabled_planes;
+    } plane_assignment;
+
+    /**
+     * @brief The plane configurations that were tested with DRM_MODE_ATOMIC_TEST_ONLY commits.
+     * 
+     * The first time a layer structure is presented, @ref on_present_layers tests how many of
+     * its backing stores the hardware can show on their own planes, together with the planes
+     * of the platform views, starting with all of them. The backing stores that didn't get a plane
+     * are composited into the backing store directly below them using OpenGL, beginning with the
+     * highest one. Backing stores are never composited across a platform view, so the
+     * platform views stay between the same flutter layers.
+     * 
+     * Only used on the raster thread. Cleared when a modeset is applied.
+     */
+    struct plane_config plane_configs[PLANE_CONFIG_CACHE_SIZE];
+    int n_plane_configs;
+    int next_plane_config;
+
+    /**
+     * @brief The OpenGL program used for compositing backing stores into each other,
+     * if the hardware doesn't have enough planes. Lives in the root context.
+     */
+    GLuint flatten_program;
+
+    /**
+     * @brief The display-sized buffers the frames of the software renderer (--renderer software)
+     * are copied into. One is on screen while the next frame is copied into the other one.
+     * 
+     * Only used on the raster thread.
+     */
+    struct {
+        struct dumb_buffer buffers[2];
+        int back_buffer;
+    } software;
 };
 
 /*
@@ -180,7 +440,26 @@ struct backing_store_metadata {
 
 struct rendertarget_gbm {
     struct gbm_surface *gbm_surface;
-    struct gbm_bo *current_front_bo;
+
+    /**
+     * @brief The buffers that were locked for presenting, oldest first, and
+     * the sequence numbers of the frames they were presented in.
+     * 
+     * A buffer is released when a newer one was flipped to the screen.
+     * Until then, it may still be scanned out (or be waiting for its commit).
+     */
+    struct {
+        struct gbm_bo *bo;
+        uint64_t frame_seq;
+    } locked_bos[FRAME_QUEUE_MAX_DEPTH + 2];
+    int n_locked_bos;
+
+    /**
+     * @brief The damage of the last frames that were presented from this rendertarget, newest first.
+     * A buffer that missed some frames needs the damage of all of them.
+     */
+    struct drm_mode_rect damage_history[FRAME_QUEUE_MAX_DEPTH + 2];
+    int n_damage_history;
 };
 
 /**
@@ -189,7 +468,16 @@ struct rendertarget_gbm {
  */
 struct rendertarget_nogbm {
     GLuint gl_fbo_id;
-    struct drm_rbo rbos[2];
+
+    /**
+     * @brief The renderbuffers that are cycled through. Only the first @ref n_rbos are used.
+     * 
+     * One renderbuffer is on screen, and every frame that's in flight
+     * (at most --frame-queue-depth) needs one more. The committed frames
+     * may still be waiting in the KMS commit thread for their flip.
+     */
+    struct drm_rbo rbos[FRAME_QUEUE_MAX_DEPTH + 1];
+    int n_rbos;
     
     /**
      * @brief The index of the @ref drm_rbo in the @ref rendertarget_nogbm::rbos array that
@@ -203,6 +491,25 @@ struct rendertarget {
 
     struct compositor *compositor;
 
+    /**
+     * @brief The size and DRM fourcc format of the buffers of this rendertarget.
+     * Used as the key in the stale rendertarget pool.
+     */
+    int width, height;
+    uint32_t format;
+
+    /**
+     * @brief When this rendertarget was put into the stale rendertarget pool.
+     */
+    uint64_t stale_since;
+
+    /**
+     * @brief The region the compositor drew into this rendertarget for the current frame,
+     * in addition to the layer flutter rendered. (For example, when other backing stores
+     * were composited into it.) Empty if x1 == x2. Only used by GBM rendertargets, reset after each present.
+     */
+    struct drm_mode_rect damage;
+
     union {
         struct rendertarget_gbm gbm;
         struct rendertarget_nogbm nogbm;
@@ -211,6 +518,11 @@ struct rendertarget {
     GLuint gl_fbo_id;
 
     void (*destroy)(struct rendertarget *target);
+    /**
+     * @brief Put the next frame of this rendertarget on the given plane.
+     * If update_fb_only is true, the plane was already configured by the last commit
+     * for this rendertarget and only the framebuffer needs to change.
+     */
     int (*present)(
         struct rendertarget *target,
         struct drmdev_atomic_req *atomic_req,
@@ -219,7 +531,8 @@ struct rendertarget {
         int offset_y,
         int width,
         int height,
-        int zpos
+        int zpos,
+        bool update_fb_only
     );
     int (*present_legacy)(
         struct rendertarget *target,
@@ -242,9 +555,54 @@ struct flutterpi_backing_store {
 
 extern const FlutterCompositor flutter_compositor;
 
+/**
+ * @brief Called on the main thread when a (real or simulated) page flip ocurred.
+ * 
+ * Fills in the present and commit timestamps of the frame that was just flipped
+ * into timings_out, if it's not NULL.
+ * 
+ * @param is_simulated Whether this page flip was simulated for a commit that didn't
+ *   request a page flip event. (see @ref flutterpi_schedule_simulated_page_flip)
+ */
 int compositor_on_page_flip(
 	uint32_t sec,
-	uint32_t usec
+	uint32_t usec,
+	bool is_simulated,
+	struct frame_timings *timings_out
+);
+
+/**
+ * @brief Switch the display to another mode of the same resolution (for example
+ * one with a lower refresh rate), while flutter-pi is running.
+ * Only supported with atomic modesetting.
+ * 
+ * The KMS commit thread applies the new mode with the next frame that's committed,
+ * or right away if no frame is waiting to be committed. callback is called
+ * on the main thread with the result once the commit returned.
+ */
+int compositor_set_mode(
+	const drmModeModeInfo *mode,
+	compositor_mode_set_cb callback,
+	void *userdata
+);
+
+/**
+ * @brief Print the rendertarget pool hit / miss counters to file.
+ */
+void compositor_print_stats(FILE *file);
+
+/**
+ * @brief Present a frame rendered by the flutter software renderer. (--renderer software)
+ * Called on the raster thread.
+ * 
+ * The frame is copied into the back dumb buffer, rotated by the view rotation on the way,
+ * and flipped to the screen with the next vblank. Only one flip can be pending, so this
+ * waits for the flip of the last frame first.
+ */
+bool compositor_present_software_frame(
+    const void *allocation,
+    size_t row_bytes,
+    size_t height
 );
 
 int compositor_set_view_callbacks(
@@ -260,6 +618,56 @@ int compositor_remove_view_callbacks(
     int64_t view_id
 );
 
+/**
+ * @brief A single-planar dmabuf a producer (for example a video decoder)
+ * wants to have shown by a scanout view.
+ */
+struct scanout_buffer {
+    int fd;
+    uint32_t fourcc;
+    uint64_t modifier;
+    int width, height;
+    uint32_t stride, offset;
+};
+
+/**
+ * @brief Make the platform view with this id a scanout view.
+ * 
+ * Scanout views don't need platform view callbacks, the compositor puts the buffer
+ * that was last given to @ref compositor_set_scanout_view_buffer directly on a free
+ * overlay plane when presenting the view, without copying it. Only supported with
+ * atomic modesetting.
+ */
+int compositor_add_scanout_view(
+    int64_t view_id
+);
+
+/**
+ * @brief Show this buffer in the scanout view, starting with the next frame flutter presents.
+ * Can be called from any thread.
+ * 
+ * The buffer is imported and wrapped into a DRM framebuffer the first time it's given,
+ * the framebuffers of the last @ref SCANOUT_VIEW_FB_CACHE_SIZE buffers are cached.
+ * The compositor doesn't keep the fd, the producer can close it afterwards.
+ * The producer must not write into the buffer while it's still on screen.
+ * 
+ * @returns EBUSY if all cached framebuffers are still in use, so the buffer can't be imported.
+ */
+int compositor_set_scanout_view_buffer(
+    int64_t view_id,
+    const struct scanout_buffer *buffer
+);
+
+/**
+ * @brief Stop treating the platform view with this id as a scanout view.
+ * 
+ * The framebuffers of its buffers are destroyed once a frame that doesn't show
+ * the view anymore was flipped to the screen.
+ */
+int compositor_remove_scanout_view(
+    int64_t view_id
+);
+
 int compositor_apply_cursor_state(
     bool is_enabled,
     int rotation,
@@ -272,5 +680,11 @@ int compositor_initialize(
     struct drmdev *drmdev
 );
 
+/**
+ * @brief Stop the KMS commit thread. Frames that weren't committed yet are dropped.
+ * Must be called on the main thread, after the main loop exited.
+ */
+void compositor_deinitialize(void);
+
 
 #endif
\ No newline at end of file
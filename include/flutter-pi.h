@@ -26,6 +26,11 @@
 
 #include <modesetting.h>
 #include <collection.h>
+#include <latency_histogram.h>
+#include <vsync_estimator.h>
+#include <frame_telemetry.h>
+#include <input_resampler.h>
+#include <input_recording.h>
 #include <keyboard.h>
 
 long gettid();
@@ -198,6 +203,13 @@ struct libudev {
 	- ANGLE_FROM_ORIENTATION(o_start) \
 	+ (ANGLE_FROM_ORIENTATION(o_start) > ANGLE_FROM_ORIENTATION(o_end) ? 360 : 0))
 
+/// The DRM plane rotation that rotates an image clockwise by deg degrees.
+/// (DRM rotates counter-clockwise)
+#define DRM_ROTATION_FROM_ANGLE(deg) \
+	((deg) == 90 ? DRM_MODE_ROTATE_270 : \
+	 (deg) == 180 ? DRM_MODE_ROTATE_180 : \
+	 (deg) == 270 ? DRM_MODE_ROTATE_90 : DRM_MODE_ROTATE_0)
+
 #define FLUTTER_TRANSLATION_TRANSFORMATION(translate_x, translate_y) ((FlutterTransformation) \
 	{.scaleX = 1, .skewX  = 0, .transX = translate_x, \
 	 .skewY  = 0, .scaleY = 1, .transY = translate_y, \
@@ -280,6 +292,10 @@ enum frame_state {
 	kFrameRendered
 };
 
+/// The maximum number of frames that can be rendered / be waiting for their
+/// pageflip at the same time. (see --frame-queue-depth)
+#define FRAME_QUEUE_MAX_DEPTH 3
+
 struct frame {
 	/// The current state of the frame.
 	/// - Pending, when the frame was requested using the FlutterProjectArgs' vsync_callback.
@@ -289,6 +305,9 @@ struct frame {
 
 	/// The baton to be returned to the flutter engine when the frame can be rendered.
 	intptr_t baton;
+
+	/// When the frame reached each stage, for the frame telemetry.
+	struct frame_timings timings;
 };
 
 struct compositor;
@@ -297,6 +316,67 @@ enum flutter_runtime_mode {
 	kDebug, kRelease
 };
 
+/// How flutter renders its frames. (--renderer)
+enum renderer_type {
+	/// Using OpenGL ES into GBM surfaces / DRM buffers, composited using the DRM planes.
+	kOpenGLRenderer,
+	/// Using the CPU into a pixel buffer, which is copied into DRM dumb buffers.
+	/// For devices without a usable GPU.
+	kSoftwareRenderer
+};
+
+struct task_source_stats {
+	/// How long callbacks of this source waited before they were run.
+	struct latency_histogram delay;
+
+	/// How long callbacks of this source took to run.
+	struct latency_histogram duration;
+};
+
+/// Pointer events that are collected and sent to flutter using one
+/// FlutterEngineSendPointerEvent call. Allocated once and grown when needed,
+/// but never freed.
+struct pointer_event_batch {
+	FlutterPointerEvent *events;
+	size_t n_events;
+	size_t size;
+
+	/// How many batches were sent, with how many events in total,
+	/// the biggest batch, and how often a batch was sent early
+	/// because it reached the high-water mark.
+	uint64_t n_batches;
+	uint64_t n_total_events;
+	size_t max_batch_size;
+	uint64_t n_early_flushes;
+
+	/// The timestamp of the oldest input event in the batch, in microseconds. 0 if there's none.
+	uint64_t oldest_input_time;
+};
+
+/// The lanes platform tasks can be posted to.
+/// The main loop always executes the tasks of a higher priority lane first.
+enum platform_task_priority {
+	/// vsync replies, page flips
+	kPlatformTaskPriorityFrame,
+	/// user input
+	kPlatformTaskPriorityInput,
+	/// engine & internal flutter-pi tasks. (default)
+	kPlatformTaskPriorityEngine,
+	/// plugin I/O, platform messages.
+	/// These only get a limited time budget per main loop iteration.
+	kPlatformTaskPriorityBackground,
+	kPlatformTaskPriorityCount
+};
+
+/**
+ * @brief A copy of the view & display properties needed to translate input events.
+ */
+struct input_view_geometry {
+	FlutterTransformation display_to_view_transform;
+	int rotation;
+	int display_width, display_height;
+};
+
 struct flutterpi {
 	/// graphics stuff
 	struct {
@@ -304,13 +384,57 @@ struct flutterpi {
 		drmEventContext evctx;
 		sd_event_source *drm_pageflip_event_source;
 		bool platform_supports_get_sequence_ioctl;
+
+		/// Predicts the vblank timestamps for the frame requests
+		/// from the timestamps of the past page flips.
+		struct vsync_estimator vsync_estimator;
+
+		/// Generates the page flip events for commits that don't send any.
+		/// (blocking atomic commits, legacy modesets)
+		/// Only touched on the main thread.
+		struct {
+			/// Fires at the vblank the next simulated page flip should be reported at.
+			int timerfd;
+			sd_event_source *source;
+
+			/// How many simulated page flips are still due.
+			unsigned int n_pending;
+
+			/// The vblank timestamp of the next / last simulated page flip.
+			uint64_t next_flip_time;
+			uint64_t last_flip_time;
+		} simulated_vblank;
 	} drm;
 
+	/// Switches the display to a lower refresh rate while nothing is drawn.
+	/// (see --idle-refresh-rate) Only touched on the main thread.
+	struct {
+		/// The refresh rate given using --idle-refresh-rate, or 0 if disabled.
+		int refresh_rate;
+		uint64_t timeout_ns;
+
+		const drmModeModeInfo *active_mode;
+		const drmModeModeInfo *idle_mode;
+
+		/// The mode the display was last asked to switch to.
+		/// is_idle only changes once the switch to it was actually applied.
+		const drmModeModeInfo *target_mode;
+
+		bool is_idle;
+		uint64_t last_activity_time;
+		uint64_t last_flip_time;
+		sd_event_source *timer;
+	} idle;
+
 	struct {
 		struct gbm_device  *device;
 		struct gbm_surface *surface;
 		uint32_t 			format;
 		uint64_t			modifier;
+
+		/// The size of the GBM surface (and of the backing stores flutter renders into).
+		/// The display size, swapped if the planes rotate the view by 90 or 270 degrees.
+		int					width, height;
 	} gbm;
 
 	struct {
@@ -329,6 +453,18 @@ struct flutterpi {
 		PFNEGLCREATEPLATFORMPIXMAPSURFACEEXTPROC createPlatformPixmapSurface;
 		PFNEGLCREATEDRMIMAGEMESAPROC createDRMImageMESA;
 		PFNEGLEXPORTDRMIMAGEMESAPROC exportDRMImageMESA;
+
+		/// Whether the display supports EGL_EXT_buffer_age, so the damage of the window
+		/// surface buffers can be limited to what changed since they were last presented.
+		bool supports_buffer_age;
+
+		/// Whether the display supports EGL_ANDROID_native_fence_sync and EGL_KHR_wait_sync.
+		/// The procedures below are only loaded if it does.
+		bool supports_native_fence_sync;
+		PFNEGLCREATESYNCKHRPROC createSyncKHR;
+		PFNEGLDESTROYSYNCKHRPROC destroySyncKHR;
+		PFNEGLWAITSYNCKHRPROC waitSyncKHR;
+		PFNEGLDUPNATIVEFENCEFDANDROIDPROC dupNativeFenceFDANDROID;
 	} egl;
 
 	struct  {
@@ -380,10 +516,17 @@ struct flutterpi {
 
 		int width_mm, height_mm;
 		
-		/// Used by flutter to transform the flutter view to fill the display.
+		/// The part of rotation the DRM planes apply when scanning out, so flutter doesn't
+		/// have to render rotated. Chosen at startup, 0 if the planes can't rotate.
+		int hw_rotation;
+
 		/// Matrix that transforms flutter view coordinates to display coordinates.
 		FlutterTransformation view_to_display_transform;
 
+		/// Used by flutter to transform the flutter view to fill the GBM surface.
+		/// Only applies the part of rotation the planes don't apply. (see hw_rotation)
+		FlutterTransformation view_to_surface_transform;
+
 		/// Used by the touch input to transform raw display coordinates into flutter view coordinates.
 		/// Matrix that transforms display coordinates into flutter view coordinates
 		FlutterTransformation display_to_view_transform;
@@ -391,6 +534,45 @@ struct flutterpi {
 
 	struct concurrent_queue frame_queue;
 
+	/// How many frames may be in flight (rendering or waiting for their pageflip)
+	/// at the same time. 1 means a frame is only started after the previous one
+	/// was flipped to the screen.
+	int frame_queue_depth;
+
+	/// Synchronize the GPU and the display using explicit fences
+	/// (EGL native fences and the IN_FENCE_FD / OUT_FENCE_PTR DRM properties)
+	/// instead of the implicit fences attached to the buffers. (--explicit-sync)
+	bool use_explicit_sync;
+
+	/// Whether flutter renders using OpenGL ES or the CPU. (--renderer)
+	enum renderer_type renderer_type;
+
+	/// How many rendertargets the compositor creates in advance, so a platform
+	/// view appearing doesn't need to allocate buffers mid-frame.
+	int n_prewarmed_rendertargets;
+
+	/// How long it takes from the input event to the engine and to the display.
+	struct {
+		/// input event timestamp -> FlutterEngineSendPointerEvent,
+		/// for the oldest event in every batch that was sent.
+		struct latency_histogram input_to_dispatch;
+
+		/// The timestamp of the oldest input event that was sent to the engine
+		/// since the last frame started rendering, in nanoseconds. 0 if there's none.
+		/// Written by the threads sending pointer events, taken by the next frame.
+		atomic_uint_least64_t pending_input_time;
+
+		/// How many times input was sent to the engine, but no frame started rendering
+		/// in the INPUT_LATENCY_MAX_FRAME_DELAY_NS after that.
+		atomic_uint_least64_t n_inputs_without_frame;
+	} input_latency;
+
+	/// Frame latency statistics, and the timings of the frames flipped since the
+	/// last stats dump (in the records ring, up to FRAME_TELEMETRY_N_RECORDS of them).
+	/// Frames are added by the main thread when they're flipped to the screen,
+	/// the records are taken out by the main thread when the stats are dumped.
+	struct frame_telemetry frame_telemetry;
+
 	struct compositor *compositor;
 
 	/// IO
@@ -408,6 +590,99 @@ struct flutterpi {
 
 		int64_t next_unused_flutter_device_id;
 		double cursor_x, cursor_y;
+
+		/// The pointer events on_libinput_ready collected so far.
+		/// Only used on the main thread.
+		struct pointer_event_batch pointer_event_batch;
+
+		/// Coalesces pointer motion between frames and resamples it at the next vblank.
+		/// (see --resample-input) Only used on the main thread.
+		struct {
+			bool enabled;
+			struct input_resampler resampler;
+
+			/// Fires a bit before the next vblank when there's motion to resample.
+			int timerfd;
+			sd_event_source *source;
+			bool is_armed;
+
+			/// The vblank the timer was armed for, in nanoseconds.
+			uint64_t sample_time;
+		} resampling;
+
+		/// Reads and translates the libinput events on its own thread. (see --input-thread)
+		/// When enabled, the input thread owns the libinput context and the input device data.
+		struct {
+			bool enabled;
+			pthread_t thread;
+
+			/// Work the input thread hands to the main thread. (cursor updates, text input,
+			/// and pointer events when they're resampled) Drained by a task on the input lane.
+			struct spsc_queue queue;
+
+			/// Whether a task to drain the queue was posted that didn't run yet.
+			atomic_bool drain_pending;
+
+			/// How often the input thread had to wait because the queue was full.
+			atomic_uint_least64_t n_queue_full;
+
+			/// Set by the input thread when it waits for room in the queue.
+			/// on_drain_input_queue then writes space_available_fd (a blocking eventfd)
+			/// once it emptied the queue.
+			atomic_bool waiting_for_space;
+			int space_available_fd;
+
+			/// Set by stop_input_thread, which then writes stop_fd (a nonblocking eventfd the input thread polls)
+			/// and space_available_fd, so the input thread exits no matter where it's waiting.
+			atomic_bool should_stop;
+			int stop_fd;
+
+			/// The pointer events the input thread sends to the engine itself.
+			/// Only used on the input thread.
+			struct pointer_event_batch pointer_event_batch;
+		} thread;
+
+		/// The view geometry process_libinput_events uses, published using a seqlock
+		/// since the input thread reads it while the main thread might update it.
+		/// (see flutterpi_fill_view_properties)
+		struct {
+			atomic_uint sequence;
+			struct input_view_geometry geometry;
+		} view_geometry;
+
+		/// Writes the translated input events to a file. (see --record-input)
+		/// Only used by the thread that processes the libinput events.
+		struct {
+			/// NULL if we're not recording.
+			const char *path;
+			struct input_recorder recorder;
+
+			/// The kernel timestamp of the libinput event that's currently being
+			/// processed, in microseconds. 0 if the event doesn't have one.
+			uint64_t event_time_us;
+		} recording;
+
+		/// Replays recorded input instead of reading the input devices. (see --replay-input)
+		/// Only used on the main thread.
+		struct {
+			/// NULL if we're not replaying.
+			const char *path;
+			bool as_fast_as_possible;
+			struct input_replayer replayer;
+
+			/// Fires when the next event is due.
+			int timerfd;
+			sd_event_source *source;
+
+			/// The next event, if it was already read but isn't due yet.
+			bool has_next_event;
+			struct input_recording_event next_event;
+
+			/// The record time of the first event and the time the replay started, in microseconds.
+			/// The recorded times are shifted by (start_time - first_event_time).
+			uint64_t first_event_time;
+			uint64_t start_time;
+		} replay;
 	} input;
 	
 	/// flutter stuff
@@ -427,10 +702,108 @@ struct flutterpi {
 	
 	/// main event loop
 	pthread_t event_loop_thread;
+
+	/// Only held while adding sources to the event loop or queueing overflowed
+	/// platform tasks, never while event loop callbacks run.
+	/// sd_event itself is only ever touched by the main thread.
 	pthread_mutex_t event_loop_mutex;
 	sd_event *event_loop;
+
+	/// The epoll instance the main loop waits on.
+	/// Contains the wakeup eventfd, the engine task timerfd and the fd of the sd_event loop.
+	int epoll_fd;
 	int wakeup_event_loop_fd;
 
+	/// Platform tasks posted using flutterpi_post_platform_task, one queue per priority lane.
+	/// Drained by the wakeup callback of the main loop.
+	struct mpsc_queue platform_task_queues[kPlatformTaskPriorityCount];
+
+	/// true if there's already a wakeup on its way to the main loop,
+	/// so other posters don't need to write the eventfd again.
+	atomic_bool platform_task_wakeup_pending;
+
+	/// Platform tasks that didn't fit into their lane, one list per lane, in posting order.
+	/// Protected by event_loop_mutex. While a lane is marked as overflowed,
+	/// newly posted tasks of that lane are appended to its list too.
+	struct overflowed_platform_task *overflowed_platform_tasks[kPlatformTaskPriorityCount];
+	struct overflowed_platform_task **overflowed_platform_tasks_tail[kPlatformTaskPriorityCount];
+	atomic_bool platform_task_lane_overflowed[kPlatformTaskPriorityCount];
+
+	/// event loop instrumentation
+	struct {
+		/// How long tasks waited in each platform task lane & how long they ran.
+		struct task_source_stats platform_tasks[kPlatformTaskPriorityCount];
+
+		/// Tasks posted using flutterpi_post_platform_task_with_time.
+		/// The delay is measured from the target time.
+		struct task_source_stats timed_platform_tasks;
+
+		/// Tasks posted by the engine. The delay is measured from the target time.
+		struct task_source_stats engine_tasks;
+
+		/// Callbacks added using flutterpi_sd_event_add_io.
+		/// The delay is measured from the time the main loop woke up.
+		struct task_source_stats io_callbacks;
+
+		/// Time between the main loop being signalled for platform tasks
+		/// and the main loop starting to execute them.
+		struct latency_histogram wakeup_latency;
+
+		/// When the currently pending platform task wakeup was signalled.
+		atomic_uint_least64_t wakeup_signal_time;
+
+		/// When epoll_wait last returned in the main loop.
+		uint64_t wakeup_time;
+
+		/// Callbacks that run longer than this are reported as slow.
+		/// 0 disables the slow callback watchdog.
+		uint64_t slow_callback_threshold_ns;
+		atomic_uint_least64_t n_slow_callbacks;
+
+		/// Print the event loop statistics when flutter-pi exits.
+		bool dump_on_exit;
+	} loop_stats;
+
+	/// timed engine tasks
+	struct {
+		/// Engine tasks posted by on_post_flutter_task (from any thread),
+		/// not yet sorted into the heap.
+		struct mpsc_queue posted;
+
+		/// Min-heap of pending engine tasks, earliest target time first.
+		/// Only accessed on the main thread.
+		struct engine_task *heap;
+		size_t heap_length;
+		size_t heap_size;
+		uint64_t next_sequence;
+
+		/// Engine tasks that didn't fit into posted, in posting order.
+		/// Protected by event_loop_mutex. While has_overflowed is true,
+		/// newly posted engine tasks are appended here too.
+		struct overflowed_engine_task *overflowed;
+		struct overflowed_engine_task **overflowed_tail;
+		atomic_bool has_overflowed;
+
+		/// CLOCK_MONOTONIC timerfd in the main loop epoll set, armed with the
+		/// absolute target time of the earliest task in the heap.
+		int timerfd;
+
+		/// The target time timerfd is currently armed with, 0 if it's disarmed.
+		uint64_t timer_target_time;
+
+		/// Number of main loop wakeups that ran at least one engine task.
+		uint64_t n_wakeups;
+
+		/// Total number of engine tasks run.
+		uint64_t n_expired_total;
+
+		/// Number of engine tasks that were due and run on the last wakeup.
+		unsigned int n_expired_last_wakeup;
+
+		/// Maximum number of engine tasks run on a single wakeup.
+		unsigned int max_expired_per_wakeup;
+	} engine_tasks;
+
 	/// flutter-pi internal stuff
 	struct plugin_registry *plugin_registry;
 };
@@ -438,6 +811,30 @@ struct flutterpi {
 struct platform_task {
 	int (*callback)(void *userdata);
 	void *userdata;
+
+	/// When this task was posted, in CLOCK_MONOTONIC nanoseconds.
+	uint64_t post_time;
+};
+
+struct overflowed_platform_task {
+	struct overflowed_platform_task *next;
+	struct platform_task task;
+};
+
+struct engine_task {
+	/// The time this task should run at, in nanoseconds, in the
+	/// FlutterEngineGetCurrentTime (CLOCK_MONOTONIC) timebase.
+	uint64_t target_time;
+
+	/// Used to keep the posting order of tasks with the same target time.
+	uint64_t sequence;
+
+	FlutterTask task;
+};
+
+struct overflowed_engine_task {
+	struct overflowed_engine_task *next;
+	struct engine_task task;
 };
 
 typedef int (*send_resp_callback)(struct platch_obj *object, void *userdata);
@@ -479,6 +876,12 @@ int flutterpi_post_platform_task(
 	void *userdata
 );
 
+int flutterpi_post_platform_task_with_priority(
+	int (*callback)(void *userdata),
+	void *userdata,
+	enum platform_task_priority priority
+);
+
 int flutterpi_post_platform_task_with_time(
 	int (*callback)(void *userdata),
 	void *userdata,
@@ -510,4 +913,19 @@ int flutterpi_respond_to_platform_message(
 
 int flutterpi_schedule_exit(void);
 
+/**
+ * @brief Report a page flip for a frame that was committed without requesting
+ * a page flip event, at the vblank the frame was (or will be) shown at.
+ * The page flips are paced at the refresh rate of the display, and phase-locked
+ * to the vblanks if commit_waited_for_vblank is true.
+ * Must be called on the main thread.
+ * 
+ * @param commit_time When the commit returned. (FlutterEngineGetCurrentTime)
+ * @param commit_waited_for_vblank Whether the commit blocked until the frame was on screen.
+ */
+int flutterpi_schedule_simulated_page_flip(
+	uint64_t commit_time,
+	bool commit_waited_for_vblank
+);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,138 @@
+#ifndef _FRAME_TELEMETRY_H
+#define _FRAME_TELEMETRY_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdatomic.h>
+
+#include <collection.h>
+#include <latency_histogram.h>
+
+/// How many of the most recent frames are kept in the records ring.
+#define FRAME_TELEMETRY_N_RECORDS 128
+
+/**
+ * @brief The timestamps of every stage of a frame's life, in nanoseconds
+ * (CLOCK_MONOTONIC, the same clock as FlutterEngineGetCurrentTime).
+ * A stage that wasn't reached is 0.
+ */
+struct frame_timings {
+	/// When the engine requested the frame (the vsync callback was called with the baton).
+	uint64_t request_time;
+
+	/// When the baton was returned to the engine using FlutterEngineOnVsync.
+	uint64_t vsync_reply_time;
+
+	/// The vblank the frame was supposed to be shown at. (The frame target time passed to the engine)
+	uint64_t target_vblank_time;
+
+	/// When the compositor started presenting the frame.
+	uint64_t present_time;
+
+	/// When the atomic commit (or legacy pageflip) of the frame returned.
+	uint64_t commit_time;
+
+	/// The timestamp of the page flip that put the frame on screen.
+	uint64_t flip_time;
+
+	/// The (kernel) timestamp of the oldest input event that was sent to the engine
+	/// after the previous frame started rendering and before this one did.
+	/// 0 if there was none.
+	uint64_t input_time;
+};
+
+/**
+ * @brief Keeps frame latency statistics over all frames.
+ *
+ * Frames are added by a single thread (the main thread, on page flip).
+ * The statistics can be printed from any thread, but only one thread
+ * may take the per-frame records out of the records ring.
+ */
+struct frame_telemetry {
+	/// The total number of frames added.
+	atomic_uint_least64_t n_frames;
+
+	/// vsync reply -> page flip
+	struct latency_histogram frame_latency;
+
+	/// vsync reply -> present
+	struct latency_histogram build_duration;
+
+	/// present -> commit returned
+	struct latency_histogram commit_duration;
+
+	/// commit returned -> page flip
+	struct latency_histogram flip_latency;
+
+	/// input event -> estimated time the frame showing it lit up the display
+	/// (half a refresh period after the page flip, the middle of the scanout)
+	struct latency_histogram input_to_photon;
+
+	/// The number of frames that were flipped at least one vblank after their target vblank.
+	atomic_uint_least64_t n_late_frames;
+
+	/// The total number of vblanks frames were late by.
+	atomic_uint_least64_t n_missed_vblanks;
+
+	/// The number of frames that were replaced by a newer frame before they were committed.
+	atomic_uint_least64_t n_dropped_frames;
+
+	/// The timings of the recent frames, oldest first.
+	/// The thread adding frames is the producer, the thread taking them
+	/// (see @ref frame_telemetry_take_recent_frames) is the consumer.
+	struct spsc_queue records;
+
+	/// The number of frame records that were discarded because nobody took
+	/// them out of the records ring in time.
+	atomic_uint_least64_t n_discarded_records;
+};
+
+int frame_telemetry_init(
+	struct frame_telemetry *telemetry
+);
+
+void frame_telemetry_deinit(
+	struct frame_telemetry *telemetry
+);
+
+/**
+ * @brief Add the timings of a frame that was just flipped to the screen.
+ * Must only be called by one thread.
+ * The timings are also put into the records ring, if there's space left.
+ *
+ * @param refresh_period_ns The refresh period of the display, used to count the missed vblanks.
+ */
+void frame_telemetry_add_frame(
+	struct frame_telemetry *telemetry,
+	const struct frame_timings *timings,
+	uint64_t refresh_period_ns
+);
+
+/**
+ * @brief Count a frame that was never shown, because a newer frame replaced it before it was committed.
+ */
+void frame_telemetry_add_dropped_frame(
+	struct frame_telemetry *telemetry
+);
+
+/**
+ * @brief Take at most max_frames of the oldest frame records out of the records ring.
+ * Must only be called by one thread.
+ *
+ * @returns The number of records written to timings_out.
+ */
+size_t frame_telemetry_take_recent_frames(
+	struct frame_telemetry *telemetry,
+	struct frame_timings *timings_out,
+	size_t max_frames
+);
+
+/**
+ * @brief Prints the frame latency statistics and missed vblank counts to file.
+ */
+void frame_telemetry_print(
+	struct frame_telemetry *telemetry,
+	FILE *file
+);
+
+#endif
@@ -0,0 +1,119 @@
+#ifndef _INPUT_RECORDING_H
+#define _INPUT_RECORDING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include <flutter_embedder.h>
+
+/// The first bytes of every input recording, followed by a 32-bit version.
+#define INPUT_RECORDING_MAGIC "FPINPUT"
+#define INPUT_RECORDING_VERSION 1
+
+enum input_recording_event_type {
+	kInputRecordingPointerEvent = 1,
+	kInputRecordingCursorPos,
+	kInputRecordingShowCursor,
+	kInputRecordingRawKeyEvent,
+	kInputRecordingUtf8Char,
+	kInputRecordingXkbKeysym
+};
+
+/**
+ * @brief One translated input event, as it was handed to the engine / the plugins.
+ */
+struct input_recording_event {
+	enum input_recording_event_type type;
+
+	/// When the event was recorded (CLOCK_MONOTONIC), in microseconds.
+	/// Used to replay the events at the original cadence.
+	uint64_t time_us;
+
+	union {
+		/// Only the fields flutter-pi sets are recorded.
+		FlutterPointerEvent pointer_event;
+
+		struct {
+			int32_t x, y;
+		} cursor_pos;
+
+		/// The arguments of rawkb_send_gtk_keyevent.
+		struct {
+			uint32_t unicode_scalar_values;
+			uint32_t key_code;
+			uint32_t scan_code;
+			uint32_t modifiers;
+			bool is_down;
+		} raw_key_event;
+
+		uint8_t utf8_char[4];
+
+		uint32_t keysym;
+	};
+};
+
+/**
+ * @brief Writes input events to a compact binary file.
+ *
+ * The file starts with INPUT_RECORDING_MAGIC (including the null terminator) and
+ * INPUT_RECORDING_VERSION. Every event is a type byte, the 64-bit record time and
+ * a fixed-size payload depending on the type. All integers are little endian,
+ * doubles are stored as their little endian IEEE-754 bits.
+ *
+ * Not thread-safe.
+ */
+struct input_recorder {
+	FILE *file;
+	uint64_t n_events;
+};
+
+int input_recorder_open(
+	struct input_recorder *recorder,
+	const char *path
+);
+
+int input_recorder_write(
+	struct input_recorder *recorder,
+	const struct input_recording_event *event
+);
+
+void input_recorder_flush(
+	struct input_recorder *recorder
+);
+
+void input_recorder_close(
+	struct input_recorder *recorder
+);
+
+/**
+ * @brief Reads the input events written by an input_recorder.
+ *
+ * Not thread-safe.
+ */
+struct input_replayer {
+	FILE *file;
+	uint64_t n_events;
+};
+
+int input_replayer_open(
+	struct input_replayer *replayer,
+	const char *path
+);
+
+/**
+ * @brief Reads the next event of the recording.
+ *
+ * @returns 0 on success, ENODATA at the end of the recording,
+ *          EINVAL if the recording is corrupt or truncated.
+ */
+int input_replayer_read(
+	struct input_replayer *replayer,
+	struct input_recording_event *event_out
+);
+
+void input_replayer_close(
+	struct input_replayer *replayer
+);
+
+#endif
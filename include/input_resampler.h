@@ -0,0 +1,112 @@
+#ifndef _INPUT_RESAMPLER_H
+#define _INPUT_RESAMPLER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <flutter_embedder.h>
+
+/// How many pointers (mice, touch slots) can have coalesced motion at the same time.
+/// Motion of any more pointers is passed through unchanged.
+#define INPUT_RESAMPLER_MAX_POINTERS 32
+
+/// The two samples we inter- or extrapolate from must be at least / at most
+/// this far apart (in microseconds). Otherwise the newest sample is used as-is.
+#define INPUT_RESAMPLER_MIN_SAMPLE_DELTA_US 2000
+#define INPUT_RESAMPLER_MAX_SAMPLE_DELTA_US 20000
+
+/// We never predict further than this (in microseconds) past the newest sample,
+/// and never further than half the time between the last two samples.
+#define INPUT_RESAMPLER_MAX_EXTRAPOLATION_US 8000
+
+struct input_resampler_pointer {
+	bool in_use;
+	int64_t device;
+
+	/// The newest motion event of this pointer that wasn't sent yet.
+	bool has_pending;
+	FlutterPointerEvent pending;
+
+	/// The timestamp of the oldest motion event that was coalesced into pending.
+	size_t pending_since;
+
+	/// The two newest positions of this pointer, [1] is the newest one.
+	unsigned int n_samples;
+	double x[2], y[2];
+	size_t timestamp[2];
+
+	/// The timestamp of the last event sent for this pointer,
+	/// so resampled events never go back in time.
+	size_t last_sent_timestamp;
+};
+
+/**
+ * @brief Coalesces the motion events of each pointer between frames, and turns them
+ * into a single event at the time the next frame is shown.
+ *
+ * Motion events (kMove, kHover) are held back until input_resampler_resample is called.
+ * Every other event (down, up, button changes, ...) is sent right away, and the held back
+ * motion of the same pointer is sent unchanged before it, so they stay exact.
+ *
+ * Not thread-safe.
+ */
+struct input_resampler {
+	struct input_resampler_pointer pointers[INPUT_RESAMPLER_MAX_POINTERS];
+	unsigned int n_pending;
+
+	/// How many motion events were replaced by a newer one, how many events
+	/// were resampled, and how many motion events had to be passed through
+	/// because all pointer slots were in use.
+	uint64_t n_coalesced;
+	uint64_t n_resampled;
+	uint64_t n_passed_through;
+
+	/// The timestamp of the oldest motion event that went into the events
+	/// returned by the last input_resampler_resample call. (The resampled
+	/// events have the sample time as their timestamp.)
+	size_t oldest_input_timestamp;
+};
+
+void input_resampler_init(
+	struct input_resampler *resampler
+);
+
+/**
+ * @brief Adds a pointer event to the resampler.
+ *
+ * @param events_out Receives the events that should be sent to flutter right now,
+ *                   in order. Must have room for 2 events.
+ * @returns The number of events written to events_out. (0 if the event was held back)
+ */
+size_t input_resampler_add_event(
+	struct input_resampler *resampler,
+	const FlutterPointerEvent *event,
+	FlutterPointerEvent *events_out
+);
+
+/**
+ * @brief Returns true if there are motion events waiting for input_resampler_resample.
+ */
+static inline bool input_resampler_has_pending(struct input_resampler *resampler) {
+	return resampler->n_pending > 0;
+}
+
+/**
+ * @brief Turns the held back motion of every pointer into one event at sample_time_us,
+ * interpolated / extrapolated from the last two positions of that pointer.
+ *
+ * @param sample_time_us The time (usually the next vblank) the events should be resampled at,
+ *                       in microseconds, the same clock as the event timestamps.
+ * @param events_out Receives the resampled events.
+ * @param n_max How many events fit into events_out.
+ * @returns The number of events written to events_out.
+ */
+size_t input_resampler_resample(
+	struct input_resampler *resampler,
+	size_t sample_time_us,
+	FlutterPointerEvent *events_out,
+	size_t n_max
+);
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef _LATENCY_HISTOGRAM_H
+#define _LATENCY_HISTOGRAM_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdatomic.h>
+
+#define LATENCY_HISTOGRAM_N_BUCKETS 32
+
+/**
+ * @brief A histogram of durations, with logarithmic (power-of-two microseconds) buckets.
+ * 
+ * Bucket 0 counts durations below 1us, bucket i counts durations
+ * in [2^(i-1), 2^i) microseconds. The last bucket also counts everything above.
+ * 
+ * Recording a sample is just a couple of relaxed atomic adds, so it can be
+ * done from any thread and the histogram can be dumped while it's being updated.
+ */
+struct latency_histogram {
+	const char *name;
+
+	atomic_uint_least64_t buckets[LATENCY_HISTOGRAM_N_BUCKETS];
+	atomic_uint_least64_t n_samples;
+	atomic_uint_least64_t total_ns;
+	atomic_uint_least64_t max_ns;
+};
+
+void latency_histogram_init(
+	struct latency_histogram *histogram,
+	const char *name
+);
+
+static inline void latency_histogram_record(
+	struct latency_histogram *histogram,
+	uint64_t duration_ns
+) {
+	uint64_t duration_us, max;
+	unsigned int bucket;
+
+	duration_us = duration_ns / 1000;
+	bucket = duration_us ? 64 - __builtin_clzll(duration_us) : 0;
+	if (bucket >= LATENCY_HISTOGRAM_N_BUCKETS) {
+		bucket = LATENCY_HISTOGRAM_N_BUCKETS - 1;
+	}
+
+	atomic_fetch_add_explicit(histogram->buckets + bucket, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&histogram->n_samples, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&histogram->total_ns, duration_ns, memory_order_relaxed);
+
+	max = atomic_load_explicit(&histogram->max_ns, memory_order_relaxed);
+	while ((duration_ns > max) && !atomic_compare_exchange_weak_explicit(&histogram->max_ns, &max, duration_ns, memory_order_relaxed, memory_order_relaxed));
+}
+
+/**
+ * @brief Returns an upper bound for the given percentile (0 - 100) of the recorded durations, in nanoseconds.
+ * 
+ * The result is the upper edge of the bucket that contains the percentile,
+ * clamped to the maximum recorded duration. Returns 0 if there are no samples.
+ */
+uint64_t latency_histogram_get_percentile(
+	struct latency_histogram *histogram,
+	double percentile
+);
+
+/**
+ * @brief Prints a one-line summary (count, average, p50/p95/p99, max)
+ * and the non-empty buckets of the histogram to file.
+ */
+void latency_histogram_print(
+	struct latency_histogram *histogram,
+	FILE *file
+);
+
+#endif
@@ -9,10 +9,40 @@
 
 #include <collection.h>
 
+/**
+ * @brief The DRM object properties that are put into (almost) every atomic request.
+ * Their IDs are looked up once when the drmdev is created, so the
+ * drmdev_atomic_req_put_..._prop functions don't need to search them by name.
+ */
+enum drm_property {
+    kDrmPropertyFbId,
+    kDrmPropertyCrtcId,
+    kDrmPropertySrcX,
+    kDrmPropertySrcY,
+    kDrmPropertySrcW,
+    kDrmPropertySrcH,
+    kDrmPropertyCrtcX,
+    kDrmPropertyCrtcY,
+    kDrmPropertyCrtcW,
+    kDrmPropertyCrtcH,
+    kDrmPropertyZpos,
+    kDrmPropertyRotation,
+    kDrmPropertyModeId,
+    kDrmPropertyActive,
+    kDrmPropertyInFenceFd,
+    kDrmPropertyFbDamageClips,
+    kDrmPropertyOutFencePtr,
+    kDrmPropertyCount
+};
+
 struct drm_connector {
     drmModeConnector *connector;
 	drmModeObjectProperties *props;
     drmModePropertyRes **props_info;
+
+    /// The IDs of this connectors properties, indexed by enum drm_property.
+    /// 0 if the connector doesn't have that property.
+    uint32_t prop_ids[kDrmPropertyCount];
 };
 
 struct drm_encoder {
@@ -23,6 +53,7 @@ struct drm_crtc {
     drmModeCrtc *crtc;
     drmModeObjectProperties *props;
     drmModePropertyRes **props_info;
+    uint32_t prop_ids[kDrmPropertyCount];
     uint32_t bitmask;
     uint8_t index;
 };
@@ -32,6 +63,7 @@ struct drm_plane {
     drmModePlane *plane;
     drmModeObjectProperties *props;
     drmModePropertyRes **props_info;
+    uint32_t prop_ids[kDrmPropertyCount];
 };
 
 struct drmdev {
@@ -69,6 +101,17 @@ struct drmdev_atomic_req {
 
     void *available_planes_storage[32];
     struct pointer_set available_planes;
+
+    /// The planes that were available when the request was created,
+    /// so @ref drmdev_atomic_req_reset doesn't need to search them again.
+    void *initial_available_planes_storage[32];
+    size_t n_initial_available_planes;
+
+    /// The property blobs that were created for this request, and the planes they were put for.
+    /// They're destroyed when the request is reset or destroyed.
+    uint32_t blob_ids[8];
+    const struct drm_plane *blob_planes[8];
+    int n_blobs;
 };
 
 int drmdev_new_from_fd(
@@ -94,6 +137,15 @@ int drmdev_plane_get_type(
     uint32_t plane_id
 );
 
+/**
+ * @brief Get the plane with this id, or NULL if there's no such plane.
+ * The planes of a drmdev never change, so this doesn't lock the drmdev.
+ */
+struct drm_plane *drmdev_get_plane(
+    struct drmdev *drmdev,
+    uint32_t plane_id
+);
+
 int drmdev_plane_supports_setting_rotation_value(
     struct drmdev *drmdev,
     uint32_t plane_id,
@@ -135,6 +187,18 @@ void drmdev_destroy_atomic_req(
     struct drmdev_atomic_req *req
 );
 
+/**
+ * @brief Remove all properties from the atomic request and make all planes
+ * available again, so it can be reused for the next commit instead of
+ * allocating a new one.
+ * 
+ * The available planes are the ones that could be used with the CRTC that was
+ * selected when the request was created.
+ */
+void drmdev_atomic_req_reset(
+    struct drmdev_atomic_req *req
+);
+
 int drmdev_atomic_req_put_connector_property(
     struct drmdev_atomic_req *req,
     const char *name,
@@ -154,11 +218,76 @@ int drmdev_atomic_req_put_plane_property(
     uint64_t value
 );
 
+/**
+ * @brief Add a property of this plane to the atomic request, using the cached property ID.
+ * Unlike @ref drmdev_atomic_req_put_plane_property, this neither locks the drmdev
+ * nor searches the property by name.
+ * 
+ * @returns EINVAL if the plane doesn't have this property.
+ */
+int drmdev_atomic_req_put_plane_prop(
+    struct drmdev_atomic_req *req,
+    const struct drm_plane *plane,
+    enum drm_property prop,
+    uint64_t value
+);
+
+/**
+ * @brief Like @ref drmdev_atomic_req_put_plane_prop, but for the selected CRTC.
+ * Must not be called while @ref drmdev_configure selects another CRTC.
+ */
+int drmdev_atomic_req_put_crtc_prop(
+    struct drmdev_atomic_req *req,
+    enum drm_property prop,
+    uint64_t value
+);
+
+/**
+ * @brief Like @ref drmdev_atomic_req_put_plane_prop, but for the selected connector.
+ * Must not be called while @ref drmdev_configure selects another connector.
+ */
+int drmdev_atomic_req_put_connector_prop(
+    struct drmdev_atomic_req *req,
+    enum drm_property prop,
+    uint64_t value
+);
+
+/**
+ * @brief Tell the driver which regions of the new framebuffer of the plane changed,
+ * so it only needs to update those. (Useful for panel self refresh or SPI / DSI command mode panels)
+ * Not putting any damage clips means the whole framebuffer changed.
+ * 
+ * Does nothing if the plane doesn't support FB_DAMAGE_CLIPS.
+ */
+int drmdev_atomic_req_put_plane_damage_clips(
+    struct drmdev_atomic_req *req,
+    const struct drm_plane *plane,
+    const struct drm_mode_rect *clips,
+    int n_clips
+);
+
 int drmdev_atomic_req_put_modeset_props(
     struct drmdev_atomic_req *req,
     uint32_t *flags
 );
 
+/**
+ * @brief Append all properties of newer to req, so committing req applies both.
+ * If both requests set the same property, the value of newer wins.
+ * 
+ * req takes over the property blobs of newer. Since the damage of two frames can't be
+ * described relative to only the older one, the planes that had damage clips in
+ * either request are marked as fully damaged.
+ * 
+ * newer can be reset and reused afterwards.
+ * 
+ * @returns ENOSPC if req can't take over the property blobs of newer.
+ */
+int drmdev_atomic_req_merge(
+    struct drmdev_atomic_req *req,
+    struct drmdev_atomic_req *newer
+);
+
 inline static int drmdev_atomic_req_reserve_plane(
     struct drmdev_atomic_req *req,
     struct drm_plane *plane
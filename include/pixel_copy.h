@@ -0,0 +1,27 @@
+#ifndef _PIXEL_COPY_H
+#define _PIXEL_COPY_H
+
+#include <stddef.h>
+
+/**
+ * @brief Copy an image of 32-bit pixels from src to dst, rotating it clockwise
+ * by rotation degrees (0, 90, 180 or 270) on the way.
+ * 
+ * width and height are the size of the source image. For 90 and 270 degrees,
+ * dst needs to be (at least) height pixels wide and width pixels high.
+ * The strides are in bytes.
+ * 
+ * Uses NEON or SSE2 if the compiler targets them. The rotated copies work in 4x4 pixel
+ * tiles, so both buffers are walked mostly sequentially.
+ */
+void pixel_copy_rotated_32(
+	void *dst,
+	size_t dst_stride,
+	const void *src,
+	size_t src_stride,
+	int width,
+	int height,
+	int rotation
+);
+
+#endif
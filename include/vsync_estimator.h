@@ -0,0 +1,96 @@
+#ifndef _VSYNC_ESTIMATOR_H
+#define _VSYNC_ESTIMATOR_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define VSYNC_ESTIMATOR_N_SAMPLES 32
+
+/// The minimum number of samples we need before we trust the estimate.
+#define VSYNC_ESTIMATOR_MIN_SAMPLES 4
+
+/**
+ * @brief Predicts vblank timestamps from a history of observed vblanks (page flips).
+ * 
+ * Fits a line (least squares) through the last VSYNC_ESTIMATOR_N_SAMPLES
+ * (vblank sequence number, timestamp) pairs. The slope is the refresh period, and the
+ * line gives the phase. Using the vblank sequence number as x means vblanks where we
+ * didn't flip don't disturb the estimate.
+ * 
+ * Not thread-safe.
+ */
+struct vsync_estimator {
+	/// The refresh period we assume until we've seen enough vblanks. (from the display mode)
+	uint64_t nominal_period_ns;
+
+	uint64_t sequences[VSYNC_ESTIMATOR_N_SAMPLES];
+	uint64_t timestamps[VSYNC_ESTIMATOR_N_SAMPLES];
+	unsigned int n_samples;
+	unsigned int next_index;
+
+	/// The result of the last fit. Only valid if is_valid is true.
+	bool is_valid;
+	double period_ns;
+
+	/// The fitted timestamp of the newest sample, in nanoseconds.
+	/// This is used as the phase reference for predictions.
+	uint64_t anchor_ns;
+
+	/// Number of times the history was thrown away because a vblank
+	/// didn't match the prediction. (mode changes, timestamp jumps, ...)
+	unsigned int n_resets;
+};
+
+void vsync_estimator_init(
+	struct vsync_estimator *estimator,
+	uint64_t nominal_period_ns
+);
+
+/**
+ * @brief Adds an observed vblank to the history and updates the estimate.
+ * 
+ * @param sequence The vblank sequence number (the "frame" of the DRM page flip event).
+ * @param timestamp_ns The CLOCK_MONOTONIC timestamp of the vblank, in nanoseconds.
+ */
+void vsync_estimator_add_vblank(
+	struct vsync_estimator *estimator,
+	uint64_t sequence,
+	uint64_t timestamp_ns
+);
+
+/**
+ * @brief Adds an observed vblank whose sequence number isn't known.
+ * 
+ * The sequence number is derived from the newest vblank in the history,
+ * by counting the (estimated) refresh periods since then. This is used for
+ * simulated page flips, so they don't mix made up sequence numbers with
+ * the real ones of the DRM page flip events.
+ * 
+ * @param timestamp_ns The CLOCK_MONOTONIC timestamp of the vblank, in nanoseconds.
+ */
+void vsync_estimator_add_vblank_timestamp(
+	struct vsync_estimator *estimator,
+	uint64_t timestamp_ns
+);
+
+/**
+ * @brief Predicts the timestamp of the last vblank at or before now_ns and
+ * of the vblank after that.
+ * 
+ * @returns 0 on success, EAGAIN if the estimator hasn't seen enough vblanks yet.
+ */
+int vsync_estimator_predict(
+	struct vsync_estimator *estimator,
+	uint64_t now_ns,
+	uint64_t *last_vblank_ns_out,
+	uint64_t *next_vblank_ns_out
+);
+
+/**
+ * @brief Returns the estimated refresh period, or the nominal one if there's no estimate yet.
+ */
+static inline uint64_t vsync_estimator_get_period_ns(struct vsync_estimator *estimator) {
+	return estimator->is_valid ? (uint64_t) estimator->period_ns : estimator->nominal_period_ns;
+}
+
+#endif
@@ -1,3 +1,6 @@
+#include <stddef.h>
+#include <stdint.h>
+
 #include <collection.h>
 
 int queue_init(struct queue *queue, size_t element_size, size_t max_queue_size) {
@@ -113,6 +116,25 @@ int queue_peek(
 	return 0;
 }
 
+int queue_peek_nth(
+	struct queue *queue,
+	size_t index,
+	void **pelement_out
+) {
+	if (index >= queue->length) {
+		if (pelement_out != NULL) {
+			*pelement_out = NULL;
+		}
+		return EAGAIN;
+	}
+
+	if (pelement_out != NULL) {
+		*pelement_out = ((char*) queue->elements) + (queue->element_size*((queue->start_index + index) & (queue->size - 1)));
+	}
+
+	return 0;
+}
+
 
 int cqueue_init(
     struct concurrent_queue *queue,
@@ -274,6 +296,218 @@ int cqueue_peek_locked(
     return queue_peek(&queue->queue, pelement_out);
 }
 
+int cqueue_peek_nth_locked(
+	struct concurrent_queue *queue,
+	size_t index,
+	void **pelement_out
+) {
+	return queue_peek_nth(&queue->queue, index, pelement_out);
+}
+
+
+#define MPSCQ_SLOT(queue, index) ((atomic_size_t*) (((char*) (queue)->slots) + ((queue)->slot_size * ((index) & ((queue)->size - 1)))))
+#define MPSCQ_SLOT_DATA(slot) ((void*) (((char*) (slot)) + sizeof(atomic_size_t)))
+
+int mpscq_init(
+	struct mpsc_queue *queue,
+	size_t element_size,
+	size_t size
+) {
+	size_t slot_size, rounded_size;
+
+	memset(queue, 0, sizeof(*queue));
+
+	// round the size up to the next power of two, so we can mask instead of modulo.
+	rounded_size = 1;
+	while (rounded_size < size) {
+		rounded_size <<= 1;
+	}
+
+	// keep the sequence numbers of all slots aligned
+	slot_size = sizeof(atomic_size_t) + element_size;
+	slot_size = (slot_size + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1);
+
+	queue->slots = calloc(rounded_size, slot_size);
+	if (queue->slots == NULL) {
+		return ENOMEM;
+	}
+
+	queue->size = rounded_size;
+	queue->element_size = element_size;
+	queue->slot_size = slot_size;
+
+	for (size_t i = 0; i < rounded_size; i++) {
+		atomic_init(MPSCQ_SLOT(queue, i), i);
+	}
+
+	atomic_init(&queue->enqueue_index, 0);
+	queue->dequeue_index = 0;
+
+	return 0;
+}
+
+void mpscq_deinit(
+	struct mpsc_queue *queue
+) {
+	if (queue->slots != NULL) {
+		free(queue->slots);
+	}
+
+	queue->slots = NULL;
+	queue->size = 0;
+	queue->element_size = 0;
+	queue->slot_size = 0;
+}
+
+int mpscq_try_enqueue(
+	struct mpsc_queue *queue,
+	const void *p_element
+) {
+	atomic_size_t *slot;
+	size_t index, sequence;
+	intptr_t diff;
+
+	index = atomic_load_explicit(&queue->enqueue_index, memory_order_relaxed);
+	while (1) {
+		slot = MPSCQ_SLOT(queue, index);
+		sequence = atomic_load_explicit(slot, memory_order_acquire);
+		diff = (intptr_t) sequence - (intptr_t) index;
+
+		if (diff == 0) {
+			// the slot is free, try to claim it.
+			if (atomic_compare_exchange_weak_explicit(&queue->enqueue_index, &index, index + 1, memory_order_relaxed, memory_order_relaxed)) {
+				break;
+			}
+		} else if (diff < 0) {
+			// the slot still contains an element from the previous round.
+			return ENOSPC;
+		} else {
+			// another producer claimed this slot in the meantime.
+			index = atomic_load_explicit(&queue->enqueue_index, memory_order_relaxed);
+		}
+	}
+
+	memcpy(MPSCQ_SLOT_DATA(slot), p_element, queue->element_size);
+
+	// publish the element to the consumer
+	atomic_store_explicit(slot, index + 1, memory_order_release);
+
+	return 0;
+}
+
+int mpscq_try_dequeue(
+	struct mpsc_queue *queue,
+	void *element_out
+) {
+	atomic_size_t *slot;
+	size_t index, sequence;
+
+	index = queue->dequeue_index;
+	slot = MPSCQ_SLOT(queue, index);
+	sequence = atomic_load_explicit(slot, memory_order_acquire);
+
+	if (sequence != index + 1) {
+		// either the queue is empty, or the producer that claimed
+		// this slot has not yet finished writing its element.
+		return EAGAIN;
+	}
+
+	memcpy(element_out, MPSCQ_SLOT_DATA(slot), queue->element_size);
+
+	queue->dequeue_index = index + 1;
+
+	// mark the slot as free for the next round of producers
+	atomic_store_explicit(slot, index + queue->size, memory_order_release);
+
+	return 0;
+}
+
+
+#define SPSCQ_ELEMENT(queue, index) ((void*) (((char*) (queue)->elements) + ((queue)->element_size * ((index) & ((queue)->size - 1)))))
+
+int spscq_init(
+	struct spsc_queue *queue,
+	size_t element_size,
+	size_t size
+) {
+	size_t rounded_size;
+
+	memset(queue, 0, sizeof(*queue));
+
+	// round the size up to the next power of two, so we can mask instead of modulo.
+	rounded_size = 1;
+	while (rounded_size < size) {
+		rounded_size <<= 1;
+	}
+
+	queue->elements = calloc(rounded_size, element_size);
+	if (queue->elements == NULL) {
+		return ENOMEM;
+	}
+
+	queue->size = rounded_size;
+	queue->element_size = element_size;
+
+	atomic_init(&queue->write_index, 0);
+	atomic_init(&queue->read_index, 0);
+
+	return 0;
+}
+
+void spscq_deinit(
+	struct spsc_queue *queue
+) {
+	if (queue->elements != NULL) {
+		free(queue->elements);
+	}
+
+	queue->elements = NULL;
+	queue->size = 0;
+	queue->element_size = 0;
+}
+
+int spscq_try_enqueue(
+	struct spsc_queue *queue,
+	const void *p_element
+) {
+	size_t write_index, read_index;
+
+	write_index = atomic_load_explicit(&queue->write_index, memory_order_relaxed);
+	read_index = atomic_load_explicit(&queue->read_index, memory_order_acquire);
+
+	if (write_index - read_index == queue->size) {
+		return ENOSPC;
+	}
+
+	memcpy(SPSCQ_ELEMENT(queue, write_index), p_element, queue->element_size);
+
+	// publish the element to the consumer
+	atomic_store_explicit(&queue->write_index, write_index + 1, memory_order_release);
+
+	return 0;
+}
+
+int spscq_try_dequeue(
+	struct spsc_queue *queue,
+	void *element_out
+) {
+	size_t write_index, read_index;
+
+	read_index = atomic_load_explicit(&queue->read_index, memory_order_relaxed);
+	write_index = atomic_load_explicit(&queue->write_index, memory_order_acquire);
+
+	if (read_index == write_index) {
+		return EAGAIN;
+	}
+
+	memcpy(element_out, SPSCQ_ELEMENT(queue, read_index), queue->element_size);
+
+	// give the element back to the producer
+	atomic_store_explicit(&queue->read_index, read_index + 1, memory_order_release);
+
+	return 0;
+}
+
 
 int pset_init(
 	struct pointer_set *set,
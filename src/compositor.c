@@ -1,5 +1,8 @@
 #include <stdio.h>
 #include <errno.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
 #include <sys/mman.h>
 
 #include <xf86drm.h>
@@ -18,6 +21,7 @@
 #include <collection.h>
 #include <compositor.h>
 #include <cursor.h>
+#include <pixel_copy.h>
 
 struct view_cb_data {
 	int64_t view_id;
@@ -33,8 +37,52 @@ struct view_cb_data {
 	FlutterPoint last_offset;
 	int last_num_mutations;
 	FlutterPlatformViewMutation last_mutations[16];
+
+	/// The planes the present callback reserved last frame, as a bitmask of plane indices.
+	uint64_t planes;
+};
+
+/**
+ * @brief A DRM framebuffer that was created for a buffer given to a scanout view.
+ */
+struct scanout_fb {
+	struct scanout_buffer buffer;
+	uint32_t gem_handle;
+	uint32_t fb_id;
+
+	/// The sequence number of the last frame that presented this framebuffer.
+	/// It can be destroyed once a later frame was flipped to the screen.
+	uint64_t frame_seq;
+	uint64_t last_used;
+};
+
+/**
+ * @brief A platform view that shows dmabufs directly on an overlay plane.
+ * (see @ref compositor_add_scanout_view)
+ */
+struct scanout_view {
+	int64_t view_id;
+
+	/// Protects the fb cache and the current fb, since producers give us buffers from their own threads.
+	pthread_mutex_t mutex;
+
+	struct scanout_fb fbs[SCANOUT_VIEW_FB_CACHE_SIZE];
+	int n_fbs;
+	uint64_t use_counter;
+
+	/// The framebuffer that'll be shown with the next frame, or NULL if there's no buffer yet.
+	struct scanout_fb *current_fb;
+
+	/// The plane the view was presented on last frame. Only used on the raster thread.
+	struct drm_plane *plane;
+
+	/// After the view was removed, the sequence number of the last frame that presented
+	/// one of its framebuffers. They're destroyed once a later frame was flipped to the screen.
+	uint64_t retire_frame_seq;
 };
 
+static void release_retired_scanout_views(uint64_t flipped_frame_seq);
+
 /*
 struct plane_data {
 	int type;
@@ -50,9 +98,57 @@ struct compositor compositor = {
 	.has_applied_modeset = false,
 	.should_create_window_surface_backing_store = true,
 	.stale_rendertargets = CPSET_INITIALIZER(CPSET_DEFAULT_MAX_SIZE),
-	.do_blocking_atomic_commits = false
+	.has_pending_page_flip = false,
+	.page_flip_mutex = PTHREAD_MUTEX_INITIALIZER,
+	.page_flip_cond = PTHREAD_COND_INITIALIZER,
+	.last_present_time = 0,
+	.last_commit_time = 0,
+	.use_explicit_sync = false,
+	.kms_commit = {
+		.mailbox = NULL,
+		.n_mailbox_in_fence_fds = 0,
+		.n_free_reqs = 0,
+		.out_fence_fd = -1,
+		.has_failed_commit = false,
+		.has_pending_mode = false,
+		.pending_mode_cb = NULL,
+		.pending_mode_userdata = NULL,
+		.is_committing_mode = false,
+		.previous_mode = NULL,
+		.committing_mode_cb = NULL,
+		.committing_mode_userdata = NULL,
+		.should_stop = false
+	},
+	.frame_seq = 0,
+	.pending_flip_frame_seq = 0,
+	.flipped_frame_seq = 0,
+	.plane_assignment = {
+		.is_valid = false
+	},
+	.n_plane_configs = 0,
+	.next_plane_config = 0,
+	.flatten_program = 0,
+	.has_prewarmed_rendertargets = false,
+	.n_rendertarget_pool_hits = 0,
+	.n_rendertarget_pool_misses = 0,
+	.n_rendertargets_trimmed = 0
 };
 
+/// How long @ref wait_for_pending_page_flip and the KMS commit thread wait for a page flip event before
+/// giving up. Only reached if the event got lost, so the compositor doesn't hang forever.
+#define PAGE_FLIP_TIMEOUT_MS 100
+
+/// How long a rendertarget can stay unused in the stale rendertarget pool
+/// before @ref trim_stale_rendertargets destroys it.
+#define RENDERTARGET_POOL_IDLE_TIMEOUT_NS 10000000000ull
+
+static int rendertarget_nogbm_new(
+	struct rendertarget **out,
+	struct compositor *compositor,
+	int width,
+	int height
+);
+
 static struct view_cb_data *get_cbs_for_view_id_locked(int64_t view_id) {
 	struct view_cb_data *data;
 	
@@ -76,19 +172,116 @@ static struct view_cb_data *get_cbs_for_view_id(int64_t view_id) {
 }
 
 /**
- * @brief Destroy all the rendertargets in the stale rendertarget cache.
+ * @brief Put a rendertarget that's not used by any backing store anymore
+ * into the stale rendertarget pool, so it can be reused.
+ */
+static void put_stale_rendertarget(struct compositor *compositor, struct rendertarget *target) {
+	target->stale_since = flutterpi.flutter.libflutter_engine.FlutterEngineGetCurrentTime();
+	cpset_put_(&compositor->stale_rendertargets, target);
+}
+
+/**
+ * @brief Take a rendertarget with the given size & format out of the stale rendertarget pool.
+ * Prefers the GBM rendertarget, since that's the one rendering into the primary plane.
+ * 
+ * @returns The rendertarget, or NULL if there's no matching rendertarget in the pool.
+ */
+static struct rendertarget *take_stale_rendertarget(
+	struct compositor *compositor,
+	int width,
+	int height,
+	uint32_t format
+) {
+	struct rendertarget *target, *match;
+
+	match = NULL;
+
+	cpset_lock(&compositor->stale_rendertargets);
+
+	for_each_pointer_in_cpset(&compositor->stale_rendertargets, target) {
+		if (target->width == width && target->height == height && target->format == format) {
+			match = target;
+			if (target->is_gbm) {
+				break;
+			}
+		}
+	}
+
+	if (match != NULL) {
+		cpset_remove_locked(&compositor->stale_rendertargets, match);
+	}
+
+	cpset_unlock(&compositor->stale_rendertargets);
+
+	return match;
+}
+
+/**
+ * @brief Create the rendertargets requested using --prewarm-rendertargets and
+ * put them into the stale rendertarget pool. They need to be created in the flutter
+ * GL context, so this is called the first time flutter creates a backing store.
  */
-static int destroy_stale_rendertargets(void) {
+static void prewarm_rendertargets(struct compositor *compositor) {
 	struct rendertarget *target;
+	int ok;
 
-	cpset_lock(&compositor.stale_rendertargets);
+	for (int i = 0; i < flutterpi.n_prewarmed_rendertargets; i++) {
+		ok = rendertarget_nogbm_new(&target, compositor, flutterpi.gbm.width, flutterpi.gbm.height);
+		if (ok != 0) {
+			fprintf(stderr, "[compositor] Could not prewarm rendertarget. rendertarget_nogbm_new: %s\n", strerror(ok));
+			break;
+		}
 
-	for_each_pointer_in_cpset(&compositor.stale_rendertargets, target) {
-		target->destroy(target);
-		target = NULL;
+		put_stale_rendertarget(compositor, target);
 	}
 
-	cpset_unlock(&compositor.stale_rendertargets);
+	compositor->has_prewarmed_rendertargets = true;
+}
+
+/**
+ * @brief Destroy the rendertargets that were in the stale rendertarget pool
+ * for longer than RENDERTARGET_POOL_IDLE_TIMEOUT_NS, but keep at least as many
+ * as were prewarmed. The GBM rendertarget is never destroyed.
+ * 
+ * Must be called with the flutter GL context current, since that's the context
+ * the FBOs of the rendertargets were created in.
+ */
+static void trim_stale_rendertargets(struct compositor *compositor) {
+	struct rendertarget *target, *expired[CPSET_DEFAULT_MAX_SIZE];
+	uint64_t now;
+	int n_expired, n_remaining;
+
+	now = flutterpi.flutter.libflutter_engine.FlutterEngineGetCurrentTime();
+	n_expired = 0;
+
+	cpset_lock(&compositor->stale_rendertargets);
+
+	n_remaining = cpset_get_count_pointers_locked(&compositor->stale_rendertargets);
+	for_each_pointer_in_cpset(&compositor->stale_rendertargets, target) {
+		if (n_remaining <= flutterpi.n_prewarmed_rendertargets || n_expired == CPSET_DEFAULT_MAX_SIZE) {
+			break;
+		}
+
+		if (!target->is_gbm && (now - target->stale_since) > RENDERTARGET_POOL_IDLE_TIMEOUT_NS) {
+			expired[n_expired++] = target;
+			n_remaining--;
+		}
+	}
+
+	// removing pointers while iterating over the set would skip some of them.
+	for (int i = 0; i < n_expired; i++) {
+		cpset_remove_locked(&compositor->stale_rendertargets, expired[i]);
+	}
+
+	cpset_unlock(&compositor->stale_rendertargets);
+
+	for (int i = 0; i < n_expired; i++) {
+		expired[i]->destroy(expired[i]);
+	}
+
+	if (n_expired > 0) {
+		atomic_fetch_add_explicit(&compositor->n_rendertargets_trimmed, n_expired, memory_order_relaxed);
+	}
 }
 
 static void destroy_gbm_bo(
@@ -335,47 +528,50 @@ static void destroy_drm_rbo(
 	}
 }
 
-static void rendertarget_gbm_destroy(struct rendertarget *target) {
-	free(target);
-}
-
-static int rendertarget_gbm_present(
+/**
+ * @brief Put everything but the framebuffer of the plane that presents this rendertarget:
+ * which CRTC it's on, the source and destination rectangles, the rotation and the zpos.
+ */
+static int put_rendertarget_plane_geometry(
 	struct rendertarget *target,
-	struct drmdev_atomic_req *atomic_req,
-	uint32_t drm_plane_id,
-	int offset_x,
-	int offset_y,
-	int width,
-	int height,
+	struct drmdev_atomic_req *req,
+	struct drm_plane *plane,
 	int zpos
 ) {
-	struct rendertarget_gbm *gbm_target;
-	struct gbm_bo *next_front_bo;
-	uint32_t next_front_fb_id;
-	bool supported;
+	uint64_t rotation;
+	bool supported, supports_zpos;
 	int ok;
 
-	gbm_target = &target->gbm;
+	// Flutter renders into the renderbuffers of no-GBM rendertargets upside down.
+	// All planes apply the part of the view rotation that flutter doesn't render.
+	rotation = DRM_ROTATION_FROM_ANGLE(flutterpi.view.hw_rotation) | (target->is_gbm ? 0 : DRM_MODE_REFLECT_Y);
 
-	next_front_bo = gbm_surface_lock_front_buffer(gbm_target->gbm_surface);
-	next_front_fb_id = gbm_bo_get_drm_fb_id(next_front_bo);
+	// Check everything that can fail before putting any property,
+	// so a failed call doesn't leave the plane half configured.
+	ok = drmdev_plane_supports_setting_rotation_value(req->drmdev, plane->plane->plane_id, rotation, &supported);
+	if (ok != 0) return ok;
+
+	if (!supported && (flutterpi.view.hw_rotation != 0)) {
+		// This plane would show the layer unrotated. Fail, so the plane allocator
+		// composites this layer into one of the planes that can rotate instead.
+		return ENOTSUP;
+	}
 
-	drmdev_atomic_req_put_plane_property(atomic_req, drm_plane_id, "FB_ID", next_front_fb_id);
-	drmdev_atomic_req_put_plane_property(atomic_req, drm_plane_id, "CRTC_ID", target->compositor->drmdev->selected_crtc->crtc->crtc_id);
-	drmdev_atomic_req_put_plane_property(atomic_req, drm_plane_id, "SRC_X", 0);
-	drmdev_atomic_req_put_plane_property(atomic_req, drm_plane_id, "SRC_Y", 0);
-	drmdev_atomic_req_put_plane_property(atomic_req, drm_plane_id, "SRC_W", ((uint16_t) flutterpi.display.width) << 16);
-	drmdev_atomic_req_put_plane_property(atomic_req, drm_plane_id, "SRC_H", ((uint16_t) flutterpi.display.height) << 16);
-	drmdev_atomic_req_put_plane_property(atomic_req, drm_plane_id, "CRTC_X", 0);
-	drmdev_atomic_req_put_plane_property(atomic_req, drm_plane_id, "CRTC_Y", 0);
-	drmdev_atomic_req_put_plane_property(atomic_req, drm_plane_id, "CRTC_W", flutterpi.display.width);
-	drmdev_atomic_req_put_plane_property(atomic_req, drm_plane_id, "CRTC_H", flutterpi.display.height);
-
-	ok = drmdev_plane_supports_setting_rotation_value(atomic_req->drmdev, drm_plane_id, DRM_MODE_ROTATE_0, &supported);
+	ok = drmdev_plane_supports_setting_zpos_value(req->drmdev, plane->plane->plane_id, zpos, &supports_zpos);
 	if (ok != 0) return ok;
 
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPropertyCrtcId, req->drmdev->selected_crtc->crtc->crtc_id);
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPropertySrcX, 0);
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPropertySrcY, 0);
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPropertySrcW, ((uint16_t) target->width) << 16);
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPropertySrcH, ((uint16_t) target->height) << 16);
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPropertyCrtcX, 0);
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPropertyCrtcY, 0);
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPropertyCrtcW, flutterpi.display.width);
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPropertyCrtcH, flutterpi.display.height);
+
 	if (supported) {
-		drmdev_atomic_req_put_plane_property(atomic_req, drm_plane_id, "rotation", DRM_MODE_ROTATE_0);
+		drmdev_atomic_req_put_plane_prop(req, plane, kDrmPropertyRotation, rotation);
 	} else {
 		static bool printed = false;
 
@@ -388,16 +584,13 @@ static int rendertarget_gbm_present(
 			printed = true;
 		}
 	}
-	
-	ok = drmdev_plane_supports_setting_zpos_value(atomic_req->drmdev, drm_plane_id, zpos, &supported);
-	if (ok != 0) return ok;
 
-	if (supported) {
-		drmdev_atomic_req_put_plane_property(atomic_req, drm_plane_id, "zpos", zpos);
+	if (supports_zpos) {
+		drmdev_atomic_req_put_plane_prop(req, plane, kDrmPropertyZpos, zpos);
 	} else {
 		static bool printed = false;
 
-		if (!printed) { 
+		if (!printed) {
 			fprintf(stderr,
 					"[compositor] GPU does not supported the desired HW plane order.\n"
 					"             Some UI layers may be invisible.\n"
@@ -406,15 +599,198 @@ static int rendertarget_gbm_present(
 		}
 	}
 
-	// TODO: move this to the page flip handler.
-	// We can only be sure the buffer can be released when the buffer swap
-	// ocurred.
-	if (gbm_target->current_front_bo != NULL) {
-		gbm_surface_release_buffer(gbm_target->gbm_surface, gbm_target->current_front_bo);
+	return 0;
+}
+
+/**
+ * @brief Grow rect so it also covers other. An empty rect (x1 == x2) doesn't cover anything.
+ */
+static void union_damage_rect(struct drm_mode_rect *rect, const struct drm_mode_rect *other) {
+	if (other->x1 == other->x2) {
+		return;
+	} else if (rect->x1 == rect->x2) {
+		*rect = *other;
+		return;
 	}
-	gbm_target->current_front_bo = (struct gbm_bo *) next_front_bo;
 
-	return 0;
+	if (other->x1 < rect->x1) rect->x1 = other->x1;
+	if (other->y1 < rect->y1) rect->y1 = other->y1;
+	if (other->x2 > rect->x2) rect->x2 = other->x2;
+	if (other->y2 > rect->y2) rect->y2 = other->y2;
+}
+
+/**
+ * @brief Record the damage of the frame that's being presented from the GBM rendertarget
+ * and put the FB_DAMAGE_CLIPS of the buffer that's presented with it.
+ * 
+ * The buffer was last presented buffer_age frames ago, so it differs from what it showed
+ * then by the damage of all the frames since. Puts no damage clips (meaning everything changed)
+ * if the age is unknown, if it's older than the damage history or if everything changed anyway.
+ */
+static int put_rendertarget_gbm_damage(
+	struct rendertarget *target,
+	struct drmdev_atomic_req *req,
+	const struct drm_plane *plane,
+	int offset_x,
+	int offset_y,
+	int width,
+	int height
+) {
+	struct rendertarget_gbm *gbm_target;
+	struct drm_mode_rect frame_damage, damage;
+	int age;
+
+	gbm_target = &target->gbm;
+
+	// The layer flutter rendered, and whatever else was drawn into the buffer.
+	frame_damage = (struct drm_mode_rect) {
+		.x1 = offset_x > 0 ? offset_x : 0,
+		.y1 = offset_y > 0 ? offset_y : 0,
+		.x2 = offset_x + width < target->width ? offset_x + width : target->width,
+		.y2 = offset_y + height < target->height ? offset_y + height : target->height
+	};
+	if ((frame_damage.x1 >= frame_damage.x2) || (frame_damage.y1 >= frame_damage.y2)) {
+		frame_damage = (struct drm_mode_rect) {0};
+	}
+	union_damage_rect(&frame_damage, &target->damage);
+	target->damage = (struct drm_mode_rect) {0};
+
+	age = target->compositor->gbm_buffer_age;
+
+	damage = frame_damage;
+	if ((age > 0) && (age - 1 <= gbm_target->n_damage_history)) {
+		for (int i = 0; i < age - 1; i++) {
+			union_damage_rect(&damage, gbm_target->damage_history + i);
+		}
+	} else {
+		damage = (struct drm_mode_rect) {
+			.x1 = 0,
+			.y1 = 0,
+			.x2 = target->width,
+			.y2 = target->height
+		};
+	}
+
+	if (gbm_target->n_damage_history == sizeof(gbm_target->damage_history) / sizeof(*gbm_target->damage_history)) {
+		gbm_target->n_damage_history--;
+	}
+	memmove(gbm_target->damage_history + 1, gbm_target->damage_history, gbm_target->n_damage_history * sizeof(*gbm_target->damage_history));
+	gbm_target->damage_history[0] = frame_damage;
+	gbm_target->n_damage_history++;
+
+	if ((damage.x1 <= 0) && (damage.y1 <= 0) && (damage.x2 >= target->width) && (damage.y2 >= target->height)) {
+		return 0;
+	}
+
+	if (damage.x1 == damage.x2) {
+		// Nothing changed. The driver still needs a non-empty damage blob,
+		// otherwise it would update the whole framebuffer.
+		damage = (struct drm_mode_rect) {
+			.x1 = 0,
+			.y1 = 0,
+			.x2 = 1,
+			.y2 = 1
+		};
+	}
+
+	return drmdev_atomic_req_put_plane_damage_clips(req, plane, &damage, 1);
+}
+
+static void rendertarget_gbm_destroy(struct rendertarget *target) {
+	free(target);
+}
+
+/**
+ * @brief Lock the buffer flutter just rendered into for presenting it with the current frame.
+ * Releases the buffers that aren't scanned out anymore, because a newer one was flipped to the screen.
+ */
+static struct gbm_bo *rendertarget_gbm_lock_front_bo(struct rendertarget *target) {
+	struct rendertarget_gbm *gbm_target;
+	struct gbm_bo *bo;
+	uint64_t flipped_frame_seq, on_screen_frame_seq;
+	int i, n;
+
+	gbm_target = &target->gbm;
+
+	// The newest buffer that was flipped is still on screen, all older ones can be released.
+	flipped_frame_seq = atomic_load(&target->compositor->flipped_frame_seq);
+	on_screen_frame_seq = 0;
+	for (i = 0; i < gbm_target->n_locked_bos; i++) {
+		if (gbm_target->locked_bos[i].frame_seq <= flipped_frame_seq) {
+			on_screen_frame_seq = gbm_target->locked_bos[i].frame_seq;
+		}
+	}
+
+	for (i = 0, n = 0; i < gbm_target->n_locked_bos; i++) {
+		if (gbm_target->locked_bos[i].frame_seq < on_screen_frame_seq) {
+			gbm_surface_release_buffer(gbm_target->gbm_surface, gbm_target->locked_bos[i].bo);
+		} else {
+			gbm_target->locked_bos[n++] = gbm_target->locked_bos[i];
+		}
+	}
+	gbm_target->n_locked_bos = n;
+
+	bo = gbm_surface_lock_front_buffer(gbm_target->gbm_surface);
+	if (bo == NULL) {
+		return NULL;
+	}
+
+	// Only happens if page flip events got lost, since the frame queue
+	// limits how many frames can be in flight.
+	if (gbm_target->n_locked_bos == sizeof(gbm_target->locked_bos) / sizeof(*gbm_target->locked_bos)) {
+		gbm_surface_release_buffer(gbm_target->gbm_surface, gbm_target->locked_bos[0].bo);
+		memmove(gbm_target->locked_bos, gbm_target->locked_bos + 1, (gbm_target->n_locked_bos - 1) * sizeof(*gbm_target->locked_bos));
+		gbm_target->n_locked_bos--;
+	}
+
+	gbm_target->locked_bos[gbm_target->n_locked_bos].bo = bo;
+	gbm_target->locked_bos[gbm_target->n_locked_bos].frame_seq = target->compositor->frame_seq;
+	gbm_target->n_locked_bos++;
+
+	return bo;
+}
+
+static int rendertarget_gbm_present(
+	struct rendertarget *target,
+	struct drmdev_atomic_req *atomic_req,
+	uint32_t drm_plane_id,
+	int offset_x,
+	int offset_y,
+	int width,
+	int height,
+	int zpos,
+	bool update_fb_only
+) {
+	struct drm_plane *plane;
+	struct gbm_bo *next_front_bo;
+	uint32_t next_front_fb_id;
+	int ok;
+
+	plane = drmdev_get_plane(atomic_req->drmdev, drm_plane_id);
+	if (plane == NULL) {
+		return EINVAL;
+	}
+
+	next_front_bo = rendertarget_gbm_lock_front_bo(target);
+	if (next_front_bo == NULL) {
+		return EIO;
+	}
+
+	next_front_fb_id = gbm_bo_get_drm_fb_id(next_front_bo);
+
+	drmdev_atomic_req_put_plane_prop(atomic_req, plane, kDrmPropertyFbId, next_front_fb_id);
+
+	// Damage clips aren't kept across commits, so they're put even if only the framebuffer changes.
+	ok = put_rendertarget_gbm_damage(target, atomic_req, plane, offset_x, offset_y, width, height);
+	if (ok != 0) {
+		fprintf(stderr, "[compositor] Could not put the damage of the backing store. put_rendertarget_gbm_damage: %s\n", strerror(ok));
+	}
+
+	if (update_fb_only) {
+		return 0;
+	}
+
+	return put_rendertarget_plane_geometry(target, atomic_req, plane, zpos);
 }
 
 static int rendertarget_gbm_present_legacy(
@@ -428,17 +804,18 @@ static int rendertarget_gbm_present_legacy(
 	int zpos,
 	bool set_mode
 ) {
-	struct rendertarget_gbm *gbm_target;
 	struct gbm_bo *next_front_bo;
 	uint32_t next_front_fb_id;
 	bool supported, is_primary;
 	int ok;
 
-	gbm_target = &target->gbm;
-
 	is_primary = drmdev_plane_get_type(drmdev, drm_plane_id) == DRM_PLANE_TYPE_PRIMARY;
 
-	next_front_bo = gbm_surface_lock_front_buffer(gbm_target->gbm_surface);
+	next_front_bo = rendertarget_gbm_lock_front_bo(target);
+	if (next_front_bo == NULL) {
+		return EIO;
+	}
+
 	next_front_fb_id = gbm_bo_get_drm_fb_id(next_front_bo);
 
 	if (is_primary) {
@@ -448,10 +825,11 @@ static int rendertarget_gbm_present_legacy(
 				next_front_fb_id
 			);
 		} else {
+			// the page flip event completes one frame.
 			drmdev_legacy_primary_plane_pageflip(
 				drmdev,
 				next_front_fb_id,
-				NULL
+				(void*) (uintptr_t) 1
 			);
 		}
 	} else {
@@ -469,14 +847,6 @@ static int rendertarget_gbm_present_legacy(
 			((uint16_t) flutterpi.display.height) << 16
 		);
 	}
-	
-	// TODO: move this to the page flip handler.
-	// We can only be sure the buffer can be released when the buffer swap
-	// ocurred.
-	if (gbm_target->current_front_bo != NULL) {
-		gbm_surface_release_buffer(gbm_target->gbm_surface, gbm_target->current_front_bo);
-	}
-	gbm_target->current_front_bo = (struct gbm_bo *) next_front_bo;
 
 	return 0;
 }
@@ -505,9 +875,15 @@ static int rendertarget_gbm_new(
 	*target = (struct rendertarget) {
 		.is_gbm = true,
 		.compositor = compositor,
+		.width = flutterpi.gbm.width,
+		.height = flutterpi.gbm.height,
+		.format = flutterpi.gbm.format,
+		.stale_since = 0,
+		.damage = {0},
 		.gbm = {
 			.gbm_surface = flutterpi.gbm.surface,
-			.current_front_bo = NULL
+			.n_locked_bos = 0,
+			.n_damage_history = 0
 		},
 		.gl_fbo_id = 0,
 		.destroy = rendertarget_gbm_destroy,
@@ -522,8 +898,9 @@ static int rendertarget_gbm_new(
 
 static void rendertarget_nogbm_destroy(struct rendertarget *target) {
 	glDeleteFramebuffers(1, &target->nogbm.gl_fbo_id);
-	destroy_drm_rbo(target->nogbm.rbos + 1);
-	destroy_drm_rbo(target->nogbm.rbos + 0);
+	for (int i = target->nogbm.n_rbos - 1; i >= 0; i--) {
+		destroy_drm_rbo(target->nogbm.rbos + i);
+	}
 	free(target);
 }
 
@@ -535,65 +912,33 @@ static int rendertarget_nogbm_present(
 	int offset_y,
 	int width,
 	int height,
-	int zpos
+	int zpos,
+	bool update_fb_only
 ) {
 	struct rendertarget_nogbm *nogbm_target;
-	bool supported;
+	struct drm_plane *plane;
+	uint32_t fb_id;
 	int ok;
 
 	nogbm_target = &target->nogbm;
 
-	nogbm_target->current_front_rbo ^= 1;
-	ok = attach_drm_rbo_to_fbo(nogbm_target->gl_fbo_id, nogbm_target->rbos + nogbm_target->current_front_rbo);
-	if (ok != 0) return ok;
-
-	drmdev_atomic_req_put_plane_property(req, drm_plane_id, "FB_ID", nogbm_target->rbos[nogbm_target->current_front_rbo ^ 1].drm_fb_id);
-	drmdev_atomic_req_put_plane_property(req, drm_plane_id, "CRTC_ID", target->compositor->drmdev->selected_crtc->crtc->crtc_id);
-	drmdev_atomic_req_put_plane_property(req, drm_plane_id, "SRC_X", 0);
-	drmdev_atomic_req_put_plane_property(req, drm_plane_id, "SRC_Y", 0);
-	drmdev_atomic_req_put_plane_property(req, drm_plane_id, "SRC_W", ((uint16_t) flutterpi.display.width) << 16);
-	drmdev_atomic_req_put_plane_property(req, drm_plane_id, "SRC_H", ((uint16_t) flutterpi.display.height) << 16);
-	drmdev_atomic_req_put_plane_property(req, drm_plane_id, "CRTC_X", 0);
-	drmdev_atomic_req_put_plane_property(req, drm_plane_id, "CRTC_Y", 0);
-	drmdev_atomic_req_put_plane_property(req, drm_plane_id, "CRTC_W", flutterpi.display.width);
-	drmdev_atomic_req_put_plane_property(req, drm_plane_id, "CRTC_H", flutterpi.display.height);
-	
-	ok = drmdev_plane_supports_setting_rotation_value(req->drmdev, drm_plane_id, DRM_MODE_ROTATE_0 | DRM_MODE_REFLECT_Y, &supported);
-	if (ok != 0) return ok;
-	
-	if (supported) {
-		drmdev_atomic_req_put_plane_property(req, drm_plane_id, "rotation", DRM_MODE_ROTATE_0 | DRM_MODE_REFLECT_Y);
-	} else {
-		static bool printed = false;
-
-		if (!printed) {
-			fprintf(stderr,
-					"[compositor] GPU does not support reflecting the screen in Y-direction.\n"
-					"             This is required for rendering into hardware overlay planes though.\n"
-					"             Any UI that is drawn in overlay planes will look upside down.\n"
-			);
-			printed = true;
-		}
+	plane = drmdev_get_plane(req->drmdev, drm_plane_id);
+	if (plane == NULL) {
+		return EINVAL;
 	}
 
-	ok = drmdev_plane_supports_setting_zpos_value(req->drmdev, drm_plane_id, zpos, &supported);
+	fb_id = nogbm_target->rbos[nogbm_target->current_front_rbo].drm_fb_id;
+
+	nogbm_target->current_front_rbo = (nogbm_target->current_front_rbo + 1) % nogbm_target->n_rbos;
+	ok = attach_drm_rbo_to_fbo(nogbm_target->gl_fbo_id, nogbm_target->rbos + nogbm_target->current_front_rbo);
 	if (ok != 0) return ok;
-	
-	if (supported) {
-		drmdev_atomic_req_put_plane_property(req, drm_plane_id, "zpos", zpos);
-	} else {
-		static bool printed = false;
 
-		if (!printed) { 
-			fprintf(stderr,
-					"[compositor] GPU does not supported the desired HW plane order.\n"
-					"             Some UI layers may be invisible.\n"
-			);
-			printed = true;
-		}
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPropertyFbId, fb_id);
+	if (update_fb_only) {
+		return 0;
 	}
 
-	return 0;
+	return put_rendertarget_plane_geometry(target, req, plane, zpos);
 }
 
 static int rendertarget_nogbm_present_legacy(
@@ -616,12 +961,12 @@ static int rendertarget_nogbm_present_legacy(
 
 	is_primary = drmdev_plane_get_type(drmdev, drm_plane_id) == DRM_PLANE_TYPE_PRIMARY;
 
-	nogbm_target->current_front_rbo ^= 1;
+	fb_id = nogbm_target->rbos[nogbm_target->current_front_rbo].drm_fb_id;
+
+	nogbm_target->current_front_rbo = (nogbm_target->current_front_rbo + 1) % nogbm_target->n_rbos;
 	ok = attach_drm_rbo_to_fbo(nogbm_target->gl_fbo_id, nogbm_target->rbos + nogbm_target->current_front_rbo);
 	if (ok != 0) return ok;
 
-	fb_id = nogbm_target->rbos[nogbm_target->current_front_rbo ^ 1].drm_fb_id;
-
 	if (is_primary) {
 		if (set_mode) {
 			drmdev_legacy_set_mode_and_fb(
@@ -646,8 +991,8 @@ static int rendertarget_nogbm_present_legacy(
 			flutterpi.display.height,
 			0,
 			0,
-			((uint16_t) flutterpi.display.width) << 16,
-			((uint16_t) flutterpi.display.height) << 16
+			((uint16_t) target->width) << 16,
+			((uint16_t) target->height) << 16
 		);
 	}
 	
@@ -694,17 +1039,21 @@ static int rendertarget_nogbm_present_legacy(
  * 
  * @param[out] out A pointer to the pointer of the created rendertarget.
  * @param[in] compositor The compositor which this rendertarget should be associated with.
+ * @param[in] width The width of the renderbuffers, in pixels.
+ * @param[in] height The height of the renderbuffers, in pixels.
  * 
  * @see rendertarget_nogbm
  */
 static int rendertarget_nogbm_new(
 	struct rendertarget **out,
-	struct compositor *compositor
+	struct compositor *compositor,
+	int width,
+	int height
 ) {
 	struct rendertarget *target;
 	EGLint egl_error;
 	GLenum gl_error;
-	int ok;
+	int ok, i, n_rbos;
 
 	target = calloc(1, sizeof *target);
 	if (target == NULL) {
@@ -713,6 +1062,10 @@ static int rendertarget_nogbm_new(
 
 	target->is_gbm = false;
 	target->compositor = compositor;
+	target->width = width;
+	target->height = height;
+	target->format = DRM_FORMAT_ARGB8888;
+	target->stale_since = 0;
 	target->destroy = rendertarget_nogbm_destroy;
 	target->present = rendertarget_nogbm_present;
 	target->present_legacy = rendertarget_nogbm_present_legacy;
@@ -727,27 +1080,26 @@ static int rendertarget_nogbm_new(
 		goto fail_free_target;
 	}
 
-	ok = create_drm_rbo(
-		flutterpi.display.width,
-		flutterpi.display.height,
-		target->nogbm.rbos + 0
-	);
-	if (ok != 0) {
-		goto fail_delete_fb;
+	// One renderbuffer may be on screen, the others are being rendered into
+	// or waiting for their commit / page flip.
+	n_rbos = flutterpi.frame_queue_depth + 1;
+
+	for (i = 0; i < n_rbos; i++) {
+		ok = create_drm_rbo(
+			width,
+			height,
+			target->nogbm.rbos + i
+		);
+		if (ok != 0) {
+			goto fail_destroy_drm_rbos;
+		}
 	}
 
-	ok = create_drm_rbo(
-		flutterpi.display.width,
-		flutterpi.display.height,
-		target->nogbm.rbos + 1
-	);
-	if (ok != 0) {
-		goto fail_destroy_drm_rbo_0;
-	}
+	target->nogbm.n_rbos = n_rbos;
 
 	ok = attach_drm_rbo_to_fbo(target->nogbm.gl_fbo_id, target->nogbm.rbos + target->nogbm.current_front_rbo);
 	if (ok != 0) {
-		goto fail_destroy_drm_rbo_1;
+		goto fail_destroy_drm_rbos;
 	}
 
 	target->gl_fbo_id = target->nogbm.gl_fbo_id;
@@ -756,13 +1108,11 @@ static int rendertarget_nogbm_new(
 	return 0;
 
 
-	fail_destroy_drm_rbo_1:
-	destroy_drm_rbo(target->nogbm.rbos + 1);
-
-	fail_destroy_drm_rbo_0:
-	destroy_drm_rbo(target->nogbm.rbos + 0);
+	fail_destroy_drm_rbos:
+	while (i--) {
+		destroy_drm_rbo(target->nogbm.rbos + i);
+	}
 
-	fail_delete_fb:
 	glDeleteFramebuffers(1, &target->nogbm.gl_fbo_id);
 
 	fail_free_target:
@@ -785,11 +1135,11 @@ static void on_destroy_backing_store_gl_fb(void *userdata) {
 	store = userdata;
 	compositor = store->target->compositor;
 
-	cpset_put_(&compositor->stale_rendertargets, store->target);
-
+	// Whichever of the two callbacks comes first returns the rendertarget to the pool.
 	if (store->should_free_on_next_destroy) {
 		free(store);
 	} else {
+		put_stale_rendertarget(compositor, store->target);
 		store->should_free_on_next_destroy = true;
 	}
 }
@@ -812,11 +1162,11 @@ static bool on_collect_backing_store(
 	store = backing_store->user_data;
 	compositor = store->target->compositor;
 
-	cpset_put_(&compositor->stale_rendertargets, store->target);
-
+	// Whichever of the two callbacks comes first returns the rendertarget to the pool.
 	if (store->should_free_on_next_destroy) {
 		free(store);
 	} else {
+		put_stale_rendertarget(compositor, store->target);
 		store->should_free_on_next_destroy = true;
 	}
 
@@ -839,7 +1189,7 @@ static bool on_create_backing_store(
 	struct flutterpi_backing_store *store;
 	struct rendertarget *target;
 	struct compositor *compositor;
-	int ok;
+	int ok, width, height;
 
 	compositor = userdata;
 
@@ -848,17 +1198,32 @@ static bool on_create_backing_store(
 		return false;
 	}
 
-	// first, try to find a stale GBM rendertarget.
-	cpset_lock(&compositor->stale_rendertargets);
-	for_each_pointer_in_cpset(&compositor->stale_rendertargets, target) break;
-	if (target != NULL) {
-		cpset_remove_locked(&compositor->stale_rendertargets, target);
+	if (!compositor->has_prewarmed_rendertargets) {
+		prewarm_rendertargets(compositor);
+	}
+
+	width = (int) round(config->size.width);
+	height = (int) round(config->size.height);
+
+	// The first backing store is always the GBM rendertarget, even if there are
+	// prewarmed rendertargets in the pool. After that, try to find a stale
+	// rendertarget with the same size & format. (The GBM one, if it's stale.)
+	target = NULL;
+	if (!compositor->should_create_window_surface_backing_store) {
+		target = take_stale_rendertarget(compositor, width, height, flutterpi.gbm.format);
+		if (target == NULL && flutterpi.gbm.format != DRM_FORMAT_ARGB8888) {
+			target = take_stale_rendertarget(compositor, width, height, DRM_FORMAT_ARGB8888);
+		}
+
+		if (target != NULL) {
+			atomic_fetch_add_explicit(&compositor->n_rendertarget_pool_hits, 1, memory_order_relaxed);
+		} else {
+			atomic_fetch_add_explicit(&compositor->n_rendertarget_pool_misses, 1, memory_order_relaxed);
+		}
 	}
-	cpset_unlock(&compositor->stale_rendertargets);
 
-	// if we didn't find one, check if we should create one. If not,
-	// try to find a stale No-GBM rendertarget. If there is none,
-	// create one.
+	// if we didn't find one, check if we should create the GBM rendertarget.
+	// If not, create a No-GBM rendertarget.
 	if (target == NULL) {
 		if (compositor->should_create_window_surface_backing_store) {
 			// We create 1 "backing store" that is rendering to the DRM_PLANE_PRIMARY
@@ -879,7 +1244,9 @@ static bool on_create_backing_store(
 		} else {
 			ok = rendertarget_nogbm_new(
 				&target,
-				compositor
+				compositor,
+				width,
+				height
 			);
 
 			if (ok != 0) {
@@ -911,239 +1278,1514 @@ static bool on_create_backing_store(
 }
 
 struct simulated_page_flip_event_data {
-	unsigned int sec;
-	unsigned int usec;
+	uint64_t commit_time;
+	bool commit_waited_for_vblank;
 };
 
-extern void on_pageflip_event(
-	int fd,
-	unsigned int frame,
-	unsigned int sec,
-	unsigned int usec,
-	void *userdata
-);
-
 static int execute_simulate_page_flip_event(void *userdata) {
 	struct simulated_page_flip_event_data *data;
+	int ok;
 
 	data = userdata;
 
-	on_pageflip_event(flutterpi.drm.drmdev->fd, 0, data->sec, data->usec, NULL);
+	ok = flutterpi_schedule_simulated_page_flip(data->commit_time, data->commit_waited_for_vblank);
 
 	free(data);
 
-	return 0;
+	return ok;
 }
 
-/// PRESENT FUNCS
-static bool on_present_layers(
-	const FlutterLayer **layers,
-	size_t layers_count,
-	void *userdata
-) {
-	struct drmdev_atomic_req *req;
-	struct view_cb_data *cb_data;
-	struct pointer_set planes;
-	struct compositor *compositor;
-	struct drm_plane *plane;
-	struct drmdev *drmdev;
-	uint32_t req_flags;
-	void *planes_storage[32] = {0};
-	bool legacy_rendertarget_set_mode = false;
-	bool schedule_fake_page_flip_event;
-	bool use_atomic_modesetting;
+/**
+ * @brief Set whether a page flip event is expected for the frame that's about to be committed,
+ * and when presenting that frame started.
+ * 
+ * The page flip event can be dispatched on the main thread before the commit even returns,
+ * so this needs to be called before committing.
+ */
+static void set_pending_page_flip(struct compositor *compositor, bool pending, uint64_t present_time) {
+	pthread_mutex_lock(&compositor->page_flip_mutex);
+	compositor->has_pending_page_flip = pending;
+	compositor->pending_flip_frame_seq = compositor->frame_seq;
+	compositor->last_present_time = present_time;
+	compositor->last_commit_time = 0;
+	pthread_mutex_unlock(&compositor->page_flip_mutex);
+}
+
+static void set_commit_time(struct compositor *compositor, uint64_t commit_time) {
+	pthread_mutex_lock(&compositor->page_flip_mutex);
+	compositor->last_commit_time = commit_time;
+	pthread_mutex_unlock(&compositor->page_flip_mutex);
+}
+
+/**
+ * @brief Wait until the last committed frame was flipped to the screen.
+ * Must be called with the page flip mutex locked.
+ * 
+ * Gives up after PAGE_FLIP_TIMEOUT_MS, in case the page flip event got lost.
+ */
+static void wait_for_pending_page_flip_locked(struct compositor *compositor) {
+	struct timespec timeout;
 	int ok;
 
-	compositor = userdata;
-	drmdev = compositor->drmdev;
-	schedule_fake_page_flip_event = compositor->do_blocking_atomic_commits;
-	use_atomic_modesetting = drmdev->supports_atomic_modesetting;
+	clock_gettime(CLOCK_REALTIME, &timeout);
+	timeout.tv_nsec += PAGE_FLIP_TIMEOUT_MS * 1000000l;
+	timeout.tv_sec += timeout.tv_nsec / 1000000000l;
+	timeout.tv_nsec %= 1000000000l;
 
-	if (use_atomic_modesetting) {
-		drmdev_new_atomic_req(compositor->drmdev, &req);
-	} else {
-		planes = PSET_INITIALIZER_STATIC(planes_storage, 32);
-		for_each_plane_in_drmdev(drmdev, plane) {
-			if (plane->plane->possible_crtcs & drmdev->selected_crtc->bitmask) {
-				pset_put(&planes, plane);
-			}
+	while (compositor->has_pending_page_flip) {
+		ok = pthread_cond_timedwait(&compositor->page_flip_cond, &compositor->page_flip_mutex, &timeout);
+		if (ok == ETIMEDOUT) {
+			fprintf(stderr, "[compositor] Timed out waiting for the page flip of the last frame.\n");
+			compositor->has_pending_page_flip = false;
 		}
 	}
+}
 
-	cpset_lock(&compositor->cbs);
+/**
+ * @brief Wait until the last committed frame was flipped to the screen.
+ * Only used for legacy modesetting, with atomic modesetting the KMS commit thread does this.
+ * 
+ * A CRTC can only have one pending page flip, so if frames are pipelined
+ * (--frame-queue-depth > 1) the next frame can be done rendering before the last one was flipped.
+ * Committing it now would fail with EBUSY. With a frame queue depth of 1, the engine doesn't
+ * even start a frame before the last one was flipped, so this won't wait.
+ */
+static void wait_for_pending_page_flip(struct compositor *compositor) {
+	pthread_mutex_lock(&compositor->page_flip_mutex);
+	wait_for_pending_page_flip_locked(compositor);
+	pthread_mutex_unlock(&compositor->page_flip_mutex);
+}
 
-	eglMakeCurrent(flutterpi.egl.display, flutterpi.egl.surface, flutterpi.egl.surface, flutterpi.egl.root_context);
-	eglSwapBuffers(flutterpi.egl.display, flutterpi.egl.surface);
+/**
+ * @brief Get an atomic request for building the next frame. Reuses one the
+ * KMS commit thread is done with, if there's any.
+ */
+static int take_atomic_req(struct compositor *compositor, struct drmdev_atomic_req **req_out) {
+	struct drmdev_atomic_req *req;
+	int ok;
 
-	req_flags =  0 /* DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_NONBLOCK*/;
-	if (compositor->has_applied_modeset == false) {
-		if (use_atomic_modesetting) {
-			ok = drmdev_atomic_req_put_modeset_props(req, &req_flags);
-			if (ok != 0) return false;
-		} else {
-			legacy_rendertarget_set_mode = true;
-			schedule_fake_page_flip_event = true;
-		}
+	req = NULL;
 
-		int64_t max_zpos = 0;
+	pthread_mutex_lock(&compositor->page_flip_mutex);
+	if (compositor->kms_commit.n_free_reqs > 0) {
+		req = compositor->kms_commit.free_reqs[--compositor->kms_commit.n_free_reqs];
+	}
 
-		if (use_atomic_modesetting) {
-			for_each_unreserved_plane_in_atomic_req(req, plane) {
-				if (plane->type == DRM_PLANE_TYPE_CURSOR) {
-					// make sure the cursor is in front of everything
-					int64_t max_zpos;
-					bool supported;
+	// The commit the last plane assignment was recorded for didn't go through.
+	if (compositor->kms_commit.has_failed_commit) {
+		compositor->plane_assignment.is_valid = false;
+		compositor->kms_commit.has_failed_commit = false;
+	}
+	pthread_mutex_unlock(&compositor->page_flip_mutex);
 
-					ok = drmdev_plane_get_max_zpos_value(req->drmdev, plane->plane->plane_id, &max_zpos);
-					if (ok != 0) {
-						printf("[compositor] Could not move cursor to front. Mouse cursor may be invisible. drmdev_plane_get_max_zpos_value: %s\n", strerror(ok));
-						continue;
-					}
-					
-					ok = drmdev_plane_supports_setting_zpos_value(req->drmdev, plane->plane->plane_id, max_zpos, &supported);
-					if (ok != 0) {
-						printf("[compositor] Could not move cursor to front. Mouse cursor may be invisible. drmdev_plane_supports_setting_zpos_value: %s\n", strerror(ok));
-						continue;
-					}
+	if (req != NULL) {
+		*req_out = req;
+		return 0;
+	}
 
-					if (supported) {
-						drmdev_atomic_req_put_plane_property(req, plane->plane->plane_id, "zpos", max_zpos);
-					} else {
-						printf("[compositor] Could not move cursor to front. Mouse cursor may be invisible. drmdev_plane_supports_setting_zpos_value: %s\n", strerror(ok));
-						continue;
-					}
-				}
-			}
-		} else {
-			for_each_pointer_in_pset(&planes, plane) {
-				if (plane->type == DRM_PLANE_TYPE_CURSOR) {
-					// make sure the cursor is in front of everything
-					int64_t max_zpos;
-					bool supported;
+	ok = drmdev_new_atomic_req(compositor->drmdev, &req);
+	if (ok != 0) {
+		fprintf(stderr, "[compositor] Could not create atomic request. drmdev_new_atomic_req: %s\n", strerror(ok));
+		return ok;
+	}
 
-					ok = drmdev_plane_get_max_zpos_value(drmdev, plane->plane->plane_id, &max_zpos);
-					if (ok != 0) {
-						printf("[compositor] Could not move cursor to front. Mouse cursor may be invisible. drmdev_plane_get_max_zpos_value: %s\n", strerror(ok));
-						continue;
-					}
-					
-					ok = drmdev_plane_supports_setting_zpos_value(drmdev, plane->plane->plane_id, max_zpos, &supported);
-					if (ok != 0) {
-						printf("[compositor] Could not move cursor to front. Mouse cursor may be invisible. drmdev_plane_supports_setting_zpos_value: %s\n", strerror(ok));
-						continue;
-					}
+	*req_out = req;
+	return 0;
+}
 
-					if (supported) {
-						drmdev_legacy_set_plane_property(drmdev, plane->plane->plane_id, "zpos", max_zpos);
-					} else {
-						printf("[compositor] Could not move cursor to front. Mouse cursor may be invisible. drmdev_plane_supports_setting_zpos_value: %s\n", strerror(ok));
-						continue;
-					}
-				}
-			}
-		}
-		
-		compositor->has_applied_modeset = true;
+/**
+ * @brief Reset a request that was committed (or merged into another one) and keep it for later frames.
+ * Must be called with the page flip mutex locked.
+ */
+static void put_free_atomic_req_locked(struct compositor *compositor, struct drmdev_atomic_req *req) {
+	if (compositor->kms_commit.n_free_reqs == sizeof(compositor->kms_commit.free_reqs) / sizeof(*compositor->kms_commit.free_reqs)) {
+		drmdev_destroy_atomic_req(req);
+		return;
 	}
-	
-	// first, the state machine phase.
-	// go through the layers, update
-	// all platform views accordingly.
-	// unmount, update, mount. in that order
-	{
-		void *mounted_views_storage[layers_count];
-		memset(mounted_views_storage, 0, layers_count * sizeof(void*));
-		struct pointer_set mounted_views = PSET_INITIALIZER_STATIC(mounted_views_storage, layers_count);
-
-		void *unmounted_views_storage[layers_count];
-		memset(unmounted_views_storage, 0, layers_count * sizeof(void*));
-		struct pointer_set unmounted_views = PSET_INITIALIZER_STATIC(unmounted_views_storage, layers_count);
 
-		void *updated_views_storage[layers_count];
-		memset(updated_views_storage, 0, layers_count * sizeof(void*));
-		struct pointer_set updated_views = PSET_INITIALIZER_STATIC(updated_views_storage, layers_count);
-	
-		for_each_pointer_in_cpset(&compositor->cbs, cb_data) {
-			const FlutterLayer *layer;
-			bool is_present = false;
-			int zpos;
+	drmdev_atomic_req_reset(req);
+	compositor->kms_commit.free_reqs[compositor->kms_commit.n_free_reqs++] = req;
+}
 
-			for (int i = 0; i < layers_count; i++) {
-				if (layers[i]->type == kFlutterLayerContentTypePlatformView &&
-					layers[i]->platform_view->identifier == cb_data->view_id) {
-					is_present = true;
-					layer = layers[i];
-					zpos = i;
-					break;
-				}
-			}
+/**
+ * @brief Drop the frames of a request instead of committing it. Must be called with the page flip mutex locked.
+ * 
+ * Used for requests that only update the framebuffers of the plane state a failed commit
+ * would have applied. There's no page flip event for them, so simulate one for each frame.
+ */
+static void discard_kms_commit_locked(
+	struct compositor *compositor,
+	struct drmdev_atomic_req *req,
+	const int *in_fence_fds,
+	int n_in_fence_fds,
+	unsigned int n_frames
+) {
+	struct simulated_page_flip_event_data *data;
 
-			if (!is_present && cb_data->was_present_last_frame) {
-				pset_put(&unmounted_views, cb_data);
-			} else if (is_present && cb_data->was_present_last_frame) {
-				if (cb_data->update_view != NULL) {
-					bool did_update_view = false;
+	for (int i = 0; i < n_in_fence_fds; i++) {
+		close(in_fence_fds[i]);
+	}
 
-					did_update_view = did_update_view || (zpos != cb_data->last_zpos);
-					did_update_view = did_update_view || memcmp(&cb_data->last_size, &layer->size, sizeof(FlutterSize));
-					did_update_view = did_update_view || memcmp(&cb_data->last_offset, &layer->offset, sizeof(FlutterPoint));
-					did_update_view = did_update_view || (cb_data->last_num_mutations != layer->platform_view->mutations_count);
-					for (int i = 0; (i < layer->platform_view->mutations_count) && !did_update_view; i++) {
-						did_update_view = did_update_view || memcmp(cb_data->last_mutations + i, layer->platform_view->mutations[i], sizeof(FlutterPlatformViewMutation));
-					}
+	put_free_atomic_req_locked(compositor, req);
 
-					if (did_update_view) {
-						pset_put(&updated_views, cb_data);
-					}
-				}
-			} else if (is_present && !cb_data->was_present_last_frame) {
-				pset_put(&mounted_views, cb_data);
-			}
+	for (unsigned int i = 0; i < n_frames; i++) {
+		data = malloc(sizeof *data);
+		if (data == NULL) {
+			break;
 		}
 
-		for_each_pointer_in_pset(&unmounted_views, cb_data) {
-			if (cb_data->unmount != NULL) {
-				ok = cb_data->unmount(
-					cb_data->view_id,
-					req,
-					cb_data->userdata
-				);
-				if (ok != 0) {
-					fprintf(stderr, "[compositor] Could not unmount platform view. unmount: %s\n", strerror(ok));
-				}
-			}
-		}
+		data->commit_time = flutterpi.flutter.libflutter_engine.FlutterEngineGetCurrentTime();
+		data->commit_waited_for_vblank = false;
 
-		for_each_pointer_in_pset(&updated_views, cb_data) {
-			const FlutterLayer *layer;
-			int zpos;
+		flutterpi_post_platform_task_with_priority(execute_simulate_page_flip_event, data, kPlatformTaskPriorityFrame);
+	}
+}
 
-			for (int i = 0; i < layers_count; i++) {
-				if (layers[i]->type == kFlutterLayerContentTypePlatformView &&
-					layers[i]->platform_view->identifier == cb_data->view_id) {
-					layer = layers[i];
-					zpos = i;
-					break;
+/**
+ * @brief Hand the atomic request of a frame over to the KMS commit thread and return immediately.
+ * 
+ * If the request of the last frame is still waiting for its commit, this frame is merged into it,
+ * so the newest frame is shown with the next page flip. Only waits for the commit thread if the
+ * requests can't be merged.
+ * 
+ * If req only updates the framebuffers of the last plane assignment (is_incremental) and
+ * a commit failed since that assignment was recorded, the frame is dropped instead.
+ * 
+ * Takes ownership of req and in_fence_fd.
+ * 
+ * @returns Whether the frame was queued.
+ */
+static bool queue_kms_commit(
+	struct compositor *compositor,
+	struct drmdev_atomic_req *req,
+	uint32_t flags,
+	int in_fence_fd,
+	uint64_t present_time,
+	bool is_incremental
+) {
+	int ok;
+
+	pthread_mutex_lock(&compositor->page_flip_mutex);
+
+	if (is_incremental && compositor->kms_commit.has_failed_commit) {
+		// The planes don't have the state this request builds on.
+		fprintf(stderr, "[compositor] Dropping a frame because the commit it builds on failed.\n");
+		discard_kms_commit_locked(compositor, req, &in_fence_fd, in_fence_fd >= 0 ? 1 : 0, 1);
+		pthread_mutex_unlock(&compositor->page_flip_mutex);
+		return false;
+	}
+
+	while (compositor->kms_commit.mailbox != NULL) {
+		if ((in_fence_fd < 0) || (compositor->kms_commit.n_mailbox_in_fence_fds < KMS_COMMIT_MAX_IN_FENCES)) {
+			ok = drmdev_atomic_req_merge(compositor->kms_commit.mailbox, req);
+			if (ok == 0) {
+				put_free_atomic_req_locked(compositor, req);
+
+				compositor->kms_commit.mailbox_flags |= flags;
+				compositor->kms_commit.mailbox_present_time = present_time;
+				compositor->kms_commit.mailbox_frame_seq = compositor->frame_seq;
+				compositor->kms_commit.n_mailbox_frames++;
+				compositor->kms_commit.is_mailbox_incremental |= is_incremental;
+				if (in_fence_fd >= 0) {
+					compositor->kms_commit.mailbox_in_fence_fds[compositor->kms_commit.n_mailbox_in_fence_fds++] = in_fence_fd;
 				}
-			}
 
-			ok = cb_data->update_view(
-				cb_data->view_id,
-				req,
-				layer->platform_view->mutations,
-				layer->platform_view->mutations_count,
-				(int) round(layer->offset.x),
-				(int) round(layer->offset.y),
-				(int) round(layer->size.width),
-				(int) round(layer->size.height),
-				zpos,
-				cb_data->userdata
-			);
-			if (ok != 0) {
-				fprintf(stderr, "[compositor] Could not update platform view. update_view: %s\n", strerror(ok));
+				pthread_mutex_unlock(&compositor->page_flip_mutex);
+				return true;
 			}
+		}
 
-			cb_data->last_zpos = zpos;
+		pthread_cond_wait(&compositor->page_flip_cond, &compositor->page_flip_mutex);
+	}
+
+	compositor->kms_commit.mailbox = req;
+	compositor->kms_commit.mailbox_flags = flags;
+	compositor->kms_commit.mailbox_present_time = present_time;
+	compositor->kms_commit.mailbox_frame_seq = compositor->frame_seq;
+	compositor->kms_commit.n_mailbox_frames = 1;
+	compositor->kms_commit.is_mailbox_incremental = is_incremental;
+	compositor->kms_commit.n_mailbox_in_fence_fds = 0;
+	if (in_fence_fd >= 0) {
+		compositor->kms_commit.mailbox_in_fence_fds[compositor->kms_commit.n_mailbox_in_fence_fds++] = in_fence_fd;
+	}
+
+	pthread_cond_broadcast(&compositor->page_flip_cond);
+	pthread_mutex_unlock(&compositor->page_flip_mutex);
+	return true;
+}
+
+/**
+ * @brief Take the OUT_FENCE_PTR fence of the last commit, if nobody waited for it yet.
+ * 
+ * @returns The fence fd, or -1 if there's none.
+ */
+static int take_kms_out_fence(struct compositor *compositor) {
+	int fd;
+
+	pthread_mutex_lock(&compositor->page_flip_mutex);
+	fd = compositor->kms_commit.out_fence_fd;
+	compositor->kms_commit.out_fence_fd = -1;
+	pthread_mutex_unlock(&compositor->page_flip_mutex);
+
+	return fd;
+}
+
+struct mode_set_result_data {
+	compositor_mode_set_cb callback;
+	void *userdata;
+	int result;
+};
+
+static int execute_mode_set_result(void *userdata) {
+	struct mode_set_result_data *data;
+
+	data = userdata;
+
+	data->callback(data->result, data->userdata);
+
+	free(data);
+
+	return 0;
+}
+
+/**
+ * @brief Tell the main thread whether a mode switch succeeded by calling callback there.
+ */
+static void report_mode_set_result(compositor_mode_set_cb callback, void *userdata, int result) {
+	struct mode_set_result_data *data;
+
+	if (callback == NULL) {
+		return;
+	}
+
+	data = malloc(sizeof *data);
+	if (data == NULL) {
+		fprintf(stderr, "[compositor] Could not report the result of a display mode switch. Out of memory.\n");
+		return;
+	}
+
+	data->callback = callback;
+	data->userdata = userdata;
+	data->result = result;
+
+	flutterpi_post_platform_task(execute_mode_set_result, data);
+}
+
+/**
+ * @brief Select the mode again that was selected before a modeset that didn't go through.
+ */
+static void restore_previous_mode(struct compositor *compositor, const drmModeModeInfo *previous_mode) {
+	struct drmdev *drmdev;
+	int ok;
+
+	drmdev = compositor->drmdev;
+
+	ok = drmdev_configure(
+		drmdev,
+		drmdev->selected_connector->connector->connector_id,
+		drmdev->selected_encoder->encoder->encoder_id,
+		drmdev->selected_crtc->crtc->crtc_id,
+		previous_mode
+	);
+	if (ok != 0) {
+		fprintf(stderr, "[compositor] Could not select the previous display mode again. drmdev_configure: %s\n", strerror(ok));
+	}
+}
+
+/**
+ * @brief Select the mode @ref compositor_set_mode staged and put the modeset into req.
+ * Must be called on the KMS commit thread with the page flip mutex locked, so nobody
+ * reads the selected mode or its property blob meanwhile.
+ * 
+ * If this succeeds, @ref finish_mode_commit_locked must be called with the result of committing req.
+ */
+static int put_pending_mode_locked(struct compositor *compositor, struct drmdev_atomic_req *req, uint32_t *flags) {
+	const drmModeModeInfo *previous_mode;
+	compositor_mode_set_cb callback;
+	drmModeModeInfo *mode;
+	struct drmdev *drmdev;
+	void *userdata;
+	int ok;
+
+	drmdev = compositor->drmdev;
+	previous_mode = drmdev->selected_mode;
+	callback = compositor->kms_commit.pending_mode_cb;
+	userdata = compositor->kms_commit.pending_mode_userdata;
+	compositor->kms_commit.has_pending_mode = false;
+	compositor->kms_commit.pending_mode_cb = NULL;
+	compositor->kms_commit.pending_mode_userdata = NULL;
+
+	// Use the storage the drmdev doesn't point to right now, so the previous mode stays valid.
+	mode = compositor->kms_commit.selected_modes;
+	if (previous_mode == mode) {
+		mode++;
+	}
+	*mode = compositor->kms_commit.pending_mode;
+
+	// Nothing is being committed right now, and the MODE_ID of the only queued request
+	// (the mailbox) is replaced below, so drmdev_configure can destroy the old property blob.
+	ok = drmdev_configure(
+		drmdev,
+		drmdev->selected_connector->connector->connector_id,
+		drmdev->selected_encoder->encoder->encoder_id,
+		drmdev->selected_crtc->crtc->crtc_id,
+		mode
+	);
+	if (ok != 0) {
+		fprintf(stderr, "[compositor] Could not select new display mode. drmdev_configure: %s\n", strerror(ok));
+		report_mode_set_result(callback, userdata, ok);
+		return ok;
+	}
+
+	ok = drmdev_atomic_req_put_modeset_props(req, flags);
+	if (ok != 0) {
+		fprintf(stderr, "[compositor] Could not apply new display mode. drmdev_atomic_req_put_modeset_props: %s\n", strerror(ok));
+		restore_previous_mode(compositor, previous_mode);
+		report_mode_set_result(callback, userdata, ok);
+		return ok;
+	}
+
+	compositor->kms_commit.is_committing_mode = true;
+	compositor->kms_commit.previous_mode = previous_mode;
+	compositor->kms_commit.committing_mode_cb = callback;
+	compositor->kms_commit.committing_mode_userdata = userdata;
+
+	return 0;
+}
+
+/**
+ * @brief Called on the KMS commit thread with the page flip mutex locked after the request
+ * @ref put_pending_mode_locked put a new mode into was committed. Selects the previous mode
+ * again if the commit failed, since the display still uses it, and reports the result.
+ */
+static void finish_mode_commit_locked(struct compositor *compositor, int result) {
+	if (!compositor->kms_commit.is_committing_mode) {
+		return;
+	}
+
+	compositor->kms_commit.is_committing_mode = false;
+
+	if (result != 0) {
+		restore_previous_mode(compositor, compositor->kms_commit.previous_mode);
+	}
+
+	report_mode_set_result(
+		compositor->kms_commit.committing_mode_cb,
+		compositor->kms_commit.committing_mode_userdata,
+		result
+	);
+
+	compositor->kms_commit.previous_mode = NULL;
+	compositor->kms_commit.committing_mode_cb = NULL;
+	compositor->kms_commit.committing_mode_userdata = NULL;
+}
+
+/**
+ * @brief Apply the mode @ref compositor_set_mode staged while no frame is waiting to be committed.
+ * Must be called on the KMS commit thread with the page flip mutex locked. Unlocks it while committing.
+ */
+static void commit_pending_mode_locked(struct compositor *compositor) {
+	struct drmdev_atomic_req *req;
+	uint32_t flags;
+	int ok;
+
+	if (compositor->kms_commit.n_free_reqs > 0) {
+		req = compositor->kms_commit.free_reqs[--compositor->kms_commit.n_free_reqs];
+	} else {
+		ok = drmdev_new_atomic_req(compositor->drmdev, &req);
+		if (ok != 0) {
+			fprintf(stderr, "[compositor] Could not create atomic request. drmdev_new_atomic_req: %s\n", strerror(ok));
+			report_mode_set_result(compositor->kms_commit.pending_mode_cb, compositor->kms_commit.pending_mode_userdata, ok);
+			compositor->kms_commit.has_pending_mode = false;
+			compositor->kms_commit.pending_mode_cb = NULL;
+			compositor->kms_commit.pending_mode_userdata = NULL;
+			return;
+		}
+	}
+
+	// The planes keep their framebuffers, we only change the CRTC mode.
+	flags = 0;
+	ok = put_pending_mode_locked(compositor, req, &flags);
+	if (ok == 0) {
+		// Frames queued meanwhile wait in the mailbox until this returns.
+		pthread_mutex_unlock(&compositor->page_flip_mutex);
+
+		ok = drmdev_atomic_req_commit(req, flags, NULL);
+		if (ok != 0) {
+			fprintf(stderr, "[compositor] Could not apply new display mode. drmModeAtomicCommit: %s\n", strerror(ok));
+		}
+
+		pthread_mutex_lock(&compositor->page_flip_mutex);
+
+		finish_mode_commit_locked(compositor, ok);
+	}
+
+	put_free_atomic_req_locked(compositor, req);
+}
+
+static void *kms_commit_thread_main(void *userdata) {
+	struct simulated_page_flip_event_data *data;
+	struct drmdev_atomic_req *req;
+	struct compositor *compositor;
+	unsigned int n_frames;
+	uint32_t flags;
+	uint64_t frame_seq, commit_time;
+	int32_t out_fence_fd;
+	int in_fence_fds[KMS_COMMIT_MAX_IN_FENCES];
+	int n_in_fence_fds;
+	bool blocking;
+	int ok;
+
+	compositor = userdata;
+
+	pthread_mutex_lock(&compositor->page_flip_mutex);
+
+	while (!compositor->kms_commit.should_stop) {
+		if ((compositor->kms_commit.mailbox == NULL) && !compositor->kms_commit.has_pending_mode) {
+			pthread_cond_wait(&compositor->page_flip_cond, &compositor->page_flip_mutex);
+			continue;
+		}
+
+		// New frames keep getting merged into the mailbox request while we wait here.
+		wait_for_pending_page_flip_locked(compositor);
+
+		if (compositor->kms_commit.mailbox == NULL) {
+			// Only the mode changed, flutter didn't present a new frame.
+			commit_pending_mode_locked(compositor);
+			continue;
+		}
+
+		// Take everything out of the mailbox, so we don't need the lock while committing.
+		req = compositor->kms_commit.mailbox;
+		flags = compositor->kms_commit.mailbox_flags;
+		if (compositor->kms_commit.has_pending_mode) {
+			put_pending_mode_locked(compositor, req, &flags);
+		}
+		frame_seq = compositor->kms_commit.mailbox_frame_seq;
+		n_frames = compositor->kms_commit.n_mailbox_frames;
+		n_in_fence_fds = compositor->kms_commit.n_mailbox_in_fence_fds;
+		memcpy(in_fence_fds, compositor->kms_commit.mailbox_in_fence_fds, n_in_fence_fds * sizeof(*in_fence_fds));
+		compositor->kms_commit.mailbox = NULL;
+		compositor->kms_commit.n_mailbox_in_fence_fds = 0;
+
+		// The page flip event can be dispatched before the commit even returns,
+		// so the page flip handler needs to know about this frame before we commit it.
+		compositor->last_present_time = compositor->kms_commit.mailbox_present_time;
+		compositor->last_commit_time = 0;
+		compositor->pending_flip_frame_seq = frame_seq;
+		compositor->has_pending_page_flip = true;
+
+		// the raster thread may be waiting for an empty mailbox.
+		pthread_cond_broadcast(&compositor->page_flip_cond);
+		pthread_mutex_unlock(&compositor->page_flip_mutex);
+
+		out_fence_fd = -1;
+		if (n_in_fence_fds > 0) {
+			// the kernel writes the out fence fd into out_fence_fd while committing.
+			drmdev_atomic_req_put_crtc_prop(req, kDrmPropertyOutFencePtr, (uint64_t) (uintptr_t) &out_fence_fd);
+		}
+
+		// The page flip event tells on_pageflip_event how many frames this commit completes.
+		blocking = false;
+		ok = drmdev_atomic_req_commit(req, flags | DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT, (void*) (uintptr_t) n_frames);
+		if (ok == EBUSY) {
+			// There's still a page flip pending we don't know about. (For example, because
+			// we timed out waiting for its event.) Only commit this frame blockingly,
+			// the next ones can be nonblocking again.
+			fprintf(stderr, "[compositor] Non-blocking drmModeAtomicCommit failed with EBUSY. Committing this frame blockingly.\n");
+
+			pthread_mutex_lock(&compositor->page_flip_mutex);
+			compositor->has_pending_page_flip = false;
+			pthread_mutex_unlock(&compositor->page_flip_mutex);
+
+			blocking = true;
+			ok = drmdev_atomic_req_commit(req, flags & ~(DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT), (void*) (uintptr_t) n_frames);
+		}
+
+		commit_time = flutterpi.flutter.libflutter_engine.FlutterEngineGetCurrentTime();
+
+		for (int i = 0; i < n_in_fence_fds; i++) {
+			close(in_fence_fds[i]);
+		}
+
+		pthread_mutex_lock(&compositor->page_flip_mutex);
+
+		// A mode that was put into this request is only applied if the commit succeeded.
+		finish_mode_commit_locked(compositor, ok);
+
+		if (ok != 0) {
+			fprintf(stderr, "[compositor] Could not present frame. drmModeAtomicCommit: %s\n", strerror(ok));
+			compositor->has_pending_page_flip = false;
+			compositor->kms_commit.has_failed_commit = true;
+
+			// A request that was queued meanwhile may only update the framebuffers
+			// of the plane state this commit would have applied.
+			if ((compositor->kms_commit.mailbox != NULL) && compositor->kms_commit.is_mailbox_incremental) {
+				fprintf(stderr, "[compositor] Dropping %u frame(s) because the commit they build on failed.\n", compositor->kms_commit.n_mailbox_frames);
+				discard_kms_commit_locked(
+					compositor,
+					compositor->kms_commit.mailbox,
+					compositor->kms_commit.mailbox_in_fence_fds,
+					compositor->kms_commit.n_mailbox_in_fence_fds,
+					compositor->kms_commit.n_mailbox_frames
+				);
+				compositor->kms_commit.mailbox = NULL;
+				compositor->kms_commit.n_mailbox_in_fence_fds = 0;
+				pthread_cond_broadcast(&compositor->page_flip_cond);
+			}
+		} else {
+			// If the page flip of this frame was already handled, it was reported without a commit time.
+			if (atomic_load(&compositor->flipped_frame_seq) < frame_seq) {
+				compositor->last_commit_time = commit_time;
+			}
+
+			if (blocking) {
+				// Blocking commits only return after the vblank that put the frame on screen.
+				atomic_store(&compositor->flipped_frame_seq, frame_seq);
+			}
+		}
+
+		if (out_fence_fd >= 0) {
+			if (compositor->kms_commit.out_fence_fd >= 0) {
+				close(compositor->kms_commit.out_fence_fd);
+			}
+			compositor->kms_commit.out_fence_fd = out_fence_fd;
+		}
+
+		put_free_atomic_req_locked(compositor, req);
+
+		if ((ok != 0) || blocking) {
+			// There's no page flip event for blocking or failed commits, so simulate one for each frame.
+			// Otherwise the frames would never leave the frame queue.
+			for (unsigned int i = 0; i < n_frames; i++) {
+				data = malloc(sizeof *data);
+				if (data == NULL) {
+					break;
+				}
+
+				data->commit_time = commit_time;
+				data->commit_waited_for_vblank = ok == 0;
+
+				flutterpi_post_platform_task_with_priority(execute_simulate_page_flip_event, data, kPlatformTaskPriorityFrame);
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&compositor->page_flip_mutex);
+
+	return NULL;
+}
+
+/**
+ * @brief Create a native fence that signals when the GPU has finished all the
+ * rendering that was issued in the current EGL context so far.
+ * 
+ * @returns The fence fd, or -1 if it couldn't be created.
+ */
+static int create_render_fence_fd(void) {
+	EGLSyncKHR sync;
+	int fd;
+
+	sync = flutterpi.egl.createSyncKHR(flutterpi.egl.display, EGL_SYNC_NATIVE_FENCE_ANDROID, NULL);
+	if (sync == EGL_NO_SYNC_KHR) {
+		fprintf(stderr, "[compositor] Could not create render fence. eglCreateSyncKHR: 0x%08X\n", eglGetError());
+		return -1;
+	}
+
+	// the fence only gets an fd once it was flushed to the GPU.
+	glFlush();
+
+	fd = flutterpi.egl.dupNativeFenceFDANDROID(flutterpi.egl.display, sync);
+	if (fd == EGL_NO_NATIVE_FENCE_FD_ANDROID) {
+		fprintf(stderr, "[compositor] Could not get render fence fd. eglDupNativeFenceFDANDROID: 0x%08X\n", eglGetError());
+		fd = -1;
+	}
+
+	flutterpi.egl.destroySyncKHR(flutterpi.egl.display, sync);
+
+	return fd;
+}
+
+/**
+ * @brief Make the GPU wait for the fence before it executes any of the commands
+ * that are issued in the current EGL context from now on. Doesn't block the CPU.
+ */
+static int gpu_wait_for_fence_fd(int fence_fd) {
+	EGLSyncKHR sync;
+	int fd;
+
+	// EGL takes ownership of the fd.
+	fd = dup(fence_fd);
+	if (fd < 0) {
+		perror("[compositor] Could not duplicate fence fd. dup");
+		return errno;
+	}
+
+	sync = flutterpi.egl.createSyncKHR(
+		flutterpi.egl.display,
+		EGL_SYNC_NATIVE_FENCE_ANDROID,
+		(EGLint[]) {
+			EGL_SYNC_NATIVE_FENCE_FD_ANDROID, fd,
+			EGL_NONE
+		}
+	);
+	if (sync == EGL_NO_SYNC_KHR) {
+		fprintf(stderr, "[compositor] Could not import fence. eglCreateSyncKHR: 0x%08X\n", eglGetError());
+		close(fd);
+		return EIO;
+	}
+
+	if (flutterpi.egl.waitSyncKHR(flutterpi.egl.display, sync, 0) != EGL_TRUE) {
+		fprintf(stderr, "[compositor] Could not wait for fence. eglWaitSyncKHR: 0x%08X\n", eglGetError());
+		flutterpi.egl.destroySyncKHR(flutterpi.egl.display, sync);
+		return EIO;
+	}
+
+	flutterpi.egl.destroySyncKHR(flutterpi.egl.display, sync);
+
+	return 0;
+}
+
+/**
+ * @brief Check whether the layers of this frame have the same structure as the
+ * layers of the last frame, so the last plane assignment can be reused.
+ */
+static bool can_reuse_plane_assignment(
+	struct compositor *compositor,
+	const FlutterLayer **layers,
+	size_t layers_count
+) {
+	struct rendertarget *target;
+
+	if (!compositor->plane_assignment.is_valid || (compositor->plane_assignment.n_layers != layers_count)) {
+		return false;
+	}
+
+	for (int i = 0; i < layers_count; i++) {
+		if (layers[i]->type != compositor->plane_assignment.layers[i].type) {
+			return false;
+		}
+
+		if (layers[i]->type == kFlutterLayerContentTypePlatformView) {
+			if (layers[i]->platform_view->identifier != compositor->plane_assignment.layers[i].platform_view_id) {
+				return false;
+			}
+		} else {
+			target = ((struct flutterpi_backing_store *) layers[i]->backing_store->user_data)->target;
+
+			if ((target->is_gbm != compositor->plane_assignment.layers[i].is_gbm) ||
+				(target->width != compositor->plane_assignment.layers[i].width) ||
+				(target->height != compositor->plane_assignment.layers[i].height)) {
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+/**
+ * @brief The planes this platform view reserved when it was presented last frame, as a bitmask
+ * of plane indices. Must be called with the cbs locked.
+ */
+static uint64_t get_platform_view_planes_locked(int64_t view_id) {
+	struct view_cb_data *cb_data;
+
+	cb_data = get_cbs_for_view_id_locked(view_id);
+	if (cb_data == NULL) {
+		return 0;
+	}
+
+	return cb_data->planes;
+}
+
+/**
+ * @brief The unreserved planes of this request, as a bitmask of plane indices.
+ */
+static uint64_t get_unreserved_planes(struct drmdev_atomic_req *req) {
+	struct drm_plane *plane;
+	uint64_t planes;
+	int index;
+
+	planes = 0;
+	for_each_unreserved_plane_in_atomic_req(req, plane) {
+		index = plane - req->drmdev->planes;
+		if (index < 64) {
+			planes |= 1ull << index;
+		}
+	}
+
+	return planes;
+}
+
+/**
+ * @brief Whether this backing store can be composited into the layer directly below it,
+ * because that's a backing store too.
+ */
+static bool can_flatten_backing_store(const FlutterLayer **layers, int index) {
+	return (index > 0) &&
+		(layers[index]->type == kFlutterLayerContentTypeBackingStore) &&
+		(layers[index - 1]->type == kFlutterLayerContentTypeBackingStore);
+}
+
+/**
+ * @brief Whether the backing store at this layer index is composited into the backing store
+ * below it by @ref flatten_backing_stores, when only n_planes backing stores of this frame get a plane.
+ * 
+ * Beginning with the highest one, only backing stores that are directly above another backing store
+ * are composited. So no platform view ever ends up above flutter UI that's supposed to cover it.
+ */
+static bool is_flattened_backing_store(const FlutterLayer **layers, size_t layers_count, int n_planes, int index) {
+	int n_backing_stores, n_flattened_above;
+
+	if (!can_flatten_backing_store(layers, index)) {
+		return false;
+	}
+
+	n_backing_stores = 0;
+	n_flattened_above = 0;
+	for (int i = 0; i < layers_count; i++) {
+		if (layers[i]->type == kFlutterLayerContentTypeBackingStore) {
+			n_backing_stores++;
+		}
+		if ((i > index) && can_flatten_backing_store(layers, i)) {
+			n_flattened_above++;
+		}
+	}
+
+	return n_flattened_above < n_backing_stores - n_planes;
+}
+
+/**
+ * @brief The least number of planes the backing stores of this frame can be shown on,
+ * one for each run of backing stores that's not interrupted by a platform view.
+ */
+static int get_min_n_backing_store_planes(const FlutterLayer **layers, size_t layers_count) {
+	int n_planes;
+
+	n_planes = 0;
+	for (int i = 0; i < layers_count; i++) {
+		if ((layers[i]->type == kFlutterLayerContentTypeBackingStore) && !can_flatten_backing_store(layers, i)) {
+			n_planes++;
+		}
+	}
+
+	return n_planes;
+}
+
+/**
+ * @brief Must be called with the cbs locked, since the key contains the planes of the platform views.
+ */
+static void get_plane_config_key(
+	const FlutterLayer **layers,
+	size_t layers_count,
+	struct plane_config *key_out
+) {
+	struct rendertarget *target;
+
+	// the key is compared using memcmp, so the padding needs to be zeroed too.
+	memset(key_out, 0, sizeof *key_out);
+
+	key_out->n_layers = layers_count;
+	for (int i = 0; i < layers_count; i++) {
+		key_out->layers[i].type = layers[i]->type;
+		if (layers[i]->type == kFlutterLayerContentTypeBackingStore) {
+			target = ((struct flutterpi_backing_store *) layers[i]->backing_store->user_data)->target;
+
+			key_out->layers[i].is_gbm = target->is_gbm;
+			key_out->layers[i].width = target->width;
+			key_out->layers[i].height = target->height;
+		} else {
+			key_out->layers[i].platform_view_planes = get_platform_view_planes_locked(layers[i]->platform_view->identifier);
+		}
+	}
+}
+
+/**
+ * @brief The framebuffer a DRM_MODE_ATOMIC_TEST_ONLY commit can use for this rendertarget,
+ * without locking or rotating any buffers.
+ * 
+ * @returns The framebuffer ID, or 0 if the rendertarget wasn't rendered into yet.
+ */
+static uint32_t get_rendertarget_test_fb_id(struct rendertarget *target) {
+	if (target->is_gbm) {
+		if (target->gbm.n_locked_bos == 0) {
+			return 0;
+		}
+
+		return gbm_bo_get_drm_fb_id(target->gbm.locked_bos[target->gbm.n_locked_bos - 1].bo);
+	} else {
+		return target->nogbm.rbos[target->nogbm.current_front_rbo].drm_fb_id;
+	}
+}
+
+/**
+ * @brief Check whether the hardware can show this frame with n_planes of its backing stores
+ * on their own planes, using a DRM_MODE_ATOMIC_TEST_ONLY commit.
+ * 
+ * The planes are chosen the same way @ref on_present_layers chooses them. The platform views keep
+ * the planes they used last frame, so the whole plane set of the frame is tested. If the mode
+ * wasn't applied yet, the test includes the modeset.
+ * 
+ * Must be called with the cbs locked.
+ * 
+ * @returns 0 if the configuration works, EAGAIN if it can't be tested yet
+ * (because a rendertarget doesn't have a framebuffer yet), or an errno otherwise.
+ */
+static int test_plane_config(
+	struct compositor *compositor,
+	const FlutterLayer **layers,
+	size_t layers_count,
+	int n_planes
+) {
+	struct drmdev_atomic_req *req;
+	struct rendertarget *target;
+	struct drm_plane *plane;
+	uint64_t platform_view_planes;
+	uint32_t fb_id, flags;
+	int64_t min_zpos;
+	int ok, index;
+
+	ok = take_atomic_req(compositor, &req);
+	if (ok != 0) {
+		return ok;
+	}
+
+	min_zpos = 0;
+	for_each_unreserved_plane_in_atomic_req(req, plane) {
+		if (plane->type == DRM_PLANE_TYPE_PRIMARY) {
+			ok = drmdev_plane_get_min_zpos_value(req->drmdev, plane->plane->plane_id, &min_zpos);
+			if (ok != 0) {
+				min_zpos = 0;
+			}
+			break;
+		}
+	}
+
+	for (int i = 0; i < layers_count; i++) {
+		if (layers[i]->type == kFlutterLayerContentTypePlatformView) {
+			// Reserving the planes without putting any properties leaves them as they are,
+			// so the test sees them showing the platform view.
+			platform_view_planes = get_platform_view_planes_locked(layers[i]->platform_view->identifier);
+			for_each_plane_in_drmdev(req->drmdev, plane) {
+				index = plane - req->drmdev->planes;
+				if ((index < 64) && (platform_view_planes & (1ull << index))) {
+					drmdev_atomic_req_reserve_plane(req, plane);
+				}
+			}
+			continue;
+		} else if (is_flattened_backing_store(layers, layers_count, n_planes, i)) {
+			continue;
+		}
+
+		target = ((struct flutterpi_backing_store *) layers[i]->backing_store->user_data)->target;
+
+		fb_id = get_rendertarget_test_fb_id(target);
+		if (fb_id == 0) {
+			ok = EAGAIN;
+			goto fail_put_req;
+		}
+
+		for_each_unreserved_plane_in_atomic_req(req, plane) {
+			if (((i == 0) && (plane->type == DRM_PLANE_TYPE_PRIMARY)) || ((i != 0) && (plane->type == DRM_PLANE_TYPE_OVERLAY))) {
+				break;
+			}
+		}
+		if ((plane == NULL) || (drmdev_atomic_req_reserve_plane(req, plane) != 0)) {
+			ok = ENOSPC;
+			goto fail_put_req;
+		}
+
+		ok = put_rendertarget_plane_geometry(target, req, plane, i + min_zpos);
+		if (ok != 0) {
+			goto fail_put_req;
+		}
+		drmdev_atomic_req_put_plane_prop(req, plane, kDrmPropertyFbId, fb_id);
+	}
+
+	for_each_unreserved_plane_in_atomic_req(req, plane) {
+		if ((plane->type == DRM_PLANE_TYPE_PRIMARY) || (plane->type == DRM_PLANE_TYPE_OVERLAY)) {
+			drmdev_atomic_req_put_plane_prop(req, plane, kDrmPropertyFbId, 0);
+			drmdev_atomic_req_put_plane_prop(req, plane, kDrmPropertyCrtcId, 0);
+		}
+	}
+
+	flags = DRM_MODE_ATOMIC_TEST_ONLY;
+	if (!compositor->has_applied_modeset) {
+		// The KMS commit thread can't replace the property blob of the mode while we hold the lock.
+		pthread_mutex_lock(&compositor->page_flip_mutex);
+		ok = drmdev_atomic_req_put_modeset_props(req, &flags);
+		if (ok == 0) {
+			ok = drmdev_atomic_req_commit(req, flags, NULL);
+		}
+		pthread_mutex_unlock(&compositor->page_flip_mutex);
+	} else {
+		ok = drmdev_atomic_req_commit(req, flags, NULL);
+	}
+
+	fail_put_req:
+	pthread_mutex_lock(&compositor->page_flip_mutex);
+	put_free_atomic_req_locked(compositor, req);
+	pthread_mutex_unlock(&compositor->page_flip_mutex);
+
+	return ok;
+}
+
+/**
+ * @brief Get how many backing stores of this frame can be shown on their own planes.
+ * Uses the cached result if this layer structure was tested before, and tests
+ * it using DRM_MODE_ATOMIC_TEST_ONLY commits otherwise.
+ * 
+ * Must be called with the cbs locked.
+ */
+static int get_n_backing_store_planes(
+	struct compositor *compositor,
+	const FlutterLayer **layers,
+	size_t layers_count
+) {
+	struct plane_config key;
+	int ok, n_backing_stores, n_planes, min_n_planes;
+
+	n_backing_stores = 0;
+	for (int i = 0; i < layers_count; i++) {
+		if (layers[i]->type == kFlutterLayerContentTypeBackingStore) {
+			n_backing_stores++;
+		}
+	}
+
+	min_n_planes = get_min_n_backing_store_planes(layers, layers_count);
+
+	// Without atomic modesetting we can't test anything, and if no backing store
+	// can be composited into another one, there's nothing to choose from.
+	if ((n_backing_stores <= min_n_planes) || !compositor->drmdev->supports_atomic_modesetting) {
+		return n_backing_stores;
+	} else if (layers_count > PLANE_ASSIGNMENT_CACHE_MAX_LAYERS) {
+		// The result couldn't be cached, and testing every frame is too expensive.
+		return min_n_planes;
+	}
+
+	// The configurations were tested against the mode that was applied before.
+	if (!compositor->has_applied_modeset) {
+		compositor->n_plane_configs = 0;
+	}
+
+	get_plane_config_key(layers, layers_count, &key);
+
+	for (int i = 0; i < compositor->n_plane_configs; i++) {
+		if (memcmp(compositor->plane_configs[i].layers, key.layers, sizeof(key.layers)) == 0 &&
+			compositor->plane_configs[i].n_layers == key.n_layers) {
+			return compositor->plane_configs[i].n_planes;
+		}
+	}
+
+	for (n_planes = n_backing_stores; n_planes >= min_n_planes; n_planes--) {
+		ok = test_plane_config(compositor, layers, layers_count, n_planes);
+		if (ok == 0) {
+			break;
+		} else if (ok == EAGAIN) {
+			// Use as few planes as possible until it can be tested, next frame.
+			return min_n_planes;
+		}
+	}
+
+	if (n_planes < min_n_planes) {
+		n_planes = min_n_planes;
+		fprintf(
+			stderr,
+			"[compositor] The display hardware doesn't accept the %d flutter layers that are separated by platform views on their own planes.\n"
+			"             Some flutter layers may be invisible.\n",
+			min_n_planes
+		);
+	} else if (n_planes < n_backing_stores) {
+		fprintf(
+			stderr,
+			"[compositor] The display hardware only accepts %d of the %d flutter layers on their own planes.\n"
+			"             The other ones will be composited using OpenGL.\n",
+			n_planes,
+			n_backing_stores
+		);
+	}
+
+	key.n_planes = n_planes;
+	compositor->plane_configs[compositor->next_plane_config] = key;
+	compositor->next_plane_config = (compositor->next_plane_config + 1) % PLANE_CONFIG_CACHE_SIZE;
+	if (compositor->n_plane_configs < PLANE_CONFIG_CACHE_SIZE) {
+		compositor->n_plane_configs++;
+	}
+
+	return n_planes;
+}
+
+static GLuint compile_flatten_shader(GLenum type, const char *source) {
+	GLuint shader;
+	GLint status;
+
+	shader = glCreateShader(type);
+	glShaderSource(shader, 1, &source, NULL);
+	glCompileShader(shader);
+
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+	if (status != GL_TRUE) {
+		fprintf(stderr, "[compositor] Could not compile layer compositing shader.\n");
+		glDeleteShader(shader);
+		return 0;
+	}
+
+	return shader;
+}
+
+/**
+ * @brief Create the program for compositing backing stores into each other, if it doesn't exist yet.
+ * Must be called with the root context current.
+ */
+static int ensure_flatten_program(struct compositor *compositor) {
+	GLuint program, vertex_shader, fragment_shader;
+	GLint status;
+
+	if (compositor->flatten_program != 0) {
+		return 0;
+	}
+
+	vertex_shader = compile_flatten_shader(
+		GL_VERTEX_SHADER,
+		"attribute vec2 position;\n"
+		"varying vec2 texcoord;\n"
+		"void main() {\n"
+		"    texcoord = (position + 1.0) * 0.5;\n"
+		"    gl_Position = vec4(position, 0.0, 1.0);\n"
+		"}\n"
+	);
+	if (vertex_shader == 0) {
+		return EINVAL;
+	}
+
+	// Flutter renders with premultiplied alpha.
+	fragment_shader = compile_flatten_shader(
+		GL_FRAGMENT_SHADER,
+		"precision mediump float;\n"
+		"uniform sampler2D layer;\n"
+		"varying vec2 texcoord;\n"
+		"void main() {\n"
+		"    gl_FragColor = texture2D(layer, texcoord);\n"
+		"}\n"
+	);
+	if (fragment_shader == 0) {
+		glDeleteShader(vertex_shader);
+		return EINVAL;
+	}
+
+	program = glCreateProgram();
+	glAttachShader(program, vertex_shader);
+	glAttachShader(program, fragment_shader);
+	glBindAttribLocation(program, 0, "position");
+	glLinkProgram(program);
+
+	glDeleteShader(vertex_shader);
+	glDeleteShader(fragment_shader);
+
+	glGetProgramiv(program, GL_LINK_STATUS, &status);
+	if (status != GL_TRUE) {
+		fprintf(stderr, "[compositor] Could not link layer compositing program.\n");
+		glDeleteProgram(program);
+		return EINVAL;
+	}
+
+	compositor->flatten_program = program;
+
+	return 0;
+}
+
+/**
+ * @brief Bind the framebuffer of this rendertarget in the root context, for compositing other backing stores into it.
+ * 
+ * @returns The FBO that was created for it, or 0 if it's the window surface.
+ */
+static GLuint bind_flatten_destination(struct rendertarget *dest) {
+	GLuint fbo;
+
+	// FBOs aren't shared between contexts, but the renderbuffers are.
+	fbo = 0;
+	if (!dest->is_gbm) {
+		glGenFramebuffers(1, &fbo);
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, dest->nogbm.rbos[dest->nogbm.current_front_rbo].gl_rbo_id);
+	} else {
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+
+	glViewport(0, 0, dest->width, dest->height);
+
+	return fbo;
+}
+
+/**
+ * @brief Composite the backing stores that didn't get a plane (see @ref is_flattened_backing_store)
+ * on top of the backing store below them, in layer order, so they're still visible.
+ * 
+ * A backing store is only ever composited into one from the same run of backing stores,
+ * so the platform views stay between the flutter layers they were between.
+ * 
+ * Must be called with the root context current, before the window surface is swapped.
+ * The root context has its own GL state, so this doesn't disturb the state flutter's context caches.
+ */
+static int flatten_backing_stores(
+	struct compositor *compositor,
+	const FlutterLayer **layers,
+	size_t layers_count,
+	int n_planes
+) {
+	struct rendertarget *target, *dest, *bound_dest;
+	GLuint texture, fbo;
+	bool has_flattened_backing_stores;
+	int ok;
+
+	has_flattened_backing_stores = false;
+	for (int i = 0; i < layers_count; i++) {
+		if (is_flattened_backing_store(layers, layers_count, n_planes, i)) {
+			has_flattened_backing_stores = true;
+			break;
+		}
+	}
+
+	if (!has_flattened_backing_stores) {
+		return 0;
+	}
+
+	ok = ensure_flatten_program(compositor);
+	if (ok != 0) {
+		return ok;
+	}
+
+	glUseProgram(compositor->flatten_program);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+	glActiveTexture(GL_TEXTURE0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, (const GLfloat[]) {-1, -1, 1, -1, -1, 1, 1, 1});
+
+	fbo = 0;
+	dest = NULL;
+	bound_dest = NULL;
+	for (int i = 0; i < layers_count; i++) {
+		if (layers[i]->type != kFlutterLayerContentTypeBackingStore) {
+			continue;
+		}
+
+		target = ((struct flutterpi_backing_store *) layers[i]->backing_store->user_data)->target;
+
+		// The backing store below a flattened one is either flattened too or
+		// has a plane, so dest is always in the same run as this one.
+		if (!is_flattened_backing_store(layers, layers_count, n_planes, i)) {
+			dest = target;
+			continue;
+		}
+
+		if (target->is_gbm) {
+			// The window surface can't be sampled from.
+			fprintf(stderr, "[compositor] Can't composite the GBM backing store into another one. It will be invisible.\n");
+			continue;
+		}
+
+		if (dest != bound_dest) {
+			if (fbo != 0) {
+				glDeleteFramebuffers(1, &fbo);
+			}
+			fbo = bind_flatten_destination(dest);
+			bound_dest = dest;
+		}
+
+		glGenTextures(1, &texture);
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		flutterpi.gl.EGLImageTargetTexture2DOES(GL_TEXTURE_2D, target->nogbm.rbos[target->nogbm.current_front_rbo].egl_image);
+
+		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+
+		// The backing stores are display-sized, so all of dest changed.
+		if (dest->is_gbm) {
+			dest->damage = (struct drm_mode_rect) {
+				.x1 = 0,
+				.y1 = 0,
+				.x2 = dest->width,
+				.y2 = dest->height
+			};
+		}
+
+		glDeleteTextures(1, &texture);
+	}
+
+	glDisableVertexAttribArray(0);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	if (fbo != 0) {
+		glDeleteFramebuffers(1, &fbo);
+	}
+
+	// The render fence only covers what flutter rendered in its own context.
+	if (compositor->use_explicit_sync) {
+		glFinish();
+	}
+
+	return 0;
+}
+
+/// PRESENT FUNCS
+static bool on_present_layers(
+	const FlutterLayer **layers,
+	size_t layers_count,
+	void *userdata
+) {
+	struct drmdev_atomic_req *req;
+	struct view_cb_data *cb_data;
+	struct pointer_set planes;
+	struct compositor *compositor;
+	struct drm_plane *plane;
+	struct drmdev *drmdev;
+	uint32_t req_flags;
+	uint64_t present_time, disabled_planes;
+	void *planes_storage[32] = {0};
+	bool legacy_rendertarget_set_mode = false;
+	bool schedule_fake_page_flip_event;
+	bool use_atomic_modesetting;
+	bool reuse_plane_assignment, did_apply_modeset, has_complete_plane_assignment = true;
+	EGLint buffer_age;
+	int ok, in_fence_fd, out_fence_fd, n_backing_store_planes;
+
+	compositor = userdata;
+	drmdev = compositor->drmdev;
+	schedule_fake_page_flip_event = false;
+	use_atomic_modesetting = drmdev->supports_atomic_modesetting;
+
+	compositor->frame_seq++;
+
+	if (use_atomic_modesetting) {
+		ok = take_atomic_req(compositor, &req);
+		if (ok != 0) {
+			return false;
+		}
+	} else {
+		planes = PSET_INITIALIZER_STATIC(planes_storage, 32);
+		for_each_plane_in_drmdev(drmdev, plane) {
+			if (plane->plane->possible_crtcs & drmdev->selected_crtc->bitmask) {
+				pset_put(&planes, plane);
+			}
+		}
+
+		// With atomic modesetting, the KMS commit thread waits for the page flip instead.
+		wait_for_pending_page_flip(compositor);
+	}
+
+	// Only start measuring now, waiting for the last page flip is not part of presenting this frame.
+	present_time = flutterpi.flutter.libflutter_engine.FlutterEngineGetCurrentTime();
+
+	// The flutter GL context is still current here, so we can destroy the FBOs of rendertargets that weren't used for a while.
+	trim_stale_rendertargets(compositor);
+
+	// Same for the render fence, it needs to be created in the context flutter rendered the frame in.
+	in_fence_fd = -1;
+	if (use_atomic_modesetting && compositor->use_explicit_sync) {
+		in_fence_fd = create_render_fence_fd();
+	}
+
+	cpset_lock(&compositor->cbs);
+
+	eglMakeCurrent(flutterpi.egl.display, flutterpi.egl.surface, flutterpi.egl.surface, flutterpi.egl.root_context);
+
+	// The backing stores that don't get a plane need to be composited before
+	// the window surface is swapped, since they might be composited into it.
+	n_backing_store_planes = get_n_backing_store_planes(compositor, layers, layers_count);
+	ok = flatten_backing_stores(compositor, layers, layers_count, n_backing_store_planes);
+	if (ok != 0) {
+		fprintf(stderr, "[compositor] Could not composite the backing stores that didn't get a plane. flatten_backing_stores: %s\n", strerror(ok));
+	}
+
+	// The age of the buffer that's swapped to the front now. Asking after the swap
+	// would return the age of the next back buffer instead.
+	compositor->gbm_buffer_age = 0;
+	if (flutterpi.egl.supports_buffer_age) {
+		if (eglQuerySurface(flutterpi.egl.display, flutterpi.egl.surface, EGL_BUFFER_AGE_EXT, &buffer_age) == EGL_TRUE) {
+			compositor->gbm_buffer_age = buffer_age;
+		}
+	}
+
+	eglSwapBuffers(flutterpi.egl.display, flutterpi.egl.surface);
+
+	req_flags =  0 /* DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_NONBLOCK*/;
+	did_apply_modeset = compositor->has_applied_modeset == false;
+	if (compositor->has_applied_modeset == false) {
+		if (use_atomic_modesetting) {
+			// The KMS commit thread might be selecting a new mode right now.
+			pthread_mutex_lock(&compositor->page_flip_mutex);
+			ok = drmdev_atomic_req_put_modeset_props(req, &req_flags);
+			pthread_mutex_unlock(&compositor->page_flip_mutex);
+			if (ok != 0) return false;
+		} else {
+			legacy_rendertarget_set_mode = true;
+			schedule_fake_page_flip_event = true;
+		}
+
+		int64_t max_zpos = 0;
+
+		if (use_atomic_modesetting) {
+			for_each_unreserved_plane_in_atomic_req(req, plane) {
+				if (plane->type == DRM_PLANE_TYPE_CURSOR) {
+					// make sure the cursor is in front of everything
+					int64_t max_zpos;
+					bool supported;
+
+					ok = drmdev_plane_get_max_zpos_value(req->drmdev, plane->plane->plane_id, &max_zpos);
+					if (ok != 0) {
+						printf("[compositor] Could not move cursor to front. Mouse cursor may be invisible. drmdev_plane_get_max_zpos_value: %s\n", strerror(ok));
+						continue;
+					}
+					
+					ok = drmdev_plane_supports_setting_zpos_value(req->drmdev, plane->plane->plane_id, max_zpos, &supported);
+					if (ok != 0) {
+						printf("[compositor] Could not move cursor to front. Mouse cursor may be invisible. drmdev_plane_supports_setting_zpos_value: %s\n", strerror(ok));
+						continue;
+					}
+
+					if (supported) {
+						drmdev_atomic_req_put_plane_prop(req, plane, kDrmPropertyZpos, max_zpos);
+					} else {
+						printf("[compositor] Could not move cursor to front. Mouse cursor may be invisible. drmdev_plane_supports_setting_zpos_value: %s\n", strerror(ok));
+						continue;
+					}
+				}
+			}
+		} else {
+			for_each_pointer_in_pset(&planes, plane) {
+				if (plane->type == DRM_PLANE_TYPE_CURSOR) {
+					// make sure the cursor is in front of everything
+					int64_t max_zpos;
+					bool supported;
+
+					ok = drmdev_plane_get_max_zpos_value(drmdev, plane->plane->plane_id, &max_zpos);
+					if (ok != 0) {
+						printf("[compositor] Could not move cursor to front. Mouse cursor may be invisible. drmdev_plane_get_max_zpos_value: %s\n", strerror(ok));
+						continue;
+					}
+					
+					ok = drmdev_plane_supports_setting_zpos_value(drmdev, plane->plane->plane_id, max_zpos, &supported);
+					if (ok != 0) {
+						printf("[compositor] Could not move cursor to front. Mouse cursor may be invisible. drmdev_plane_supports_setting_zpos_value: %s\n", strerror(ok));
+						continue;
+					}
+
+					if (supported) {
+						drmdev_legacy_set_plane_property(drmdev, plane->plane->plane_id, "zpos", max_zpos);
+					} else {
+						printf("[compositor] Could not move cursor to front. Mouse cursor may be invisible. drmdev_plane_supports_setting_zpos_value: %s\n", strerror(ok));
+						continue;
+					}
+				}
+			}
+		}
+		
+		compositor->has_applied_modeset = true;
+	}
+	
+	// first, the state machine phase.
+	// go through the layers, update
+	// all platform views accordingly.
+	// unmount, update, mount. in that order
+	{
+		void *mounted_views_storage[layers_count];
+		memset(mounted_views_storage, 0, layers_count * sizeof(void*));
+		struct pointer_set mounted_views = PSET_INITIALIZER_STATIC(mounted_views_storage, layers_count);
+
+		void *unmounted_views_storage[layers_count];
+		memset(unmounted_views_storage, 0, layers_count * sizeof(void*));
+		struct pointer_set unmounted_views = PSET_INITIALIZER_STATIC(unmounted_views_storage, layers_count);
+
+		void *updated_views_storage[layers_count];
+		memset(updated_views_storage, 0, layers_count * sizeof(void*));
+		struct pointer_set updated_views = PSET_INITIALIZER_STATIC(updated_views_storage, layers_count);
+	
+		for_each_pointer_in_cpset(&compositor->cbs, cb_data) {
+			const FlutterLayer *layer;
+			bool is_present = false;
+			int zpos;
+
+			for (int i = 0; i < layers_count; i++) {
+				if (layers[i]->type == kFlutterLayerContentTypePlatformView &&
+					layers[i]->platform_view->identifier == cb_data->view_id) {
+					is_present = true;
+					layer = layers[i];
+					zpos = i;
+					break;
+				}
+			}
+
+			if (!is_present && cb_data->was_present_last_frame) {
+				pset_put(&unmounted_views, cb_data);
+			} else if (is_present && cb_data->was_present_last_frame) {
+				if (cb_data->update_view != NULL) {
+					bool did_update_view = false;
+
+					did_update_view = did_update_view || (zpos != cb_data->last_zpos);
+					did_update_view = did_update_view || memcmp(&cb_data->last_size, &layer->size, sizeof(FlutterSize));
+					did_update_view = did_update_view || memcmp(&cb_data->last_offset, &layer->offset, sizeof(FlutterPoint));
+					did_update_view = did_update_view || (cb_data->last_num_mutations != layer->platform_view->mutations_count);
+					for (int i = 0; (i < layer->platform_view->mutations_count) && !did_update_view; i++) {
+						did_update_view = did_update_view || memcmp(cb_data->last_mutations + i, layer->platform_view->mutations[i], sizeof(FlutterPlatformViewMutation));
+					}
+
+					if (did_update_view) {
+						pset_put(&updated_views, cb_data);
+					}
+				}
+			} else if (is_present && !cb_data->was_present_last_frame) {
+				pset_put(&mounted_views, cb_data);
+			}
+		}
+
+		for_each_pointer_in_pset(&unmounted_views, cb_data) {
+			cb_data->planes = 0;
+
+			if (cb_data->unmount != NULL) {
+				ok = cb_data->unmount(
+					cb_data->view_id,
+					req,
+					cb_data->userdata
+				);
+				if (ok != 0) {
+					fprintf(stderr, "[compositor] Could not unmount platform view. unmount: %s\n", strerror(ok));
+				}
+			}
+		}
+
+		for_each_pointer_in_pset(&updated_views, cb_data) {
+			const FlutterLayer *layer;
+			int zpos;
+
+			for (int i = 0; i < layers_count; i++) {
+				if (layers[i]->type == kFlutterLayerContentTypePlatformView &&
+					layers[i]->platform_view->identifier == cb_data->view_id) {
+					layer = layers[i];
+					zpos = i;
+					break;
+				}
+			}
+
+			ok = cb_data->update_view(
+				cb_data->view_id,
+				req,
+				layer->platform_view->mutations,
+				layer->platform_view->mutations_count,
+				(int) round(layer->offset.x),
+				(int) round(layer->offset.y),
+				(int) round(layer->size.width),
+				(int) round(layer->size.height),
+				zpos,
+				cb_data->userdata
+			);
+			if (ok != 0) {
+				fprintf(stderr, "[compositor] Could not update platform view. update_view: %s\n", strerror(ok));
+			}
+
+			cb_data->last_zpos = zpos;
 			cb_data->last_size = layer->size;
 			cb_data->last_offset = layer->offset;
 			cb_data->last_num_mutations = layer->platform_view->mutations_count;
@@ -1193,8 +2835,24 @@ static bool on_present_layers(
 		}
 	}
 	
+	if (!use_atomic_modesetting) {
+		// the legacy primary plane pageflip below will send a page flip event,
+		// unless we're doing a modeset.
+		set_pending_page_flip(compositor, !schedule_fake_page_flip_event, present_time);
+	}
+
+	// If the layers look like they did last frame, the planes still have the right
+	// geometry, rotation and zpos. We only need to give them the new framebuffers.
+	reuse_plane_assignment = use_atomic_modesetting && !did_apply_modeset && can_reuse_plane_assignment(compositor, layers, layers_count);
+	if (use_atomic_modesetting && !reuse_plane_assignment) {
+		compositor->plane_assignment.is_valid = false;
+		compositor->plane_assignment.n_layers = layers_count;
+	}
+
 	int64_t min_zpos;
-	if (use_atomic_modesetting) {
+	if (reuse_plane_assignment) {
+		min_zpos = compositor->plane_assignment.min_zpos;
+	} else if (use_atomic_modesetting) {
 		for_each_unreserved_plane_in_atomic_req(req, plane) {
 			if (plane->type == DRM_PLANE_TYPE_PRIMARY) {
 				ok = drmdev_plane_get_min_zpos_value(req->drmdev, plane->plane->plane_id, &min_zpos);
@@ -1216,9 +2874,39 @@ static bool on_present_layers(
 		}
 	}
 
+	if (use_atomic_modesetting && !reuse_plane_assignment) {
+		compositor->plane_assignment.min_zpos = min_zpos;
+	}
+
 	for (int i = 0; i < layers_count; i++) {
-		if (layers[i]->type == kFlutterLayerContentTypeBackingStore) {
-			if (use_atomic_modesetting) {
+		if (is_flattened_backing_store(layers, layers_count, n_backing_store_planes, i)) {
+			// composited into the backing store below it by flatten_backing_stores.
+			if (use_atomic_modesetting && (i < PLANE_ASSIGNMENT_CACHE_MAX_LAYERS)) {
+				struct rendertarget *target = ((struct flutterpi_backing_store *) layers[i]->backing_store->user_data)->target;
+
+				compositor->plane_assignment.layers[i].type = kFlutterLayerContentTypeBackingStore;
+				compositor->plane_assignment.layers[i].is_gbm = target->is_gbm;
+				compositor->plane_assignment.layers[i].width = target->width;
+				compositor->plane_assignment.layers[i].height = target->height;
+				compositor->plane_assignment.layers[i].plane = NULL;
+			}
+		} else if (layers[i]->type == kFlutterLayerContentTypeBackingStore) {
+			bool reused_plane = false;
+
+			plane = NULL;
+			if (reuse_plane_assignment) {
+				// a platform view might have reserved the plane for itself in the meantime.
+				plane = compositor->plane_assignment.layers[i].plane;
+				if (drmdev_atomic_req_reserve_plane(req, plane) == 0) {
+					reused_plane = true;
+				} else {
+					plane = NULL;
+				}
+			}
+
+			if (reused_plane) {
+				// the plane is still set up for this layer by the last commit.
+			} else if (use_atomic_modesetting) {
 				for_each_unreserved_plane_in_atomic_req(req, plane) {
 					// choose a plane which has an "intrinsic" zpos that matches
 					// the zpos we want the plane to have.
@@ -1248,25 +2936,46 @@ static bool on_present_layers(
 			}
 			if (plane == NULL) {
 				fprintf(stderr, "[compositor] Could not find a free primary/overlay DRM plane for presenting the backing store. drmdev_atomic_req_reserve_plane: %s\n", strerror(ok));
+				has_complete_plane_assignment = false;
 				continue;
 			}
 
 			struct flutterpi_backing_store *store = layers[i]->backing_store->user_data;
 			struct rendertarget *target = store->target;
 
+			if (use_atomic_modesetting && (i < PLANE_ASSIGNMENT_CACHE_MAX_LAYERS)) {
+				compositor->plane_assignment.layers[i].type = kFlutterLayerContentTypeBackingStore;
+				compositor->plane_assignment.layers[i].is_gbm = target->is_gbm;
+				compositor->plane_assignment.layers[i].width = target->width;
+				compositor->plane_assignment.layers[i].height = target->height;
+				compositor->plane_assignment.layers[i].plane = plane;
+			}
+
 			if (use_atomic_modesetting) {
 				ok = target->present(
 					target,
 					req,
 					plane->plane->plane_id,
-					0,
-					0,
-					compositor->drmdev->selected_mode->hdisplay,
-					compositor->drmdev->selected_mode->vdisplay,
-					i + min_zpos
+					(int) round(layers[i]->offset.x),
+					(int) round(layers[i]->offset.y),
+					(int) round(layers[i]->size.width),
+					(int) round(layers[i]->size.height),
+					i + min_zpos,
+					reused_plane
 				);
 				if (ok != 0) {
 					fprintf(stderr, "[compositor] Could not present backing store. rendertarget->present: %s\n", strerror(ok));
+
+					// Don't leave the plane with only some of its new properties.
+					drmdev_atomic_req_put_plane_prop(req, plane, kDrmPropertyFbId, 0);
+					drmdev_atomic_req_put_plane_prop(req, plane, kDrmPropertyCrtcId, 0);
+					has_complete_plane_assignment = false;
+					continue;
+				}
+
+				// IN_FENCE_FD isn't kept across commits, so it's needed even if the plane was reused.
+				if (in_fence_fd >= 0) {
+					drmdev_atomic_req_put_plane_prop(req, plane, kDrmPropertyInFenceFd, in_fence_fd);
 				}
 			} else {
 				ok = target->present_legacy(
@@ -1275,16 +2984,24 @@ static bool on_present_layers(
 					plane->plane->plane_id,
 					0,
 					0,
-					compositor->drmdev->selected_mode->hdisplay,
-					compositor->drmdev->selected_mode->vdisplay,
+					flutterpi.display.width,
+					flutterpi.display.height,
 					i + min_zpos,
 					legacy_rendertarget_set_mode && (plane->type == DRM_PLANE_TYPE_PRIMARY)
 				);
 			}
 		} else if (layers[i]->type == kFlutterLayerContentTypePlatformView) {
+			if (use_atomic_modesetting && (i < PLANE_ASSIGNMENT_CACHE_MAX_LAYERS)) {
+				compositor->plane_assignment.layers[i].type = kFlutterLayerContentTypePlatformView;
+				compositor->plane_assignment.layers[i].platform_view_id = layers[i]->platform_view->identifier;
+				compositor->plane_assignment.layers[i].plane = NULL;
+			}
+
 			cb_data = get_cbs_for_view_id_locked(layers[i]->platform_view->identifier);
 
 			if ((cb_data != NULL) && (cb_data->present != NULL)) {
+				uint64_t unreserved_planes = use_atomic_modesetting ? get_unreserved_planes(req) : 0;
+
 				ok = cb_data->present(
 					cb_data->view_id,
 					req,
@@ -1300,74 +3017,338 @@ static bool on_present_layers(
 				if (ok != 0) {
 					fprintf(stderr, "[compositor] Could not present platform view. platform_view->present: %s\n", strerror(ok));
 				}
+
+				// test_plane_config tests the backing stores together with these planes.
+				if (use_atomic_modesetting) {
+					cb_data->planes = unreserved_planes & ~get_unreserved_planes(req);
+				}
+			}
+		}
+	}
+
+	disabled_planes = 0;
+	if (use_atomic_modesetting) {
+		for_each_unreserved_plane_in_atomic_req(req, plane) {
+			if ((plane->type == DRM_PLANE_TYPE_PRIMARY) || (plane->type == DRM_PLANE_TYPE_OVERLAY)) {
+				int index = plane - drmdev->planes;
+				uint64_t bit = index < 64 ? (1ull << index) : 0;
+
+				disabled_planes |= bit;
+
+				// no need to disable it again if the last commit already did.
+				if (reuse_plane_assignment && (compositor->plane_assignment.disabled_planes & bit)) {
+					continue;
+				}
+
+				drmdev_atomic_req_put_plane_prop(req, plane, kDrmPropertyFbId, 0);
+				drmdev_atomic_req_put_plane_prop(req, plane, kDrmPropertyCrtcId, 0);
+			}
+		}
+	}
+
+	eglMakeCurrent(flutterpi.egl.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+
+	if (use_atomic_modesetting) {
+		// The commit thread commits the frame as soon as the last one was flipped.
+		if (queue_kms_commit(compositor, req, req_flags, in_fence_fd, present_time, reuse_plane_assignment)) {
+			// The planes will have the state we just queued, so the next frame can build on it.
+			// (If the commit fails, take_atomic_req invalidates this again.)
+			compositor->plane_assignment.is_valid = has_complete_plane_assignment && (layers_count <= PLANE_ASSIGNMENT_CACHE_MAX_LAYERS);
+			compositor->plane_assignment.disabled_planes = disabled_planes;
+		} else {
+			compositor->plane_assignment.is_valid = false;
+		}
+
+		out_fence_fd = take_kms_out_fence(compositor);
+		if (out_fence_fd >= 0) {
+			// The next frames are rendered into the buffers the last commit replaced on screen.
+			// Let the GPU wait until they're actually not scanned out anymore, instead of
+			// blocking the raster thread.
+			eglMakeCurrent(flutterpi.egl.display, flutterpi.egl.surface, flutterpi.egl.surface, flutterpi.egl.flutter_render_context);
+			gpu_wait_for_fence_fd(out_fence_fd);
+			eglMakeCurrent(flutterpi.egl.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+
+			close(out_fence_fd);
+		}
+	} else {
+		set_commit_time(compositor, flutterpi.flutter.libflutter_engine.FlutterEngineGetCurrentTime());
+
+		if (schedule_fake_page_flip_event) {
+			// The legacy modeset is synchronous, the frame is on screen now.
+			atomic_store(&compositor->flipped_frame_seq, compositor->frame_seq);
+		}
+	}
+
+	if (schedule_fake_page_flip_event) {
+		struct simulated_page_flip_event_data *data = malloc(sizeof(struct simulated_page_flip_event_data));
+		if (data == NULL) {
+			return false;
+		}
+
+		data->commit_time = flutterpi.flutter.libflutter_engine.FlutterEngineGetCurrentTime();
+		data->commit_waited_for_vblank = false;
+
+		flutterpi_post_platform_task_with_priority(execute_simulate_page_flip_event, data, kPlatformTaskPriorityFrame);
+	}
+
+	cpset_unlock(&compositor->cbs);
+
+	return true;
+}
+
+int compositor_on_page_flip(
+	uint32_t sec,
+	uint32_t usec,
+	bool is_simulated,
+	struct frame_timings *timings_out
+) {
+	pthread_mutex_lock(&compositor.page_flip_mutex);
+	if (timings_out != NULL) {
+		timings_out->present_time = compositor.last_present_time;
+		timings_out->commit_time = compositor.last_commit_time;
+	}
+
+	// Simulated page flips are reported for commits that didn't request a page flip event.
+	// Whoever did that commit already knows when it was on screen.
+	if (!is_simulated) {
+		atomic_store(&compositor.flipped_frame_seq, compositor.pending_flip_frame_seq);
+		compositor.has_pending_page_flip = false;
+		pthread_cond_broadcast(&compositor.page_flip_cond);
+	}
+	pthread_mutex_unlock(&compositor.page_flip_mutex);
+
+	// The framebuffers of removed scanout views can go once a frame without them is on screen.
+	release_retired_scanout_views(atomic_load(&compositor.flipped_frame_seq));
+
+	return 0;
+}
+
+int compositor_set_mode(
+	const drmModeModeInfo *mode,
+	compositor_mode_set_cb callback,
+	void *userdata
+) {
+	if (!compositor.drmdev->supports_atomic_modesetting) {
+		return ENOTSUP;
+	}
+
+	// The KMS commit thread applies the mode, either together with the next frame
+	// or on its own if there's no frame waiting to be committed.
+	pthread_mutex_lock(&compositor.page_flip_mutex);
+	if (compositor.kms_commit.has_pending_mode) {
+		// the mode staged before was never applied.
+		report_mode_set_result(compositor.kms_commit.pending_mode_cb, compositor.kms_commit.pending_mode_userdata, ECANCELED);
+	}
+	compositor.kms_commit.pending_mode = *mode;
+	compositor.kms_commit.has_pending_mode = true;
+	compositor.kms_commit.pending_mode_cb = callback;
+	compositor.kms_commit.pending_mode_userdata = userdata;
+	pthread_cond_broadcast(&compositor.page_flip_cond);
+	pthread_mutex_unlock(&compositor.page_flip_mutex);
+
+	return 0;
+}
+
+/// SOFTWARE RENDERING
+static void destroy_dumb_buffer(struct dumb_buffer *buffer) {
+	struct drm_mode_destroy_dumb destroy_req;
+
+	munmap(buffer->map, buffer->size);
+	drmModeRmFB(compositor.drmdev->fd, buffer->fb_id);
+
+	memset(&destroy_req, 0, sizeof destroy_req);
+	destroy_req.handle = buffer->gem_handle;
+	ioctl(compositor.drmdev->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy_req);
+}
+
+/**
+ * @brief Create a display-sized XRGB8888 dumb buffer and map it, so the
+ * frames of the software renderer can be copied into it.
+ */
+static int create_dumb_buffer(int width, int height, struct dumb_buffer *buffer_out) {
+	struct drm_mode_destroy_dumb destroy_req;
+	struct drm_mode_create_dumb create_req;
+	struct drm_mode_map_dumb map_req;
+	uint32_t fb_id;
+	void *map;
+	int ok;
+
+	memset(&create_req, 0, sizeof create_req);
+	create_req.width = width;
+	create_req.height = height;
+	create_req.bpp = 32;
+	create_req.flags = 0;
+
+	ok = ioctl(compositor.drmdev->fd, DRM_IOCTL_MODE_CREATE_DUMB, &create_req);
+	if (ok < 0) {
+		ok = errno;
+		perror("[compositor] Could not create a dumb buffer for software rendering. ioctl");
+		return ok;
+	}
+
+	ok = drmModeAddFB2(
+		compositor.drmdev->fd,
+		width,
+		height,
+		DRM_FORMAT_XRGB8888,
+		(uint32_t[4]) {create_req.handle, 0, 0, 0},
+		(uint32_t[4]) {create_req.pitch, 0, 0, 0},
+		(uint32_t[4]) {0, 0, 0, 0},
+		&fb_id,
+		0
+	);
+	if (ok < 0) {
+		ok = errno;
+		perror("[compositor] Could not make a DRM FB out of the software rendering buffer. drmModeAddFB2");
+		goto fail_destroy_dumb_buffer;
+	}
+
+	memset(&map_req, 0, sizeof map_req);
+	map_req.handle = create_req.handle;
+
+	ok = ioctl(compositor.drmdev->fd, DRM_IOCTL_MODE_MAP_DUMB, &map_req);
+	if (ok < 0) {
+		ok = errno;
+		perror("[compositor] Could not prepare dumb buffer mmap for software rendering. ioctl");
+		goto fail_rm_drm_fb;
+	}
+
+	map = mmap(0, create_req.size, PROT_READ | PROT_WRITE, MAP_SHARED, compositor.drmdev->fd, map_req.offset);
+	if (map == MAP_FAILED) {
+		ok = errno;
+		perror("[compositor] Could not mmap dumb buffer for software rendering. mmap");
+		goto fail_rm_drm_fb;
+	}
+
+	// start out black instead of with whatever was in there.
+	memset(map, 0, create_req.size);
+
+	buffer_out->gem_handle = create_req.handle;
+	buffer_out->pitch = create_req.pitch;
+	buffer_out->size = create_req.size;
+	buffer_out->fb_id = fb_id;
+	buffer_out->map = map;
+
+	return 0;
+
+
+	fail_rm_drm_fb:
+	drmModeRmFB(compositor.drmdev->fd, fb_id);
+
+	fail_destroy_dumb_buffer:
+	memset(&destroy_req, 0, sizeof destroy_req);
+	destroy_req.handle = create_req.handle;
+	ioctl(compositor.drmdev->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy_req);
+
+	return ok;
+}
+
+static int init_software_rendering(void) {
+	uint64_t cap;
+	int ok;
+
+	ok = drmGetCap(compositor.drmdev->fd, DRM_CAP_DUMB_BUFFER, &cap);
+	if ((ok < 0) || (cap == 0)) {
+		fprintf(stderr, "[compositor] Kernel / GPU Driver does not support dumb DRM buffers, which are needed for software rendering.\n");
+		return ENOTSUP;
+	}
+
+	for (int i = 0; i < 2; i++) {
+		ok = create_dumb_buffer(flutterpi.display.width, flutterpi.display.height, compositor.software.buffers + i);
+		if (ok != 0) {
+			while (i--) {
+				destroy_dumb_buffer(compositor.software.buffers + i);
 			}
+			return ok;
 		}
 	}
 
-	if (use_atomic_modesetting) {
-		for_each_unreserved_plane_in_atomic_req(req, plane) {
-			if ((plane->type == DRM_PLANE_TYPE_PRIMARY) || (plane->type == DRM_PLANE_TYPE_OVERLAY)) {
-				drmdev_atomic_req_put_plane_property(req, plane->plane->plane_id, "FB_ID", 0);
-				drmdev_atomic_req_put_plane_property(req, plane->plane->plane_id, "CRTC_ID", 0);
-			}
-		}
+	compositor.software.back_buffer = 0;
+
+	return 0;
+}
+
+bool compositor_present_software_frame(
+	const void *allocation,
+	size_t row_bytes,
+	size_t height
+) {
+	struct simulated_page_flip_event_data *data;
+	struct dumb_buffer *buffer;
+	uint64_t present_time;
+	int ok, width, max_width, max_height, rotation;
+	bool did_apply_modeset;
+
+	present_time = flutterpi.flutter.libflutter_engine.FlutterEngineGetCurrentTime();
+
+	compositor.frame_seq++;
+
+	// With double buffering, the back buffer is on screen until the last flip is done.
+	wait_for_pending_page_flip(&compositor);
+
+	buffer = compositor.software.buffers + compositor.software.back_buffer;
+	rotation = flutterpi.view.rotation;
+
+	// The rotation might have changed while flutter was rendering this frame,
+	// so make sure we don't write past the buffer.
+	if ((rotation == 90) || (rotation == 270)) {
+		max_width = flutterpi.display.height;
+		max_height = flutterpi.display.width;
+	} else {
+		max_width = flutterpi.display.width;
+		max_height = flutterpi.display.height;
+	}
+
+	width = row_bytes / 4 < max_width ? row_bytes / 4 : max_width;
+	if (height > max_height) {
+		height = max_height;
 	}
 
-	eglMakeCurrent(flutterpi.egl.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
-	
-	if (use_atomic_modesetting) {
-		do_commit:
-		if (compositor->do_blocking_atomic_commits) {
-			req_flags &= ~(DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT);
-		} else {
-			req_flags |= DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT;
-		}
-		
-		ok = drmdev_atomic_req_commit(req, req_flags, NULL);
-		if ((compositor->do_blocking_atomic_commits == false) && (ok == EBUSY)) {
-			printf("[compositor] Non-blocking drmModeAtomicCommit failed with EBUSY.\n"
-				"             Future drmModeAtomicCommits will be executed blockingly.\n"
-				"             This may have have an impact on performance.\n");
+	pixel_copy_rotated_32(buffer->map, buffer->pitch, allocation, row_bytes, width, height, rotation);
 
-			compositor->do_blocking_atomic_commits = true;
-			schedule_fake_page_flip_event = true;
-			goto do_commit;
-		} else if (ok != 0) {
-			fprintf(stderr, "[compositor] Could not present frame. drmModeAtomicCommit: %s\n", strerror(ok));
-			drmdev_destroy_atomic_req(req);
-			cpset_unlock(&compositor->cbs);
+	did_apply_modeset = false;
+	if (!compositor.has_applied_modeset) {
+		set_pending_page_flip(&compositor, false, present_time);
+
+		ok = drmdev_legacy_set_mode_and_fb(compositor.drmdev, buffer->fb_id);
+		if (ok != 0) {
 			return false;
 		}
 
-		drmdev_destroy_atomic_req(req);	
+		compositor.has_applied_modeset = true;
+		did_apply_modeset = true;
+	} else {
+		set_pending_page_flip(&compositor, true, present_time);
+
+		ok = drmdev_legacy_primary_plane_pageflip(compositor.drmdev, buffer->fb_id, (void*) (uintptr_t) 1);
+		if (ok != 0) {
+			set_pending_page_flip(&compositor, false, present_time);
+			return false;
+		}
 	}
 
-	if (schedule_fake_page_flip_event) {
-		uint64_t time = flutterpi.flutter.libflutter_engine.FlutterEngineGetCurrentTime();
+	set_commit_time(&compositor, flutterpi.flutter.libflutter_engine.FlutterEngineGetCurrentTime());
 
-		struct simulated_page_flip_event_data *data = malloc(sizeof(struct simulated_page_flip_event_data));
+	compositor.software.back_buffer = (compositor.software.back_buffer + 1) % 2;
+
+	if (did_apply_modeset) {
+		// The modeset is synchronous, the frame is on screen now.
+		atomic_store(&compositor.flipped_frame_seq, compositor.frame_seq);
+
+		data = malloc(sizeof *data);
 		if (data == NULL) {
 			return false;
 		}
 
-		data->sec = time / 1000000000llu;
-		data->usec = (time % 1000000000llu) / 1000;
+		data->commit_time = flutterpi.flutter.libflutter_engine.FlutterEngineGetCurrentTime();
+		data->commit_waited_for_vblank = false;
 
-		flutterpi_post_platform_task(execute_simulate_page_flip_event, data);
+		flutterpi_post_platform_task_with_priority(execute_simulate_page_flip_event, data, kPlatformTaskPriorityFrame);
 	}
 
-	cpset_unlock(&compositor->cbs);
-
 	return true;
 }
 
-int compositor_on_page_flip(
-	uint32_t sec,
-	uint32_t usec
-) {
-	return 0;
-}
-
 /// PLATFORM VIEW CALLBACKS
 int compositor_set_view_callbacks(
 	int64_t view_id,
@@ -1422,12 +3403,534 @@ int compositor_remove_view_callbacks(int64_t view_id) {
 	return 0;
 }
 
+/// SCANOUT VIEWS
+static struct concurrent_pointer_set scanout_views = CPSET_INITIALIZER(CPSET_DEFAULT_MAX_SIZE);
+
+/// Scanout views that were removed, but whose framebuffers may still be used by the KMS commits.
+static struct concurrent_pointer_set retired_scanout_views = CPSET_INITIALIZER(CPSET_DEFAULT_MAX_SIZE);
+
+static struct scanout_view *get_scanout_view_locked(int64_t view_id) {
+	struct scanout_view *view;
+
+	for_each_pointer_in_cpset(&scanout_views, view) {
+		if (view->view_id == view_id) {
+			return view;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Close this GEM handle, unless another framebuffer of the view uses it.
+ * (The same buffer can be in the cache more than once, with a different format or stride.)
+ */
+static void close_scanout_gem_handle(struct scanout_view *view, uint32_t gem_handle, const struct scanout_fb *except) {
+	int ok;
+
+	for (int i = 0; i < view->n_fbs; i++) {
+		if ((view->fbs + i != except) && (view->fbs[i].gem_handle == gem_handle)) {
+			return;
+		}
+	}
+
+	ok = drmIoctl(flutterpi.drm.drmdev->fd, DRM_IOCTL_GEM_CLOSE, &(struct drm_gem_close) {.handle = gem_handle});
+	if (ok < 0) {
+		fprintf(stderr, "[compositor] Could not close scanout view buffer handle. ioctl: %s\n", strerror(errno));
+	}
+}
+
+static void destroy_scanout_fb(struct scanout_view *view, struct scanout_fb *fb) {
+	int ok;
+
+	ok = drmModeRmFB(flutterpi.drm.drmdev->fd, fb->fb_id);
+	if (ok < 0) {
+		fprintf(stderr, "[compositor] Could not remove scanout view framebuffer. drmModeRmFB: %s\n", strerror(errno));
+	}
+
+	close_scanout_gem_handle(view, fb->gem_handle, fb);
+}
+
+static void destroy_scanout_view(struct scanout_view *view) {
+	while (view->n_fbs > 0) {
+		destroy_scanout_fb(view, view->fbs + view->n_fbs - 1);
+		view->n_fbs--;
+	}
+
+	pthread_mutex_destroy(&view->mutex);
+	free(view);
+}
+
+/**
+ * @brief Destroy the removed scanout views whose framebuffers were replaced on screen
+ * by a later frame. Called after every page flip.
+ */
+static void release_retired_scanout_views(uint64_t flipped_frame_seq) {
+	struct scanout_view *view;
+
+	cpset_lock(&retired_scanout_views);
+
+	do {
+		for_each_pointer_in_cpset(&retired_scanout_views, view) {
+			if (view->retire_frame_seq < flipped_frame_seq) {
+				break;
+			}
+		}
+
+		if (view != NULL) {
+			cpset_remove_locked(&retired_scanout_views, view);
+			destroy_scanout_view(view);
+		}
+	} while (view != NULL);
+
+	cpset_unlock(&retired_scanout_views);
+}
+
+/**
+ * @brief Transform a rectangle of the flutter surface into display coordinates,
+ * by applying the rotation the planes do when scanning out. (see flutterpi.view.hw_rotation)
+ */
+static void surface_rect_to_display_rect(int *x, int *y, int *width, int *height) {
+	int surface_w = flutterpi.gbm.width, surface_h = flutterpi.gbm.height;
+	int rx = *x, ry = *y, rw = *width, rh = *height;
+
+	if (flutterpi.view.hw_rotation == 90) {
+		*x = surface_h - ry - rh;
+		*y = rx;
+		*width = rh;
+		*height = rw;
+	} else if (flutterpi.view.hw_rotation == 180) {
+		*x = surface_w - rx - rw;
+		*y = surface_h - ry - rh;
+	} else if (flutterpi.view.hw_rotation == 270) {
+		*x = ry;
+		*y = surface_w - rx - rw;
+		*width = rh;
+		*height = rw;
+	}
+}
+
+static bool plane_supports_format(const struct drm_plane *plane, uint32_t fourcc) {
+	for (int i = 0; i < plane->plane->count_formats; i++) {
+		if (plane->plane->formats[i] == fourcc) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static int on_present_scanout_view(
+	int64_t view_id,
+	struct drmdev_atomic_req *req,
+	const FlutterPlatformViewMutation **mutations,
+	size_t num_mutations,
+	int offset_x,
+	int offset_y,
+	int width,
+	int height,
+	int zpos,
+	void *userdata
+) {
+	struct scanout_view *view;
+	struct drm_plane *plane;
+	struct scanout_fb *fb;
+	uint64_t rotation;
+	bool supported;
+	int ok;
+
+	view = userdata;
+
+	if (req == NULL) {
+		// legacy modesetting can't put anything on overlay planes.
+		return ENOTSUP;
+	}
+
+	pthread_mutex_lock(&view->mutex);
+
+	fb = view->current_fb;
+	if (fb == NULL) {
+		pthread_mutex_unlock(&view->mutex);
+		return 0;
+	}
+
+	// prefer the plane we used last frame, it's known to work with this buffer.
+	if ((view->plane != NULL) && (drmdev_atomic_req_reserve_plane(req, view->plane) == 0)) {
+		plane = view->plane;
+	} else {
+		for_each_unreserved_plane_in_atomic_req(req, plane) {
+			if ((plane->type == DRM_PLANE_TYPE_OVERLAY) && plane_supports_format(plane, fb->buffer.fourcc)) {
+				break;
+			}
+		}
+
+		if ((plane == NULL) || (drmdev_atomic_req_reserve_plane(req, plane) != 0)) {
+			pthread_mutex_unlock(&view->mutex);
+			return EBUSY;
+		}
+	}
+
+	view->plane = plane;
+
+	surface_rect_to_display_rect(&offset_x, &offset_y, &width, &height);
+
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPropertyFbId, fb->fb_id);
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPropertyCrtcId, req->drmdev->selected_crtc->crtc->crtc_id);
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPropertySrcX, 0);
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPropertySrcY, 0);
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPropertySrcW, ((uint16_t) fb->buffer.width) << 16);
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPropertySrcH, ((uint16_t) fb->buffer.height) << 16);
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPropertyCrtcX, offset_x);
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPropertyCrtcY, offset_y);
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPropertyCrtcW, width);
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPropertyCrtcH, height);
+
+	rotation = DRM_ROTATION_FROM_ANGLE(flutterpi.view.hw_rotation);
+	ok = drmdev_plane_supports_setting_rotation_value(req->drmdev, plane->plane->plane_id, rotation, &supported);
+	if ((ok == 0) && supported) {
+		drmdev_atomic_req_put_plane_prop(req, plane, kDrmPropertyRotation, rotation);
+	}
+
+	ok = drmdev_plane_supports_setting_zpos_value(req->drmdev, plane->plane->plane_id, zpos, &supported);
+	if ((ok == 0) && supported) {
+		drmdev_atomic_req_put_plane_prop(req, plane, kDrmPropertyZpos, zpos);
+	}
+
+	// the frame that's being presented right now has the sequence number frame_seq.
+	fb->frame_seq = compositor.frame_seq;
+
+	pthread_mutex_unlock(&view->mutex);
+
+	return 0;
+}
+
+static int on_unmount_scanout_view(
+	int64_t view_id,
+	struct drmdev_atomic_req *req,
+	void *userdata
+) {
+	struct scanout_view *view;
+
+	view = userdata;
+
+	// the plane isn't reserved anymore, so on_present_layers disables it.
+	view->plane = NULL;
+
+	return 0;
+}
+
+int compositor_add_scanout_view(int64_t view_id) {
+	struct scanout_view *view;
+	int ok;
+
+	if (!compositor.drmdev->supports_atomic_modesetting) {
+		return ENOTSUP;
+	}
+
+	view = calloc(1, sizeof *view);
+	if (view == NULL) {
+		return ENOMEM;
+	}
+
+	view->view_id = view_id;
+	pthread_mutex_init(&view->mutex, NULL);
+	view->n_fbs = 0;
+	view->use_counter = 0;
+	view->current_fb = NULL;
+	view->plane = NULL;
+
+	cpset_lock(&scanout_views);
+	if (get_scanout_view_locked(view_id) != NULL) {
+		cpset_unlock(&scanout_views);
+		pthread_mutex_destroy(&view->mutex);
+		free(view);
+		return EEXIST;
+	}
+
+	ok = cpset_put_locked(&scanout_views, view);
+	cpset_unlock(&scanout_views);
+
+	if (ok != 0) {
+		pthread_mutex_destroy(&view->mutex);
+		free(view);
+		return ok;
+	}
+
+	ok = compositor_set_view_callbacks(view_id, NULL, on_unmount_scanout_view, NULL, on_present_scanout_view, view);
+	if (ok != 0) {
+		cpset_remove_(&scanout_views, view);
+		pthread_mutex_destroy(&view->mutex);
+		free(view);
+		return ok;
+	}
+
+	return 0;
+}
+
+int compositor_set_scanout_view_buffer(
+	int64_t view_id,
+	const struct scanout_buffer *buffer
+) {
+	struct scanout_view *view;
+	struct scanout_fb *fb;
+	uint64_t flipped_frame_seq, on_screen_frame_seq;
+	uint32_t gem_handle, fb_id;
+	int ok;
+
+	cpset_lock(&scanout_views);
+
+	view = get_scanout_view_locked(view_id);
+	if (view == NULL) {
+		cpset_unlock(&scanout_views);
+		return EINVAL;
+	}
+
+	// Importing the same dmabuf again gives us the same GEM handle,
+	// so the handle identifies the buffer.
+	ok = drmPrimeFDToHandle(flutterpi.drm.drmdev->fd, buffer->fd, &gem_handle);
+	if (ok < 0) {
+		ok = errno;
+		perror("[compositor] Could not import scanout view buffer. drmPrimeFDToHandle");
+		cpset_unlock(&scanout_views);
+		return ok;
+	}
+
+	pthread_mutex_lock(&view->mutex);
+
+	fb = NULL;
+	for (int i = 0; i < view->n_fbs; i++) {
+		if ((view->fbs[i].gem_handle == gem_handle) &&
+			(view->fbs[i].buffer.fourcc == buffer->fourcc) &&
+			(view->fbs[i].buffer.modifier == buffer->modifier) &&
+			(view->fbs[i].buffer.width == buffer->width) &&
+			(view->fbs[i].buffer.height == buffer->height) &&
+			(view->fbs[i].buffer.stride == buffer->stride) &&
+			(view->fbs[i].buffer.offset == buffer->offset)) {
+			fb = view->fbs + i;
+			break;
+		}
+	}
+
+	if (fb == NULL) {
+		ok = drmModeAddFB2WithModifiers(
+			flutterpi.drm.drmdev->fd,
+			buffer->width,
+			buffer->height,
+			buffer->fourcc,
+			(uint32_t[4]) {gem_handle, 0, 0, 0},
+			(uint32_t[4]) {buffer->stride, 0, 0, 0},
+			(uint32_t[4]) {buffer->offset, 0, 0, 0},
+			(uint64_t[4]) {buffer->modifier, 0, 0, 0},
+			&fb_id,
+			buffer->modifier != DRM_FORMAT_MOD_INVALID ? DRM_MODE_FB_MODIFIERS : 0
+		);
+		if (ok < 0) {
+			ok = errno;
+			perror("[compositor] Could not create framebuffer for scanout view buffer. drmModeAddFB2WithModifiers");
+			goto fail_close_gem_handle;
+		}
+
+		if (view->n_fbs < SCANOUT_VIEW_FB_CACHE_SIZE) {
+			fb = view->fbs + view->n_fbs;
+			view->n_fbs++;
+		} else {
+			// The newest framebuffer that was flipped to the screen might still be scanned out,
+			// the ones presented after it are waiting for their flip.
+			flipped_frame_seq = atomic_load(&compositor.flipped_frame_seq);
+			on_screen_frame_seq = 0;
+			for (int i = 0; i < view->n_fbs; i++) {
+				if ((view->fbs[i].frame_seq <= flipped_frame_seq) && (view->fbs[i].frame_seq > on_screen_frame_seq)) {
+					on_screen_frame_seq = view->fbs[i].frame_seq;
+				}
+			}
+
+			// evict the least recently used framebuffer that's not in use anymore.
+			for (int i = 0; i < view->n_fbs; i++) {
+				if ((view->fbs + i == view->current_fb) || ((view->fbs[i].frame_seq != 0) && (view->fbs[i].frame_seq >= on_screen_frame_seq))) {
+					continue;
+				}
+
+				if ((fb == NULL) || (view->fbs[i].last_used < fb->last_used)) {
+					fb = view->fbs + i;
+				}
+			}
+
+			if (fb == NULL) {
+				drmModeRmFB(flutterpi.drm.drmdev->fd, fb_id);
+				ok = EBUSY;
+				goto fail_close_gem_handle;
+			}
+
+			if (fb->gem_handle == gem_handle) {
+				// the new framebuffer uses the same buffer, keep the handle.
+				drmModeRmFB(flutterpi.drm.drmdev->fd, fb->fb_id);
+			} else {
+				destroy_scanout_fb(view, fb);
+			}
+		}
+
+		fb->buffer = *buffer;
+		fb->buffer.fd = -1;
+		fb->gem_handle = gem_handle;
+		fb->fb_id = fb_id;
+		fb->frame_seq = 0;
+	}
+
+	fb->last_used = ++view->use_counter;
+	view->current_fb = fb;
+
+	pthread_mutex_unlock(&view->mutex);
+	cpset_unlock(&scanout_views);
+
+	return 0;
+
+
+	fail_close_gem_handle:
+	close_scanout_gem_handle(view, gem_handle, NULL);
+
+	pthread_mutex_unlock(&view->mutex);
+	cpset_unlock(&scanout_views);
+	return ok;
+}
+
+int compositor_remove_scanout_view(int64_t view_id) {
+	struct scanout_view *view;
+	int ok;
+
+	cpset_lock(&scanout_views);
+
+	view = get_scanout_view_locked(view_id);
+	if (view == NULL) {
+		cpset_unlock(&scanout_views);
+		return EINVAL;
+	}
+
+	cpset_remove_locked(&scanout_views, view);
+	cpset_unlock(&scanout_views);
+
+	// after this, the compositor won't present the view anymore.
+	compositor_remove_view_callbacks(view_id);
+
+	// The framebuffers can still be on screen, in the KMS mailbox or in a commit that's in flight.
+	// Removing them now would make those commits fail, so they're only destroyed after a
+	// later frame, which doesn't show the view anymore, was flipped to the screen.
+	pthread_mutex_lock(&view->mutex);
+	view->retire_frame_seq = 0;
+	for (int i = 0; i < view->n_fbs; i++) {
+		if (view->fbs[i].frame_seq > view->retire_frame_seq) {
+			view->retire_frame_seq = view->fbs[i].frame_seq;
+		}
+	}
+	pthread_mutex_unlock(&view->mutex);
+
+	if (view->retire_frame_seq == 0) {
+		// none of the framebuffers was ever presented.
+		destroy_scanout_view(view);
+		return 0;
+	}
+
+	ok = cpset_put_(&retired_scanout_views, view);
+	if (ok != 0) {
+		fprintf(stderr, "[compositor] Could not defer destroying the scanout view framebuffers. They are leaked. cpset_put: %s\n", strerror(ok));
+		return ok;
+	}
+
+	release_retired_scanout_views(atomic_load(&compositor.flipped_frame_seq));
+
+	return 0;
+}
+
+void compositor_print_stats(FILE *file) {
+	int n_stale;
+
+	cpset_lock(&compositor.stale_rendertargets);
+	n_stale = cpset_get_count_pointers_locked(&compositor.stale_rendertargets);
+	cpset_unlock(&compositor.stale_rendertargets);
+
+	fprintf(
+		file,
+		"[compositor] rendertarget pool: %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64 " trimmed, %d stale\n",
+		atomic_load_explicit(&compositor.n_rendertarget_pool_hits, memory_order_relaxed),
+		atomic_load_explicit(&compositor.n_rendertarget_pool_misses, memory_order_relaxed),
+		atomic_load_explicit(&compositor.n_rendertargets_trimmed, memory_order_relaxed),
+		n_stale
+	);
+}
+
 /// COMPOSITOR INITIALIZATION
 int compositor_initialize(struct drmdev *drmdev) {
+	int ok;
+
 	compositor.drmdev = drmdev;
+
+	if (flutterpi.use_explicit_sync) {
+		compositor.use_explicit_sync =
+			flutterpi.egl.supports_native_fence_sync &&
+			drmdev->supports_atomic_modesetting &&
+			(drmdev->selected_crtc->prop_ids[kDrmPropertyOutFencePtr] != 0);
+
+		if (!compositor.use_explicit_sync) {
+			fprintf(stderr, "[compositor] Explicit sync is not supported by the driver. Using implicit sync instead.\n");
+		}
+	}
+
+	if (flutterpi.renderer_type == kSoftwareRenderer) {
+		ok = init_software_rendering();
+		if (ok != 0) {
+			return ok;
+		}
+	}
+
+	if (drmdev->supports_atomic_modesetting) {
+		ok = pthread_create(&compositor.kms_commit.thread, NULL, kms_commit_thread_main, &compositor);
+		if (ok != 0) {
+			fprintf(stderr, "[compositor] Could not start KMS commit thread. pthread_create: %s\n", strerror(ok));
+			return ok;
+		}
+	}
+
 	return 0;
 }
 
+void compositor_deinitialize(void) {
+	if ((compositor.drmdev == NULL) || !compositor.drmdev->supports_atomic_modesetting) {
+		return;
+	}
+
+	pthread_mutex_lock(&compositor.page_flip_mutex);
+	compositor.kms_commit.should_stop = true;
+	pthread_cond_broadcast(&compositor.page_flip_cond);
+	pthread_mutex_unlock(&compositor.page_flip_mutex);
+
+	pthread_join(compositor.kms_commit.thread, NULL);
+
+	pthread_mutex_lock(&compositor.page_flip_mutex);
+
+	// The frames that were still waiting for their commit won't be shown anymore.
+	if (compositor.kms_commit.mailbox != NULL) {
+		for (int i = 0; i < compositor.kms_commit.n_mailbox_in_fence_fds; i++) {
+			close(compositor.kms_commit.mailbox_in_fence_fds[i]);
+		}
+		drmdev_destroy_atomic_req(compositor.kms_commit.mailbox);
+		compositor.kms_commit.mailbox = NULL;
+		compositor.kms_commit.n_mailbox_in_fence_fds = 0;
+	}
+
+	while (compositor.kms_commit.n_free_reqs > 0) {
+		drmdev_destroy_atomic_req(compositor.kms_commit.free_reqs[--compositor.kms_commit.n_free_reqs]);
+	}
+
+	if (compositor.kms_commit.out_fence_fd >= 0) {
+		close(compositor.kms_commit.out_fence_fd);
+		compositor.kms_commit.out_fence_fd = -1;
+	}
+
+	pthread_mutex_unlock(&compositor.page_flip_mutex);
+
+	// Nothing is committed anymore, so all framebuffers of removed scanout views can go.
+	release_retired_scanout_views(UINT64_MAX);
+}
+
 static void destroy_cursor_buffer(void) {
 	struct drm_mode_destroy_dumb destroy_req;
 
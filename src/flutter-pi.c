@@ -9,19 +9,24 @@
 #include <features.h>
 #include <float.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <linux/input.h>
 #include <math.h>
+#include <poll.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/eventfd.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
@@ -47,6 +52,7 @@
 #include <platformchannel.h>
 #include <pluginregistry.h>
 #include <texture_registry.h>
+#include <vsync_estimator.h>
 //#include <plugins/services.h>
 #include <plugins/text_input.h>
 #include <plugins/raw_keyboard.h>
@@ -108,6 +114,79 @@ OPTIONS:\n\
                              This means flutter-pi won't configure the console\n\
                              to raw/non-canonical mode.\n\
                              \n\
+  --slow-callback-threshold <ms>  Report every main loop callback (platform\n\
+                             task, engine task, IO callback) that runs longer\n\
+                             than this many milliseconds. 0 disables the\n\
+                             reports. (default: 4)\n\
+                             \n\
+  --dump-loop-stats          Print the main loop latency and frame timing\n\
+                             statistics when flutter-pi exits. They're also\n\
+                             printed every time flutter-pi receives SIGUSR1.\n\
+                             \n\
+  --frame-queue-depth <n>    How many frames may be rendering or waiting to be\n\
+                             shown on the display at the same time. Valid\n\
+                             values are 1, 2 and 3. Higher values make heavy\n\
+                             UIs drop less frames, but each frame is shown\n\
+                             up to (n - 1) refresh periods later. (default: 1)\n\
+                             \n\
+  --idle-refresh-rate <hz>   Switch the display to the mode with the same\n\
+                             resolution whose refresh rate is closest to this\n\
+                             one (but lower than the normal one) when nothing\n\
+                             was drawn for --idle-timeout milliseconds.\n\
+                             Switches back on user input or when the app\n\
+                             starts animating. Needs atomic modesetting.\n\
+                             Note that some displays go black for a moment\n\
+                             when the mode changes. (default: disabled)\n\
+                             \n\
+  --idle-timeout <ms>        See --idle-refresh-rate. (default: 5000)\n\
+                             \n\
+  --explicit-sync            Synchronize rendering and scanout using explicit\n\
+                             fences (EGL_ANDROID_native_fence_sync and the\n\
+                             IN_FENCE_FD / OUT_FENCE_PTR DRM properties)\n\
+                             instead of implicit buffer fences. Needs atomic\n\
+                             modesetting. Falls back to implicit sync if the\n\
+                             driver doesn't support it.\n\
+                             \n\
+  --prewarm-rendertargets <n> Create n display-sized overlay rendertargets at\n\
+                             startup, so showing a platform view doesn't need\n\
+                             to allocate buffers mid-frame. Unused overlay\n\
+                             rendertargets are freed after a while, but at\n\
+                             least n are kept around. (default: 0)\n\
+                             \n\
+  --renderer <opengl|software> Whether flutter renders using OpenGL ES or\n\
+                             the CPU. The software renderer copies every frame\n\
+                             into a DRM dumb buffer, so it works without a GPU\n\
+                             (for example with vkms), but it's much slower and\n\
+                             doesn't support platform views or external\n\
+                             textures. (default: opengl)\n\
+                             \n\
+  --resample-input           Coalesce the touch and mouse motion events that\n\
+                             arrive between two frames, and send a single\n\
+                             event per pointer, resampled at the time the next\n\
+                             frame is shown. Down, up and button events are\n\
+                             still sent right away. Saves CPU time with high\n\
+                             rate touchscreens and mice and makes scrolling\n\
+                             smoother.\n\
+                             \n\
+  --input-thread             Read and translate the input events on a separate\n\
+                             thread, so input latency doesn't depend on how\n\
+                             busy the main thread is. Pointer events are sent\n\
+                             to flutter from that thread directly (unless\n\
+                             --resample-input is given), cursor updates and\n\
+                             text input are handed to the main thread.\n\
+                             \n\
+  --record-input <file>      Write the translated input events (pointer, key\n\
+                             and text input events) with their timestamps to\n\
+                             a compact binary file, for --replay-input.\n\
+                             \n\
+  --replay-input <file>      Don't read any input devices, replay the events\n\
+                             recorded using --record-input instead, at the\n\
+                             cadence they were recorded at. Can't be used\n\
+                             together with --input-thread.\n\
+                             \n\
+  --replay-input-fast        See --replay-input. Replay the events as fast as\n\
+                             possible instead.\n\
+                             \n\
   -h, --help                 Show this help and exit.\n\
 \n\
 EXAMPLES:\n\
@@ -131,6 +210,43 @@ SEE ALSO:\n\
 
 struct flutterpi flutterpi;
 
+/// Number of platform tasks that can be queued per priority lane
+/// without falling back to an sd_event defer source.
+#define PLATFORM_TASK_QUEUE_SIZE 1024
+
+/// How long we execute background platform tasks (plugin I/O)
+/// per main loop iteration before giving other event sources a chance, in nanoseconds.
+#define BACKGROUND_PLATFORM_TASK_BUDGET_NS 2000000ull
+
+/// How many pointer events fit into the pointer event batch initially.
+#define POINTER_EVENT_BATCH_INITIAL_SIZE 64
+
+/// The pointer event batch is sent to the engine early when it has this many events,
+/// so a burst of input can't make it grow without bounds.
+#define POINTER_EVENT_BATCH_HIGH_WATER_MARK 512
+
+/// How long before the next vblank the coalesced pointer motion is resampled and sent
+/// to the engine, in nanoseconds. Gives the engine some time to dispatch the events
+/// before the frame for that vblank starts.
+#define INPUT_RESAMPLING_LEAD_TIME_NS 1000000ull
+
+/// How many records (pointer events, cursor updates, text input) the input thread
+/// can hand to the main thread before it has to wait for the main thread.
+#define INPUT_THREAD_QUEUE_SIZE 1024
+
+/// Input that was sent to the engine is attributed to the next frame that starts rendering,
+/// unless no frame starts rendering for this long, in nanoseconds. Then we assume the
+/// input didn't change anything on screen.
+#define INPUT_LATENCY_MAX_FRAME_DELAY_NS 100000000ull
+
+/// With --replay-input-fast, how many recorded events are replayed
+/// before the main loop gets a chance to do other work.
+#define INPUT_REPLAY_MAX_EVENTS_PER_ITERATION 64
+
+/// Number of engine tasks that can be handed to the main loop
+/// before on_post_flutter_task falls back to heap-allocated tasks.
+#define ENGINE_TASK_QUEUE_SIZE 1024
+
 /*static int flutterpi_post_platform_task(
 	int (*callback)(void *userdata),
 	void *userdata
@@ -359,59 +475,133 @@ static void on_platform_message(
 	}
 }
 
+/// Remembers that input with the given timestamp (in nanoseconds) was sent to the engine,
+/// so the next frame that starts rendering can be attributed to it. Can be called from any thread.
+static void add_pending_input_time(uint64_t input_time) {
+	uint64_t pending;
+
+	pending = atomic_load_explicit(&flutterpi.input_latency.pending_input_time, memory_order_relaxed);
+	while (1) {
+		if ((pending != 0) && (input_time >= pending) && (input_time <= pending + INPUT_LATENCY_MAX_FRAME_DELAY_NS)) {
+			// keep the oldest one.
+			return;
+		}
+
+		if (atomic_compare_exchange_weak_explicit(&flutterpi.input_latency.pending_input_time, &pending, input_time, memory_order_relaxed, memory_order_relaxed)) {
+			break;
+		}
+	}
+
+	// The pending input is so old that it didn't cause a frame.
+	if ((pending != 0) && (input_time > pending + INPUT_LATENCY_MAX_FRAME_DELAY_NS)) {
+		atomic_fetch_add_explicit(&flutterpi.input_latency.n_inputs_without_frame, 1, memory_order_relaxed);
+	}
+}
+
+/// Returns the timestamp of the oldest input that was sent to the engine since the last
+/// frame started rendering, or 0 if there's none. now is the time the frame starts rendering.
+static uint64_t take_pending_input_time(uint64_t now) {
+	uint64_t input_time;
+
+	input_time = atomic_exchange_explicit(&flutterpi.input_latency.pending_input_time, 0, memory_order_relaxed);
+	if (input_time && (now > input_time + INPUT_LATENCY_MAX_FRAME_DELAY_NS)) {
+		atomic_fetch_add_explicit(&flutterpi.input_latency.n_inputs_without_frame, 1, memory_order_relaxed);
+		return 0;
+	}
+
+	return input_time;
+}
+
+/// Replies to the pending frames in the frame queue that may start rendering,
+/// i.e. that have less than `flutterpi.frame_queue_depth` frames queued before them.
+/// The n-th frame in the queue will be flipped n refresh periods after the first one,
+/// so its vblank timestamps are offset by that much.
+/// The frame queue must be locked.
+static int reply_to_pending_frames_locked(
+	uint64_t vblank_ns,
+	uint64_t next_vblank_ns
+) {
+	FlutterEngineResult result;
+	struct frame *frame;
+	uint64_t offset, now;
+	int ok, i;
+
+	now = flutterpi.flutter.libflutter_engine.FlutterEngineGetCurrentTime();
+
+	for (i = 0; i < flutterpi.frame_queue_depth; i++) {
+		ok = cqueue_peek_nth_locked(&flutterpi.frame_queue, i, (void**) &frame);
+		if (ok == EAGAIN) {
+			break;
+		} else if (ok != 0) {
+			fprintf(stderr, "[flutter-pi] Could not get frame from frame queue. cqueue_peek_nth_locked: %s\n", strerror(ok));
+			return ok;
+		}
+
+		if (frame->state != kFramePending) {
+			continue;
+		}
+
+		offset = i * (next_vblank_ns - vblank_ns);
+
+		result = flutterpi.flutter.libflutter_engine.FlutterEngineOnVsync(
+			flutterpi.flutter.engine,
+			frame->baton,
+			vblank_ns + offset,
+			next_vblank_ns + offset
+		);
+		if (result != kSuccess) {
+			fprintf(stderr, "[flutter-pi] Could not reply to frame request. FlutterEngineOnVsync: %s\n", FLUTTER_RESULT_TO_STRING(result));
+			return EIO;
+		}
+
+		frame->state = kFrameRendering;
+		frame->timings.vsync_reply_time = now;
+		frame->timings.target_vblank_time = next_vblank_ns + offset;
+		frame->timings.input_time = take_pending_input_time(now);
+	}
+
+	return 0;
+}
+
 /// Called on the main thread when a new frame request may have arrived.
 /// Uses [drmCrtcGetSequence] or [FlutterEngineGetCurrentTime] to complete
 /// the frame request.
 static int on_execute_frame_request(
 	void *userdata
 ) {
-	FlutterEngineResult result;
-	struct frame *peek;
+	uint64_t ns, next_ns;
 	int ok;
 
 	cqueue_lock(&flutterpi.frame_queue);
 
-	ok = cqueue_peek_locked(&flutterpi.frame_queue, (void**) &peek);
-	if (ok == 0) {
-		if (peek->state == kFramePending) {
-			uint64_t ns;
-			if (flutterpi.drm.platform_supports_get_sequence_ioctl) {
-				ns = 0;
-				ok = drmCrtcGetSequence(flutterpi.drm.drmdev->fd, flutterpi.drm.drmdev->selected_crtc->crtc->crtc_id, NULL, &ns);
-				if (ok < 0) {
-					perror("[flutter-pi] Couldn't get last vblank timestamp. drmCrtcGetSequence");
-					cqueue_unlock(&flutterpi.frame_queue);
-					return errno;
-				}
-			} else {
-				ns = flutterpi.flutter.libflutter_engine.FlutterEngineGetCurrentTime();
-			}
-			
-			result = flutterpi.flutter.libflutter_engine.FlutterEngineOnVsync(
-				flutterpi.flutter.engine,
-				peek->baton,
-				ns,
-				ns + (1000000000 / flutterpi.display.refresh_rate)
-			);
-			if (result != kSuccess) {
-				fprintf(stderr, "[flutter-pi] Could not reply to frame request. FlutterEngineOnVsync: %s\n", FLUTTER_RESULT_TO_STRING(result));
+	ok = vsync_estimator_predict(
+		&flutterpi.drm.vsync_estimator,
+		flutterpi.flutter.libflutter_engine.FlutterEngineGetCurrentTime(),
+		&ns,
+		&next_ns
+	);
+	if (ok != 0) {
+		// We haven't seen enough page flips to predict the vblanks yet.
+		if (flutterpi.drm.platform_supports_get_sequence_ioctl) {
+			ns = 0;
+			ok = drmCrtcGetSequence(flutterpi.drm.drmdev->fd, flutterpi.drm.drmdev->selected_crtc->crtc->crtc_id, NULL, &ns);
+			if (ok < 0) {
+				perror("[flutter-pi] Couldn't get last vblank timestamp. drmCrtcGetSequence");
 				cqueue_unlock(&flutterpi.frame_queue);
-				return EIO;
+				return errno;
 			}
-
-			peek->state = kFrameRendering;
+		} else {
+			ns = flutterpi.flutter.libflutter_engine.FlutterEngineGetCurrentTime();
 		}
-	} else if (ok == EAGAIN) {
-		// do nothing	
-	} else if (ok != 0) {
-		fprintf(stderr, "[flutter-pi] Could not get peek of frame queue. cqueue_peek_locked: %s\n", strerror(ok));
-		cqueue_unlock(&flutterpi.frame_queue);
-		return ok;
+
+		next_ns = ns + vsync_estimator_get_period_ns(&flutterpi.drm.vsync_estimator);
 	}
 
+	ok = reply_to_pending_frames_locked(ns, next_ns);
+
 	cqueue_unlock(&flutterpi.frame_queue);
 
-	return 0;
+	return ok;
 }
 
 /// Called on some flutter internal thread to request a frame,
@@ -420,19 +610,23 @@ static void on_frame_request(
 	void* userdata,
 	intptr_t baton
 ) {
-	sd_event_source *event_source;
-	struct frame *peek;
+	bool reply_instantly;
 	int ok;
 
 	cqueue_lock(&flutterpi.frame_queue);
 
-	ok = cqueue_peek_locked(&flutterpi.frame_queue, (void**) &peek);
+	// If there are less than frame_queue_depth frames in flight,
+	// this frame can start rendering right away.
+	ok = cqueue_peek_nth_locked(&flutterpi.frame_queue, flutterpi.frame_queue_depth - 1, NULL);
 	if ((ok == 0) || (ok == EAGAIN)) {
-		bool reply_instantly = ok == EAGAIN;
+		reply_instantly = ok == EAGAIN;
 
 		ok = cqueue_try_enqueue_locked(&flutterpi.frame_queue, &(struct frame) {
 			.state = kFramePending,
-			.baton = baton
+			.baton = baton,
+			.timings = {
+				.request_time = flutterpi.flutter.libflutter_engine.FlutterEngineGetCurrentTime()
+			}
 		});
 		if (ok != 0) {
 			fprintf(stderr, "[flutter-pi] Could not enqueue frame request. cqueue_try_enqueue_locked: %s\n", strerror(ok));
@@ -441,114 +635,298 @@ static void on_frame_request(
 		}
 
 		if (reply_instantly) {	
-			flutterpi_post_platform_task(
+			flutterpi_post_platform_task_with_priority(
 				on_execute_frame_request,
-				NULL
+				NULL,
+				kPlatformTaskPriorityFrame
 			);
 		}
 	} else if (ok != 0) {
-		fprintf(stderr, "[flutter-pi] Could not get peek of frame queue. cqueue_peek_locked: %s\n", strerror(ok));
+		fprintf(stderr, "[flutter-pi] Could not get frame from frame queue. cqueue_peek_nth_locked: %s\n", strerror(ok));
 	}
 
 	cqueue_unlock(&flutterpi.frame_queue);
 }
 
+/// Called on the raster thread with the frame the software renderer just rendered.
+static bool on_present_software(void *userdata, const void *allocation, size_t row_bytes, size_t height) {
+	return compositor_present_software_frame(allocation, row_bytes, height);
+}
+
 static FlutterTransformation on_get_transformation(void *userdata) {
-	return flutterpi.view.view_to_display_transform;
+	return flutterpi.view.view_to_surface_transform;
 }
 
 /// platform tasks
-static int on_execute_platform_task(
-	sd_event_source *s,
-	void *userdata
+static inline uint64_t get_monotonic_time_ns(void) {
+	struct timespec time;
+
+	clock_gettime(CLOCK_MONOTONIC, &time);
+
+	return time.tv_sec * 1000000000ull + time.tv_nsec;
+}
+
+/// Records how long a callback of this task source waited before it was run
+/// (from ready_time to start_time) and how long it ran (from start_time to end_time).
+/// If the callback ran longer than the slow callback threshold, it's reported on stderr.
+static void record_callback_timing(
+	struct task_source_stats *stats,
+	void *callback,
+	uint64_t ready_time,
+	uint64_t start_time,
+	uint64_t end_time
+) {
+	uint64_t duration;
+
+	duration = end_time - start_time;
+
+	latency_histogram_record(&stats->delay, start_time > ready_time ? start_time - ready_time : 0);
+	latency_histogram_record(&stats->duration, duration);
+
+	if (flutterpi.loop_stats.slow_callback_threshold_ns && (duration > flutterpi.loop_stats.slow_callback_threshold_ns)) {
+		atomic_fetch_add_explicit(&flutterpi.loop_stats.n_slow_callbacks, 1, memory_order_relaxed);
+		fprintf(
+			stderr,
+			"[flutter-pi] Slow callback (%s) %p took %.3fms (threshold: %.3fms)\n",
+			stats->duration.name,
+			callback,
+			duration / 1000000.0,
+			flutterpi.loop_stats.slow_callback_threshold_ns / 1000000.0
+		);
+	}
+}
+
+/// Runs a platform task that was dequeued from one of the task queues.
+static void execute_platform_task(
+	const struct platform_task *task,
+	struct task_source_stats *stats
 ) {
-	struct platform_task *task;
+	uint64_t start_time;
 	int ok;
 
-	task = userdata;
+	start_time = get_monotonic_time_ns();
+
 	ok = task->callback(task->userdata);
 	if (ok != 0) {
 		fprintf(stderr, "[flutter-pi] Error executing platform task: %s\n", strerror(ok));
 	}
 
-	free(task);
+	record_callback_timing(stats, (void*) task->callback, task->post_time, start_time, get_monotonic_time_ns());
+}
 
-	sd_event_source_set_enabled(s, SD_EVENT_OFF);
-	sd_event_source_unrefp(&s);
+/// Makes sure the main loop will wake up and drain the platform task queues.
+/// Only the first poster since the last drain actually writes the eventfd.
+static int signal_platform_task_queue(void) {
+	int ok;
+
+	if (atomic_exchange(&flutterpi.platform_task_wakeup_pending, true) == true) {
+		return 0;
+	}
+
+	atomic_store_explicit(&flutterpi.loop_stats.wakeup_signal_time, get_monotonic_time_ns(), memory_order_relaxed);
+
+	ok = write(flutterpi.wakeup_event_loop_fd, (uint8_t[8]) {0, 0, 0, 0, 0, 0, 0, 1}, 8);
+	if (ok < 0) {
+		perror("[flutter-pi] Error arming main loop for platform task. write");
+		atomic_store(&flutterpi.platform_task_wakeup_pending, false);
+		return errno;
+	}
 
 	return 0;
 }
 
-int flutterpi_post_platform_task(
-	int (*callback)(void *userdata),
-	void *userdata
-) {
-	struct platform_task *task;
-	int ok;
+/// Executes the platform tasks that didn't fit into the given priority lane,
+/// in the order they were posted.
+/// Only called once the lane itself is empty, since everything in the
+/// overflow list was posted after the tasks in the lane.
+static void drain_overflowed_platform_tasks(enum platform_task_priority priority) {
+	struct overflowed_platform_task *entry, *next;
 
-	task = malloc(sizeof *task);
-	if (task == NULL) {
-		return ENOMEM;
+	pthread_mutex_lock(&flutterpi.event_loop_mutex);
+	entry = flutterpi.overflowed_platform_tasks[priority];
+	flutterpi.overflowed_platform_tasks[priority] = NULL;
+	flutterpi.overflowed_platform_tasks_tail[priority] = &flutterpi.overflowed_platform_tasks[priority];
+	atomic_store(flutterpi.platform_task_lane_overflowed + priority, false);
+	pthread_mutex_unlock(&flutterpi.event_loop_mutex);
+
+	while (entry != NULL) {
+		execute_platform_task(&entry->task, flutterpi.loop_stats.platform_tasks + priority);
+
+		next = entry->next;
+		free(entry);
+		entry = next;
 	}
+}
 
-	task->callback = callback;
-	task->userdata = userdata;
+/// Executes the platform tasks that were posted to the platform task queue
+/// with the given priority.
+/// Executes at most one queue-full per call, so a task that re-posts itself
+/// can't starve the rest of the main loop.
+/// Returns true if the lane was fully drained.
+static bool drain_platform_task_lane(enum platform_task_priority priority) {
+	struct platform_task task;
+	struct mpsc_queue *queue;
+	size_t n_executed;
+	int ok;
+
+	queue = flutterpi.platform_task_queues + priority;
+
+	for (n_executed = 0; n_executed < queue->size; n_executed++) {
+		ok = mpscq_try_dequeue(queue, &task);
+		if (ok == EAGAIN) {
+			if (atomic_load(flutterpi.platform_task_lane_overflowed + priority)) {
+				drain_overflowed_platform_tasks(priority);
+			}
+			return true;
+		}
 
-	if (pthread_self() != flutterpi.event_loop_thread) {
-		pthread_mutex_lock(&flutterpi.event_loop_mutex);
+		execute_platform_task(&task, flutterpi.loop_stats.platform_tasks + priority);
 	}
 
-	ok = sd_event_add_defer(
-		flutterpi.event_loop,
-		NULL,
-		on_execute_platform_task,
-		task
-	);
-	if (ok < 0) {
-		fprintf(stderr, "[flutter-pi] Error posting platform task to main loop. sd_event_add_defer: %s\n", strerror(-ok));
-		ok = -ok;
-		goto fail_unlock_event_loop;
+	return false;
+}
+
+/// Drains all lanes with a higher priority than kPlatformTaskPriorityBackground,
+/// highest priority first.
+static bool drain_foreground_platform_task_lanes(void) {
+	bool drained = true;
+
+	for (int priority = 0; priority < kPlatformTaskPriorityBackground; priority++) {
+		drained = drain_platform_task_lane(priority) && drained;
 	}
 
-	if (pthread_self() != flutterpi.event_loop_thread) {
-		ok = write(flutterpi.wakeup_event_loop_fd, (uint8_t[8]) {0, 0, 0, 0, 0, 0, 0, 1}, 8);
-		if (ok < 0) {
-			perror("[flutter-pi] Error arming main loop for platform task. write");
-			ok = errno;
-			goto fail_unlock_event_loop;
+	return drained;
+}
+
+/// Executes the platform tasks that were posted to the platform task queues.
+/// Higher priority lanes are always drained first. Background tasks are only
+/// executed for BACKGROUND_PLATFORM_TASK_BUDGET_NS, and any higher priority
+/// task that's posted in the meantime gets to run before the next background task.
+static void drain_platform_task_queues(void) {
+	struct platform_task task;
+	uint64_t deadline;
+	bool drained;
+	int ok;
+
+	drained = drain_foreground_platform_task_lanes();
+
+	deadline = get_monotonic_time_ns() + BACKGROUND_PLATFORM_TASK_BUDGET_NS;
+	while (1) {
+		ok = mpscq_try_dequeue(flutterpi.platform_task_queues + kPlatformTaskPriorityBackground, &task);
+		if (ok == EAGAIN) {
+			if (atomic_load(flutterpi.platform_task_lane_overflowed + kPlatformTaskPriorityBackground)) {
+				drain_overflowed_platform_tasks(kPlatformTaskPriorityBackground);
+			}
+			break;
+		}
+
+		execute_platform_task(&task, flutterpi.loop_stats.platform_tasks + kPlatformTaskPriorityBackground);
+
+		drained = drain_foreground_platform_task_lanes() && drained;
+
+		if (get_monotonic_time_ns() >= deadline) {
+			// we're over budget, continue in the next main loop iteration.
+			drained = false;
+			break;
 		}
 	}
 
-	if (pthread_self() != flutterpi.event_loop_thread) {
-		pthread_mutex_unlock(&flutterpi.event_loop_mutex);
+	if (!drained) {
+		signal_platform_task_queue();
 	}
+}
 
-	return 0;
+int flutterpi_post_platform_task_with_priority(
+	int (*callback)(void *userdata),
+	void *userdata,
+	enum platform_task_priority priority
+) {
+	struct overflowed_platform_task *entry;
+	int ok;
+
+	if ((priority < 0) || (priority >= kPlatformTaskPriorityCount)) {
+		return EINVAL;
+	}
 
+	// Once a task has overflowed its lane, every following task of that lane
+	// is overflowed too until the main loop executed them, so the lane stays in order.
+	if (atomic_load(flutterpi.platform_task_lane_overflowed + priority) == false) {
+		ok = mpscq_try_enqueue(
+			flutterpi.platform_task_queues + priority,
+			&(struct platform_task) {
+				.callback = callback,
+				.userdata = userdata,
+				.post_time = get_monotonic_time_ns()
+			}
+		);
+		if (ok == 0) {
+			return signal_platform_task_queue();
+		} else if (ok != ENOSPC) {
+			return ok;
+		}
+	}
 
-	fail_unlock_event_loop:
-	if (pthread_self() != flutterpi.event_loop_thread) {
-		pthread_mutex_unlock(&flutterpi.event_loop_mutex);
+	// The lane is full. Put the task into the overflow list of the lane,
+	// the main loop will execute it once the lane is empty.
+	entry = malloc(sizeof *entry);
+	if (entry == NULL) {
+		return ENOMEM;
 	}
 
-	return ok;
+	entry->next = NULL;
+	entry->task.callback = callback;
+	entry->task.userdata = userdata;
+	entry->task.post_time = get_monotonic_time_ns();
+
+	pthread_mutex_lock(&flutterpi.event_loop_mutex);
+	*flutterpi.overflowed_platform_tasks_tail[priority] = entry;
+	flutterpi.overflowed_platform_tasks_tail[priority] = &entry->next;
+	atomic_store(flutterpi.platform_task_lane_overflowed + priority, true);
+	pthread_mutex_unlock(&flutterpi.event_loop_mutex);
+
+	return signal_platform_task_queue();
+}
+
+int flutterpi_post_platform_task(
+	int (*callback)(void *userdata),
+	void *userdata
+) {
+	return flutterpi_post_platform_task_with_priority(callback, userdata, kPlatformTaskPriorityEngine);
 }
 
 /// timed platform tasks
+struct timed_platform_task {
+	int (*callback)(void *userdata);
+	void *userdata;
+	uint64_t target_time_usec;
+};
+
 static int on_execute_platform_task_with_time(
 	sd_event_source *s,
 	uint64_t usec,
 	void *userdata
 ) {
-	struct platform_task *task;
+	struct timed_platform_task *task;
+	uint64_t start_time;
 	int ok;
 
 	task = userdata;
+
+	start_time = get_monotonic_time_ns();
+
 	ok = task->callback(task->userdata);
 	if (ok != 0) {
 		fprintf(stderr, "[flutter-pi] Error executing timed platform task: %s\n", strerror(ok));
 	}
 
+	record_callback_timing(
+		&flutterpi.loop_stats.timed_platform_tasks,
+		(void*) task->callback,
+		task->target_time_usec * 1000,
+		start_time,
+		get_monotonic_time_ns()
+	);
+
 	free(task);
 
 	sd_event_source_set_enabled(s, SD_EVENT_OFF);
@@ -557,162 +935,516 @@ static int on_execute_platform_task_with_time(
 	return 0;
 }
 
-int flutterpi_post_platform_task_with_time(
-	int (*callback)(void *userdata),
-	void *userdata,
-	uint64_t target_time_usec
-) {
-	struct platform_task *task;
-	//sd_event_source *source;
+/// Adds a time source for this task to the main loop. Must be called on the main thread.
+static int add_timed_platform_task_source(struct timed_platform_task *task) {
 	int ok;
 
-	task = malloc(sizeof *task);
-	if (task == NULL) {
-		return ENOMEM;
-	}
-
-	task->callback = callback;
-	task->userdata = userdata;
-	
-	if (pthread_self() != flutterpi.event_loop_thread) {
-		pthread_mutex_lock(&flutterpi.event_loop_mutex);
-	}
-
+	pthread_mutex_lock(&flutterpi.event_loop_mutex);
 	ok = sd_event_add_time(
 		flutterpi.event_loop,
 		NULL,
 		CLOCK_MONOTONIC,
-		target_time_usec,
+		task->target_time_usec,
 		1,
 		on_execute_platform_task_with_time,
 		task
 	);
+	pthread_mutex_unlock(&flutterpi.event_loop_mutex);
+
 	if (ok < 0) {
 		fprintf(stderr, "[flutter-pi] Error posting platform task to main loop. sd_event_add_time: %s\n", strerror(-ok));
-		ok = -ok;
-		goto fail_unlock_event_loop;
-	}
-
-	if (pthread_self() != flutterpi.event_loop_thread) {
-		ok = write(flutterpi.wakeup_event_loop_fd, (uint8_t[8]) {0, 0, 0, 0, 0, 0, 0, 1}, 8);
-		if (ok < 0) {
-			perror("[flutter-pi] Error arming main loop for platform task. write");
-			ok = errno;
-			goto fail_unlock_event_loop;
-		}
-	}
-
-	if (pthread_self() != flutterpi.event_loop_thread) {
-		pthread_mutex_unlock(&flutterpi.event_loop_mutex);
+		return -ok;
 	}
 
 	return 0;
+}
 
+static int on_add_timed_platform_task_source(void *userdata) {
+	int ok;
 
-	fail_unlock_event_loop:
-	if (pthread_self() != flutterpi.event_loop_thread) {
-		pthread_mutex_unlock(&flutterpi.event_loop_mutex);
+	ok = add_timed_platform_task_source(userdata);
+	if (ok != 0) {
+		free(userdata);
 	}
 
-	fail_free_task:
-	free(task);
-
 	return ok;
 }
 
-int flutterpi_sd_event_add_io(
-	sd_event_source **source_out,
-	int fd,
-	uint32_t events,
-	sd_event_io_handler_t callback,
-	void *userdata
+int flutterpi_post_platform_task_with_time(
+	int (*callback)(void *userdata),
+	void *userdata,
+	uint64_t target_time_usec
 ) {
+	struct timed_platform_task *task;
 	int ok;
 
-	if (pthread_self() != flutterpi.event_loop_thread) {
-		pthread_mutex_lock(&flutterpi.event_loop_mutex);
+	task = malloc(sizeof *task);
+	if (task == NULL) {
+		return ENOMEM;
 	}
 
-	ok = sd_event_add_io(
-		flutterpi.event_loop,
-		source_out,
-		fd,
-		events,
-		callback,
-		userdata
-	);
-	if (ok < 0) {
-		fprintf(stderr, "[flutter-pi] Could not add IO callback to event loop. sd_event_add_io: %s\n", strerror(-ok));
-		return -ok;
-	}
+	task->callback = callback;
+	task->userdata = userdata;
+	task->target_time_usec = target_time_usec;
 
-	if (pthread_self() != flutterpi.event_loop_thread) {
-		ok = write(flutterpi.wakeup_event_loop_fd, (uint8_t[8]) {0, 0, 0, 0, 0, 0, 0, 1}, 8);
-		if (ok < 0) {
-			perror("[flutter-pi] Error arming main loop for io callback. write");
-			ok = errno;
-			goto fail_unlock_event_loop;
-		}
+	if (runs_platform_tasks_on_current_thread(NULL)) {
+		ok = add_timed_platform_task_source(task);
+	} else {
+		// The main loop dispatches sd_event without holding any lock,
+		// so only the main thread may add sources to it.
+		ok = flutterpi_post_platform_task_with_priority(
+			on_add_timed_platform_task_source,
+			task,
+			kPlatformTaskPriorityEngine
+		);
 	}
 
-	if (pthread_self() != flutterpi.event_loop_thread) {
-		pthread_mutex_unlock(&flutterpi.event_loop_mutex);
+	if (ok != 0) {
+		free(task);
+		return ok;
 	}
 
 	return 0;
+}
 
+/// Wraps the callback & userdata of an IO source added
+/// using flutterpi_sd_event_add_io, so we can measure it.
+struct instrumented_io_source {
+	sd_event_io_handler_t callback;
+	void *userdata;
+};
 
-	fail_unlock_event_loop:
-	if (pthread_self() != flutterpi.event_loop_thread) {
-		pthread_mutex_unlock(&flutterpi.event_loop_mutex);
-	}
-}
+static int on_instrumented_io_source_ready(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+	struct instrumented_io_source *source;
+	uint64_t start_time;
+	int ok;
 
-/// flutter tasks
-static int on_execute_flutter_task(
+	source = userdata;
+
+	start_time = get_monotonic_time_ns();
+
+	ok = source->callback(s, fd, revents, source->userdata);
+
+	record_callback_timing(
+		&flutterpi.loop_stats.io_callbacks,
+		(void*) source->callback,
+		flutterpi.loop_stats.wakeup_time,
+		start_time,
+		get_monotonic_time_ns()
+	);
+
+	return ok;
+}
+
+static void on_destroy_instrumented_io_source(void *userdata) {
+	free(userdata);
+}
+
+struct sd_event_add_io_request {
+	int fd;
+	uint32_t events;
+	sd_event_io_handler_t callback;
+	void *userdata;
+};
+
+static int on_execute_sd_event_add_io_request(void *userdata) {
+	struct sd_event_add_io_request *request;
+	int ok;
+
+	request = userdata;
+
+	ok = flutterpi_sd_event_add_io(
+		NULL,
+		request->fd,
+		request->events,
+		request->callback,
+		request->userdata
+	);
+
+	free(request);
+
+	return ok;
+}
+
+/// Adds an IO source to the main loop.
+///
+/// If called on any other thread than the main thread, the source is added
+/// asynchronously by the main thread, so we never block on it (the main thread
+/// could be waiting for the calling thread). source_out must be NULL in that case,
+/// and failures to add the source are only logged.
+int flutterpi_sd_event_add_io(
+	sd_event_source **source_out,
+	int fd,
+	uint32_t events,
+	sd_event_io_handler_t callback,
 	void *userdata
 ) {
-	FlutterEngineResult result;
-	FlutterTask *task;
+	struct instrumented_io_source *instrumented_source;
+	struct sd_event_add_io_request *request;
+	sd_event_source *source;
+	int ok;
 
-	task = userdata;
+	if (!runs_platform_tasks_on_current_thread(NULL)) {
+		// The source would only exist once the main thread ran the request.
+		if (source_out != NULL) {
+			return EINVAL;
+		}
 
-	result = flutterpi.flutter.libflutter_engine.FlutterEngineRunTask(flutterpi.flutter.engine, task);
-	if (result != kSuccess) {
-		fprintf(stderr, "[flutter-pi] Error running platform task. FlutterEngineRunTask: %d\n", result);
-		free(task);
-		return EINVAL;
+		request = malloc(sizeof *request);
+		if (request == NULL) {
+			return ENOMEM;
+		}
+
+		request->fd = fd;
+		request->events = events;
+		request->callback = callback;
+		request->userdata = userdata;
+
+		ok = flutterpi_post_platform_task_with_priority(
+			on_execute_sd_event_add_io_request,
+			request,
+			kPlatformTaskPriorityEngine
+		);
+		if (ok != 0) {
+			free(request);
+			return ok;
+		}
+
+		return 0;
 	}
 
-	free(task);
+	instrumented_source = malloc(sizeof *instrumented_source);
+	if (instrumented_source == NULL) {
+		return ENOMEM;
+	}
+
+	instrumented_source->callback = callback;
+	instrumented_source->userdata = userdata;
+
+	// We always need the source to set the destroy callback.
+	// If the caller doesn't want it, we make it floating below.
+	pthread_mutex_lock(&flutterpi.event_loop_mutex);
+	ok = sd_event_add_io(
+		flutterpi.event_loop,
+		&source,
+		fd,
+		events,
+		on_instrumented_io_source_ready,
+		instrumented_source
+	);
+	if (ok >= 0) {
+		sd_event_source_set_destroy_callback(source, on_destroy_instrumented_io_source);
+	}
+	pthread_mutex_unlock(&flutterpi.event_loop_mutex);
+
+	if (ok < 0) {
+		fprintf(stderr, "[flutter-pi] Could not add IO callback to event loop. sd_event_add_io: %s\n", strerror(-ok));
+		free(instrumented_source);
+		return -ok;
+	}
+
+	if (source_out != NULL) {
+		*source_out = source;
+	} else {
+		// let the event loop own the source, like sd_event_add_io with a NULL source does.
+		sd_event_source_set_floating(source, true);
+		sd_event_source_unref(source);
+	}
+
+	return 0;
+}
+
+/// flutter tasks
+static inline bool engine_task_is_earlier(const struct engine_task *a, const struct engine_task *b) {
+	if (a->target_time != b->target_time) {
+		return a->target_time < b->target_time;
+	}
+
+	// keep tasks with the same target time in the order they were posted
+	return a->sequence < b->sequence;
+}
+
+/// Restores the heap property of the engine task heap, starting at index i and moving up.
+static void engine_task_heap_sift_up(size_t i) {
+	struct engine_task *heap = flutterpi.engine_tasks.heap;
+	struct engine_task tmp;
+	size_t parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (!engine_task_is_earlier(heap + i, heap + parent)) {
+			break;
+		}
+
+		tmp = heap[i];
+		heap[i] = heap[parent];
+		heap[parent] = tmp;
+
+		i = parent;
+	}
+}
+
+/// Restores the heap property of the engine task heap, starting at index i and moving down.
+static void engine_task_heap_sift_down(size_t i) {
+	struct engine_task *heap = flutterpi.engine_tasks.heap;
+	size_t length = flutterpi.engine_tasks.heap_length;
+	struct engine_task tmp;
+	size_t child, earliest;
+
+	while (1) {
+		earliest = i;
+
+		child = 2*i + 1;
+		if ((child < length) && engine_task_is_earlier(heap + child, heap + earliest)) {
+			earliest = child;
+		}
+
+		child = 2*i + 2;
+		if ((child < length) && engine_task_is_earlier(heap + child, heap + earliest)) {
+			earliest = child;
+		}
+
+		if (earliest == i) {
+			break;
+		}
+
+		tmp = heap[i];
+		heap[i] = heap[earliest];
+		heap[earliest] = tmp;
+
+		i = earliest;
+	}
+}
+
+/// Makes sure there's room for at least one more task in the engine task heap.
+static int engine_task_heap_reserve(void) {
+	struct engine_task *new_heap;
+	size_t new_size;
+
+	if (flutterpi.engine_tasks.heap_length < flutterpi.engine_tasks.heap_size) {
+		return 0;
+	}
+
+	new_size = flutterpi.engine_tasks.heap_size ? flutterpi.engine_tasks.heap_size * 2 : 64;
+
+	new_heap = realloc(flutterpi.engine_tasks.heap, new_size * sizeof *new_heap);
+	if (new_heap == NULL) {
+		return ENOMEM;
+	}
+
+	flutterpi.engine_tasks.heap = new_heap;
+	flutterpi.engine_tasks.heap_size = new_size;
 
 	return 0;
 }
 
+/// Adds a task to the engine task heap.
+/// There must be room for it, see engine_task_heap_reserve.
+static void engine_task_heap_push(const struct engine_task *task) {
+	flutterpi.engine_tasks.heap[flutterpi.engine_tasks.heap_length] = *task;
+	flutterpi.engine_tasks.heap[flutterpi.engine_tasks.heap_length].sequence = flutterpi.engine_tasks.next_sequence++;
+	flutterpi.engine_tasks.heap_length++;
+
+	engine_task_heap_sift_up(flutterpi.engine_tasks.heap_length - 1);
+}
+
+static void engine_task_heap_pop(struct engine_task *task_out) {
+	*task_out = flutterpi.engine_tasks.heap[0];
+
+	flutterpi.engine_tasks.heap_length--;
+	if (flutterpi.engine_tasks.heap_length > 0) {
+		flutterpi.engine_tasks.heap[0] = flutterpi.engine_tasks.heap[flutterpi.engine_tasks.heap_length];
+		engine_task_heap_sift_down(0);
+	}
+}
+
+/// Moves all engine tasks that were posted using on_post_flutter_task
+/// into the engine task heap. Must be called on the main thread.
+///
+/// The tasks in the posted queue are always older than the overflowed ones
+/// (see on_post_flutter_task), so the queue is collected first.
+/// If the heap can't grow, the remaining tasks are left where they are
+/// and collected on the next main loop iteration.
+static void collect_posted_engine_tasks(void) {
+	struct overflowed_engine_task *entry, *next;
+	struct engine_task task;
+	int ok;
+
+	while (1) {
+		ok = engine_task_heap_reserve();
+		if (ok != 0) {
+			goto fail_retry;
+		}
+
+		if (mpscq_try_dequeue(&flutterpi.engine_tasks.posted, &task) != 0) {
+			break;
+		}
+
+		engine_task_heap_push(&task);
+	}
+
+	if (atomic_load(&flutterpi.engine_tasks.has_overflowed) == false) {
+		return;
+	}
+
+	pthread_mutex_lock(&flutterpi.event_loop_mutex);
+	entry = flutterpi.engine_tasks.overflowed;
+	flutterpi.engine_tasks.overflowed = NULL;
+	flutterpi.engine_tasks.overflowed_tail = &flutterpi.engine_tasks.overflowed;
+	atomic_store(&flutterpi.engine_tasks.has_overflowed, false);
+	pthread_mutex_unlock(&flutterpi.event_loop_mutex);
+
+	while (entry != NULL) {
+		ok = engine_task_heap_reserve();
+		if (ok != 0) {
+			// put the rest back in front of anything that was overflowed in the meantime.
+			pthread_mutex_lock(&flutterpi.event_loop_mutex);
+			for (next = entry; next->next != NULL; next = next->next);
+			next->next = flutterpi.engine_tasks.overflowed;
+			if (flutterpi.engine_tasks.overflowed == NULL) {
+				flutterpi.engine_tasks.overflowed_tail = &next->next;
+			}
+			flutterpi.engine_tasks.overflowed = entry;
+			atomic_store(&flutterpi.engine_tasks.has_overflowed, true);
+			pthread_mutex_unlock(&flutterpi.event_loop_mutex);
+			goto fail_retry;
+		}
+
+		engine_task_heap_push(&entry->task);
+
+		next = entry->next;
+		free(entry);
+		entry = next;
+	}
+
+	return;
+
+
+	fail_retry:
+	fprintf(stderr, "[flutter-pi] Could not schedule engine task. engine_task_heap_reserve: %s. Retrying.\n", strerror(ok));
+	signal_platform_task_queue();
+}
+
+/// Arms the engine task timerfd for the earliest pending engine task,
+/// or disarms it if there is none. Only touches the timerfd if the
+/// deadline actually changed. Must be called on the main thread.
+static void update_engine_task_timer(void) {
+	struct itimerspec spec = {0};
+	uint64_t target_time;
+	int ok;
+
+	target_time = 0;
+	if (flutterpi.engine_tasks.heap_length > 0) {
+		// an all-zero it_value would disarm the timer.
+		target_time = flutterpi.engine_tasks.heap[0].target_time;
+		if (target_time == 0) {
+			target_time = 1;
+		}
+	}
+
+	if (target_time == flutterpi.engine_tasks.timer_target_time) {
+		return;
+	}
+
+	spec.it_value.tv_sec = target_time / 1000000000ull;
+	spec.it_value.tv_nsec = target_time % 1000000000ull;
+
+	ok = timerfd_settime(flutterpi.engine_tasks.timerfd, TFD_TIMER_ABSTIME, &spec, NULL);
+	if (ok < 0) {
+		perror("[flutter-pi] Could not arm engine task timer. timerfd_settime");
+		return;
+	}
+
+	flutterpi.engine_tasks.timer_target_time = target_time;
+}
+
+/// Runs all engine tasks that are due at this point.
+/// Called on the main thread on every main loop iteration.
+static void run_due_engine_tasks(void) {
+	FlutterEngineResult result;
+	struct engine_task task;
+	unsigned int n_expired;
+	uint64_t now, start_time;
+
+	if ((flutterpi.engine_tasks.heap_length == 0) || (flutterpi.engine_tasks.heap[0].target_time > (now = get_monotonic_time_ns()))) {
+		return;
+	}
+
+	n_expired = 0;
+	while ((flutterpi.engine_tasks.heap_length > 0) && (flutterpi.engine_tasks.heap[0].target_time <= now)) {
+		engine_task_heap_pop(&task);
+
+		start_time = get_monotonic_time_ns();
+
+		result = flutterpi.flutter.libflutter_engine.FlutterEngineRunTask(flutterpi.flutter.engine, &task.task);
+		if (result != kSuccess) {
+			fprintf(stderr, "[flutter-pi] Error running engine task. FlutterEngineRunTask: %d\n", result);
+		}
+
+		record_callback_timing(
+			&flutterpi.loop_stats.engine_tasks,
+			(void*) flutterpi.flutter.libflutter_engine.FlutterEngineRunTask,
+			task.target_time,
+			start_time,
+			get_monotonic_time_ns()
+		);
+
+		n_expired++;
+	}
+
+	flutterpi.engine_tasks.n_wakeups++;
+	flutterpi.engine_tasks.n_expired_total += n_expired;
+	flutterpi.engine_tasks.n_expired_last_wakeup = n_expired;
+	if (n_expired > flutterpi.engine_tasks.max_expired_per_wakeup) {
+		flutterpi.engine_tasks.max_expired_per_wakeup = n_expired;
+	}
+}
+
 static void on_post_flutter_task(
 	FlutterTask task,
 	uint64_t target_time,
 	void *userdata
 ) {
-	sd_event_source *source;
-	FlutterTask *dup_task;
+	struct overflowed_engine_task *entry;
 	int ok;
 
-	dup_task = malloc(sizeof *dup_task);
-	if (dup_task == NULL) {
-		return;
+	// Once a task has overflowed, every following task is overflowed too
+	// until the main loop collected them, so they can't overtake each other.
+	if (atomic_load(&flutterpi.engine_tasks.has_overflowed) == false) {
+		ok = mpscq_try_enqueue(
+			&flutterpi.engine_tasks.posted,
+			&(struct engine_task) {
+				.target_time = target_time,
+				.task = task
+			}
+		);
+		if (ok == 0) {
+			signal_platform_task_queue();
+			return;
+		}
 	}
-	
-	*dup_task = task;
 
-	ok = flutterpi_post_platform_task_with_time(
-		on_execute_flutter_task,
-		dup_task,
-		target_time / 1000
-	);
-	if (ok != 0) {
-		free(dup_task);
+	// The engine task queue is full. Put the task into the overflow list,
+	// the main loop sorts it into the same heap on the next wakeup.
+	entry = malloc(sizeof *entry);
+	if (entry == NULL) {
+		// This can run on the platform thread, so waiting for memory here could hang the thread that frees it.
+		fprintf(stderr, "[flutter-pi] Could not post engine task. Out of memory. The task is dropped.\n");
+		return;
 	}
+
+	entry->next = NULL;
+	entry->task.target_time = target_time;
+	entry->task.sequence = 0;
+	entry->task.task = task;
+
+	pthread_mutex_lock(&flutterpi.event_loop_mutex);
+	*flutterpi.engine_tasks.overflowed_tail = entry;
+	flutterpi.engine_tasks.overflowed_tail = &entry->next;
+	atomic_store(&flutterpi.engine_tasks.has_overflowed, true);
+	pthread_mutex_unlock(&flutterpi.event_loop_mutex);
+
+	signal_platform_task_queue();
 }
 
 /// platform messages
@@ -838,9 +1570,10 @@ int flutterpi_send_platform_message(
 			msg->message_size = 0;
 		}
 
-		ok = flutterpi_post_platform_task(
+		ok = flutterpi_post_platform_task_with_priority(
 			on_send_platform_message,
-			msg
+			msg,
+			kPlatformTaskPriorityBackground
 		);
 		if (ok != 0) {
 			if (message && message_size) {
@@ -895,9 +1628,10 @@ int flutterpi_respond_to_platform_message(
 			msg->message = 0;
 		}
 
-		ok = flutterpi_post_platform_task(
+		ok = flutterpi_post_platform_task_with_priority(
 			on_send_platform_message,
-			msg
+			msg,
+			kPlatformTaskPriorityBackground
 		);
 		if (ok != 0) {
 			if (msg->message) {
@@ -915,141 +1649,596 @@ static bool runs_platform_tasks_on_current_thread(void* userdata) {
 	return pthread_equal(pthread_self(), flutterpi.event_loop_thread) != 0;
 }
 
-static int run_main_loop(void) {
-	int ok, evloop_fd;
+static void dump_task_source_stats(struct task_source_stats *stats, FILE *file) {
+	latency_histogram_print(&stats->delay, file);
+	latency_histogram_print(&stats->duration, file);
+}
 
-	pthread_mutex_lock(&flutterpi.event_loop_mutex);
-	ok = sd_event_get_fd(flutterpi.event_loop);
-	if (ok < 0) {
-		fprintf(stderr, "[flutter-pi] Could not get fd for main event loop. sd_event_get_fd: %s\n", strerror(-ok));
-		pthread_mutex_unlock(&flutterpi.event_loop_mutex);
-		return -ok;
+/// Takes the frames flipped since the last dump out of the frame telemetry records ring
+/// and prints their timings to file, in microseconds relative to the vsync reply.
+/// Must only be called on the main thread, since that's the only consumer of the ring.
+static void dump_recent_frames(FILE *file) {
+	struct frame_timings timings[FRAME_TELEMETRY_N_RECORDS];
+	size_t i, n_frames;
+
+	n_frames = frame_telemetry_take_recent_frames(&flutterpi.frame_telemetry, timings, FRAME_TELEMETRY_N_RECORDS);
+	if (n_frames == 0) {
+		return;
 	}
-	pthread_mutex_unlock(&flutterpi.event_loop_mutex);
 
-	evloop_fd = ok;
+	fprintf(file, "  recent frames (us after vsync reply: present, commit, flip):\n");
+	for (i = 0; i < n_frames; i++) {
+		if (timings[i].vsync_reply_time == 0) {
+			continue;
+		}
 
-	{
-		fd_set fds;
-		int state;
-		FD_ZERO(&fds);
-		FD_SET(evloop_fd, &fds);
+		fprintf(
+			file,
+			"    %" PRId64 ", %" PRId64 ", %" PRId64 "\n",
+			timings[i].present_time ? (int64_t) (timings[i].present_time - timings[i].vsync_reply_time) / 1000 : -1,
+			timings[i].commit_time ? (int64_t) (timings[i].commit_time - timings[i].vsync_reply_time) / 1000 : -1,
+			timings[i].flip_time ? (int64_t) (timings[i].flip_time - timings[i].vsync_reply_time) / 1000 : -1
+		);
+	}
+}
 
-		const fd_set const_fds = fds;
+/// Prints all event loop statistics to file.
+static void dump_loop_stats(FILE *file) {
+	fprintf(file, "[flutter-pi] event loop statistics:\n");
 
-		pthread_mutex_lock(&flutterpi.event_loop_mutex);
-		 
-		do {
-			state = sd_event_get_state(flutterpi.event_loop);
-			switch (state) {
-				case SD_EVENT_INITIAL:
-					ok = sd_event_prepare(flutterpi.event_loop);
-					if (ok < 0) {
-						fprintf(stderr, "[flutter-pi] Could not prepare event loop. sd_event_prepare: %s\n", strerror(-ok));
-						return -ok;
-					}
+	latency_histogram_print(&flutterpi.loop_stats.wakeup_latency, file);
+	for (int i = 0; i < kPlatformTaskPriorityCount; i++) {
+		dump_task_source_stats(flutterpi.loop_stats.platform_tasks + i, file);
+	}
+	dump_task_source_stats(&flutterpi.loop_stats.timed_platform_tasks, file);
+	dump_task_source_stats(&flutterpi.loop_stats.engine_tasks, file);
+	dump_task_source_stats(&flutterpi.loop_stats.io_callbacks, file);
+
+	fprintf(
+		file,
+		"  engine tasks: %" PRIu64 " run in %" PRIu64 " wakeups, max %u per wakeup\n",
+		flutterpi.engine_tasks.n_expired_total,
+		flutterpi.engine_tasks.n_wakeups,
+		flutterpi.engine_tasks.max_expired_per_wakeup
+	);
 
-					break;
-				case SD_EVENT_ARMED:
-					pthread_mutex_unlock(&flutterpi.event_loop_mutex);
-
-					do {
-						fds = const_fds;
-						ok = select(evloop_fd + 1, &fds, &fds, &fds, NULL);
-						if ((ok < 0) && (errno != EINTR)) {
-							perror("[flutter-pi] Could not wait for event loop events. select");
-							return errno;
-						}
-					} while ((ok < 0) && (errno == EINTR));
-					
-					pthread_mutex_lock(&flutterpi.event_loop_mutex);
-						
-					ok = sd_event_wait(flutterpi.event_loop, 0);
-					if (ok < 0) {
-						fprintf(stderr, "[flutter-pi] Could not check for event loop events. sd_event_wait: %s\n", strerror(-ok));
-						return -ok;
-					}
+	fprintf(
+		file,
+		"  slow callbacks (> %.3fms): %" PRIu64 "\n",
+		flutterpi.loop_stats.slow_callback_threshold_ns / 1000000.0,
+		atomic_load_explicit(&flutterpi.loop_stats.n_slow_callbacks, memory_order_relaxed)
+	);
 
-					break;
-				case SD_EVENT_PENDING:
-					ok = sd_event_dispatch(flutterpi.event_loop);
-					if (ok < 0) {
-						fprintf(stderr, "[flutter-pi] Could not dispatch event loop events. sd_event_dispatch: %s\n", strerror(-ok));
-						return -ok;
-					}
+	fprintf(
+		file,
+		"  pointer event batches: %" PRIu64 " with %" PRIu64 " events, max %zu per batch, %" PRIu64 " sent early, capacity %zu\n",
+		flutterpi.input.pointer_event_batch.n_batches,
+		flutterpi.input.pointer_event_batch.n_total_events,
+		flutterpi.input.pointer_event_batch.max_batch_size,
+		flutterpi.input.pointer_event_batch.n_early_flushes,
+		flutterpi.input.pointer_event_batch.size
+	);
 
-					break;
-				case SD_EVENT_FINISHED:
-					break;
-				default:
-					fprintf(stderr, "[flutter-pi] Unhandled event loop state: %d. Aborting\n", state);
-					abort();
-			}
-		} while (state != SD_EVENT_FINISHED);
+	if (flutterpi.input.thread.enabled) {
+		fprintf(
+			file,
+			"  input thread pointer event batches: %" PRIu64 " with %" PRIu64 " events, max %zu per batch, %" PRIu64 " sent early, capacity %zu\n",
+			flutterpi.input.thread.pointer_event_batch.n_batches,
+			flutterpi.input.thread.pointer_event_batch.n_total_events,
+			flutterpi.input.thread.pointer_event_batch.max_batch_size,
+			flutterpi.input.thread.pointer_event_batch.n_early_flushes,
+			flutterpi.input.thread.pointer_event_batch.size
+		);
 
-		pthread_mutex_unlock(&flutterpi.event_loop_mutex);
+		fprintf(
+			file,
+			"  input thread waited for a full queue %" PRIu64 " times\n",
+			atomic_load_explicit(&flutterpi.input.thread.n_queue_full, memory_order_relaxed)
+		);
 	}
 
-	pthread_mutex_destroy(&flutterpi.event_loop_mutex);
-	sd_event_unrefp(&flutterpi.event_loop);
+	latency_histogram_print(&flutterpi.input_latency.input_to_dispatch, file);
+	fprintf(
+		file,
+		"  input without a frame in %" PRIu64 "ms: %" PRIu64 "\n",
+		(uint64_t) (INPUT_LATENCY_MAX_FRAME_DELAY_NS / 1000000),
+		atomic_load_explicit(&flutterpi.input_latency.n_inputs_without_frame, memory_order_relaxed)
+	);
+
+	if (flutterpi.input.resampling.enabled) {
+		fprintf(
+			file,
+			"  input resampling: %" PRIu64 " motion events coalesced, %" PRIu64 " resampled, %" PRIu64 " passed through\n",
+			flutterpi.input.resampling.resampler.n_coalesced,
+			flutterpi.input.resampling.resampler.n_resampled,
+			flutterpi.input.resampling.resampler.n_passed_through
+		);
+	}
+
+	frame_telemetry_print(&flutterpi.frame_telemetry, file);
+	dump_recent_frames(file);
+	compositor_print_stats(file);
 
+	fflush(file);
+}
+
+static int on_dump_loop_stats_signal(sd_event_source *s, const struct signalfd_siginfo *si, void *userdata) {
+	dump_loop_stats(stderr);
 	return 0;
 }
 
-static int on_wakeup_main_loop(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+static void init_task_source_stats(struct task_source_stats *stats, const char *delay_name, const char *duration_name) {
+	latency_histogram_init(&stats->delay, delay_name);
+	latency_histogram_init(&stats->duration, duration_name);
+}
+
+static void init_loop_stats(void) {
+	static const char *lane_names[kPlatformTaskPriorityCount][2] = {
+		[kPlatformTaskPriorityFrame] = {"frame task delay", "frame task duration"},
+		[kPlatformTaskPriorityInput] = {"input task delay", "input task duration"},
+		[kPlatformTaskPriorityEngine] = {"platform task delay", "platform task duration"},
+		[kPlatformTaskPriorityBackground] = {"background task delay", "background task duration"}
+	};
+
+	for (int i = 0; i < kPlatformTaskPriorityCount; i++) {
+		init_task_source_stats(flutterpi.loop_stats.platform_tasks + i, lane_names[i][0], lane_names[i][1]);
+	}
+
+	init_task_source_stats(&flutterpi.loop_stats.timed_platform_tasks, "timed task delay", "timed task duration");
+	init_task_source_stats(&flutterpi.loop_stats.engine_tasks, "engine task delay", "engine task duration");
+	init_task_source_stats(&flutterpi.loop_stats.io_callbacks, "io callback delay", "io callback duration");
+	latency_histogram_init(&flutterpi.loop_stats.wakeup_latency, "main loop wakeup latency");
+
+	atomic_init(&flutterpi.loop_stats.wakeup_signal_time, 0);
+	atomic_init(&flutterpi.loop_stats.n_slow_callbacks, 0);
+	flutterpi.loop_stats.wakeup_time = 0;
+}
+
+/// Called on the main thread when the wakeup eventfd is readable.
+static int on_wakeup_main_loop(int fd) {
+	uint64_t signal_time, latency;
 	uint8_t buffer[8];
 	int ok;
 
 	ok = read(fd, buffer, 8);
-	if (ok < 0) {
+	if ((ok < 0) && (errno != EAGAIN)) {
 		perror("[flutter-pi] Could not read mainloop wakeup userdata. read");
 		return errno;
 	}
 
+	signal_time = atomic_load_explicit(&flutterpi.loop_stats.wakeup_signal_time, memory_order_relaxed);
+	latency = get_monotonic_time_ns() - signal_time;
+
+	latency_histogram_record(&flutterpi.loop_stats.wakeup_latency, latency);
+
+	// clear the flag before draining, so any task posted from now on
+	// (also by the tasks we execute) will signal the eventfd again.
+	atomic_store(&flutterpi.platform_task_wakeup_pending, false);
+
+	collect_posted_engine_tasks();
+	drain_platform_task_queues();
+
 	return 0;
 }
 
-static int init_main_loop(void) {
-	int ok, wakeup_fd;
+static int run_main_loop(void) {
+	struct epoll_event events[8];
+	bool sd_event_pending;
+	int ok, i, n_events, timeout;
 
-	flutterpi.event_loop_thread = pthread_self();
+	while (1) {
+		ok = sd_event_prepare(flutterpi.event_loop);
+		if (ok < 0) {
+			fprintf(stderr, "[flutter-pi] Could not prepare event loop. sd_event_prepare: %s\n", strerror(-ok));
+			return -ok;
+		}
 
-	wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
-	if (wakeup_fd < 0) {
-		perror("[flutter-pi] Could not create fd for waking up the main loop. eventfd");
-		return errno;
-	}
+		sd_event_pending = ok > 0;
 
-	ok = sd_event_new(&flutterpi.event_loop);
+		// sd_event keeps the timers of its own sources in its epoll fd,
+		// and the engine tasks have their own timerfd, so we never need a timeout.
+		update_engine_task_timer();
+		timeout = sd_event_pending ? 0 : -1;
+
+		do {
+			n_events = epoll_wait(flutterpi.epoll_fd, events, sizeof(events) / sizeof(*events), timeout);
+		} while ((n_events < 0) && (errno == EINTR));
+
+		if (n_events < 0) {
+			perror("[flutter-pi] Could not wait for event loop events. epoll_wait");
+			return errno;
+		}
+
+		flutterpi.loop_stats.wakeup_time = get_monotonic_time_ns();
+
+		for (i = 0; i < n_events; i++) {
+			if (events[i].data.fd == flutterpi.wakeup_event_loop_fd) {
+				on_wakeup_main_loop(flutterpi.wakeup_event_loop_fd);
+			} else if (events[i].data.fd == flutterpi.engine_tasks.timerfd) {
+				// just clear the expiration count, the due tasks are run below.
+				read(flutterpi.engine_tasks.timerfd, &(uint64_t) {0}, 8);
+			}
+		}
+
+		run_due_engine_tasks();
+
+		if (!sd_event_pending) {
+			ok = sd_event_wait(flutterpi.event_loop, 0);
+			if (ok < 0) {
+				fprintf(stderr, "[flutter-pi] Could not check for event loop events. sd_event_wait: %s\n", strerror(-ok));
+				return -ok;
+			}
+
+			sd_event_pending = ok > 0;
+		}
+
+		if (sd_event_pending) {
+			ok = sd_event_dispatch(flutterpi.event_loop);
+			if (ok < 0) {
+				fprintf(stderr, "[flutter-pi] Could not dispatch event loop events. sd_event_dispatch: %s\n", strerror(-ok));
+				return -ok;
+			}
+		}
+
+		if (sd_event_get_state(flutterpi.event_loop) == SD_EVENT_FINISHED) {
+			break;
+		}
+	}
+
+	if (flutterpi.loop_stats.dump_on_exit) {
+		dump_loop_stats(stderr);
+	}
+
+	return 0;
+}
+
+/// Destroys the main loop. Must only be called once no other thread
+/// can post tasks to it anymore. (see deinit)
+static void deinit_main_loop(void) {
+	pthread_mutex_destroy(&flutterpi.event_loop_mutex);
+	sd_event_unrefp(&flutterpi.event_loop);
+	close(flutterpi.engine_tasks.timerfd);
+	close(flutterpi.epoll_fd);
+}
+
+static int init_main_loop(void) {
+	sigset_t sigmask;
+	int ok, i, wakeup_fd, epoll_fd, timerfd;
+
+	flutterpi.event_loop_thread = pthread_self();
+
+	wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (wakeup_fd < 0) {
+		perror("[flutter-pi] Could not create fd for waking up the main loop. eventfd");
+		return errno;
+	}
+
+	for (i = 0; i < kPlatformTaskPriorityCount; i++) {
+		ok = mpscq_init(flutterpi.platform_task_queues + i, sizeof(struct platform_task), PLATFORM_TASK_QUEUE_SIZE);
+		if (ok != 0) {
+			fprintf(stderr, "[flutter-pi] Could not create platform task queue. mpscq_init: %s\n", strerror(ok));
+			goto fail_deinit_platform_task_queues;
+		}
+	}
+
+	atomic_init(&flutterpi.platform_task_wakeup_pending, false);
+	init_loop_stats();
+	for (i = 0; i < kPlatformTaskPriorityCount; i++) {
+		flutterpi.overflowed_platform_tasks[i] = NULL;
+		flutterpi.overflowed_platform_tasks_tail[i] = &flutterpi.overflowed_platform_tasks[i];
+		atomic_init(flutterpi.platform_task_lane_overflowed + i, false);
+	}
+
+	ok = mpscq_init(&flutterpi.engine_tasks.posted, sizeof(struct engine_task), ENGINE_TASK_QUEUE_SIZE);
+	if (ok != 0) {
+		fprintf(stderr, "[flutter-pi] Could not create engine task queue. mpscq_init: %s\n", strerror(ok));
+		goto fail_deinit_platform_task_queues;
+	}
+
+	flutterpi.engine_tasks.heap = NULL;
+	flutterpi.engine_tasks.heap_length = 0;
+	flutterpi.engine_tasks.heap_size = 0;
+	flutterpi.engine_tasks.next_sequence = 0;
+	flutterpi.engine_tasks.overflowed = NULL;
+	flutterpi.engine_tasks.overflowed_tail = &flutterpi.engine_tasks.overflowed;
+	atomic_init(&flutterpi.engine_tasks.has_overflowed, false);
+
+	timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (timerfd < 0) {
+		perror("[flutter-pi] Could not create engine task timer. timerfd_create");
+		ok = errno;
+		goto fail_deinit_engine_task_queue;
+	}
+
+	flutterpi.engine_tasks.timerfd = timerfd;
+	flutterpi.engine_tasks.timer_target_time = 0;
+
+	ok = sd_event_new(&flutterpi.event_loop);
 	if (ok < 0) {
 		fprintf(stderr, "[flutter-pi] Could not create main event loop. sd_event_new: %s\n", strerror(-ok));
-		return -ok;
+		ok = -ok;
+		goto fail_close_timerfd;
 	}
 
-	ok = sd_event_add_io(
-		flutterpi.event_loop,
-		NULL,
-		wakeup_fd,
-		EPOLLIN,
-		on_wakeup_main_loop,
-		NULL
-	);
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		perror("[flutter-pi] Could not create main loop epoll instance. epoll_create1");
+		ok = errno;
+		goto fail_unref_event_loop;
+	}
+
+	ok = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wakeup_fd, &(struct epoll_event) {
+		.events = EPOLLIN,
+		.data.fd = wakeup_fd
+	});
 	if (ok < 0) {
-		fprintf(stderr, "[flutter-pi] Error adding wakeup callback to main loop. sd_event_add_io: %s\n", strerror(-ok));
-		sd_event_unrefp(&flutterpi.event_loop);
-		close(wakeup_fd);
-		return -ok;
+		perror("[flutter-pi] Error adding wakeup fd to main loop. epoll_ctl");
+		ok = errno;
+		goto fail_close_epoll_fd;
+	}
+
+	ok = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timerfd, &(struct epoll_event) {
+		.events = EPOLLIN,
+		.data.fd = timerfd
+	});
+	if (ok < 0) {
+		perror("[flutter-pi] Error adding engine task timer to main loop. epoll_ctl");
+		ok = errno;
+		goto fail_close_epoll_fd;
+	}
+
+	ok = sd_event_get_fd(flutterpi.event_loop);
+	if (ok < 0) {
+		fprintf(stderr, "[flutter-pi] Could not get fd for main event loop. sd_event_get_fd: %s\n", strerror(-ok));
+		ok = -ok;
+		goto fail_close_epoll_fd;
+	}
+
+	ok = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ok, &(struct epoll_event) {
+		.events = EPOLLIN,
+		.data.fd = ok
+	});
+	if (ok < 0) {
+		perror("[flutter-pi] Error adding sd_event fd to main loop. epoll_ctl");
+		ok = errno;
+		goto fail_close_epoll_fd;
+	}
+
+	// Dump the event loop statistics on SIGUSR1. The signal needs to be blocked
+	// for sd_event to receive it. Threads spawned later inherit the signal mask.
+	sigemptyset(&sigmask);
+	sigaddset(&sigmask, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &sigmask, NULL);
+
+	ok = sd_event_add_signal(flutterpi.event_loop, NULL, SIGUSR1, on_dump_loop_stats_signal, NULL);
+	if (ok < 0) {
+		fprintf(stderr, "[flutter-pi] Could not add SIGUSR1 handler to main loop. sd_event_add_signal: %s\n", strerror(-ok));
+		ok = -ok;
+		goto fail_close_epoll_fd;
 	}
 
 	flutterpi.wakeup_event_loop_fd = wakeup_fd;
+	flutterpi.epoll_fd = epoll_fd;
 
 	return 0;
+
+
+	fail_close_epoll_fd:
+	close(epoll_fd);
+
+	fail_unref_event_loop:
+	sd_event_unrefp(&flutterpi.event_loop);
+
+	fail_close_timerfd:
+	close(timerfd);
+
+	fail_deinit_engine_task_queue:
+	mpscq_deinit(&flutterpi.engine_tasks.posted);
+
+	fail_deinit_platform_task_queues:
+	while (i--) {
+		mpscq_deinit(flutterpi.platform_task_queues + i);
+	}
+
+	close(wakeup_fd);
+	return ok;
 }
 
 /**************************
  * DISPLAY INITIALIZATION *
  **************************/
+static uint64_t get_mode_refresh_period_ns(const drmModeModeInfo *mode) {
+	// mode->vrefresh is rounded to whole Hz, so calculate the exact
+	// refresh period from the pixel clock if we can.
+	if (mode->clock && mode->htotal && mode->vtotal) {
+		return (uint64_t) (1000000000.0 / mode_get_vrefresh(mode));
+	}
+
+	return 1000000000ull / mode->vrefresh;
+}
+
+/// Called on the main thread when the KMS commit thread applied (or failed to apply)
+/// the mode switch_display_mode requested. Only now the display actually uses the new
+/// mode, so everything that depends on the refresh rate is reset here.
+static void on_display_mode_switched(int result, void *userdata) {
+	const drmModeModeInfo *mode;
+
+	mode = userdata;
+
+	if (result == ECANCELED) {
+		// a newer mode switch replaced this one.
+		return;
+	} else if (result != 0) {
+		fprintf(stderr, "[flutter-pi] Could not switch display mode to %ux%u@%u: %s\n", mode->hdisplay, mode->vdisplay, mode->vrefresh, strerror(result));
+
+		// The display still uses the mode it had before.
+		if (flutterpi.idle.target_mode == mode) {
+			flutterpi.idle.target_mode = flutterpi.idle.is_idle ? flutterpi.idle.idle_mode : flutterpi.idle.active_mode;
+		}
+		return;
+	}
+
+	flutterpi.display.refresh_rate = mode->vrefresh;
+	vsync_estimator_init(&flutterpi.drm.vsync_estimator, get_mode_refresh_period_ns(mode));
+	flutterpi.idle.is_idle = mode == flutterpi.idle.idle_mode;
+}
+
+/// Asks the compositor to switch the display to the given mode.
+/// on_display_mode_switched is called once the switch was applied.
+static int switch_display_mode(const drmModeModeInfo *mode) {
+	int ok;
+
+	ok = compositor_set_mode(mode, on_display_mode_switched, (void*) mode);
+	if (ok != 0) {
+		fprintf(stderr, "[flutter-pi] Could not switch display mode. compositor_set_mode: %s\n", strerror(ok));
+		return ok;
+	}
+
+	flutterpi.idle.target_mode = mode;
+
+	return 0;
+}
+
+static void arm_idle_timer(uint64_t target_time_ns) {
+	sd_event_source_set_time(flutterpi.idle.timer, target_time_ns / 1000);
+	sd_event_source_set_enabled(flutterpi.idle.timer, SD_EVENT_ONESHOT);
+}
+
+static void exit_idle_mode(void) {
+	if (flutterpi.idle.target_mode == flutterpi.idle.active_mode) {
+		return;
+	}
+
+	switch_display_mode(flutterpi.idle.active_mode);
+
+	arm_idle_timer(flutterpi.idle.last_activity_time + flutterpi.idle.timeout_ns);
+}
+
+/// Called on the main thread when nothing was drawn for --idle-timeout.
+static int on_idle_timer(sd_event_source *s, uint64_t usec, void *userdata) {
+	uint64_t now;
+
+	now = get_monotonic_time_ns();
+
+	if (now < flutterpi.idle.last_activity_time + flutterpi.idle.timeout_ns) {
+		// there was some activity since the timer was armed.
+		arm_idle_timer(flutterpi.idle.last_activity_time + flutterpi.idle.timeout_ns);
+		return 0;
+	}
+
+	if (flutterpi.idle.target_mode != flutterpi.idle.idle_mode) {
+		switch_display_mode(flutterpi.idle.idle_mode);
+	}
+
+	return 0;
+}
+
+/// Called on the main thread for every user input event.
+static void on_idle_input_activity(void) {
+	if (flutterpi.idle.idle_mode == NULL) {
+		return;
+	}
+
+	flutterpi.idle.last_activity_time = get_monotonic_time_ns();
+
+	// switch back right away, so the frame that reacts to the input
+	// is already shown at the full refresh rate.
+	exit_idle_mode();
+}
+
+/// Called on the main thread for every page flip.
+static void on_idle_flip_activity(uint64_t flip_time) {
+	uint64_t idle_period_ns;
+
+	if (flutterpi.idle.idle_mode == NULL) {
+		return;
+	}
+
+	flutterpi.idle.last_activity_time = get_monotonic_time_ns();
+
+	// A single frame while idle (a clock ticking, for example) is fine at the
+	// low refresh rate. But if frames come back-to-back, something is animating.
+	if (flutterpi.idle.is_idle) {
+		idle_period_ns = get_mode_refresh_period_ns(flutterpi.idle.idle_mode);
+		if (flip_time - flutterpi.idle.last_flip_time < 2 * idle_period_ns) {
+			exit_idle_mode();
+		}
+	}
+
+	flutterpi.idle.last_flip_time = flip_time;
+}
+
+/// Finds the mode to use while idle and adds the idle timer.
+/// Must be called on the main thread.
+static int init_idle_mode(const drmModeModeInfo *active_mode) {
+	const drmModeModeInfo *mode_iter, *idle_mode;
+	int ok;
+
+	flutterpi.idle.active_mode = active_mode;
+	flutterpi.idle.idle_mode = NULL;
+	flutterpi.idle.target_mode = active_mode;
+	flutterpi.idle.is_idle = false;
+	flutterpi.idle.last_activity_time = get_monotonic_time_ns();
+	flutterpi.idle.last_flip_time = 0;
+	flutterpi.idle.timer = NULL;
+
+	if (flutterpi.idle.refresh_rate == 0) {
+		return 0;
+	}
+
+	if (!flutterpi.drm.drmdev->supports_atomic_modesetting) {
+		fprintf(stderr, "[flutter-pi] Switching the refresh rate when idle needs atomic modesetting. --idle-refresh-rate will be ignored.\n");
+		return 0;
+	}
+
+	// Find the mode with the same resolution and scanout type whose
+	// refresh rate is lower than the active one and closest to the requested one.
+	idle_mode = NULL;
+	for_each_mode_in_connector(flutterpi.drm.drmdev->selected_connector, mode_iter) {
+		if ((mode_iter->hdisplay != active_mode->hdisplay) ||
+			(mode_iter->vdisplay != active_mode->vdisplay) ||
+			((mode_iter->flags & DRM_MODE_FLAG_INTERLACE) != (active_mode->flags & DRM_MODE_FLAG_INTERLACE)) ||
+			(mode_iter->vrefresh >= active_mode->vrefresh)) {
+			continue;
+		}
+
+		if ((idle_mode == NULL) ||
+			(abs((int) mode_iter->vrefresh - flutterpi.idle.refresh_rate) < abs((int) idle_mode->vrefresh - flutterpi.idle.refresh_rate))) {
+			idle_mode = mode_iter;
+		}
+	}
+
+	if (idle_mode == NULL) {
+		fprintf(stderr, "[flutter-pi] Display has no mode with a lower refresh rate than %uHz. --idle-refresh-rate will be ignored.\n", active_mode->vrefresh);
+		return 0;
+	}
+
+	pthread_mutex_lock(&flutterpi.event_loop_mutex);
+	ok = sd_event_add_time(
+		flutterpi.event_loop,
+		&flutterpi.idle.timer,
+		CLOCK_MONOTONIC,
+		(flutterpi.idle.last_activity_time + flutterpi.idle.timeout_ns) / 1000,
+		1000,
+		on_idle_timer,
+		NULL
+	);
+	pthread_mutex_unlock(&flutterpi.event_loop_mutex);
+	if (ok < 0) {
+		fprintf(stderr, "[flutter-pi] Could not add idle timer to event loop. sd_event_add_time: %s\n", strerror(-ok));
+		return -ok;
+	}
+
+	flutterpi.idle.idle_mode = idle_mode;
+
+	printf("[flutter-pi] Switching to %uHz after %.1fs without drawing.\n", idle_mode->vrefresh, flutterpi.idle.timeout_ns / 1000000000.0);
+
+	return 0;
+}
+
 /// Called on the main thread when a pageflip ocurred.
+/// userdata is the number of frames the flip completes, or NULL for simulated page flips,
+/// which complete one frame each.
 void on_pageflip_event(
 	int fd,
 	unsigned int frame,
@@ -1057,61 +2246,199 @@ void on_pageflip_event(
 	unsigned int usec,
 	void *userdata
 ) {
-	FlutterEngineResult result;
-	struct frame presented_frame, *peek;
+	struct frame_timings commit_timings = {0};
+	struct frame presented_frame;
+	uint64_t ns, next_ns, dropped_input_time;
+	unsigned int n_frames;
 	int ok;
 
 	flutterpi.flutter.libflutter_engine.FlutterEngineTraceEventInstant("pageflip");
 
+	n_frames = userdata != NULL ? (uintptr_t) userdata : 1;
+
+	// Let the compositor know first, so it can commit the next frame
+	// (if it's already waiting for this flip) as soon as possible.
+	ok = compositor_on_page_flip(sec, usec, userdata == NULL, &commit_timings);
+	if (ok != 0) {
+		fprintf(stderr, "[flutter-pi] Error notifying compositor about page flip. compositor_on_page_flip: %s\n", strerror(ok));
+	}
+
 	cqueue_lock(&flutterpi.frame_queue);
-	
+
+	// If the compositor merged frames into one commit, only the newest one
+	// was actually shown. The others were dropped.
+	// The input of the dropped frames is shown by the newest frame.
+	dropped_input_time = 0;
+	for (; n_frames > 1; n_frames--) {
+		ok = cqueue_try_dequeue_locked(&flutterpi.frame_queue, &presented_frame);
+		if (ok != 0) {
+			break;
+		}
+
+		if (presented_frame.timings.input_time && !dropped_input_time) {
+			dropped_input_time = presented_frame.timings.input_time;
+		}
+
+		frame_telemetry_add_dropped_frame(&flutterpi.frame_telemetry);
+	}
+
 	ok = cqueue_try_dequeue_locked(&flutterpi.frame_queue, &presented_frame);
 	if (ok != 0) {
 		fprintf(stderr, "[flutter-pi] Could not dequeue completed frame from frame queue: %s\n", strerror(ok));
-		goto fail_unlock_frame_queue;
+		cqueue_unlock(&flutterpi.frame_queue);
+		return;
 	}
 
-	ok = cqueue_peek_locked(&flutterpi.frame_queue, (void**) &peek);
-	if (ok == EAGAIN) {
-		// no frame queued after the one that was completed right now.
-		// do nothing here.
-	} else if (ok != 0) {
-		fprintf(stderr, "[flutter-pi] Could not get frame queue peek. cqueue_peek_locked: %s\n", strerror(ok));
-		goto fail_unlock_frame_queue;
-	} else {
-		if (peek->state == kFramePending) {
-			uint64_t ns = (sec * 1000000000ll) + (usec * 1000ll);
-
-			result = flutterpi.flutter.libflutter_engine.FlutterEngineOnVsync(
-				flutterpi.flutter.engine,
-				peek->baton,
-				ns,
-				ns + (1000000000ll / flutterpi.display.refresh_rate)
-			);
-			if (result != kSuccess) {
-				fprintf(stderr, "[flutter-pi] Could not reply to frame request. FlutterEngineOnVsync: %s\n", FLUTTER_RESULT_TO_STRING(result));
-				goto fail_unlock_frame_queue;
-			}
+	if (dropped_input_time) {
+		presented_frame.timings.input_time = dropped_input_time;
+	}
 
-			peek->state = kFrameRendering;
-		} else {
-			fprintf(stderr, "[flutter-pi] frame queue in inconsistent state. aborting\n");
-			abort();
-		}
+	presented_frame.timings.present_time = commit_timings.present_time;
+	presented_frame.timings.commit_time = commit_timings.commit_time;
+	presented_frame.timings.flip_time = (sec * 1000000000ull) + (usec * 1000ull);
+
+	// Now that one frame less is in flight, the next pending frame
+	// (if there's any) can start rendering.
+	ok = vsync_estimator_predict(
+		&flutterpi.drm.vsync_estimator,
+		flutterpi.flutter.libflutter_engine.FlutterEngineGetCurrentTime(),
+		&ns,
+		&next_ns
+	);
+	if (ok != 0) {
+		ns = (sec * 1000000000ll) + (usec * 1000ll);
+		next_ns = ns + vsync_estimator_get_period_ns(&flutterpi.drm.vsync_estimator);
 	}
 
+	reply_to_pending_frames_locked(ns, next_ns);
+
 	cqueue_unlock(&flutterpi.frame_queue);
 
-	ok = compositor_on_page_flip(sec, usec);
-	if (ok != 0) {
-		fprintf(stderr, "[flutter-pi] Error notifying compositor about page flip. compositor_on_page_flip: %s\n", strerror(ok));
+	frame_telemetry_add_frame(
+		&flutterpi.frame_telemetry,
+		&presented_frame.timings,
+		vsync_estimator_get_period_ns(&flutterpi.drm.vsync_estimator)
+	);
+
+	on_idle_flip_activity(presented_frame.timings.flip_time);
+}
+
+/// Called on the main thread when a real (not simulated) pageflip ocurred.
+static void on_drm_pageflip_event(
+	int fd,
+	unsigned int frame,
+	unsigned int sec,
+	unsigned int usec,
+	void *userdata
+) {
+	vsync_estimator_add_vblank(&flutterpi.drm.vsync_estimator, frame, (sec * 1000000000ull) + (usec * 1000ull));
+
+	on_pageflip_event(fd, frame, sec, usec, userdata);
+}
+
+static int arm_simulated_vblank_timer(uint64_t target_time) {
+	struct itimerspec spec;
+	int ok;
+
+	// an all-zero it_value would disarm the timer.
+	if (target_time == 0) {
+		target_time = 1;
 	}
 
-	return;
+	spec = (struct itimerspec) {
+		.it_interval = {0},
+		.it_value = {
+			.tv_sec = target_time / 1000000000ull,
+			.tv_nsec = target_time % 1000000000ull
+		}
+	};
+
+	ok = timerfd_settime(flutterpi.drm.simulated_vblank.timerfd, TFD_TIMER_ABSTIME, &spec, NULL);
+	if (ok < 0) {
+		perror("[flutter-pi] Could not arm simulated vblank timer. timerfd_settime");
+		return errno;
+	}
 
+	return 0;
+}
+
+/// Called on the main thread when the simulated vblank timer fired.
+static int on_simulated_vblank(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+	uint64_t expirations, flip_time;
+	int ok;
+
+	ok = read(fd, &expirations, sizeof(expirations));
+	if ((ok < 0) && (errno != EAGAIN)) {
+		perror("[flutter-pi] Could not read simulated vblank timer. read");
+		return errno;
+	}
+
+	if (flutterpi.drm.simulated_vblank.n_pending == 0) {
+		return 0;
+	}
+
+	flip_time = flutterpi.drm.simulated_vblank.next_flip_time;
+	flutterpi.drm.simulated_vblank.last_flip_time = flip_time;
+	flutterpi.drm.simulated_vblank.n_pending--;
+
+	// If more frames were committed in the meantime, flip them
+	// at the following vblanks, one per refresh period.
+	if (flutterpi.drm.simulated_vblank.n_pending > 0) {
+		flutterpi.drm.simulated_vblank.next_flip_time = flip_time + vsync_estimator_get_period_ns(&flutterpi.drm.vsync_estimator);
+		arm_simulated_vblank_timer(flutterpi.drm.simulated_vblank.next_flip_time);
+	}
+
+	on_pageflip_event(flutterpi.drm.drmdev->fd, 0, flip_time / 1000000000ull, (flip_time % 1000000000ull) / 1000, NULL);
+
+	return 0;
+}
+
+int flutterpi_schedule_simulated_page_flip(
+	uint64_t commit_time,
+	bool commit_waited_for_vblank
+) {
+	uint64_t period, last_vblank, next_vblank, flip_time;
+	int ok;
+
+	period = vsync_estimator_get_period_ns(&flutterpi.drm.vsync_estimator);
+
+	if (commit_waited_for_vblank) {
+		// The commit returned right after the vblank that put the frame on screen,
+		// so it's as good as a page flip timestamp. We don't know the real vblank
+		// sequence number though, so let the estimator count the refresh periods.
+		vsync_estimator_add_vblank_timestamp(&flutterpi.drm.vsync_estimator, commit_time);
+	}
+
+	ok = vsync_estimator_predict(&flutterpi.drm.vsync_estimator, commit_time, &last_vblank, &next_vblank);
+	if (ok == 0) {
+		// phase-lock to the estimated vblanks. If the commit waited for the vblank,
+		// the frame was put on screen at the vblank that just happened.
+		if (commit_waited_for_vblank && (commit_time - last_vblank < period / 2)) {
+			flip_time = last_vblank;
+		} else {
+			flip_time = next_vblank;
+		}
+	} else {
+		// We don't know the phase of the vblanks (yet), just pace at the refresh rate.
+		flip_time = commit_waited_for_vblank ? commit_time : commit_time + period;
+	}
+
+	// never report more than one page flip per refresh period.
+	if (flip_time < flutterpi.drm.simulated_vblank.last_flip_time + period / 2) {
+		flip_time = flutterpi.drm.simulated_vblank.last_flip_time + period;
+	}
+
+	flutterpi.drm.simulated_vblank.n_pending++;
+	if (flutterpi.drm.simulated_vblank.n_pending == 1) {
+		flutterpi.drm.simulated_vblank.next_flip_time = flip_time;
+		ok = arm_simulated_vblank_timer(flip_time);
+		if (ok != 0) {
+			flutterpi.drm.simulated_vblank.n_pending--;
+			return ok;
+		}
+	}
 
-	fail_unlock_frame_queue:
-	cqueue_unlock(&flutterpi.frame_queue);
+	return 0;
 }
 
 static int on_drm_fd_ready(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
@@ -1126,6 +2453,65 @@ static int on_drm_fd_ready(sd_event_source *s, int fd, uint32_t revents, void *u
 	return 0;
 }
 
+/// Get the transformation that rotates the flutter view clockwise by rotation degrees
+/// (0, 90, 180 or 270) so it fills a target that's width x height pixels large.
+static FlutterTransformation get_view_rotation_transformation(int rotation, int width, int height) {
+	FlutterTransformation transform;
+
+	if (rotation == 90) {
+		transform = FLUTTER_ROTZ_TRANSFORMATION(90);
+		transform.transX = width;
+	} else if (rotation == 180) {
+		transform = FLUTTER_ROTZ_TRANSFORMATION(180);
+		transform.transX = width;
+		transform.transY = height;
+	} else if (rotation == 270) {
+		transform = FLUTTER_ROTZ_TRANSFORMATION(270);
+		transform.transY = height;
+	} else {
+		transform = FLUTTER_TRANSLATION_TRANSFORMATION(0, 0);
+	}
+
+	return transform;
+}
+
+/// Publishes the parts of flutterpi.view and flutterpi.display the input processing
+/// needs, so the input thread never reads them while the main thread updates them.
+/// Called on the main thread, which is the only writer.
+static void publish_input_view_geometry(void) {
+	unsigned int sequence;
+
+	sequence = atomic_load_explicit(&flutterpi.input.view_geometry.sequence, memory_order_relaxed);
+
+	// an odd sequence number tells the readers an update is in progress.
+	atomic_store_explicit(&flutterpi.input.view_geometry.sequence, sequence + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	flutterpi.input.view_geometry.geometry = (struct input_view_geometry) {
+		.display_to_view_transform = flutterpi.view.display_to_view_transform,
+		.rotation = flutterpi.view.rotation,
+		.display_width = flutterpi.display.width,
+		.display_height = flutterpi.display.height
+	};
+
+	atomic_store_explicit(&flutterpi.input.view_geometry.sequence, sequence + 2, memory_order_release);
+}
+
+/// Reads a consistent copy of the view geometry published by publish_input_view_geometry.
+/// Can be called on any thread.
+static void read_input_view_geometry(struct input_view_geometry *geometry_out) {
+	unsigned int sequence_before, sequence_after;
+
+	do {
+		sequence_before = atomic_load_explicit(&flutterpi.input.view_geometry.sequence, memory_order_acquire);
+
+		*geometry_out = flutterpi.input.view_geometry.geometry;
+
+		atomic_thread_fence(memory_order_acquire);
+		sequence_after = atomic_load_explicit(&flutterpi.input.view_geometry.sequence, memory_order_relaxed);
+	} while ((sequence_before & 1) || (sequence_before != sequence_after));
+}
+
 int flutterpi_fill_view_properties(
 	bool has_orientation,
 	enum device_orientation orientation,
@@ -1171,56 +2557,407 @@ int flutterpi_fill_view_properties(
 		}
 	}
 
-	if ((flutterpi.view.rotation <= 45) || ((flutterpi.view.rotation >= 135) && (flutterpi.view.rotation <= 225)) || (flutterpi.view.rotation >= 315)) {
-		flutterpi.view.width = flutterpi.display.width;
-		flutterpi.view.height = flutterpi.display.height;
-		flutterpi.view.width_mm = flutterpi.display.width_mm;
-		flutterpi.view.height_mm = flutterpi.display.height_mm;
-	} else {
-		flutterpi.view.width = flutterpi.display.height;
-		flutterpi.view.height = flutterpi.display.width;
-		flutterpi.view.width_mm = flutterpi.display.height_mm;
-		flutterpi.view.height_mm = flutterpi.display.width_mm;
+	if ((flutterpi.view.rotation <= 45) || ((flutterpi.view.rotation >= 135) && (flutterpi.view.rotation <= 225)) || (flutterpi.view.rotation >= 315)) {
+		flutterpi.view.width = flutterpi.display.width;
+		flutterpi.view.height = flutterpi.display.height;
+		flutterpi.view.width_mm = flutterpi.display.width_mm;
+		flutterpi.view.height_mm = flutterpi.display.height_mm;
+	} else {
+		flutterpi.view.width = flutterpi.display.height;
+		flutterpi.view.height = flutterpi.display.width;
+		flutterpi.view.width_mm = flutterpi.display.height_mm;
+		flutterpi.view.height_mm = flutterpi.display.width_mm;
+	}
+
+	if (flutterpi.view.rotation == 0) {
+		flutterpi.view.view_to_display_transform = FLUTTER_TRANSLATION_TRANSFORMATION(0, 0);
+
+		flutterpi.view.display_to_view_transform = FLUTTER_TRANSLATION_TRANSFORMATION(0, 0);
+	} else if (flutterpi.view.rotation == 90) {
+		flutterpi.view.view_to_display_transform = FLUTTER_ROTZ_TRANSFORMATION(90);
+		flutterpi.view.view_to_display_transform.transX = flutterpi.display.width;
+
+		flutterpi.view.display_to_view_transform = FLUTTER_ROTZ_TRANSFORMATION(-90);
+		flutterpi.view.display_to_view_transform.transY = flutterpi.display.width;
+	} else if (flutterpi.view.rotation == 180) {
+		flutterpi.view.view_to_display_transform = FLUTTER_ROTZ_TRANSFORMATION(180);
+		flutterpi.view.view_to_display_transform.transX = flutterpi.display.width;
+		flutterpi.view.view_to_display_transform.transY = flutterpi.display.height;
+
+		flutterpi.view.display_to_view_transform = FLUTTER_ROTZ_TRANSFORMATION(-180);
+		flutterpi.view.display_to_view_transform.transX = flutterpi.display.width;
+		flutterpi.view.display_to_view_transform.transY = flutterpi.display.height;
+	} else if (flutterpi.view.rotation == 270) {
+		flutterpi.view.view_to_display_transform = FLUTTER_ROTZ_TRANSFORMATION(270);
+		flutterpi.view.view_to_display_transform.transY = flutterpi.display.height;
+
+		flutterpi.view.display_to_view_transform = FLUTTER_ROTZ_TRANSFORMATION(-270);
+		flutterpi.view.display_to_view_transform.transX = flutterpi.display.height;
+	}
+
+	// The planes rotate the GBM surface by hw_rotation when scanning it out,
+	// flutter only needs to apply what's left of the rotation.
+	flutterpi.view.view_to_surface_transform = get_view_rotation_transformation(
+		(flutterpi.view.rotation - flutterpi.view.hw_rotation + 360) % 360,
+		flutterpi.gbm.width,
+		flutterpi.gbm.height
+	);
+
+	publish_input_view_geometry();
+
+	return 0;
+}
+
+static int load_egl_gl_procs(void) {
+	LOAD_EGL_PROC(flutterpi, getPlatformDisplay);
+	LOAD_EGL_PROC(flutterpi, createPlatformWindowSurface);
+	LOAD_EGL_PROC(flutterpi, createPlatformPixmapSurface);
+	LOAD_EGL_PROC(flutterpi, createDRMImageMESA);
+	LOAD_EGL_PROC(flutterpi, exportDRMImageMESA);
+
+	LOAD_GL_PROC(flutterpi, EGLImageTargetTexture2DOES);
+	LOAD_GL_PROC(flutterpi, EGLImageTargetRenderbufferStorageOES);
+
+	return 0;
+}
+
+/**
+ * @brief Check if the primary plane can scan out the GBM surface rotated by the
+ * rotation of the view, using a DRM_MODE_ATOMIC_TEST_ONLY commit of a dummy buffer.
+ * If it can, flutterpi.view.hw_rotation is set to the view rotation, so flutter can
+ * render unrotated and the display controller does the rotation for free.
+ * 
+ * Must be called after the mode was selected and before the GBM surface is created.
+ */
+static void init_hw_rotation(void) {
+	struct drmdev_atomic_req *req;
+	struct drm_plane *plane;
+	struct gbm_bo *bo;
+	uint32_t fb_id, flags;
+	bool supported;
+	int ok, rotation, width, height;
+
+	flutterpi.view.hw_rotation = 0;
+
+	rotation = flutterpi.view.rotation;
+	if (((rotation != 90) && (rotation != 180) && (rotation != 270)) || !flutterpi.drm.drmdev->supports_atomic_modesetting) {
+		return;
+	}
+
+	if ((rotation == 90) || (rotation == 270)) {
+		width = flutterpi.display.height;
+		height = flutterpi.display.width;
+	} else {
+		width = flutterpi.display.width;
+		height = flutterpi.display.height;
+	}
+
+	ok = drmdev_new_atomic_req(flutterpi.drm.drmdev, &req);
+	if (ok != 0) {
+		return;
+	}
+
+	for_each_unreserved_plane_in_atomic_req(req, plane) {
+		if (plane->type == DRM_PLANE_TYPE_PRIMARY) {
+			break;
+		}
+	}
+	if (plane == NULL) {
+		goto fail_destroy_req;
+	}
+
+	ok = drmdev_plane_supports_setting_rotation_value(flutterpi.drm.drmdev, plane->plane->plane_id, DRM_ROTATION_FROM_ANGLE(rotation), &supported);
+	if ((ok != 0) || !supported) {
+		goto fail_destroy_req;
+	}
+
+	drmdev_atomic_req_reserve_plane(req, plane);
+
+	bo = gbm_bo_create(flutterpi.gbm.device, width, height, flutterpi.gbm.format, GBM_BO_USE_SCANOUT);
+	if (bo == NULL) {
+		goto fail_destroy_req;
+	}
+
+	ok = drmModeAddFB2(
+		flutterpi.drm.drmdev->fd,
+		width,
+		height,
+		flutterpi.gbm.format,
+		(uint32_t[4]) {gbm_bo_get_handle(bo).u32, 0, 0, 0},
+		(uint32_t[4]) {gbm_bo_get_stride(bo), 0, 0, 0},
+		(uint32_t[4]) {0, 0, 0, 0},
+		&fb_id,
+		0
+	);
+	if (ok < 0) {
+		goto fail_destroy_bo;
+	}
+
+	flags = 0;
+	ok = drmdev_atomic_req_put_modeset_props(req, &flags);
+	if (ok != 0) {
+		goto fail_rm_fb;
+	}
+
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPropertyFbId, fb_id);
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPropertyCrtcId, flutterpi.drm.drmdev->selected_crtc->crtc->crtc_id);
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPropertySrcX, 0);
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPropertySrcY, 0);
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPropertySrcW, ((uint16_t) width) << 16);
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPropertySrcH, ((uint16_t) height) << 16);
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPropertyCrtcX, 0);
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPropertyCrtcY, 0);
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPropertyCrtcW, flutterpi.display.width);
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPropertyCrtcH, flutterpi.display.height);
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPropertyRotation, DRM_ROTATION_FROM_ANGLE(rotation));
+
+	// other planes might still be showing something (the console for example)
+	for_each_unreserved_plane_in_atomic_req(req, plane) {
+		if ((plane->type == DRM_PLANE_TYPE_PRIMARY) || (plane->type == DRM_PLANE_TYPE_OVERLAY)) {
+			drmdev_atomic_req_put_plane_prop(req, plane, kDrmPropertyFbId, 0);
+			drmdev_atomic_req_put_plane_prop(req, plane, kDrmPropertyCrtcId, 0);
+		}
+	}
+
+	ok = drmdev_atomic_req_commit(req, flags | DRM_MODE_ATOMIC_TEST_ONLY, NULL);
+	if (ok == 0) {
+		flutterpi.view.hw_rotation = rotation;
+		printf("[flutter-pi] Rotating the display by %d degrees using the display controller.\n", rotation);
+	}
+
+	fail_rm_fb:
+	drmModeRmFB(flutterpi.drm.drmdev->fd, fb_id);
+
+	fail_destroy_bo:
+	gbm_bo_destroy(bo);
+
+	fail_destroy_req:
+	drmdev_destroy_atomic_req(req);
+}
+
+static int init_gbm_and_egl(void) {
+	EGLint egl_error;
+	int ok;
+
+	/**********************
+	 * GBM INITIALIZATION *
+	 **********************/
+	flutterpi.gbm.device = gbm_create_device(flutterpi.drm.drmdev->fd);
+	flutterpi.gbm.format = DRM_FORMAT_ARGB8888;
+	flutterpi.gbm.surface = NULL;
+	flutterpi.gbm.modifier = DRM_FORMAT_MOD_LINEAR;
+
+	// resolve the rotation of the view, so we know if the planes should rotate it.
+	flutterpi_fill_view_properties(false, 0, false, 0);
+	init_hw_rotation();
+
+	if ((flutterpi.view.hw_rotation == 90) || (flutterpi.view.hw_rotation == 270)) {
+		flutterpi.gbm.width = flutterpi.display.height;
+		flutterpi.gbm.height = flutterpi.display.width;
+	} else {
+		flutterpi.gbm.width = flutterpi.display.width;
+		flutterpi.gbm.height = flutterpi.display.height;
+	}
+
+	flutterpi.gbm.surface = gbm_surface_create_with_modifiers(flutterpi.gbm.device, flutterpi.gbm.width, flutterpi.gbm.height, flutterpi.gbm.format, &flutterpi.gbm.modifier, 1);
+	if (flutterpi.gbm.surface == NULL) {
+		perror("[flutter-pi] Could not create GBM Surface. gbm_surface_create_with_modifiers");
+		return errno;
+	}
+
+	/**********************
+	 * EGL INITIALIZATION *
+	 **********************/
+	EGLint major, minor;
+
+	static const EGLint context_attribs[] = {
+		EGL_CONTEXT_CLIENT_VERSION, 2,
+		EGL_NONE
+	};
+
+	const EGLint config_attribs[] = {
+		EGL_SURFACE_TYPE, EGL_WINDOW_BIT,
+		EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
+		EGL_SAMPLES, 0,
+		EGL_NONE
+	};
+
+	const char *egl_exts_client, *egl_exts_dpy, *gl_exts;
+
+	egl_exts_client = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+
+	ok = load_egl_gl_procs();
+	if (ok != 0) {
+		fprintf(stderr, "[flutter-pi] Could not load EGL / GL ES procedure addresses! error: %s\n", strerror(ok));
+		return ok;
+	}
+
+	eglGetError();
+
+#ifdef EGL_KHR_platform_gbm
+	flutterpi.egl.display = flutterpi.egl.getPlatformDisplay(EGL_PLATFORM_GBM_KHR, flutterpi.gbm.device, NULL);
+	if ((egl_error = eglGetError()) != EGL_SUCCESS) {
+		fprintf(stderr, "[flutter-pi] Could not get EGL display! eglGetPlatformDisplay: 0x%08X\n", egl_error);
+		return EIO;
+	}
+#else
+	flutterpi.egl.display = eglGetDisplay((void*) flutterpi.gbm.device);
+	if ((egl_error = eglGetError()) != EGL_SUCCESS) {
+		fprintf(stderr, "[flutter-pi] Could not get EGL display! eglGetDisplay: 0x%08X\n", egl_error);
+		return EIO;
+	}
+#endif
+	
+	eglInitialize(flutterpi.egl.display, &major, &minor);
+	if ((egl_error = eglGetError()) != EGL_SUCCESS) {
+		fprintf(stderr, "[flutter-pi] Failed to initialize EGL! eglInitialize: 0x%08X\n", egl_error);
+		return EIO;
+	}
+
+	egl_exts_dpy = eglQueryString(flutterpi.egl.display, EGL_EXTENSIONS);
+
+	flutterpi.egl.supports_buffer_age = strstr(egl_exts_dpy, "EGL_EXT_buffer_age") != NULL;
+
+	flutterpi.egl.supports_native_fence_sync = false;
+	if (strstr(egl_exts_dpy, "EGL_ANDROID_native_fence_sync") && strstr(egl_exts_dpy, "EGL_KHR_wait_sync")) {
+		flutterpi.egl.createSyncKHR = (PFNEGLCREATESYNCKHRPROC) eglGetProcAddress("eglCreateSyncKHR");
+		flutterpi.egl.destroySyncKHR = (PFNEGLDESTROYSYNCKHRPROC) eglGetProcAddress("eglDestroySyncKHR");
+		flutterpi.egl.waitSyncKHR = (PFNEGLWAITSYNCKHRPROC) eglGetProcAddress("eglWaitSyncKHR");
+		flutterpi.egl.dupNativeFenceFDANDROID = (PFNEGLDUPNATIVEFENCEFDANDROIDPROC) eglGetProcAddress("eglDupNativeFenceFDANDROID");
+
+		flutterpi.egl.supports_native_fence_sync =
+			flutterpi.egl.createSyncKHR &&
+			flutterpi.egl.destroySyncKHR &&
+			flutterpi.egl.waitSyncKHR &&
+			flutterpi.egl.dupNativeFenceFDANDROID;
+	}
+
+	printf("EGL information:\n");
+	printf("  version: %s\n", eglQueryString(flutterpi.egl.display, EGL_VERSION));
+	printf("  vendor: \"%s\"\n", eglQueryString(flutterpi.egl.display, EGL_VENDOR));
+	printf("  client extensions: \"%s\"\n", egl_exts_client);
+	printf("  display extensions: \"%s\"\n", egl_exts_dpy);
+	printf("===================================\n");
+
+	eglBindAPI(EGL_OPENGL_ES_API);
+	if ((egl_error = eglGetError()) != EGL_SUCCESS) {
+		fprintf(stderr, "[flutter-pi] Failed to bind OpenGL ES API! eglBindAPI: 0x%08X\n", egl_error);
+		return EIO;
+	}
+
+	EGLint count = 0, matched = 0;
+	EGLConfig *configs;
+	bool _found_matching_config = false;
+	
+	eglGetConfigs(flutterpi.egl.display, NULL, 0, &count);
+	if ((egl_error = eglGetError()) != EGL_SUCCESS) {
+		fprintf(stderr, "[flutter-pi] Could not get the number of EGL framebuffer configurations. eglGetConfigs: 0x%08X\n", egl_error);
+		return EIO;
+	}
+
+	configs = malloc(count * sizeof(EGLConfig));
+	if (!configs) return ENOMEM;
+
+	eglChooseConfig(flutterpi.egl.display, config_attribs, configs, count, &matched);
+	if ((egl_error = eglGetError()) != EGL_SUCCESS) {
+		fprintf(stderr, "[flutter-pi] Could not query EGL framebuffer configurations with fitting attributes. eglChooseConfig: 0x%08X\n", egl_error);
+		return EIO;
+	}
+
+	if (matched == 0) {
+		fprintf(stderr, "[flutter-pi] No fitting EGL framebuffer configuration found.\n");
+		return EIO;
+	}
+
+	for (int i = 0; i < count; i++) {
+		EGLint native_visual_id;
+
+		eglGetConfigAttrib(flutterpi.egl.display, configs[i], EGL_NATIVE_VISUAL_ID, &native_visual_id);
+		if ((egl_error = eglGetError()) != EGL_SUCCESS) {
+			fprintf(stderr, "[flutter-pi] Could not query native visual ID of EGL config. eglGetConfigAttrib: 0x%08X\n", egl_error);
+			continue;
+		}
+
+		if (native_visual_id == flutterpi.gbm.format) {
+			flutterpi.egl.config = configs[i];
+			_found_matching_config = true;
+			break;
+		}
+	}
+	free(configs);
+
+	if (_found_matching_config == false) {
+		fprintf(stderr, "[flutter-pi] Could not find EGL framebuffer configuration with appropriate attributes & native visual ID.\n");
+		return EIO;
+	}
+
+	/****************************
+	 * OPENGL ES INITIALIZATION *
+	 ****************************/
+	flutterpi.egl.root_context = eglCreateContext(flutterpi.egl.display, flutterpi.egl.config, EGL_NO_CONTEXT, context_attribs);
+	if ((egl_error = eglGetError()) != EGL_SUCCESS) {
+		fprintf(stderr, "[flutter-pi] Could not create OpenGL ES root context. eglCreateContext: 0x%08X\n", egl_error);
+		return EIO;
+	}
+
+	flutterpi.egl.flutter_render_context = eglCreateContext(flutterpi.egl.display, flutterpi.egl.config, flutterpi.egl.root_context, context_attribs);
+	if ((egl_error = eglGetError()) != EGL_SUCCESS) {
+		fprintf(stderr, "[flutter-pi] Could not create OpenGL ES context for flutter rendering. eglCreateContext: 0x%08X\n", egl_error);
+		return EIO;
 	}
 
-	if (flutterpi.view.rotation == 0) {
-		flutterpi.view.view_to_display_transform = FLUTTER_TRANSLATION_TRANSFORMATION(0, 0);
-
-		flutterpi.view.display_to_view_transform = FLUTTER_TRANSLATION_TRANSFORMATION(0, 0);
-	} else if (flutterpi.view.rotation == 90) {
-		flutterpi.view.view_to_display_transform = FLUTTER_ROTZ_TRANSFORMATION(90);
-		flutterpi.view.view_to_display_transform.transX = flutterpi.display.width;
+	flutterpi.egl.flutter_resource_uploading_context = eglCreateContext(flutterpi.egl.display, flutterpi.egl.config, flutterpi.egl.root_context, context_attribs);
+	if ((egl_error = eglGetError()) != EGL_SUCCESS) {
+		fprintf(stderr, "[flutter-pi] Could not create OpenGL ES context for flutter resource uploads. eglCreateContext: 0x%08X\n", egl_error);
+		return EIO;
+	}
 
-		flutterpi.view.display_to_view_transform = FLUTTER_ROTZ_TRANSFORMATION(-90);
-		flutterpi.view.display_to_view_transform.transY = flutterpi.display.width;
-	} else if (flutterpi.view.rotation == 180) {
-		flutterpi.view.view_to_display_transform = FLUTTER_ROTZ_TRANSFORMATION(180);
-		flutterpi.view.view_to_display_transform.transX = flutterpi.display.width;
-		flutterpi.view.view_to_display_transform.transY = flutterpi.display.height;
+	flutterpi.egl.compositor_context = eglCreateContext(flutterpi.egl.display, flutterpi.egl.config, flutterpi.egl.root_context, context_attribs);
+	if ((egl_error = eglGetError()) != EGL_SUCCESS) {
+		fprintf(stderr, "[flutter-pi] Could not create OpenGL ES context for compositor. eglCreateContext: 0x%08X\n", egl_error);
+		return EIO;
+	}
 
-		flutterpi.view.display_to_view_transform = FLUTTER_ROTZ_TRANSFORMATION(-180);
-		flutterpi.view.display_to_view_transform.transX = flutterpi.display.width;
-		flutterpi.view.display_to_view_transform.transY = flutterpi.display.height;
-	} else if (flutterpi.view.rotation == 270) {
-		flutterpi.view.view_to_display_transform = FLUTTER_ROTZ_TRANSFORMATION(270);
-		flutterpi.view.view_to_display_transform.transY = flutterpi.display.height;
+	flutterpi.egl.surface = eglCreateWindowSurface(flutterpi.egl.display, flutterpi.egl.config, (EGLNativeWindowType) flutterpi.gbm.surface, NULL);
+	if ((egl_error = eglGetError()) != EGL_SUCCESS) {
+		fprintf(stderr, "[flutter-pi] Could not create EGL window surface. eglCreateWindowSurface: 0x%08X\n", egl_error);
+		return EIO;
+	}
 
-		flutterpi.view.display_to_view_transform = FLUTTER_ROTZ_TRANSFORMATION(-270);
-		flutterpi.view.display_to_view_transform.transX = flutterpi.display.height;
+	eglMakeCurrent(flutterpi.egl.display, flutterpi.egl.surface, flutterpi.egl.surface, flutterpi.egl.root_context);
+	if ((egl_error = eglGetError()) != EGL_SUCCESS) {
+		fprintf(stderr, "[flutter-pi] Could not make OpenGL ES root context current to get OpenGL information. eglMakeCurrent: 0x%08X\n", egl_error);
+		return EIO;
 	}
 
-	return 0;
-}
+	flutterpi.egl.renderer = (char*) glGetString(GL_RENDERER);
 
-static int load_egl_gl_procs(void) {
-	LOAD_EGL_PROC(flutterpi, getPlatformDisplay);
-	LOAD_EGL_PROC(flutterpi, createPlatformWindowSurface);
-	LOAD_EGL_PROC(flutterpi, createPlatformPixmapSurface);
-	LOAD_EGL_PROC(flutterpi, createDRMImageMESA);
-	LOAD_EGL_PROC(flutterpi, exportDRMImageMESA);
+	gl_exts = (char*) glGetString(GL_EXTENSIONS);
+	printf("OpenGL ES information:\n");
+	printf("  version: \"%s\"\n", glGetString(GL_VERSION));
+	printf("  shading language version: \"%s\"\n", glGetString(GL_SHADING_LANGUAGE_VERSION));
+	printf("  vendor: \"%s\"\n", glGetString(GL_VENDOR));
+	printf("  renderer: \"%s\"\n", flutterpi.egl.renderer);
+	printf("  extensions: \"%s\"\n", gl_exts);
+	printf("===================================\n");
 
-	LOAD_GL_PROC(flutterpi, EGLImageTargetTexture2DOES);
-	LOAD_GL_PROC(flutterpi, EGLImageTargetRenderbufferStorageOES);
+	// it seems that after some Raspbian update, regular users are sometimes no longer allowed
+	//   to use the direct-rendering infrastructure; i.e. the open the devices inside /dev/dri/
+	//   as read-write. flutter-pi must be run as root then.
+	// sometimes it works fine without root, sometimes it doesn't.
+	if (strncmp(flutterpi.egl.renderer, "llvmpipe", sizeof("llvmpipe")-1) == 0) {
+		printf("WARNING: Detected llvmpipe (ie. software rendering) as the OpenGL ES renderer.\n"
+			   "         Check that flutter-pi has permission to use the 3D graphics hardware,\n"
+			   "         or try running it as root.\n"
+			   "         This warning will probably result in a \"failed to set mode\" error\n"
+			   "         later on in the initialization.\n");
+	}
+
+	eglMakeCurrent(flutterpi.egl.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	if ((egl_error = eglGetError()) != EGL_SUCCESS) {
+		fprintf(stderr, "[flutter-pi] Could not clear OpenGL ES context. eglMakeCurrent: 0x%08X\n", egl_error);
+		return EIO;
+	}
 
 	return 0;
 }
@@ -1234,7 +2971,6 @@ static int init_display(void) {
 	const struct drm_crtc *crtc;
 	const drmModeModeInfo *mode, *mode_iter;
 	drmDevicePtr devices[64];
-	EGLint egl_error;
 	int ok, num_devices;
 
 	/**********************
@@ -1338,6 +3074,8 @@ static int init_display(void) {
 	flutterpi.display.height = mode->vdisplay;
 	flutterpi.display.refresh_rate = mode->vrefresh;
 
+	vsync_estimator_init(&flutterpi.drm.vsync_estimator, get_mode_refresh_period_ns(mode));
+
 	if ((flutterpi.display.width_mm == 0) || (flutterpi.display.height_mm == 0)) {
 		fprintf(
 			stderr,
@@ -1437,225 +3175,71 @@ static int init_display(void) {
 
 	memset(&flutterpi.drm.evctx, 0, sizeof(drmEventContext));
 	flutterpi.drm.evctx.version = 4;
-	flutterpi.drm.evctx.page_flip_handler = on_pageflip_event;
+	flutterpi.drm.evctx.page_flip_handler = on_drm_pageflip_event;
 
-	ok = sd_event_add_io(
-		flutterpi.event_loop,
+	ok = flutterpi_sd_event_add_io(
 		&flutterpi.drm.drm_pageflip_event_source,
 		flutterpi.drm.drmdev->fd,
 		EPOLLIN | EPOLLHUP | EPOLLPRI,
 		on_drm_fd_ready,
 		NULL
 	);
-	if (ok < 0) {
-		fprintf(stderr, "[flutter-pi] Could not add DRM pageflip event listener. sd_event_add_io: %s\n", strerror(-ok));
-		return -ok;
-	}
-
-	printf(
-		"===================================\n"
-		"display mode:\n"
-		"  resolution: %u x %u\n"
-		"  refresh rate: %uHz\n"
-		"  physical size: %umm x %umm\n"
-		"  flutter device pixel ratio: %f\n"
-		"===================================\n",
-		flutterpi.display.width, flutterpi.display.height,
-		flutterpi.display.refresh_rate,
-		flutterpi.display.width_mm, flutterpi.display.height_mm,
-		flutterpi.display.pixel_ratio
-	);
-
-	/**********************
-	 * GBM INITIALIZATION *
-	 **********************/
-	flutterpi.gbm.device = gbm_create_device(flutterpi.drm.drmdev->fd);
-	flutterpi.gbm.format = DRM_FORMAT_ARGB8888;
-	flutterpi.gbm.surface = NULL;
-	flutterpi.gbm.modifier = DRM_FORMAT_MOD_LINEAR;
-
-	flutterpi.gbm.surface = gbm_surface_create_with_modifiers(flutterpi.gbm.device, flutterpi.display.width, flutterpi.display.height, flutterpi.gbm.format, &flutterpi.gbm.modifier, 1);
-	if (flutterpi.gbm.surface == NULL) {
-		perror("[flutter-pi] Could not create GBM Surface. gbm_surface_create_with_modifiers");
-		return errno;
-	}
-
-	/**********************
-	 * EGL INITIALIZATION *
-	 **********************/
-	EGLint major, minor;
-
-	static const EGLint context_attribs[] = {
-		EGL_CONTEXT_CLIENT_VERSION, 2,
-		EGL_NONE
-	};
-
-	const EGLint config_attribs[] = {
-		EGL_SURFACE_TYPE, EGL_WINDOW_BIT,
-		EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
-		EGL_SAMPLES, 0,
-		EGL_NONE
-	};
-
-	const char *egl_exts_client, *egl_exts_dpy, *gl_exts;
-
-	egl_exts_client = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
-
-	ok = load_egl_gl_procs();
 	if (ok != 0) {
-		fprintf(stderr, "[flutter-pi] Could not load EGL / GL ES procedure addresses! error: %s\n", strerror(ok));
+		fprintf(stderr, "[flutter-pi] Could not add DRM pageflip event listener. flutterpi_sd_event_add_io: %s\n", strerror(ok));
 		return ok;
 	}
 
-	eglGetError();
-
-#ifdef EGL_KHR_platform_gbm
-	flutterpi.egl.display = flutterpi.egl.getPlatformDisplay(EGL_PLATFORM_GBM_KHR, flutterpi.gbm.device, NULL);
-	if ((egl_error = eglGetError()) != EGL_SUCCESS) {
-		fprintf(stderr, "[flutter-pi] Could not get EGL display! eglGetPlatformDisplay: 0x%08X\n", egl_error);
-		return EIO;
-	}
-#else
-	flutterpi.egl.display = eglGetDisplay((void*) flutterpi.gbm.device);
-	if ((egl_error = eglGetError()) != EGL_SUCCESS) {
-		fprintf(stderr, "[flutter-pi] Could not get EGL display! eglGetDisplay: 0x%08X\n", egl_error);
-		return EIO;
-	}
-#endif
-	
-	eglInitialize(flutterpi.egl.display, &major, &minor);
-	if ((egl_error = eglGetError()) != EGL_SUCCESS) {
-		fprintf(stderr, "[flutter-pi] Failed to initialize EGL! eglInitialize: 0x%08X\n", egl_error);
-		return EIO;
-	}
-
-	egl_exts_dpy = eglQueryString(flutterpi.egl.display, EGL_EXTENSIONS);
-
-	printf("EGL information:\n");
-	printf("  version: %s\n", eglQueryString(flutterpi.egl.display, EGL_VERSION));
-	printf("  vendor: \"%s\"\n", eglQueryString(flutterpi.egl.display, EGL_VENDOR));
-	printf("  client extensions: \"%s\"\n", egl_exts_client);
-	printf("  display extensions: \"%s\"\n", egl_exts_dpy);
-	printf("===================================\n");
-
-	eglBindAPI(EGL_OPENGL_ES_API);
-	if ((egl_error = eglGetError()) != EGL_SUCCESS) {
-		fprintf(stderr, "[flutter-pi] Failed to bind OpenGL ES API! eglBindAPI: 0x%08X\n", egl_error);
-		return EIO;
-	}
-
-	EGLint count = 0, matched = 0;
-	EGLConfig *configs;
-	bool _found_matching_config = false;
-	
-	eglGetConfigs(flutterpi.egl.display, NULL, 0, &count);
-	if ((egl_error = eglGetError()) != EGL_SUCCESS) {
-		fprintf(stderr, "[flutter-pi] Could not get the number of EGL framebuffer configurations. eglGetConfigs: 0x%08X\n", egl_error);
-		return EIO;
-	}
-
-	configs = malloc(count * sizeof(EGLConfig));
-	if (!configs) return ENOMEM;
-
-	eglChooseConfig(flutterpi.egl.display, config_attribs, configs, count, &matched);
-	if ((egl_error = eglGetError()) != EGL_SUCCESS) {
-		fprintf(stderr, "[flutter-pi] Could not query EGL framebuffer configurations with fitting attributes. eglChooseConfig: 0x%08X\n", egl_error);
-		return EIO;
-	}
-
-	if (matched == 0) {
-		fprintf(stderr, "[flutter-pi] No fitting EGL framebuffer configuration found.\n");
-		return EIO;
-	}
-
-	for (int i = 0; i < count; i++) {
-		EGLint native_visual_id;
-
-		eglGetConfigAttrib(flutterpi.egl.display, configs[i], EGL_NATIVE_VISUAL_ID, &native_visual_id);
-		if ((egl_error = eglGetError()) != EGL_SUCCESS) {
-			fprintf(stderr, "[flutter-pi] Could not query native visual ID of EGL config. eglGetConfigAttrib: 0x%08X\n", egl_error);
-			continue;
-		}
-
-		if (native_visual_id == flutterpi.gbm.format) {
-			flutterpi.egl.config = configs[i];
-			_found_matching_config = true;
-			break;
-		}
-	}
-	free(configs);
-
-	if (_found_matching_config == false) {
-		fprintf(stderr, "[flutter-pi] Could not find EGL framebuffer configuration with appropriate attributes & native visual ID.\n");
-		return EIO;
-	}
-
-	/****************************
-	 * OPENGL ES INITIALIZATION *
-	 ****************************/
-	flutterpi.egl.root_context = eglCreateContext(flutterpi.egl.display, flutterpi.egl.config, EGL_NO_CONTEXT, context_attribs);
-	if ((egl_error = eglGetError()) != EGL_SUCCESS) {
-		fprintf(stderr, "[flutter-pi] Could not create OpenGL ES root context. eglCreateContext: 0x%08X\n", egl_error);
-		return EIO;
-	}
-
-	flutterpi.egl.flutter_render_context = eglCreateContext(flutterpi.egl.display, flutterpi.egl.config, flutterpi.egl.root_context, context_attribs);
-	if ((egl_error = eglGetError()) != EGL_SUCCESS) {
-		fprintf(stderr, "[flutter-pi] Could not create OpenGL ES context for flutter rendering. eglCreateContext: 0x%08X\n", egl_error);
-		return EIO;
-	}
-
-	flutterpi.egl.flutter_resource_uploading_context = eglCreateContext(flutterpi.egl.display, flutterpi.egl.config, flutterpi.egl.root_context, context_attribs);
-	if ((egl_error = eglGetError()) != EGL_SUCCESS) {
-		fprintf(stderr, "[flutter-pi] Could not create OpenGL ES context for flutter resource uploads. eglCreateContext: 0x%08X\n", egl_error);
-		return EIO;
-	}
-
-	flutterpi.egl.compositor_context = eglCreateContext(flutterpi.egl.display, flutterpi.egl.config, flutterpi.egl.root_context, context_attribs);
-	if ((egl_error = eglGetError()) != EGL_SUCCESS) {
-		fprintf(stderr, "[flutter-pi] Could not create OpenGL ES context for compositor. eglCreateContext: 0x%08X\n", egl_error);
-		return EIO;
-	}
+	memset(&flutterpi.drm.simulated_vblank, 0, sizeof(flutterpi.drm.simulated_vblank));
 
-	flutterpi.egl.surface = eglCreateWindowSurface(flutterpi.egl.display, flutterpi.egl.config, (EGLNativeWindowType) flutterpi.gbm.surface, NULL);
-	if ((egl_error = eglGetError()) != EGL_SUCCESS) {
-		fprintf(stderr, "[flutter-pi] Could not create EGL window surface. eglCreateWindowSurface: 0x%08X\n", egl_error);
-		return EIO;
+	flutterpi.drm.simulated_vblank.timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (flutterpi.drm.simulated_vblank.timerfd < 0) {
+		perror("[flutter-pi] Could not create simulated vblank timer. timerfd_create");
+		return errno;
 	}
 
-	eglMakeCurrent(flutterpi.egl.display, flutterpi.egl.surface, flutterpi.egl.surface, flutterpi.egl.root_context);
-	if ((egl_error = eglGetError()) != EGL_SUCCESS) {
-		fprintf(stderr, "[flutter-pi] Could not make OpenGL ES root context current to get OpenGL information. eglMakeCurrent: 0x%08X\n", egl_error);
-		return EIO;
+	ok = flutterpi_sd_event_add_io(
+		&flutterpi.drm.simulated_vblank.source,
+		flutterpi.drm.simulated_vblank.timerfd,
+		EPOLLIN,
+		on_simulated_vblank,
+		NULL
+	);
+	if (ok != 0) {
+		fprintf(stderr, "[flutter-pi] Could not add simulated vblank timer to event loop. flutterpi_sd_event_add_io: %s\n", strerror(ok));
+		close(flutterpi.drm.simulated_vblank.timerfd);
+		return ok;
 	}
 
-	flutterpi.egl.renderer = (char*) glGetString(GL_RENDERER);
-
-	gl_exts = (char*) glGetString(GL_EXTENSIONS);
-	printf("OpenGL ES information:\n");
-	printf("  version: \"%s\"\n", glGetString(GL_VERSION));
-	printf("  shading language version: \"%s\"\n", glGetString(GL_SHADING_LANGUAGE_VERSION));
-	printf("  vendor: \"%s\"\n", glGetString(GL_VENDOR));
-	printf("  renderer: \"%s\"\n", flutterpi.egl.renderer);
-	printf("  extensions: \"%s\"\n", gl_exts);
-	printf("===================================\n");
-
-	// it seems that after some Raspbian update, regular users are sometimes no longer allowed
-	//   to use the direct-rendering infrastructure; i.e. the open the devices inside /dev/dri/
-	//   as read-write. flutter-pi must be run as root then.
-	// sometimes it works fine without root, sometimes it doesn't.
-	if (strncmp(flutterpi.egl.renderer, "llvmpipe", sizeof("llvmpipe")-1) == 0) {
-		printf("WARNING: Detected llvmpipe (ie. software rendering) as the OpenGL ES renderer.\n"
-			   "         Check that flutter-pi has permission to use the 3D graphics hardware,\n"
-			   "         or try running it as root.\n"
-			   "         This warning will probably result in a \"failed to set mode\" error\n"
-			   "         later on in the initialization.\n");
+	ok = init_idle_mode(mode);
+	if (ok != 0) {
+		return ok;
 	}
 
-	eglMakeCurrent(flutterpi.egl.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
-	if ((egl_error = eglGetError()) != EGL_SUCCESS) {
-		fprintf(stderr, "[flutter-pi] Could not clear OpenGL ES context. eglMakeCurrent: 0x%08X\n", egl_error);
-		return EIO;
+	printf(
+		"===================================\n"
+		"display mode:\n"
+		"  resolution: %u x %u\n"
+		"  refresh rate: %uHz\n"
+		"  physical size: %umm x %umm\n"
+		"  flutter device pixel ratio: %f\n"
+		"===================================\n",
+		flutterpi.display.width, flutterpi.display.height,
+		flutterpi.display.refresh_rate,
+		flutterpi.display.width_mm, flutterpi.display.height_mm,
+		flutterpi.display.pixel_ratio
+	);
+
+	if (flutterpi.renderer_type == kOpenGLRenderer) {
+		ok = init_gbm_and_egl();
+		if (ok != 0) {
+			return ok;
+		}
+	} else {
+		// The software renderer copies its frames into dumb buffers (see compositor_initialize),
+		// rotating them on the way.
+		flutterpi.view.hw_rotation = 0;
+		flutterpi.gbm.width = flutterpi.display.width;
+		flutterpi.gbm.height = flutterpi.display.height;
 	}
 
 	/// miscellaneous initialization
@@ -1671,6 +3255,15 @@ static int init_display(void) {
 		return ok;
 	}
 
+	ok = frame_telemetry_init(&flutterpi.frame_telemetry);
+	if (ok != 0) {
+		return ok;
+	}
+
+	latency_histogram_init(&flutterpi.input_latency.input_to_dispatch, "input to dispatch latency");
+	atomic_init(&flutterpi.input_latency.pending_input_time, 0);
+	atomic_init(&flutterpi.input_latency.n_inputs_without_frame, 0);
+
 	/// We're starting without any rotation by default.
 	flutterpi_fill_view_properties(false, 0, false, 0);
 
@@ -1767,20 +3360,30 @@ static int init_application(void) {
 	}
 
 	// configure flutter rendering
-	renderer_config = (FlutterRendererConfig) {
-		.type = kOpenGL,
-		.open_gl = {
-			.struct_size = sizeof(FlutterOpenGLRendererConfig),
-			.make_current = on_make_current,
-			.clear_current = on_clear_current,
-			.present = on_present,
-			.fbo_callback = fbo_callback,
-			.make_resource_current = on_make_resource_current,
-			.gl_proc_resolver = proc_resolver,
-			.surface_transformation = on_get_transformation,
-			.gl_external_texture_frame_callback = texreg_gl_external_texture_frame_callback,
-		}
-	};
+	if (flutterpi.renderer_type == kSoftwareRenderer) {
+		renderer_config = (FlutterRendererConfig) {
+			.type = kSoftware,
+			.software = {
+				.struct_size = sizeof(FlutterSoftwareRendererConfig),
+				.surface_present_callback = on_present_software
+			}
+		};
+	} else {
+		renderer_config = (FlutterRendererConfig) {
+			.type = kOpenGL,
+			.open_gl = {
+				.struct_size = sizeof(FlutterOpenGLRendererConfig),
+				.make_current = on_make_current,
+				.clear_current = on_clear_current,
+				.present = on_present,
+				.fbo_callback = fbo_callback,
+				.make_resource_current = on_make_resource_current,
+				.gl_proc_resolver = proc_resolver,
+				.surface_transformation = on_get_transformation,
+				.gl_external_texture_frame_callback = texreg_gl_external_texture_frame_callback,
+			}
+		};
+	}
 
 	// configure the project
 	project_args = (FlutterProjectArgs) {
@@ -1815,7 +3418,9 @@ static int init_application(void) {
 			}
 		},
 		.shutdown_dart_vm_when_done = true,
-		.compositor = &flutter_compositor
+		// The compositor presents OpenGL backing stores, the software renderer
+		// presents its frames using on_present_software instead.
+		.compositor = flutterpi.renderer_type == kOpenGLRenderer ? &flutter_compositor : NULL
 	};
 
 	bool engine_is_aot = libflutter_engine->FlutterEngineRunsAOTCompiledDartCode();
@@ -1843,96 +3448,576 @@ static int init_application(void) {
 		return EINVAL;
 	}
 
-	if (flutterpi.flutter.runtime_mode == kRelease) {
-		aot_source = (FlutterEngineAOTDataSource) {
-			.elf_path = flutterpi.flutter.app_elf_path,
-			.type = kFlutterEngineAOTDataSourceTypeElfPath
-		};
+	if (flutterpi.flutter.runtime_mode == kRelease) {
+		aot_source = (FlutterEngineAOTDataSource) {
+			.elf_path = flutterpi.flutter.app_elf_path,
+			.type = kFlutterEngineAOTDataSourceTypeElfPath
+		};
+
+		engine_result = libflutter_engine->FlutterEngineCreateAOTData(&aot_source, &aot_data);
+		if (engine_result != kSuccess) {
+			fprintf(stderr, "[flutter-pi] Could not load AOT data. FlutterEngineCreateAOTData: %s\n", FLUTTER_RESULT_TO_STRING(engine_result));
+			return EIO;
+		}
+
+		project_args.aot_data = aot_data;
+	}
+
+	// spin up the engine
+	engine_result = libflutter_engine->FlutterEngineRun(FLUTTER_ENGINE_VERSION, &renderer_config, &project_args, NULL, &flutterpi.flutter.engine);
+	if (engine_result != kSuccess) {
+		fprintf(stderr, "[flutter-pi] Could not run the flutter engine. FlutterEngineRun: %s\n", FLUTTER_RESULT_TO_STRING(engine_result));
+		return EINVAL;
+	}
+
+	// update window size
+	engine_result = libflutter_engine->FlutterEngineSendWindowMetricsEvent(
+		flutterpi.flutter.engine,
+		&(FlutterWindowMetricsEvent) {
+			.struct_size = sizeof(FlutterWindowMetricsEvent),
+			.width = flutterpi.view.width,
+			.height = flutterpi.view.height,
+			.pixel_ratio = flutterpi.display.pixel_ratio
+		}
+	);
+	if (engine_result != kSuccess) {
+		fprintf(stderr, "[flutter-pi] Could not send window metrics to flutter engine.\n");
+		return EINVAL;
+	}
+	
+	return 0;
+}
+
+static int on_execute_schedule_exit(void *userdata) {
+	return flutterpi_schedule_exit();
+}
+
+int flutterpi_schedule_exit(void) {
+	int ok;
+
+	if (!runs_platform_tasks_on_current_thread(NULL)) {
+		// sd_event may only be touched on the main thread.
+		return flutterpi_post_platform_task_with_priority(on_execute_schedule_exit, NULL, kPlatformTaskPriorityEngine);
+	}
+	
+	ok = sd_event_exit(flutterpi.event_loop, 0);
+	if (ok < 0) {
+		fprintf(stderr, "[flutter-pi] Could not schedule application exit. sd_event_exit: %s\n", strerror(-ok));
+		return -ok;
+	}
+
+	return 0;
+}
+
+/**************
+ * USER INPUT *
+ **************/
+static int libinput_interface_on_open(const char *path, int flags, void *userdata) {
+	return open(path, flags | O_CLOEXEC);
+}
+
+static void libinput_interface_on_close(int fd, void *userdata) {
+	close(fd);
+}
+
+const struct libinput_interface flutterpi_libinput_interface = {
+	.open_restricted = libinput_interface_on_open,
+	.close_restricted = libinput_interface_on_close 
+};
+
+/// Sends the pointer events collected in batch so far to the engine.
+static void flush_pointer_event_batch(struct pointer_event_batch *batch) {
+	FlutterEngineResult result;
+	uint64_t input_time, now;
+	size_t n_events;
+
+	n_events = batch->n_events;
+	if (n_events == 0) {
+		return;
+	}
+
+	result = flutterpi.flutter.libflutter_engine.FlutterEngineSendPointerEvent(
+		flutterpi.flutter.engine,
+		batch->events,
+		n_events
+	);
+	if (result != kSuccess) {
+		fprintf(stderr, "[flutter-pi] Could not send pointer events to flutter. FlutterEngineSendPointerEvent: %s\n", FLUTTER_RESULT_TO_STRING(result));
+	} else if (batch->oldest_input_time) {
+		input_time = batch->oldest_input_time * 1000;
+		now = get_monotonic_time_ns();
+
+		if (now > input_time) {
+			latency_histogram_record(&flutterpi.input_latency.input_to_dispatch, now - input_time);
+		}
+
+		add_pending_input_time(input_time);
+	}
+
+	batch->n_batches++;
+	batch->n_total_events += n_events;
+	if (n_events > batch->max_batch_size) {
+		batch->max_batch_size = n_events;
+	}
+
+	batch->n_events = 0;
+	batch->oldest_input_time = 0;
+}
+
+/// Remembers the timestamp (in microseconds) of the oldest input event in the batch.
+static void add_input_time_to_batch(struct pointer_event_batch *batch, uint64_t input_time) {
+	if (input_time && (!batch->oldest_input_time || (input_time < batch->oldest_input_time))) {
+		batch->oldest_input_time = input_time;
+	}
+}
+
+/// Adds a pointer event to a batch.
+/// Grows the batch if it's full, and sends it early if it reached the high-water mark
+/// or can't be grown.
+static void add_pointer_event(struct pointer_event_batch *batch, const FlutterPointerEvent *event) {
+	FlutterPointerEvent *events;
+	size_t size;
+
+	if (batch->n_events >= POINTER_EVENT_BATCH_HIGH_WATER_MARK) {
+		batch->n_early_flushes++;
+		flush_pointer_event_batch(batch);
+	}
+
+	if (batch->n_events == batch->size) {
+		size = batch->size ? batch->size * 2 : POINTER_EVENT_BATCH_INITIAL_SIZE;
+
+		events = realloc(batch->events, size * sizeof *events);
+		if (events != NULL) {
+			batch->events = events;
+			batch->size = size;
+		} else if (batch->n_events > 0) {
+			// make room by sending what we have.
+			batch->n_early_flushes++;
+			flush_pointer_event_batch(batch);
+		} else {
+			// no memory at all, send this one on its own.
+			flutterpi.flutter.libflutter_engine.FlutterEngineSendPointerEvent(flutterpi.flutter.engine, event, 1);
+			return;
+		}
+	}
+
+	batch->events[batch->n_events++] = *event;
+
+	// kAdd events are timestamped using FlutterEngineGetCurrentTime, not by the kernel.
+	if ((event->phase != kAdd) && (event->phase != kRemove)) {
+		add_input_time_to_batch(batch, event->timestamp);
+	}
+}
+
+/// Arms the input resampling timer for the next vblank that's at least
+/// INPUT_RESAMPLING_LEAD_TIME_NS away, if it's not armed already.
+static int arm_input_resampling_timer(void) {
+	struct itimerspec spec;
+	uint64_t now, last_vblank, next_vblank, period, fire_time;
+	int ok;
+
+	if (flutterpi.input.resampling.is_armed) {
+		return 0;
+	}
+
+	now = get_monotonic_time_ns();
+	period = vsync_estimator_get_period_ns(&flutterpi.drm.vsync_estimator);
+
+	ok = vsync_estimator_predict(&flutterpi.drm.vsync_estimator, now, &last_vblank, &next_vblank);
+	if (ok != 0) {
+		next_vblank = now + period;
+	}
+
+	if (next_vblank < now + INPUT_RESAMPLING_LEAD_TIME_NS) {
+		next_vblank += period;
+	}
+
+	fire_time = next_vblank - INPUT_RESAMPLING_LEAD_TIME_NS;
+
+	spec = (struct itimerspec) {
+		.it_interval = {0},
+		.it_value = {
+			.tv_sec = fire_time / 1000000000ull,
+			.tv_nsec = fire_time % 1000000000ull
+		}
+	};
+
+	ok = timerfd_settime(flutterpi.input.resampling.timerfd, TFD_TIMER_ABSTIME, &spec, NULL);
+	if (ok < 0) {
+		perror("[flutter-pi] Could not arm input resampling timer. timerfd_settime");
+		return errno;
+	}
+
+	flutterpi.input.resampling.sample_time = next_vblank;
+	flutterpi.input.resampling.is_armed = true;
+
+	return 0;
+}
+
+/// Sends the held back pointer motion, resampled at the vblank the timer was armed for.
+static void send_resampled_pointer_events(void) {
+	FlutterPointerEvent events[INPUT_RESAMPLER_MAX_POINTERS];
+	size_t n_events;
+
+	n_events = input_resampler_resample(
+		&flutterpi.input.resampling.resampler,
+		flutterpi.input.resampling.sample_time / 1000,
+		events,
+		INPUT_RESAMPLER_MAX_POINTERS
+	);
+
+	for (size_t i = 0; i < n_events; i++) {
+		add_pointer_event(&flutterpi.input.pointer_event_batch, events + i);
+	}
+
+	// the resampled events are timestamped with the vblank, not with the time of the input.
+	add_input_time_to_batch(&flutterpi.input.pointer_event_batch, flutterpi.input.resampling.resampler.oldest_input_timestamp);
+
+	flush_pointer_event_batch(&flutterpi.input.pointer_event_batch);
+}
+
+/// Called on the main thread a bit before the vblank the held back pointer motion should be resampled at.
+static int on_input_resampling_timer(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+	uint64_t expirations;
+	int ok;
+
+	ok = read(fd, &expirations, sizeof(expirations));
+	if ((ok < 0) && (errno != EAGAIN)) {
+		perror("[flutter-pi] Could not read input resampling timer. read");
+		return -errno;
+	}
+
+	flutterpi.input.resampling.is_armed = false;
+
+	if (input_resampler_has_pending(&flutterpi.input.resampling.resampler)) {
+		send_resampled_pointer_events();
+	}
+
+	return 0;
+}
+
+/// Adds a pointer event to the main thread batch, or hands it to the input resampler
+/// if --resample-input was given. Must be called on the main thread.
+static void add_pointer_event_on_main_thread(const FlutterPointerEvent *event) {
+	FlutterPointerEvent events[2];
+	size_t n_events;
+
+	if (!flutterpi.input.resampling.enabled) {
+		add_pointer_event(&flutterpi.input.pointer_event_batch, event);
+		return;
+	}
+
+	n_events = input_resampler_add_event(&flutterpi.input.resampling.resampler, event, events);
+	for (size_t i = 0; i < n_events; i++) {
+		add_pointer_event(&flutterpi.input.pointer_event_batch, events + i);
+	}
+
+	if (input_resampler_has_pending(&flutterpi.input.resampling.resampler)) {
+		arm_input_resampling_timer();
+	}
+}
+
+enum input_record_type {
+	kInputRecordPointerEvent,
+	kInputRecordCursorPos,
+	kInputRecordShowCursor,
+	kInputRecordUtf8Char,
+	kInputRecordXkbKeysym
+};
+
+/// Something the input thread hands to the main thread, because it
+/// touches state that's only used on the main thread.
+struct input_record {
+	enum input_record_type type;
+	union {
+		FlutterPointerEvent pointer_event;
+		struct {
+			int x, y;
+		} cursor_pos;
+		uint8_t utf8_char[4];
+		xkb_keysym_t keysym;
+	};
+};
+
+/// Executes the records the input thread handed to the main thread.
+/// Runs on the main thread, in the input lane.
+static int on_drain_input_queue(void *userdata) {
+	struct input_record record;
+	int ok;
+
+	// clear the flag before draining, so records enqueued from now on
+	// will post a new drain task. (exchange instead of store, so we see
+	// all the records enqueued before the flag was set)
+	atomic_exchange(&flutterpi.input.thread.drain_pending, false);
+
+	on_idle_input_activity();
+
+	while (spscq_try_dequeue(&flutterpi.input.thread.queue, &record) == 0) {
+		switch (record.type) {
+			case kInputRecordPointerEvent:
+				add_pointer_event_on_main_thread(&record.pointer_event);
+				break;
+			case kInputRecordCursorPos:
+				compositor_set_cursor_pos(record.cursor_pos.x, record.cursor_pos.y);
+				break;
+			case kInputRecordShowCursor:
+				compositor_apply_cursor_state(true, flutterpi.view.rotation, flutterpi.display.pixel_ratio);
+				break;
+			case kInputRecordUtf8Char:
+				textin_on_utf8_char(record.utf8_char);
+				break;
+			case kInputRecordXkbKeysym:
+				textin_on_xkb_keysym(record.keysym);
+				break;
+			default:
+				break;
+		}
+	}
+
+	// the queue is empty now, wake up the input thread if it waits for room.
+	if (atomic_exchange(&flutterpi.input.thread.waiting_for_space, false)) {
+		ok = write(flutterpi.input.thread.space_available_fd, (uint8_t[8]) {0, 0, 0, 0, 0, 0, 0, 1}, 8);
+		if (ok < 0) {
+			perror("[flutter-pi] Could not wake up the input thread. write");
+		}
+	}
+
+	flush_pointer_event_batch(&flutterpi.input.pointer_event_batch);
 
-		engine_result = libflutter_engine->FlutterEngineCreateAOTData(&aot_source, &aot_data);
-		if (engine_result != kSuccess) {
-			fprintf(stderr, "[flutter-pi] Could not load AOT data. FlutterEngineCreateAOTData: %s\n", FLUTTER_RESULT_TO_STRING(engine_result));
-			return EIO;
-		}
+	return 0;
+}
 
-		project_args.aot_data = aot_data;
+/// Posts a task that drains the input queue to the input lane, if there's none pending.
+/// Called on the input thread.
+static void signal_input_queue(void) {
+	int ok;
+
+	if (atomic_exchange(&flutterpi.input.thread.drain_pending, true)) {
+		return;
 	}
 
-	// spin up the engine
-	engine_result = libflutter_engine->FlutterEngineRun(FLUTTER_ENGINE_VERSION, &renderer_config, &project_args, NULL, &flutterpi.flutter.engine);
-	if (engine_result != kSuccess) {
-		fprintf(stderr, "[flutter-pi] Could not run the flutter engine. FlutterEngineRun: %s\n", FLUTTER_RESULT_TO_STRING(engine_result));
-		return EINVAL;
+	ok = flutterpi_post_platform_task_with_priority(on_drain_input_queue, NULL, kPlatformTaskPriorityInput);
+	if (ok != 0) {
+		fprintf(stderr, "[flutter-pi] Could not post input queue task to the main loop. flutterpi_post_platform_task_with_priority: %s\n", strerror(ok));
+		atomic_store(&flutterpi.input.thread.drain_pending, false);
 	}
+}
 
-	// update window size
-	engine_result = libflutter_engine->FlutterEngineSendWindowMetricsEvent(
-		flutterpi.flutter.engine,
-		&(FlutterWindowMetricsEvent) {
-			.struct_size = sizeof(FlutterWindowMetricsEvent),
-			.width = flutterpi.view.width,
-			.height = flutterpi.view.height,
-			.pixel_ratio = flutterpi.display.pixel_ratio
+/// Hands a record to the main thread. Waits for the main thread if the queue is full.
+/// Called on the input thread.
+static void enqueue_input_record(const struct input_record *record) {
+	uint64_t value;
+	int ok;
+
+	while (spscq_try_enqueue(&flutterpi.input.thread.queue, record) == ENOSPC) {
+		if (atomic_load(&flutterpi.input.thread.should_stop)) {
+			// the main loop won't drain the queue anymore.
+			return;
+		}
+
+		atomic_fetch_add_explicit(&flutterpi.input.thread.n_queue_full, 1, memory_order_relaxed);
+
+		// tell on_drain_input_queue we're waiting before trying again,
+		// so it can't drain the queue in between without waking us up.
+		atomic_store(&flutterpi.input.thread.waiting_for_space, true);
+		if (spscq_try_enqueue(&flutterpi.input.thread.queue, record) == 0) {
+			atomic_store(&flutterpi.input.thread.waiting_for_space, false);
+			break;
+		}
+
+		signal_input_queue();
+
+		do {
+			ok = read(flutterpi.input.thread.space_available_fd, &value, sizeof(value));
+		} while ((ok < 0) && (errno == EINTR));
+
+		if (ok < 0) {
+			perror("[flutter-pi] Could not wait for room in the input queue. read");
+			atomic_store(&flutterpi.input.thread.waiting_for_space, false);
+			usleep(1000);
 		}
-	);
-	if (engine_result != kSuccess) {
-		fprintf(stderr, "[flutter-pi] Could not send window metrics to flutter engine.\n");
-		return EINVAL;
 	}
-	
-	return 0;
 }
 
-int flutterpi_schedule_exit(void) {
+/// Writes an input event to the recording, if --record-input was given.
+static void record_input_event(struct input_recording_event *event) {
 	int ok;
 
-	if (pthread_self() != flutterpi.event_loop_thread) {
-		pthread_mutex_lock(&flutterpi.event_loop_mutex);
+	if (flutterpi.input.recording.path == NULL) {
+		return;
 	}
-	
-	ok = sd_event_exit(flutterpi.event_loop, 0);
-	if (ok < 0) {
-		fprintf(stderr, "[flutter-pi] Could not schedule application exit. sd_event_exit: %s\n", strerror(-ok));
-		if (pthread_self() != flutterpi.event_loop_thread) {
-			pthread_mutex_unlock(&flutterpi.event_loop_mutex);
-		}
-		return -ok;
+
+	// use the kernel timestamp of the libinput event if we have one,
+	// so the recording has the real cadence of the input device.
+	if (flutterpi.input.recording.event_time_us != 0) {
+		event->time_us = flutterpi.input.recording.event_time_us;
+	} else {
+		event->time_us = get_monotonic_time_ns() / 1000;
 	}
 
-	if (pthread_self() != flutterpi.event_loop_thread) {
-		pthread_mutex_unlock(&flutterpi.event_loop_mutex);
+	ok = input_recorder_write(&flutterpi.input.recording.recorder, event);
+	if (ok != 0) {
+		fprintf(stderr, "[flutter-pi] Could not write to input recording. Recording will be stopped. input_recorder_write: %s\n", strerror(ok));
+		input_recorder_close(&flutterpi.input.recording.recorder);
+		flutterpi.input.recording.path = NULL;
 	}
+}
 
-	return 0;
+/// The following are called by process_libinput_events, which runs on the
+/// input thread if there is one, and on the main thread otherwise,
+/// and by the input replay, which runs on the main thread.
+
+static void submit_pointer_event(const FlutterPointerEvent *event) {
+	record_input_event(&(struct input_recording_event) {
+		.type = kInputRecordingPointerEvent,
+		.pointer_event = *event
+	});
+
+	if (!flutterpi.input.thread.enabled) {
+		add_pointer_event_on_main_thread(event);
+	} else if (flutterpi.input.resampling.enabled) {
+		// the resampler lives on the main thread.
+		enqueue_input_record(&(struct input_record) {
+			.type = kInputRecordPointerEvent,
+			.pointer_event = *event
+		});
+	} else {
+		// FlutterEngineSendPointerEvent is thread-safe,
+		// so we can send these to the engine ourselves.
+		add_pointer_event(&flutterpi.input.thread.pointer_event_batch, event);
+	}
 }
 
-/**************
- * USER INPUT *
- **************/
-static int libinput_interface_on_open(const char *path, int flags, void *userdata) {
-	return open(path, flags | O_CLOEXEC);
+static void submit_cursor_pos(int x, int y) {
+	record_input_event(&(struct input_recording_event) {
+		.type = kInputRecordingCursorPos,
+		.cursor_pos = {.x = x, .y = y}
+	});
+
+	if (!flutterpi.input.thread.enabled) {
+		compositor_set_cursor_pos(x, y);
+		return;
+	}
+
+	enqueue_input_record(&(struct input_record) {
+		.type = kInputRecordCursorPos,
+		.cursor_pos = {.x = x, .y = y}
+	});
 }
 
-static void libinput_interface_on_close(int fd, void *userdata) {
-	close(fd);
+static void submit_show_cursor(void) {
+	record_input_event(&(struct input_recording_event) {
+		.type = kInputRecordingShowCursor
+	});
+
+	if (!flutterpi.input.thread.enabled) {
+		compositor_apply_cursor_state(true, flutterpi.view.rotation, flutterpi.display.pixel_ratio);
+		return;
+	}
+
+	enqueue_input_record(&(struct input_record) {
+		.type = kInputRecordShowCursor
+	});
 }
 
-const struct libinput_interface flutterpi_libinput_interface = {
-	.open_restricted = libinput_interface_on_open,
-	.close_restricted = libinput_interface_on_close 
-};
+static void submit_utf8_char(uint8_t *c) {
+	struct input_recording_event recording_event;
+	struct input_record record;
+	size_t length;
+
+	if (c[0] < 0x80) {
+		length = 1;
+	} else if ((c[0] & 0xE0) == 0xC0) {
+		length = 2;
+	} else if ((c[0] & 0xF0) == 0xE0) {
+		length = 3;
+	} else {
+		length = 4;
+	}
 
-static int on_libinput_ready(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+	if (flutterpi.input.recording.path != NULL) {
+		memset(&recording_event, 0, sizeof(recording_event));
+		recording_event.type = kInputRecordingUtf8Char;
+		memcpy(recording_event.utf8_char, c, length);
+		record_input_event(&recording_event);
+	}
+
+	if (!flutterpi.input.thread.enabled) {
+		textin_on_utf8_char(c);
+		return;
+	}
+
+	record.type = kInputRecordUtf8Char;
+	memset(record.utf8_char, 0, sizeof(record.utf8_char));
+	memcpy(record.utf8_char, c, length);
+
+	enqueue_input_record(&record);
+}
+
+static void submit_xkb_keysym(xkb_keysym_t keysym) {
+	record_input_event(&(struct input_recording_event) {
+		.type = kInputRecordingXkbKeysym,
+		.keysym = keysym
+	});
+
+	if (!flutterpi.input.thread.enabled) {
+		textin_on_xkb_keysym(keysym);
+		return;
+	}
+
+	enqueue_input_record(&(struct input_record) {
+		.type = kInputRecordXkbKeysym,
+		.keysym = keysym
+	});
+}
+
+static void submit_raw_key_event(
+	uint32_t unicode_scalar_values,
+	uint32_t key_code,
+	uint32_t scan_code,
+	uint32_t modifiers,
+	bool is_down
+) {
+	record_input_event(&(struct input_recording_event) {
+		.type = kInputRecordingRawKeyEvent,
+		.raw_key_event = {
+			.unicode_scalar_values = unicode_scalar_values,
+			.key_code = key_code,
+			.scan_code = scan_code,
+			.modifiers = modifiers,
+			.is_down = is_down
+		}
+	});
+
+	// rawkb_send_gtk_keyevent only posts a platform message, so it's thread-safe.
+	rawkb_send_gtk_keyevent(unicode_scalar_values, key_code, scan_code, modifiers, is_down);
+}
+
+/// Returns the kernel timestamp of a libinput pointer, touch or keyboard event,
+/// in microseconds (CLOCK_MONOTONIC), or 0 for any other event.
+static uint64_t get_libinput_event_time_usec(struct libinput_event *event, enum libinput_event_type type) {
+	if (LIBINPUT_EVENT_IS_POINTER(type)) {
+		return libinput_event_pointer_get_time_usec(libinput_event_get_pointer_event(event));
+	} else if (LIBINPUT_EVENT_IS_TOUCH(type)) {
+		return libinput_event_touch_get_time_usec(libinput_event_get_touch_event(event));
+	} else if (LIBINPUT_EVENT_IS_KEYBOARD(type)) {
+		return libinput_event_keyboard_get_time_usec(libinput_event_get_keyboard_event(event));
+	}
+
+	return 0;
+}
+
+/// Dispatches libinput and translates its events to flutter pointer events, key events and text input.
+/// Runs on the input thread if there is one, and on the main thread otherwise.
+static int process_libinput_events(void) {
 	struct libinput_event_keyboard *keyboard_event;
 	struct libinput_event_pointer *pointer_event;
 	struct libinput_event_touch *touch_event;
 	struct input_device_data *data;
 	enum libinput_event_type type;
 	struct libinput_device *device;
+	struct input_view_geometry geometry;
 	struct libinput_event *event;
-	FlutterPointerEvent pointer_events[64];
-	FlutterEngineResult result;
-	int n_pointer_events = 0;
 	int ok;
 	
 	ok = libinput_dispatch(flutterpi.input.libinput);
@@ -1941,9 +4026,19 @@ static int on_libinput_ready(sd_event_source *s, int fd, uint32_t revents, void
 		return -ok;
 	}
 
+	if (!flutterpi.input.thread.enabled) {
+		on_idle_input_activity();
+	}
+
+	read_input_view_geometry(&geometry);
+
 	while (event = libinput_get_event(flutterpi.input.libinput), event != NULL) {
 		type = libinput_event_get_type(event);
 
+		if (flutterpi.input.recording.path != NULL) {
+			flutterpi.input.recording.event_time_us = get_libinput_event_time_usec(event, type);
+		}
+
 		if (type == LIBINPUT_EVENT_DEVICE_ADDED) {
 			device = libinput_event_get_device(event);
 			
@@ -1953,7 +4048,7 @@ static int on_libinput_ready(sd_event_source *s, int fd, uint32_t revents, void
 			libinput_device_set_user_data(device, data);
 
 			if (libinput_device_has_capability(device, LIBINPUT_DEVICE_CAP_POINTER)) {
-				pointer_events[n_pointer_events++] = (FlutterPointerEvent) {
+				submit_pointer_event(&(FlutterPointerEvent) {
 					.struct_size = sizeof(FlutterPointerEvent),
 					.phase = kAdd,
 					.timestamp = flutterpi.flutter.libflutter_engine.FlutterEngineGetCurrentTime(),
@@ -1965,14 +4060,14 @@ static int on_libinput_ready(sd_event_source *s, int fd, uint32_t revents, void
 					.scroll_delta_y = 0.0,
 					.device_kind = kFlutterPointerDeviceKindMouse,
 					.buttons = 0
-				};
+				});
 
-				compositor_apply_cursor_state(true, flutterpi.view.rotation, flutterpi.display.pixel_ratio);
+				submit_show_cursor();
 			} else if (libinput_device_has_capability(device, LIBINPUT_DEVICE_CAP_TOUCH)) {
 				int touch_count = libinput_device_touch_get_touch_count(device);
 
 				for (int i = 0; i < touch_count; i++) {
-					pointer_events[n_pointer_events++] = (FlutterPointerEvent) {
+					submit_pointer_event(&(FlutterPointerEvent) {
 						.struct_size = sizeof(FlutterPointerEvent),
 						.phase = kAdd,
 						.timestamp = flutterpi.flutter.libflutter_engine.FlutterEngineGetCurrentTime(),
@@ -1984,7 +4079,7 @@ static int on_libinput_ready(sd_event_source *s, int fd, uint32_t revents, void
 						.scroll_delta_y = 0.0,
 						.device_kind = kFlutterPointerDeviceKindTouch,
 						.buttons = 0
-					};
+					});
 				}
 			} else if (libinput_device_has_capability(device, LIBINPUT_DEVICE_CAP_KEYBOARD)) {
 				if (flutterpi.input.disable_text_input == false) {
@@ -2011,10 +4106,10 @@ static int on_libinput_ready(sd_event_source *s, int fd, uint32_t revents, void
 				}
 
 				if ((type == LIBINPUT_EVENT_TOUCH_DOWN) || (type == LIBINPUT_EVENT_TOUCH_MOTION)) {
-					double x = libinput_event_touch_get_x_transformed(touch_event, flutterpi.display.width);
-					double y = libinput_event_touch_get_y_transformed(touch_event, flutterpi.display.height);
+					double x = libinput_event_touch_get_x_transformed(touch_event, geometry.display_width);
+					double y = libinput_event_touch_get_y_transformed(touch_event, geometry.display_height);
 
-					apply_flutter_transformation(flutterpi.view.display_to_view_transform, &x, &y);
+					apply_flutter_transformation(geometry.display_to_view_transform, &x, &y);
 
 					FlutterPointerPhase phase;
 					if (type == LIBINPUT_EVENT_TOUCH_DOWN) {
@@ -2023,7 +4118,7 @@ static int on_libinput_ready(sd_event_source *s, int fd, uint32_t revents, void
 						phase = kMove;
 					}
 
-					pointer_events[n_pointer_events++] = (FlutterPointerEvent) {
+					submit_pointer_event(&(FlutterPointerEvent) {
 						.struct_size = sizeof(FlutterPointerEvent),
 						.phase = phase,
 						.timestamp = libinput_event_touch_get_time_usec(touch_event),
@@ -2035,13 +4130,13 @@ static int on_libinput_ready(sd_event_source *s, int fd, uint32_t revents, void
 						.scroll_delta_y = 0.0,
 						.device_kind = kFlutterPointerDeviceKindTouch,
 						.buttons = 0
-					};
+					});
 
 					data->x = x;
 					data->y = y;
 					data->timestamp = libinput_event_touch_get_time_usec(touch_event);
 				} else {
-					pointer_events[n_pointer_events++] = (FlutterPointerEvent) {
+					submit_pointer_event(&(FlutterPointerEvent) {
 						.struct_size = sizeof(FlutterPointerEvent),
 						.phase = kUp,
 						.timestamp = libinput_event_touch_get_time_usec(touch_event),
@@ -2053,7 +4148,7 @@ static int on_libinput_ready(sd_event_source *s, int fd, uint32_t revents, void
 						.scroll_delta_y = 0.0,
 						.device_kind = kFlutterPointerDeviceKindTouch,
 						.buttons = 0
-					};
+					});
 				}
 			}
 		} else if (LIBINPUT_EVENT_IS_POINTER(type)) {
@@ -2066,29 +4161,29 @@ static int on_libinput_ready(sd_event_source *s, int fd, uint32_t revents, void
 
 				data->timestamp = libinput_event_pointer_get_time_usec(pointer_event);
 
-				apply_flutter_transformation(FLUTTER_ROTZ_TRANSFORMATION(flutterpi.view.rotation), &dx, &dy);
+				apply_flutter_transformation(FLUTTER_ROTZ_TRANSFORMATION(geometry.rotation), &dx, &dy);
 
 				double newx = flutterpi.input.cursor_x + dx;
 				double newy = flutterpi.input.cursor_y + dy;
 
 				if (newx < 0) {
 					newx = 0;
-				} else if (newx > flutterpi.display.width - 1) {
-					newx = flutterpi.display.width - 1;
+				} else if (newx > geometry.display_width - 1) {
+					newx = geometry.display_width - 1;
 				}
 
 				if (newy < 0) {
 					newy = 0;
-				} else if (newy > flutterpi.display.height - 1) {
-					newy = flutterpi.display.height - 1;
+				} else if (newy > geometry.display_height - 1) {
+					newy = geometry.display_height - 1;
 				}
 
 				flutterpi.input.cursor_x = newx;
 				flutterpi.input.cursor_y = newy;
 
-				apply_flutter_transformation(flutterpi.view.display_to_view_transform, &newx, &newy);
+				apply_flutter_transformation(geometry.display_to_view_transform, &newx, &newy);
 
-				pointer_events[n_pointer_events++] = (FlutterPointerEvent) {
+				submit_pointer_event(&(FlutterPointerEvent) {
 					.struct_size = sizeof(FlutterPointerEvent),
 					.phase = data->buttons & kFlutterPointerButtonMousePrimary ? kMove : kHover,
 					.timestamp = libinput_event_pointer_get_time_usec(pointer_event),
@@ -2100,12 +4195,12 @@ static int on_libinput_ready(sd_event_source *s, int fd, uint32_t revents, void
 					.scroll_delta_y = 0.0,
 					.device_kind = kFlutterPointerDeviceKindMouse,
 					.buttons = data->buttons
-				};
+				});
 
-				compositor_set_cursor_pos(round(flutterpi.input.cursor_x), round(flutterpi.input.cursor_y));
+				submit_cursor_pos(round(flutterpi.input.cursor_x), round(flutterpi.input.cursor_y));
 			} else if (type == LIBINPUT_EVENT_POINTER_MOTION_ABSOLUTE) {
-				double x = libinput_event_pointer_get_absolute_x_transformed(pointer_event, flutterpi.display.width);
-				double y = libinput_event_pointer_get_absolute_y_transformed(pointer_event, flutterpi.display.height);
+				double x = libinput_event_pointer_get_absolute_x_transformed(pointer_event, geometry.display_width);
+				double y = libinput_event_pointer_get_absolute_y_transformed(pointer_event, geometry.display_height);
 
 				flutterpi.input.cursor_x = x;
 				flutterpi.input.cursor_y = y;
@@ -2114,9 +4209,9 @@ static int on_libinput_ready(sd_event_source *s, int fd, uint32_t revents, void
 				data->y = y;
 				data->timestamp = libinput_event_pointer_get_time_usec(pointer_event);
 
-				apply_flutter_transformation(flutterpi.view.display_to_view_transform, &x, &y);
+				apply_flutter_transformation(geometry.display_to_view_transform, &x, &y);
 
-				pointer_events[n_pointer_events++] = (FlutterPointerEvent) {
+				submit_pointer_event(&(FlutterPointerEvent) {
 					.struct_size = sizeof(FlutterPointerEvent),
 					.phase = data->buttons & kFlutterPointerButtonMousePrimary ? kMove : kHover,
 					.timestamp = libinput_event_pointer_get_time_usec(pointer_event),
@@ -2128,9 +4223,9 @@ static int on_libinput_ready(sd_event_source *s, int fd, uint32_t revents, void
 					.scroll_delta_y = 0.0,
 					.device_kind = kFlutterPointerDeviceKindMouse,
 					.buttons = data->buttons
-				};
+				});
 
-				compositor_set_cursor_pos((int) round(x), (int) round(y));
+				submit_cursor_pos((int) round(x), (int) round(y));
 			} else if (type == LIBINPUT_EVENT_POINTER_BUTTON) {
 				uint32_t button = libinput_event_pointer_get_button(pointer_event);
 				enum libinput_button_state button_state = libinput_event_pointer_get_button_state(pointer_event);
@@ -2168,9 +4263,9 @@ static int on_libinput_ready(sd_event_source *s, int fd, uint32_t revents, void
 					double x = flutterpi.input.cursor_x;
 					double y = flutterpi.input.cursor_y;
 
-					apply_flutter_transformation(flutterpi.view.display_to_view_transform, &x, &y);
+					apply_flutter_transformation(geometry.display_to_view_transform, &x, &y);
 
-					pointer_events[n_pointer_events++] = (FlutterPointerEvent) {
+					submit_pointer_event(&(FlutterPointerEvent) {
 						.struct_size = sizeof(FlutterPointerEvent),
 						.phase = phase,
 						.timestamp = libinput_event_pointer_get_time_usec(pointer_event),
@@ -2182,98 +4277,283 @@ static int on_libinput_ready(sd_event_source *s, int fd, uint32_t revents, void
 						.scroll_delta_y = 0.0,
 						.device_kind = kFlutterPointerDeviceKindMouse,
 						.buttons = new_flutter_button_state
-					};
+					});
 
 					data->buttons = new_flutter_button_state;
 				}
 			} else if (type == LIBINPUT_EVENT_POINTER_AXIS) {
 
-			}
-		} else if (LIBINPUT_EVENT_IS_KEYBOARD(type) && !flutterpi.input.disable_text_input) {
-			struct keyboard_modifier_state mods;
-			enum libinput_key_state key_state;
-			xkb_keysym_t keysym;
-			uint32_t codepoint, plain_codepoint;
-			uint16_t evdev_keycode;
-			
-			keyboard_event = libinput_event_get_keyboard_event(event);
-			data = libinput_device_get_user_data(libinput_event_get_device(event));
-			evdev_keycode = libinput_event_keyboard_get_key(keyboard_event);
-			key_state = libinput_event_keyboard_get_key_state(keyboard_event);
+			}
+		} else if (LIBINPUT_EVENT_IS_KEYBOARD(type) && !flutterpi.input.disable_text_input) {
+			struct keyboard_modifier_state mods;
+			enum libinput_key_state key_state;
+			xkb_keysym_t keysym;
+			uint32_t codepoint, plain_codepoint;
+			uint16_t evdev_keycode;
+			
+			keyboard_event = libinput_event_get_keyboard_event(event);
+			data = libinput_device_get_user_data(libinput_event_get_device(event));
+			evdev_keycode = libinput_event_keyboard_get_key(keyboard_event);
+			key_state = libinput_event_keyboard_get_key_state(keyboard_event);
+
+			mods = keyboard_state_get_meta_state(data->keyboard_state);
+
+			ok = keyboard_state_process_key_event(
+				data->keyboard_state,
+				evdev_keycode,
+				(int32_t) key_state,
+				&keysym,
+				&codepoint
+			);
+
+			// printf("[key event] keycode: 0x%04X, type: %s, keysym: 0x%08X, codepoint: 0x%08X\n", evdev_keycode, key_state? "down" : " up ", keysym, codepoint);
+
+			plain_codepoint = keyboard_state_get_plain_codepoint(data->keyboard_state, evdev_keycode, 1);
+			
+			submit_raw_key_event(
+				plain_codepoint,
+				(uint32_t) keysym,
+				evdev_keycode + 8,
+				keyboard_state_is_shift_active(data->keyboard_state)
+				| (keyboard_state_is_capslock_active(data->keyboard_state) << 1)
+				| (keyboard_state_is_ctrl_active(data->keyboard_state) << 2)
+				| (keyboard_state_is_alt_active(data->keyboard_state) << 3)
+				| (keyboard_state_is_numlock_active(data->keyboard_state) << 4)
+				| (keyboard_state_is_meta_active(data->keyboard_state) << 28),
+				key_state
+			);
+
+			if (codepoint) {
+				if (codepoint < 0x80) {
+					if (isprint(codepoint)) {
+						submit_utf8_char((uint8_t[1]) {codepoint});
+					}
+				} else if (codepoint < 0x800) {
+					submit_utf8_char((uint8_t[2]) {
+						0xc0 | (codepoint >> 6),
+						0x80 | (codepoint & 0x3f)
+					});
+				} else if (codepoint < 0x10000) {
+					if (!(codepoint >= 0xD800 && codepoint < 0xE000) && !(codepoint == 0xFFFF)) {
+						submit_utf8_char((uint8_t[3]) {
+							0xe0 | (codepoint >> 12),
+							0x80 | ((codepoint >> 6) & 0x3f),
+							0x80 | (codepoint & 0x3f)
+						});
+					}
+				} else if (codepoint < 0x110000) {
+					submit_utf8_char((uint8_t[4]) {
+						0xf0 | (codepoint >> 18),
+						0x80 | ((codepoint >> 12) & 0x3f),
+						0x80 | ((codepoint >> 6) & 0x3f),
+						0x80 | (codepoint & 0x3f)
+					});
+				}
+			}
+			
+			if (keysym) {
+				submit_xkb_keysym(keysym);
+			}
+		}
+
+		libinput_event_destroy(event);
+		event = NULL;
+	}
+
+	if (flutterpi.input.recording.path != NULL) {
+		input_recorder_flush(&flutterpi.input.recording.recorder);
+	}
+
+	if (flutterpi.input.thread.enabled) {
+		flush_pointer_event_batch(&flutterpi.input.thread.pointer_event_batch);
+
+		// always signal the main thread, even if there were no records,
+		// so it knows there was user input. (see on_idle_input_activity)
+		signal_input_queue();
+	} else {
+		flush_pointer_event_batch(&flutterpi.input.pointer_event_batch);
+	}
+
+	return 0;
+}
+
+static int on_libinput_ready(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+	return process_libinput_events();
+}
+
+static void *input_thread_main(void *arg) {
+	struct pollfd pollfds[2];
+	int ok;
+
+	pollfds[0].fd = libinput_get_fd(flutterpi.input.libinput);
+	pollfds[0].events = POLLIN;
+	pollfds[1].fd = flutterpi.input.thread.stop_fd;
+	pollfds[1].events = POLLIN;
+
+	while (1) {
+		ok = poll(pollfds, 2, -1);
+		if (ok < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			perror("[flutter-pi] Could not wait for input events. Flutter-pi will not receive any more user input. poll");
+			break;
+		}
+
+		if (pollfds[1].revents & POLLIN) {
+			break;
+		}
+
+		ok = process_libinput_events();
+		if (ok != 0) {
+			fprintf(stderr, "[flutter-pi] Flutter-pi will not receive any more user input.\n");
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/// Arms the input replay timer for the given time (CLOCK_MONOTONIC, in microseconds).
+static int arm_input_replay_timer(uint64_t time_us) {
+	struct itimerspec spec;
+	int ok;
+
+	// an all-zero it_value would disarm the timer.
+	if (time_us == 0) {
+		time_us = 1;
+	}
+
+	spec = (struct itimerspec) {
+		.it_interval = {0},
+		.it_value = {
+			.tv_sec = time_us / 1000000ull,
+			.tv_nsec = (time_us % 1000000ull) * 1000ull
+		}
+	};
+
+	ok = timerfd_settime(flutterpi.input.replay.timerfd, TFD_TIMER_ABSTIME, &spec, NULL);
+	if (ok < 0) {
+		perror("[flutter-pi] Could not arm input replay timer. timerfd_settime");
+		return errno;
+	}
+
+	return 0;
+}
+
+/// Hands a recorded event to the same functions the live input goes through.
+static void replay_input_event(struct input_recording_event *event) {
+	switch (event->type) {
+		case kInputRecordingPointerEvent:
+			if (event->pointer_event.phase == kAdd) {
+				// kAdd events are timestamped using FlutterEngineGetCurrentTime, not by the kernel.
+				event->pointer_event.timestamp = flutterpi.flutter.libflutter_engine.FlutterEngineGetCurrentTime();
+			} else {
+				event->pointer_event.timestamp = event->pointer_event.timestamp - flutterpi.input.replay.first_event_time + flutterpi.input.replay.start_time;
+			}
+
+			submit_pointer_event(&event->pointer_event);
+			break;
+		case kInputRecordingCursorPos:
+			submit_cursor_pos(event->cursor_pos.x, event->cursor_pos.y);
+			break;
+		case kInputRecordingShowCursor:
+			submit_show_cursor();
+			break;
+		case kInputRecordingRawKeyEvent:
+			submit_raw_key_event(
+				event->raw_key_event.unicode_scalar_values,
+				event->raw_key_event.key_code,
+				event->raw_key_event.scan_code,
+				event->raw_key_event.modifiers,
+				event->raw_key_event.is_down
+			);
+			break;
+		case kInputRecordingUtf8Char:
+			submit_utf8_char(event->utf8_char);
+			break;
+		case kInputRecordingXkbKeysym:
+			submit_xkb_keysym(event->keysym);
+			break;
+		default:
+			break;
+	}
+}
+
+static void finish_input_replay(void) {
+	uint64_t duration_us;
+
+	duration_us = get_monotonic_time_ns() / 1000 - flutterpi.input.replay.start_time;
 
-			mods = keyboard_state_get_meta_state(data->keyboard_state);
+	fprintf(
+		stderr,
+		"[flutter-pi] Replayed %" PRIu64 " input events in %.3fs.\n",
+		flutterpi.input.replay.replayer.n_events,
+		duration_us / 1000000.0
+	);
 
-			ok = keyboard_state_process_key_event(
-				data->keyboard_state,
-				evdev_keycode,
-				(int32_t) key_state,
-				&keysym,
-				&codepoint
-			);
+	input_replayer_close(&flutterpi.input.replay.replayer);
+	flutterpi.input.replay.path = NULL;
+}
 
-			// printf("[key event] keycode: 0x%04X, type: %s, keysym: 0x%08X, codepoint: 0x%08X\n", evdev_keycode, key_state? "down" : " up ", keysym, codepoint);
+/// Called on the main thread when the next recorded input event is due.
+static int on_input_replay_timer(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+	struct input_recording_event *event;
+	unsigned int n_replayed;
+	uint64_t expirations, now, due_time;
+	int ok;
 
-			plain_codepoint = keyboard_state_get_plain_codepoint(data->keyboard_state, evdev_keycode, 1);
-			
-			rawkb_send_gtk_keyevent(
-				plain_codepoint,
-				(uint32_t) keysym,
-				evdev_keycode + 8,
-				keyboard_state_is_shift_active(data->keyboard_state)
-				| (keyboard_state_is_capslock_active(data->keyboard_state) << 1)
-				| (keyboard_state_is_ctrl_active(data->keyboard_state) << 2)
-				| (keyboard_state_is_alt_active(data->keyboard_state) << 3)
-				| (keyboard_state_is_numlock_active(data->keyboard_state) << 4)
-				| (keyboard_state_is_meta_active(data->keyboard_state) << 28),
-				key_state
-			);
+	ok = read(fd, &expirations, sizeof(expirations));
+	if ((ok < 0) && (errno != EAGAIN)) {
+		perror("[flutter-pi] Could not read input replay timer. read");
+		return -errno;
+	}
 
-			if (codepoint) {
-				if (codepoint < 0x80) {
-					if (isprint(codepoint)) {
-						textin_on_utf8_char((uint8_t[1]) {codepoint});
-					}
-				} else if (codepoint < 0x800) {
-					textin_on_utf8_char((uint8_t[2]) {
-						0xc0 | (codepoint >> 6),
-						0x80 | (codepoint & 0x3f)
-					});
-				} else if (codepoint < 0x10000) {
-					if (!(codepoint >= 0xD800 && codepoint < 0xE000) && !(codepoint == 0xFFFF)) {
-						textin_on_utf8_char((uint8_t[3]) {
-							0xe0 | (codepoint >> 12),
-							0x80 | ((codepoint >> 6) & 0x3f),
-							0x80 | (codepoint & 0x3f)
-						});
-					}
-				} else if (codepoint < 0x110000) {
-					textin_on_utf8_char((uint8_t[4]) {
-						0xf0 | (codepoint >> 18),
-						0x80 | ((codepoint >> 12) & 0x3f),
-						0x80 | ((codepoint >> 6) & 0x3f),
-						0x80 | (codepoint & 0x3f)
-					});
+	if (flutterpi.input.replay.path == NULL) {
+		return 0;
+	}
+
+	event = &flutterpi.input.replay.next_event;
+	now = get_monotonic_time_ns() / 1000;
+	n_replayed = 0;
+
+	while (1) {
+		if (!flutterpi.input.replay.has_next_event) {
+			ok = input_replayer_read(&flutterpi.input.replay.replayer, event);
+			if (ok != 0) {
+				if (ok != ENODATA) {
+					fprintf(stderr, "[flutter-pi] Input recording \"%s\" is corrupt. Stopping the replay.\n", flutterpi.input.replay.path);
 				}
+
+				finish_input_replay();
+				break;
 			}
-			
-			if (keysym) {
-				textin_on_xkb_keysym(keysym);
+
+			flutterpi.input.replay.has_next_event = true;
+		}
+
+		if (flutterpi.input.replay.as_fast_as_possible) {
+			if (n_replayed >= INPUT_REPLAY_MAX_EVENTS_PER_ITERATION) {
+				arm_input_replay_timer(now);
+				break;
+			}
+		} else {
+			due_time = event->time_us - flutterpi.input.replay.first_event_time + flutterpi.input.replay.start_time;
+			if (due_time > now) {
+				arm_input_replay_timer(due_time);
+				break;
 			}
 		}
 
-		libinput_event_destroy(event);
-		event = NULL;
+		replay_input_event(event);
+		flutterpi.input.replay.has_next_event = false;
+		n_replayed++;
 	}
 
-	if (n_pointer_events > 0) {
-		result = flutterpi.flutter.libflutter_engine.FlutterEngineSendPointerEvent(
-			flutterpi.flutter.engine,
-			pointer_events,
-			n_pointer_events
-		);
-		if (result != kSuccess) {
-			fprintf(stderr, "[flutter-pi] Could not add mouse as flutter input device. FlutterEngineSendPointerEvent: %s\n", FLUTTER_RESULT_TO_STRING(result));
-		}
+	if (n_replayed > 0) {
+		on_idle_input_activity();
+		flush_pointer_event_batch(&flutterpi.input.pointer_event_batch);
 	}
 
 	return 0;
@@ -2458,6 +4738,15 @@ static struct libinput *try_create_path_backed_libinput(void) {
 	return libinput;
 }
 
+/// Allocates the pointer event batch now, so the first input events don't have to.
+static void init_pointer_event_batch(struct pointer_event_batch *batch) {
+	memset(batch, 0, sizeof(*batch));
+	batch->events = malloc(POINTER_EVENT_BATCH_INITIAL_SIZE * sizeof(FlutterPointerEvent));
+	if (batch->events != NULL) {
+		batch->size = POINTER_EVENT_BATCH_INITIAL_SIZE;
+	}
+}
+
 static int init_user_input(void) {
 	sd_event_source *libinput_event_source;
 	struct keyboard_config *kbdcfg;
@@ -2468,37 +4757,70 @@ static int init_user_input(void) {
 	kbdcfg = NULL;
 	libinput = NULL;
 
-	if (flutterpi.input.use_paths == false) {
+	// When replaying, the input comes from the recording instead of the input devices.
+	if ((flutterpi.input.replay.path == NULL) && (flutterpi.input.use_paths == false)) {
 		libinput = try_create_udev_backed_libinput();
 	}
 
-	if (libinput == NULL) {
+	if ((flutterpi.input.replay.path == NULL) && (libinput == NULL)) {
 		libinput = try_create_path_backed_libinput();
 	}
 	
+	if ((libinput != NULL) && flutterpi.input.thread.enabled) {
+		ok = spscq_init(&flutterpi.input.thread.queue, sizeof(struct input_record), INPUT_THREAD_QUEUE_SIZE);
+		if (ok != 0) {
+			fprintf(stderr, "[flutter-pi] Could not create input thread queue. Input will be handled on the main thread. spscq_init: %s\n", strerror(ok));
+			flutterpi.input.thread.enabled = false;
+		} else {
+			flutterpi.input.thread.space_available_fd = eventfd(0, EFD_CLOEXEC);
+			flutterpi.input.thread.stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+			if ((flutterpi.input.thread.space_available_fd < 0) || (flutterpi.input.thread.stop_fd < 0)) {
+				perror("[flutter-pi] Could not create input thread eventfd. Input will be handled on the main thread. eventfd");
+				if (flutterpi.input.thread.space_available_fd >= 0) {
+					close(flutterpi.input.thread.space_available_fd);
+				}
+				if (flutterpi.input.thread.stop_fd >= 0) {
+					close(flutterpi.input.thread.stop_fd);
+				}
+				spscq_deinit(&flutterpi.input.thread.queue);
+				flutterpi.input.thread.enabled = false;
+			} else {
+				atomic_init(&flutterpi.input.thread.drain_pending, false);
+				atomic_init(&flutterpi.input.thread.waiting_for_space, false);
+				atomic_init(&flutterpi.input.thread.should_stop, false);
+				atomic_init(&flutterpi.input.thread.n_queue_full, 0);
+				init_pointer_event_batch(&flutterpi.input.thread.pointer_event_batch);
+			}
+		}
+	} else {
+		flutterpi.input.thread.enabled = false;
+	}
+
 	if (libinput != NULL) {
-		ok = sd_event_add_io(
-			flutterpi.event_loop,
-			&libinput_event_source,
-			libinput_get_fd(libinput),
-			EPOLLIN | EPOLLRDHUP | EPOLLPRI,
-			on_libinput_ready,
-			NULL
-		);
-		if (ok < 0) {
-			fprintf(stderr, "[flutter-pi] Could not add libinput callback to main loop. sd_event_add_io: %s\n", strerror(-ok));
-#			ifndef BUILD_WITHOUT_UDEV_SUPPORT
-				if (libinput_get_user_data(libinput) != NULL) {
-					struct udev *udev = libinput_get_user_data(libinput);
-					libinput_unref(libinput);
-					flutterpi.input.libudev.udev_unref(udev);
-				} else {
+		// with an input thread, libinput is dispatched by the input thread. (see start_input_thread)
+		if (!flutterpi.input.thread.enabled) {
+			ok = flutterpi_sd_event_add_io(
+				&libinput_event_source,
+				libinput_get_fd(libinput),
+				EPOLLIN | EPOLLRDHUP | EPOLLPRI,
+				on_libinput_ready,
+				NULL
+			);
+			if (ok != 0) {
+				fprintf(stderr, "[flutter-pi] Could not add libinput callback to main loop. flutterpi_sd_event_add_io: %s\n", strerror(ok));
+#				ifndef BUILD_WITHOUT_UDEV_SUPPORT
+					if (libinput_get_user_data(libinput) != NULL) {
+						struct udev *udev = libinput_get_user_data(libinput);
+						libinput_unref(libinput);
+						flutterpi.input.libudev.udev_unref(udev);
+					} else {
+						libinput_unref(libinput);
+					}
+#				else
 					libinput_unref(libinput);
-				}
-#			else
-				libinput_unref(libinput);
-#			endif
-			return -ok;
+#				endif
+				return ok;
+			}
 		}
 		
 		if (flutterpi.input.disable_text_input == false) {
@@ -2507,7 +4829,7 @@ static int init_user_input(void) {
 				fprintf(stderr, "[flutter-pi] Could not initialize keyboard configuration. Flutter-pi will run without text/raw keyboard input.\n");
 			}
 		}
-	} else {
+	} else if (flutterpi.input.replay.path == NULL) {
 		fprintf(stderr, "[flutter-pi] Could not initialize input. Flutter-pi will run without user input.\n");
 	}
 
@@ -2515,9 +4837,164 @@ static int init_user_input(void) {
 	flutterpi.input.libinput_event_source = libinput_event_source;
 	flutterpi.input.keyboard_config = kbdcfg;
 
+	init_pointer_event_batch(&flutterpi.input.pointer_event_batch);
+
+	if (flutterpi.input.recording.path != NULL) {
+		ok = input_recorder_open(&flutterpi.input.recording.recorder, flutterpi.input.recording.path);
+		if (ok != 0) {
+			fprintf(stderr, "[flutter-pi] Could not open input recording \"%s\" for writing. input_recorder_open: %s\n", flutterpi.input.recording.path, strerror(ok));
+			return ok;
+		}
+	}
+
+	if (flutterpi.input.replay.path != NULL) {
+		ok = input_replayer_open(&flutterpi.input.replay.replayer, flutterpi.input.replay.path);
+		if (ok != 0) {
+			fprintf(stderr, "[flutter-pi] Could not open input recording \"%s\". input_replayer_open: %s\n", flutterpi.input.replay.path, strerror(ok));
+			return ok;
+		}
+
+		flutterpi.input.replay.has_next_event = false;
+
+		flutterpi.input.replay.timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+		if (flutterpi.input.replay.timerfd < 0) {
+			perror("[flutter-pi] Could not create input replay timer. timerfd_create");
+			input_replayer_close(&flutterpi.input.replay.replayer);
+			return errno;
+		}
+
+		ok = flutterpi_sd_event_add_io(
+			&flutterpi.input.replay.source,
+			flutterpi.input.replay.timerfd,
+			EPOLLIN,
+			on_input_replay_timer,
+			NULL
+		);
+		if (ok != 0) {
+			fprintf(stderr, "[flutter-pi] Could not add input replay timer to event loop. flutterpi_sd_event_add_io: %s\n", strerror(ok));
+			close(flutterpi.input.replay.timerfd);
+			input_replayer_close(&flutterpi.input.replay.replayer);
+			return ok;
+		}
+	}
+
+	if (flutterpi.input.resampling.enabled) {
+		input_resampler_init(&flutterpi.input.resampling.resampler);
+		flutterpi.input.resampling.is_armed = false;
+
+		flutterpi.input.resampling.timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+		if (flutterpi.input.resampling.timerfd < 0) {
+			perror("[flutter-pi] Could not create input resampling timer. Input will not be resampled. timerfd_create");
+			flutterpi.input.resampling.enabled = false;
+			return 0;
+		}
+
+		ok = flutterpi_sd_event_add_io(
+			&flutterpi.input.resampling.source,
+			flutterpi.input.resampling.timerfd,
+			EPOLLIN,
+			on_input_resampling_timer,
+			NULL
+		);
+		if (ok != 0) {
+			fprintf(stderr, "[flutter-pi] Could not add input resampling timer to event loop. Input will not be resampled. flutterpi_sd_event_add_io: %s\n", strerror(ok));
+			close(flutterpi.input.resampling.timerfd);
+			flutterpi.input.resampling.enabled = false;
+		}
+	}
+
+	return 0;
+}
+
+/// Starts the input thread if --input-thread was given. Must be called after the
+/// engine is running, since the input thread sends pointer events to it right away.
+static int start_input_thread(void) {
+	int ok;
+
+	if (!flutterpi.input.thread.enabled) {
+		return 0;
+	}
+
+	ok = pthread_create(&flutterpi.input.thread.thread, NULL, input_thread_main, NULL);
+	if (ok != 0) {
+		fprintf(stderr, "[flutter-pi] Could not start input thread. Input will be handled on the main thread. pthread_create: %s\n", strerror(ok));
+
+		flutterpi.input.thread.enabled = false;
+		spscq_deinit(&flutterpi.input.thread.queue);
+		close(flutterpi.input.thread.space_available_fd);
+		close(flutterpi.input.thread.stop_fd);
+
+		ok = flutterpi_sd_event_add_io(
+			&flutterpi.input.libinput_event_source,
+			libinput_get_fd(flutterpi.input.libinput),
+			EPOLLIN | EPOLLRDHUP | EPOLLPRI,
+			on_libinput_ready,
+			NULL
+		);
+		if (ok != 0) {
+			fprintf(stderr, "[flutter-pi] Could not add libinput callback to main loop. flutterpi_sd_event_add_io: %s\n", strerror(ok));
+			return ok;
+		}
+	}
+
 	return 0;
 }
 
+/// Stops the input thread and waits for it to exit. Must be called on the main thread,
+/// before the main loop is destroyed, since the input thread posts tasks to it.
+static void stop_input_thread(void) {
+	int ok;
+
+	if (!flutterpi.input.thread.enabled) {
+		return;
+	}
+
+	atomic_store(&flutterpi.input.thread.should_stop, true);
+
+	// the input thread either polls for input events or waits for room in the queue.
+	ok = write(flutterpi.input.thread.stop_fd, (uint8_t[8]) {0, 0, 0, 0, 0, 0, 0, 1}, 8);
+	if (ok < 0) {
+		perror("[flutter-pi] Could not stop the input thread. write");
+		return;
+	}
+
+	ok = write(flutterpi.input.thread.space_available_fd, (uint8_t[8]) {0, 0, 0, 0, 0, 0, 0, 1}, 8);
+	if (ok < 0) {
+		perror("[flutter-pi] Could not stop the input thread. write");
+		return;
+	}
+
+	pthread_join(flutterpi.input.thread.thread, NULL);
+
+	flutterpi.input.thread.enabled = false;
+	spscq_deinit(&flutterpi.input.thread.queue);
+	close(flutterpi.input.thread.space_available_fd);
+	close(flutterpi.input.thread.stop_fd);
+}
+
+/// Starts replaying the recorded input if --replay-input was given.
+/// Must be called after the engine is running.
+static int start_input_replay(void) {
+	int ok;
+
+	if (flutterpi.input.replay.path == NULL) {
+		return 0;
+	}
+
+	flutterpi.input.replay.start_time = get_monotonic_time_ns() / 1000;
+
+	ok = input_replayer_read(&flutterpi.input.replay.replayer, &flutterpi.input.replay.next_event);
+	if (ok != 0) {
+		fprintf(stderr, "[flutter-pi] Input recording \"%s\" is empty or corrupt.\n", flutterpi.input.replay.path);
+		finish_input_replay();
+		return 0;
+	}
+
+	flutterpi.input.replay.has_next_event = true;
+	flutterpi.input.replay.first_event_time = flutterpi.input.replay.next_event.time_us;
+
+	return arm_input_replay_timer(flutterpi.input.replay.start_time);
+}
 
 static bool setup_paths(void) {
 	char *kernel_blob_path, *icu_data_path, *app_elf_path;
@@ -2558,6 +5035,18 @@ static bool setup_paths(void) {
 	#undef PATH_EXISTS
 }
 
+/// getopt values of long options that don't have a short option.
+enum {
+	kOptionSlowCallbackThreshold = 256,
+	kOptionFrameQueueDepth,
+	kOptionIdleRefreshRate,
+	kOptionIdleTimeout,
+	kOptionPrewarmRendertargets,
+	kOptionRenderer,
+	kOptionRecordInput,
+	kOptionReplayInput
+};
+
 static bool parse_cmd_args(int argc, char **argv) {
 	glob_t input_devices_glob = {0};
 	bool input_specified = false;
@@ -2565,6 +5054,19 @@ static bool parse_cmd_args(int argc, char **argv) {
 	int longopt_index = 0;
 	int runtime_mode_int = kDebug;
 	int disable_text_input_int = false;
+	int dump_loop_stats_int = false;
+	int explicit_sync_int = false;
+	int resample_input_int = false;
+	int input_thread_int = false;
+	int replay_input_fast_int = false;
+	const char *record_input_path = NULL;
+	const char *replay_input_path = NULL;
+	double slow_callback_threshold_ms = 4.0;
+	long frame_queue_depth = 1;
+	long idle_refresh_rate = 0;
+	long idle_timeout_ms = 5000;
+	long n_prewarmed_rendertargets = 0;
+	enum renderer_type renderer_type = kOpenGLRenderer;
 	int ok;
 
 	struct option long_options[] = {
@@ -2574,6 +5076,19 @@ static bool parse_cmd_args(int argc, char **argv) {
 		{"rotation", required_argument, NULL, 'r'},
 		{"no-text-input", no_argument, &disable_text_input_int, true},
 		{"dimensions", required_argument, NULL, 'd'},
+		{"slow-callback-threshold", required_argument, NULL, kOptionSlowCallbackThreshold},
+		{"dump-loop-stats", no_argument, &dump_loop_stats_int, true},
+		{"explicit-sync", no_argument, &explicit_sync_int, true},
+		{"frame-queue-depth", required_argument, NULL, kOptionFrameQueueDepth},
+		{"idle-refresh-rate", required_argument, NULL, kOptionIdleRefreshRate},
+		{"idle-timeout", required_argument, NULL, kOptionIdleTimeout},
+		{"prewarm-rendertargets", required_argument, NULL, kOptionPrewarmRendertargets},
+		{"renderer", required_argument, NULL, kOptionRenderer},
+		{"resample-input", no_argument, &resample_input_int, true},
+		{"input-thread", no_argument, &input_thread_int, true},
+		{"record-input", required_argument, NULL, kOptionRecordInput},
+		{"replay-input", required_argument, NULL, kOptionReplayInput},
+		{"replay-input-fast", no_argument, &replay_input_fast_int, true},
 		{"help", no_argument, 0, 'h'},
 		{0, 0, 0, 0}
 	};
@@ -2648,6 +5163,89 @@ static bool parse_cmd_args(int argc, char **argv) {
 				flutterpi.display.height_mm = height_mm;
 				
 				break;
+
+			case kOptionSlowCallbackThreshold: ;
+				char *endptr;
+
+				slow_callback_threshold_ms = strtod(optarg, &endptr);
+				if ((endptr == optarg) || (*endptr != '\0') || (slow_callback_threshold_ms < 0)) {
+					fprintf(stderr, "ERROR: Invalid argument for --slow-callback-threshold passed.\n%s", usage);
+					return false;
+				}
+
+				break;
+
+			case kOptionFrameQueueDepth:
+				errno = 0;
+				frame_queue_depth = strtol(optarg, NULL, 0);
+				if ((errno != 0) || (frame_queue_depth < 1) || (frame_queue_depth > FRAME_QUEUE_MAX_DEPTH)) {
+					fprintf(
+						stderr,
+						"ERROR: Invalid argument for --frame-queue-depth passed.\n"
+						"Valid values are 1, 2, 3.\n"
+						"%s",
+						usage
+					);
+					return false;
+				}
+
+				break;
+
+			case kOptionIdleRefreshRate:
+				errno = 0;
+				idle_refresh_rate = strtol(optarg, NULL, 0);
+				if ((errno != 0) || (idle_refresh_rate <= 0)) {
+					fprintf(stderr, "ERROR: Invalid argument for --idle-refresh-rate passed.\n%s", usage);
+					return false;
+				}
+
+				break;
+
+			case kOptionIdleTimeout:
+				errno = 0;
+				idle_timeout_ms = strtol(optarg, NULL, 0);
+				if ((errno != 0) || (idle_timeout_ms <= 0)) {
+					fprintf(stderr, "ERROR: Invalid argument for --idle-timeout passed.\n%s", usage);
+					return false;
+				}
+
+				break;
+
+			case kOptionPrewarmRendertargets:
+				errno = 0;
+				n_prewarmed_rendertargets = strtol(optarg, NULL, 0);
+				if ((errno != 0) || (n_prewarmed_rendertargets < 0) || (n_prewarmed_rendertargets > CPSET_DEFAULT_MAX_SIZE / 2)) {
+					fprintf(stderr, "ERROR: Invalid argument for --prewarm-rendertargets passed.\n%s", usage);
+					return false;
+				}
+
+				break;
+
+			case kOptionRenderer:
+				if (STREQ(optarg, "opengl")) {
+					renderer_type = kOpenGLRenderer;
+				} else if (STREQ(optarg, "software")) {
+					renderer_type = kSoftwareRenderer;
+				} else {
+					fprintf(
+						stderr,
+						"ERROR: Invalid argument for --renderer passed.\n"
+						"Valid values are \"opengl\", \"software\".\n"
+						"%s",
+						usage
+					);
+					return false;
+				}
+
+				break;
+
+			case kOptionRecordInput:
+				record_input_path = optarg;
+				break;
+
+			case kOptionReplayInput:
+				replay_input_path = optarg;
+				break;
 			
 			case 'h':
 				printf("%s", usage);
@@ -2667,6 +5265,22 @@ static bool parse_cmd_args(int argc, char **argv) {
 		}
 	}
 	
+	if ((record_input_path != NULL) && (replay_input_path != NULL)) {
+		fprintf(stderr, "ERROR: --record-input and --replay-input can't be used at the same time.\n%s", usage);
+		return false;
+	}
+
+	if (input_thread_int && (replay_input_path != NULL)) {
+		// the replay runs on the main thread, the input thread would process libinput concurrently.
+		fprintf(stderr, "ERROR: --input-thread and --replay-input can't be used at the same time.\n%s", usage);
+		return false;
+	}
+
+	if (replay_input_fast_int && (replay_input_path == NULL)) {
+		fprintf(stderr, "ERROR: --replay-input-fast needs --replay-input.\n%s", usage);
+		return false;
+	}
+
 	if (!input_specified) {
 		// user specified no input devices. use "/dev/input/event*"".
 		glob("/dev/input/event*", GLOB_BRACE | GLOB_TILDE, NULL, &input_devices_glob);
@@ -2682,7 +5296,20 @@ static bool parse_cmd_args(int argc, char **argv) {
 	flutterpi.flutter.asset_bundle_path = strdup(argv[optind]);
 	flutterpi.flutter.runtime_mode = runtime_mode_int;
 	flutterpi.input.disable_text_input = disable_text_input_int;
+	flutterpi.input.resampling.enabled = resample_input_int;
+	flutterpi.input.thread.enabled = input_thread_int;
+	flutterpi.input.recording.path = record_input_path;
+	flutterpi.input.replay.path = replay_input_path;
+	flutterpi.input.replay.as_fast_as_possible = replay_input_fast_int;
 	flutterpi.input.input_devices_glob = input_devices_glob;
+	flutterpi.loop_stats.slow_callback_threshold_ns = slow_callback_threshold_ms * 1000000.0;
+	flutterpi.loop_stats.dump_on_exit = dump_loop_stats_int;
+	flutterpi.use_explicit_sync = explicit_sync_int;
+	flutterpi.frame_queue_depth = frame_queue_depth;
+	flutterpi.idle.refresh_rate = idle_refresh_rate;
+	flutterpi.idle.timeout_ns = idle_timeout_ms * 1000000ull;
+	flutterpi.n_prewarmed_rendertargets = n_prewarmed_rendertargets;
+	flutterpi.renderer_type = renderer_type;
 
 	argv[optind] = argv[0];
 	flutterpi.flutter.engine_argc = argc - optind;
@@ -2724,6 +5351,16 @@ int init(int argc, char **argv) {
 		return ok;
 	}
 
+	ok = start_input_thread();
+	if (ok != 0) {
+		return ok;
+	}
+
+	ok = start_input_replay();
+	if (ok != 0) {
+		return ok;
+	}
+
 	return 0;
 }
 
@@ -2732,7 +5369,12 @@ int run() {
 }
 
 void deinit() {
-	return;
+	// The input thread and the KMS commit thread post tasks to the main loop,
+	// so they need to be stopped before the main loop is destroyed.
+	stop_input_thread();
+	compositor_deinitialize();
+	deinit_main_loop();
+	frame_telemetry_deinit(&flutterpi.frame_telemetry);
 }
 
 int main(int argc, char **argv) {
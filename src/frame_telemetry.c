@@ -0,0 +1,136 @@
+#include <inttypes.h>
+
+#include <frame_telemetry.h>
+
+int frame_telemetry_init(
+	struct frame_telemetry *telemetry
+) {
+	int ok;
+
+	ok = spscq_init(&telemetry->records, sizeof(struct frame_timings), FRAME_TELEMETRY_N_RECORDS);
+	if (ok != 0) {
+		return ok;
+	}
+
+	atomic_init(&telemetry->n_frames, 0);
+
+	latency_histogram_init(&telemetry->frame_latency, "frame latency");
+	latency_histogram_init(&telemetry->build_duration, "frame build duration");
+	latency_histogram_init(&telemetry->commit_duration, "commit duration");
+	latency_histogram_init(&telemetry->flip_latency, "commit to pageflip latency");
+	latency_histogram_init(&telemetry->input_to_photon, "input to photon latency (estimate)");
+
+	atomic_init(&telemetry->n_late_frames, 0);
+	atomic_init(&telemetry->n_missed_vblanks, 0);
+	atomic_init(&telemetry->n_dropped_frames, 0);
+	atomic_init(&telemetry->n_discarded_records, 0);
+
+	return 0;
+}
+
+void frame_telemetry_deinit(
+	struct frame_telemetry *telemetry
+) {
+	spscq_deinit(&telemetry->records);
+}
+
+void frame_telemetry_add_frame(
+	struct frame_telemetry *telemetry,
+	const struct frame_timings *timings,
+	uint64_t refresh_period_ns
+) {
+	uint64_t n_missed, photon_time;
+	int ok;
+
+	atomic_fetch_add_explicit(&telemetry->n_frames, 1, memory_order_relaxed);
+
+	// Only the consumer may advance the read index, so when the ring is full
+	// the newest record is discarded instead of the oldest one.
+	ok = spscq_try_enqueue(&telemetry->records, timings);
+	if (ok != 0) {
+		atomic_fetch_add_explicit(&telemetry->n_discarded_records, 1, memory_order_relaxed);
+	}
+
+	if (timings->vsync_reply_time && timings->flip_time) {
+		latency_histogram_record(&telemetry->frame_latency, timings->flip_time - timings->vsync_reply_time);
+	}
+	if (timings->vsync_reply_time && timings->present_time) {
+		latency_histogram_record(&telemetry->build_duration, timings->present_time - timings->vsync_reply_time);
+	}
+	if (timings->present_time && timings->commit_time) {
+		latency_histogram_record(&telemetry->commit_duration, timings->commit_time - timings->present_time);
+	}
+	if (timings->commit_time && (timings->flip_time > timings->commit_time)) {
+		latency_histogram_record(&telemetry->flip_latency, timings->flip_time - timings->commit_time);
+	}
+
+	// The display shows the frame while it's scanned out after the flip.
+	// Use the middle of the scanout as the estimate for when the input became visible.
+	if (timings->input_time && timings->flip_time) {
+		photon_time = timings->flip_time + refresh_period_ns / 2;
+		if (photon_time > timings->input_time) {
+			latency_histogram_record(&telemetry->input_to_photon, photon_time - timings->input_time);
+		}
+	}
+
+	// A frame that's flipped more than half a refresh period after its
+	// target vblank was actually shown one (or more) vblanks late.
+	if (refresh_period_ns && timings->target_vblank_time && (timings->flip_time > timings->target_vblank_time + refresh_period_ns / 2)) {
+		n_missed = (timings->flip_time - timings->target_vblank_time + refresh_period_ns / 2) / refresh_period_ns;
+
+		atomic_fetch_add_explicit(&telemetry->n_late_frames, 1, memory_order_relaxed);
+		atomic_fetch_add_explicit(&telemetry->n_missed_vblanks, n_missed, memory_order_relaxed);
+	}
+}
+
+void frame_telemetry_add_dropped_frame(
+	struct frame_telemetry *telemetry
+) {
+	atomic_fetch_add_explicit(&telemetry->n_dropped_frames, 1, memory_order_relaxed);
+}
+
+size_t frame_telemetry_take_recent_frames(
+	struct frame_telemetry *telemetry,
+	struct frame_timings *timings_out,
+	size_t max_frames
+) {
+	size_t n_taken;
+
+	for (n_taken = 0; n_taken < max_frames; n_taken++) {
+		if (spscq_try_dequeue(&telemetry->records, timings_out + n_taken) != 0) {
+			break;
+		}
+	}
+
+	return n_taken;
+}
+
+void frame_telemetry_print(
+	struct frame_telemetry *telemetry,
+	FILE *file
+) {
+	fprintf(file, "[flutter-pi] frame statistics:\n");
+
+	latency_histogram_print(&telemetry->frame_latency, file);
+	latency_histogram_print(&telemetry->build_duration, file);
+	latency_histogram_print(&telemetry->commit_duration, file);
+	latency_histogram_print(&telemetry->flip_latency, file);
+	latency_histogram_print(&telemetry->input_to_photon, file);
+
+	fprintf(
+		file,
+		"  frames: %" PRIu64 ", late: %" PRIu64 ", missed vblanks: %" PRIu64 ", dropped: %" PRIu64 "\n",
+		atomic_load_explicit(&telemetry->n_frames, memory_order_relaxed),
+		atomic_load_explicit(&telemetry->n_late_frames, memory_order_relaxed),
+		atomic_load_explicit(&telemetry->n_missed_vblanks, memory_order_relaxed),
+		atomic_load_explicit(&telemetry->n_dropped_frames, memory_order_relaxed)
+	);
+
+	fprintf(
+		file,
+		"  discarded frame records: %" PRIu64 "\n",
+		atomic_load_explicit(&telemetry->n_discarded_records, memory_order_relaxed)
+	);
+
+	fflush(file);
+}
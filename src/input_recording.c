@@ -0,0 +1,276 @@
+#include <errno.h>
+#include <string.h>
+
+#include <input_recording.h>
+
+/// The biggest record (type, time, pointer event payload), in bytes.
+#define MAX_RECORD_SIZE 64
+
+static size_t put_u8(uint8_t *buffer, size_t offset, uint8_t value) {
+	buffer[offset] = value;
+	return offset + 1;
+}
+
+static size_t put_u32(uint8_t *buffer, size_t offset, uint32_t value) {
+	for (int i = 0; i < 4; i++) {
+		buffer[offset + i] = (value >> (i * 8)) & 0xFF;
+	}
+	return offset + 4;
+}
+
+static size_t put_u64(uint8_t *buffer, size_t offset, uint64_t value) {
+	for (int i = 0; i < 8; i++) {
+		buffer[offset + i] = (value >> (i * 8)) & 0xFF;
+	}
+	return offset + 8;
+}
+
+static size_t put_f64(uint8_t *buffer, size_t offset, double value) {
+	uint64_t bits;
+
+	memcpy(&bits, &value, sizeof(bits));
+	return put_u64(buffer, offset, bits);
+}
+
+static uint32_t get_u32(const uint8_t *buffer, size_t *offset) {
+	uint32_t value = 0;
+
+	for (int i = 0; i < 4; i++) {
+		value |= (uint32_t) buffer[*offset + i] << (i * 8);
+	}
+	*offset += 4;
+
+	return value;
+}
+
+static uint64_t get_u64(const uint8_t *buffer, size_t *offset) {
+	uint64_t value = 0;
+
+	for (int i = 0; i < 8; i++) {
+		value |= (uint64_t) buffer[*offset + i] << (i * 8);
+	}
+	*offset += 8;
+
+	return value;
+}
+
+static double get_f64(const uint8_t *buffer, size_t *offset) {
+	uint64_t bits;
+	double value;
+
+	bits = get_u64(buffer, offset);
+	memcpy(&value, &bits, sizeof(value));
+
+	return value;
+}
+
+/// Returns the size of the payload of an event of the given type, or -1 if the type is unknown.
+static int get_payload_size(uint8_t type) {
+	switch (type) {
+		case kInputRecordingPointerEvent: return 2 + 8 * 5;
+		case kInputRecordingCursorPos: return 8;
+		case kInputRecordingShowCursor: return 0;
+		case kInputRecordingRawKeyEvent: return 4 * 4 + 1;
+		case kInputRecordingUtf8Char: return 4;
+		case kInputRecordingXkbKeysym: return 4;
+		default: return -1;
+	}
+}
+
+int input_recorder_open(
+	struct input_recorder *recorder,
+	const char *path
+) {
+	uint8_t header[sizeof(INPUT_RECORDING_MAGIC) + 4];
+	FILE *file;
+	size_t offset;
+
+	file = fopen(path, "wb");
+	if (file == NULL) {
+		return errno;
+	}
+
+	memcpy(header, INPUT_RECORDING_MAGIC, sizeof(INPUT_RECORDING_MAGIC));
+	offset = put_u32(header, sizeof(INPUT_RECORDING_MAGIC), INPUT_RECORDING_VERSION);
+
+	if (fwrite(header, offset, 1, file) != 1) {
+		fclose(file);
+		return EIO;
+	}
+
+	recorder->file = file;
+	recorder->n_events = 0;
+
+	return 0;
+}
+
+int input_recorder_write(
+	struct input_recorder *recorder,
+	const struct input_recording_event *event
+) {
+	uint8_t buffer[MAX_RECORD_SIZE];
+	size_t offset;
+
+	offset = put_u8(buffer, 0, event->type);
+	offset = put_u64(buffer, offset, event->time_us);
+
+	switch (event->type) {
+		case kInputRecordingPointerEvent:
+			offset = put_u8(buffer, offset, event->pointer_event.phase);
+			offset = put_u8(buffer, offset, event->pointer_event.device_kind);
+			offset = put_u64(buffer, offset, (uint64_t) event->pointer_event.device);
+			offset = put_u64(buffer, offset, (uint64_t) event->pointer_event.buttons);
+			offset = put_u64(buffer, offset, event->pointer_event.timestamp);
+			offset = put_f64(buffer, offset, event->pointer_event.x);
+			offset = put_f64(buffer, offset, event->pointer_event.y);
+			break;
+		case kInputRecordingCursorPos:
+			offset = put_u32(buffer, offset, (uint32_t) event->cursor_pos.x);
+			offset = put_u32(buffer, offset, (uint32_t) event->cursor_pos.y);
+			break;
+		case kInputRecordingShowCursor:
+			break;
+		case kInputRecordingRawKeyEvent:
+			offset = put_u32(buffer, offset, event->raw_key_event.unicode_scalar_values);
+			offset = put_u32(buffer, offset, event->raw_key_event.key_code);
+			offset = put_u32(buffer, offset, event->raw_key_event.scan_code);
+			offset = put_u32(buffer, offset, event->raw_key_event.modifiers);
+			offset = put_u8(buffer, offset, event->raw_key_event.is_down);
+			break;
+		case kInputRecordingUtf8Char:
+			memcpy(buffer + offset, event->utf8_char, 4);
+			offset += 4;
+			break;
+		case kInputRecordingXkbKeysym:
+			offset = put_u32(buffer, offset, event->keysym);
+			break;
+		default:
+			return EINVAL;
+	}
+
+	if (fwrite(buffer, offset, 1, recorder->file) != 1) {
+		return EIO;
+	}
+
+	recorder->n_events++;
+
+	return 0;
+}
+
+void input_recorder_flush(
+	struct input_recorder *recorder
+) {
+	fflush(recorder->file);
+}
+
+void input_recorder_close(
+	struct input_recorder *recorder
+) {
+	fclose(recorder->file);
+	recorder->file = NULL;
+}
+
+int input_replayer_open(
+	struct input_replayer *replayer,
+	const char *path
+) {
+	uint8_t header[sizeof(INPUT_RECORDING_MAGIC) + 4];
+	FILE *file;
+	size_t offset;
+
+	file = fopen(path, "rb");
+	if (file == NULL) {
+		return errno;
+	}
+
+	if (fread(header, sizeof(header), 1, file) != 1) {
+		fclose(file);
+		return EINVAL;
+	}
+
+	offset = sizeof(INPUT_RECORDING_MAGIC);
+	if ((memcmp(header, INPUT_RECORDING_MAGIC, sizeof(INPUT_RECORDING_MAGIC)) != 0) || (get_u32(header, &offset) != INPUT_RECORDING_VERSION)) {
+		fclose(file);
+		return EINVAL;
+	}
+
+	replayer->file = file;
+	replayer->n_events = 0;
+
+	return 0;
+}
+
+int input_replayer_read(
+	struct input_replayer *replayer,
+	struct input_recording_event *event_out
+) {
+	uint8_t buffer[MAX_RECORD_SIZE];
+	size_t offset;
+	int type, payload_size;
+
+	type = fgetc(replayer->file);
+	if (type == EOF) {
+		return ENODATA;
+	}
+
+	payload_size = get_payload_size(type);
+	if (payload_size < 0) {
+		return EINVAL;
+	}
+
+	if (fread(buffer, 8 + payload_size, 1, replayer->file) != 1) {
+		return EINVAL;
+	}
+
+	memset(event_out, 0, sizeof(*event_out));
+
+	offset = 0;
+	event_out->type = type;
+	event_out->time_us = get_u64(buffer, &offset);
+
+	switch (type) {
+		case kInputRecordingPointerEvent:
+			event_out->pointer_event.struct_size = sizeof(FlutterPointerEvent);
+			event_out->pointer_event.phase = buffer[offset++];
+			event_out->pointer_event.device_kind = buffer[offset++];
+			event_out->pointer_event.device = (int64_t) get_u64(buffer, &offset);
+			event_out->pointer_event.buttons = (int64_t) get_u64(buffer, &offset);
+			event_out->pointer_event.timestamp = get_u64(buffer, &offset);
+			event_out->pointer_event.x = get_f64(buffer, &offset);
+			event_out->pointer_event.y = get_f64(buffer, &offset);
+			event_out->pointer_event.signal_kind = kFlutterPointerSignalKindNone;
+			break;
+		case kInputRecordingCursorPos:
+			event_out->cursor_pos.x = (int32_t) get_u32(buffer, &offset);
+			event_out->cursor_pos.y = (int32_t) get_u32(buffer, &offset);
+			break;
+		case kInputRecordingShowCursor:
+			break;
+		case kInputRecordingRawKeyEvent:
+			event_out->raw_key_event.unicode_scalar_values = get_u32(buffer, &offset);
+			event_out->raw_key_event.key_code = get_u32(buffer, &offset);
+			event_out->raw_key_event.scan_code = get_u32(buffer, &offset);
+			event_out->raw_key_event.modifiers = get_u32(buffer, &offset);
+			event_out->raw_key_event.is_down = buffer[offset++] != 0;
+			break;
+		case kInputRecordingUtf8Char:
+			memcpy(event_out->utf8_char, buffer + offset, 4);
+			break;
+		case kInputRecordingXkbKeysym:
+			event_out->keysym = get_u32(buffer, &offset);
+			break;
+		default:
+			return EINVAL;
+	}
+
+	replayer->n_events++;
+
+	return 0;
+}
+
+void input_replayer_close(
+	struct input_replayer *replayer
+) {
+	fclose(replayer->file);
+	replayer->file = NULL;
+}
@@ -0,0 +1,174 @@
+#include <string.h>
+
+#include <input_resampler.h>
+
+void input_resampler_init(
+	struct input_resampler *resampler
+) {
+	memset(resampler, 0, sizeof(*resampler));
+}
+
+static bool is_motion_event(const FlutterPointerEvent *event) {
+	return ((event->phase == kMove) || (event->phase == kHover)) && (event->signal_kind == kFlutterPointerSignalKindNone);
+}
+
+static struct input_resampler_pointer *get_pointer(struct input_resampler *resampler, int64_t device, bool create) {
+	struct input_resampler_pointer *unused = NULL;
+
+	for (int i = 0; i < INPUT_RESAMPLER_MAX_POINTERS; i++) {
+		if (resampler->pointers[i].in_use) {
+			if (resampler->pointers[i].device == device) {
+				return resampler->pointers + i;
+			}
+		} else if (unused == NULL) {
+			unused = resampler->pointers + i;
+		}
+	}
+
+	if (!create || (unused == NULL)) {
+		return NULL;
+	}
+
+	memset(unused, 0, sizeof(*unused));
+	unused->in_use = true;
+	unused->device = device;
+
+	return unused;
+}
+
+static void add_sample(struct input_resampler_pointer *pointer, const FlutterPointerEvent *event) {
+	pointer->x[0] = pointer->x[1];
+	pointer->y[0] = pointer->y[1];
+	pointer->timestamp[0] = pointer->timestamp[1];
+
+	pointer->x[1] = event->x;
+	pointer->y[1] = event->y;
+	pointer->timestamp[1] = event->timestamp;
+
+	if (pointer->n_samples < 2) {
+		pointer->n_samples++;
+	}
+}
+
+size_t input_resampler_add_event(
+	struct input_resampler *resampler,
+	const FlutterPointerEvent *event,
+	FlutterPointerEvent *events_out
+) {
+	struct input_resampler_pointer *pointer;
+	size_t n_events;
+
+	if (is_motion_event(event)) {
+		pointer = get_pointer(resampler, event->device, true);
+		if (pointer == NULL) {
+			resampler->n_passed_through++;
+			events_out[0] = *event;
+			return 1;
+		}
+
+		if (pointer->has_pending) {
+			resampler->n_coalesced++;
+		} else {
+			pointer->has_pending = true;
+			pointer->pending_since = event->timestamp;
+			resampler->n_pending++;
+		}
+
+		pointer->pending = *event;
+		add_sample(pointer, event);
+
+		return 0;
+	}
+
+	n_events = 0;
+
+	pointer = get_pointer(resampler, event->device, event->phase == kDown);
+	if (pointer != NULL) {
+		// send the motion before this event exactly as it was reported,
+		// so the down / up / button change happens at the right position.
+		if (pointer->has_pending) {
+			events_out[n_events++] = pointer->pending;
+			pointer->has_pending = false;
+			resampler->n_pending--;
+		}
+
+		if ((event->phase == kUp) || (event->phase == kCancel) || (event->phase == kRemove)) {
+			// the touch slot / device might be reused by a different finger later.
+			pointer->in_use = false;
+		} else if (event->phase == kDown) {
+			// don't predict a new stroke using the positions of the last one.
+			pointer->n_samples = 0;
+			add_sample(pointer, event);
+			pointer->last_sent_timestamp = event->timestamp;
+		} else {
+			add_sample(pointer, event);
+			pointer->last_sent_timestamp = event->timestamp;
+		}
+	}
+
+	events_out[n_events++] = *event;
+	return n_events;
+}
+
+size_t input_resampler_resample(
+	struct input_resampler *resampler,
+	size_t sample_time_us,
+	FlutterPointerEvent *events_out,
+	size_t n_max
+) {
+	struct input_resampler_pointer *pointer;
+	FlutterPointerEvent *event;
+	size_t n_events, delta, max_extrapolation, target;
+	double alpha;
+
+	n_events = 0;
+	resampler->oldest_input_timestamp = 0;
+	for (int i = 0; (i < INPUT_RESAMPLER_MAX_POINTERS) && (n_events < n_max) && resampler->n_pending; i++) {
+		pointer = resampler->pointers + i;
+		if (!pointer->in_use || !pointer->has_pending) {
+			continue;
+		}
+
+		event = events_out + n_events++;
+		*event = pointer->pending;
+
+		pointer->has_pending = false;
+		resampler->n_pending--;
+
+		if ((resampler->oldest_input_timestamp == 0) || (pointer->pending_since < resampler->oldest_input_timestamp)) {
+			resampler->oldest_input_timestamp = pointer->pending_since;
+		}
+
+		delta = pointer->timestamp[1] - pointer->timestamp[0];
+		if ((pointer->n_samples == 2) && (pointer->timestamp[1] > pointer->timestamp[0]) &&
+			(delta >= INPUT_RESAMPLER_MIN_SAMPLE_DELTA_US) && (delta <= INPUT_RESAMPLER_MAX_SAMPLE_DELTA_US))
+		{
+			max_extrapolation = delta / 2;
+			if (max_extrapolation > INPUT_RESAMPLER_MAX_EXTRAPOLATION_US) {
+				max_extrapolation = INPUT_RESAMPLER_MAX_EXTRAPOLATION_US;
+			}
+
+			target = sample_time_us;
+			if (target > pointer->timestamp[1] + max_extrapolation) {
+				target = pointer->timestamp[1] + max_extrapolation;
+			} else if (target < pointer->timestamp[0]) {
+				target = pointer->timestamp[0];
+			}
+
+			alpha = (double) ((int64_t) target - (int64_t) pointer->timestamp[0]) / (double) delta;
+
+			event->x = pointer->x[0] + (pointer->x[1] - pointer->x[0]) * alpha;
+			event->y = pointer->y[0] + (pointer->y[1] - pointer->y[0]) * alpha;
+			event->timestamp = target;
+
+			resampler->n_resampled++;
+		}
+
+		if (event->timestamp < pointer->last_sent_timestamp) {
+			event->timestamp = pointer->last_sent_timestamp;
+		}
+		pointer->last_sent_timestamp = event->timestamp;
+	}
+
+	return n_events;
+}
@@ -0,0 +1,100 @@
+#include <inttypes.h>
+
+#include <latency_histogram.h>
+
+void latency_histogram_init(
+	struct latency_histogram *histogram,
+	const char *name
+) {
+	histogram->name = name;
+
+	for (int i = 0; i < LATENCY_HISTOGRAM_N_BUCKETS; i++) {
+		atomic_init(histogram->buckets + i, 0);
+	}
+
+	atomic_init(&histogram->n_samples, 0);
+	atomic_init(&histogram->total_ns, 0);
+	atomic_init(&histogram->max_ns, 0);
+}
+
+/// The (exclusive) upper edge of the bucket, in nanoseconds.
+static uint64_t get_bucket_upper_edge_ns(unsigned int bucket) {
+	return (1ull << bucket) * 1000;
+}
+
+uint64_t latency_histogram_get_percentile(
+	struct latency_histogram *histogram,
+	double percentile
+) {
+	uint64_t n_samples, rank, seen, max;
+
+	n_samples = 0;
+	for (int i = 0; i < LATENCY_HISTOGRAM_N_BUCKETS; i++) {
+		n_samples += atomic_load_explicit(histogram->buckets + i, memory_order_relaxed);
+	}
+
+	if (n_samples == 0) {
+		return 0;
+	}
+
+	rank = (uint64_t) (percentile / 100.0 * n_samples + 0.5);
+	if (rank < 1) {
+		rank = 1;
+	} else if (rank > n_samples) {
+		rank = n_samples;
+	}
+
+	max = atomic_load_explicit(&histogram->max_ns, memory_order_relaxed);
+
+	seen = 0;
+	for (int i = 0; i < LATENCY_HISTOGRAM_N_BUCKETS; i++) {
+		seen += atomic_load_explicit(histogram->buckets + i, memory_order_relaxed);
+		if (seen >= rank) {
+			return (i == LATENCY_HISTOGRAM_N_BUCKETS - 1) || (get_bucket_upper_edge_ns(i) > max) ? max : get_bucket_upper_edge_ns(i);
+		}
+	}
+
+	return max;
+}
+
+void latency_histogram_print(
+	struct latency_histogram *histogram,
+	FILE *file
+) {
+	uint64_t n_samples, total_ns, count;
+
+	n_samples = atomic_load_explicit(&histogram->n_samples, memory_order_relaxed);
+	total_ns = atomic_load_explicit(&histogram->total_ns, memory_order_relaxed);
+
+	if (n_samples == 0) {
+		fprintf(file, "  %-32s no samples\n", histogram->name);
+		return;
+	}
+
+	fprintf(
+		file,
+		"  %-32s n=%-9" PRIu64 " avg=%8.3fms p50<=%8.3fms p95<=%8.3fms p99<=%8.3fms max=%8.3fms\n",
+		histogram->name,
+		n_samples,
+		total_ns / (double) n_samples / 1000000.0,
+		latency_histogram_get_percentile(histogram, 50) / 1000000.0,
+		latency_histogram_get_percentile(histogram, 95) / 1000000.0,
+		latency_histogram_get_percentile(histogram, 99) / 1000000.0,
+		atomic_load_explicit(&histogram->max_ns, memory_order_relaxed) / 1000000.0
+	);
+
+	for (int i = 0; i < LATENCY_HISTOGRAM_N_BUCKETS; i++) {
+		count = atomic_load_explicit(histogram->buckets + i, memory_order_relaxed);
+		if (count == 0) {
+			continue;
+		}
+
+		if (i == 0) {
+			fprintf(file, "    %10s < %7" PRIu64 "us: %" PRIu64 "\n", "", (uint64_t) 1, count);
+		} else if (i == LATENCY_HISTOGRAM_N_BUCKETS - 1) {
+			fprintf(file, "    %7" PRIu64 "us <= %10s: %" PRIu64 "\n", (uint64_t) 1 << (i - 1), "", count);
+		} else {
+			fprintf(file, "    %7" PRIu64 "us .. %7" PRIu64 "us: %" PRIu64 "\n", (uint64_t) 1 << (i - 1), (uint64_t) 1 << i, count);
+		}
+	}
+}
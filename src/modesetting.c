@@ -11,6 +11,26 @@
 
 #include <modesetting.h>
 
+static const char *drm_property_names[kDrmPropertyCount] = {
+    [kDrmPropertyFbId] = "FB_ID",
+    [kDrmPropertyCrtcId] = "CRTC_ID",
+    [kDrmPropertySrcX] = "SRC_X",
+    [kDrmPropertySrcY] = "SRC_Y",
+    [kDrmPropertySrcW] = "SRC_W",
+    [kDrmPropertySrcH] = "SRC_H",
+    [kDrmPropertyCrtcX] = "CRTC_X",
+    [kDrmPropertyCrtcY] = "CRTC_Y",
+    [kDrmPropertyCrtcW] = "CRTC_W",
+    [kDrmPropertyCrtcH] = "CRTC_H",
+    [kDrmPropertyZpos] = "zpos",
+    [kDrmPropertyRotation] = "rotation",
+    [kDrmPropertyModeId] = "MODE_ID",
+    [kDrmPropertyActive] = "ACTIVE",
+    [kDrmPropertyInFenceFd] = "IN_FENCE_FD",
+    [kDrmPropertyFbDamageClips] = "FB_DAMAGE_CLIPS",
+    [kDrmPropertyOutFencePtr] = "OUT_FENCE_PTR"
+};
+
 static int drmdev_lock(struct drmdev *drmdev) {
     return pthread_mutex_lock(&drmdev->mutex);
 }
@@ -19,6 +39,26 @@ static int drmdev_unlock(struct drmdev *drmdev) {
     return pthread_mutex_unlock(&drmdev->mutex);
 }
 
+/**
+ * @brief Look up the IDs of all the properties in enum drm_property
+ * in the properties of a DRM object.
+ */
+static void resolve_property_ids(
+    const drmModeObjectProperties *props,
+    drmModePropertyRes **props_info,
+    uint32_t prop_ids_out[kDrmPropertyCount]
+) {
+    for (int i = 0; i < kDrmPropertyCount; i++) {
+        prop_ids_out[i] = 0;
+        for (int j = 0; j < props->count_props; j++) {
+            if (strcmp(props_info[j]->name, drm_property_names[i]) == 0) {
+                prop_ids_out[i] = props_info[j]->prop_id;
+                break;
+            }
+        }
+    }
+}
+
 static int fetch_connectors(struct drmdev *drmdev, struct drm_connector **connectors_out, size_t *n_connectors_out) {
     struct drm_connector *connectors;
     int n_allocated_connectors;
@@ -76,6 +116,7 @@ static int fetch_connectors(struct drmdev *drmdev, struct drm_connector **connec
         connectors[i].connector = connector;
         connectors[i].props = props;
         connectors[i].props_info = props_info;
+        resolve_property_ids(props, props_info, connectors[i].prop_ids);
     }
 
     *connectors_out = connectors;
@@ -225,6 +266,7 @@ static int fetch_crtcs(struct drmdev *drmdev, struct drm_crtc **crtcs_out, size_
         crtcs[i].crtc = crtc;
         crtcs[i].props = props;
         crtcs[i].props_info = props_info;
+        resolve_property_ids(props, props_info, crtcs[i].prop_ids);
         
         crtcs[i].index = i;
         crtcs[i].bitmask = 1 << i;
@@ -334,6 +376,7 @@ static int fetch_planes(struct drmdev *drmdev, struct drm_plane **planes_out, si
         planes[i].plane = plane;
         planes[i].props = props;
         planes[i].props_info = props_info;
+        resolve_property_ids(props, props_info, planes[i].prop_ids);
     }
 
     *planes_out = planes;
@@ -609,6 +652,13 @@ static int get_plane_property_index_by_name(
     return prop_index;
 }
 
+struct drm_plane *drmdev_get_plane(
+    struct drmdev *drmdev,
+    uint32_t plane_id
+) {
+    return get_plane_by_id(drmdev, plane_id);
+}
+
 int drmdev_plane_get_type(
     struct drmdev *drmdev,
     uint32_t plane_id
@@ -855,18 +905,46 @@ int drmdev_new_atomic_req(
         }
     }
 
+    memcpy(req->initial_available_planes_storage, req->available_planes_storage, sizeof(req->available_planes_storage));
+    req->n_initial_available_planes = req->available_planes.count_pointers;
+
     *req_out = req;
     
     return 0;
 }
 
+static void destroy_atomic_req_blobs(
+    struct drmdev_atomic_req *req
+) {
+    // The kernel keeps its own reference to blobs that are part of the committed state,
+    // so we can destroy them as soon as the commit ioctl returned.
+    for (int i = 0; i < req->n_blobs; i++) {
+        drmModeDestroyPropertyBlob(req->drmdev->fd, req->blob_ids[i]);
+    }
+
+    req->n_blobs = 0;
+}
+
 void drmdev_destroy_atomic_req(
     struct drmdev_atomic_req *req
 ) {
+    destroy_atomic_req_blobs(req);
     drmModeAtomicFree(req->atomic_req);
     free(req);
 }
 
+void drmdev_atomic_req_reset(
+    struct drmdev_atomic_req *req
+) {
+    // this only rewinds the property cursor, the memory of the request is kept.
+    drmModeAtomicSetCursor(req->atomic_req, 0);
+
+    destroy_atomic_req_blobs(req);
+
+    memcpy(req->available_planes_storage, req->initial_available_planes_storage, sizeof(req->available_planes_storage));
+    req->available_planes.count_pointers = req->n_initial_available_planes;
+}
+
 int drmdev_atomic_req_put_connector_property(
     struct drmdev_atomic_req *req,
     const char *name,
@@ -986,6 +1064,94 @@ int drmdev_atomic_req_put_plane_property(
     return EINVAL;
 }
 
+/**
+ * @brief Add a property to the atomic request using its cached ID.
+ */
+static int put_cached_property(
+    struct drmdev_atomic_req *req,
+    uint32_t object_id,
+    const uint32_t prop_ids[kDrmPropertyCount],
+    enum drm_property prop,
+    uint64_t value
+) {
+    int ok;
+
+    if (prop_ids[prop] == 0) {
+        return EINVAL;
+    }
+
+    ok = drmModeAtomicAddProperty(req->atomic_req, object_id, prop_ids[prop], value);
+    if (ok < 0) {
+        ok = errno;
+        fprintf(stderr, "[modesetting] Could not add %s property to atomic request. drmModeAtomicAddProperty: %s\n", drm_property_names[prop], strerror(ok));
+        return ok;
+    }
+
+    return 0;
+}
+
+int drmdev_atomic_req_put_plane_prop(
+    struct drmdev_atomic_req *req,
+    const struct drm_plane *plane,
+    enum drm_property prop,
+    uint64_t value
+) {
+    return put_cached_property(req, plane->plane->plane_id, plane->prop_ids, prop, value);
+}
+
+int drmdev_atomic_req_put_crtc_prop(
+    struct drmdev_atomic_req *req,
+    enum drm_property prop,
+    uint64_t value
+) {
+    return put_cached_property(req, req->drmdev->selected_crtc->crtc->crtc_id, req->drmdev->selected_crtc->prop_ids, prop, value);
+}
+
+int drmdev_atomic_req_put_connector_prop(
+    struct drmdev_atomic_req *req,
+    enum drm_property prop,
+    uint64_t value
+) {
+    return put_cached_property(req, req->drmdev->selected_connector->connector->connector_id, req->drmdev->selected_connector->prop_ids, prop, value);
+}
+
+int drmdev_atomic_req_put_plane_damage_clips(
+    struct drmdev_atomic_req *req,
+    const struct drm_plane *plane,
+    const struct drm_mode_rect *clips,
+    int n_clips
+) {
+    uint32_t blob_id;
+    int ok;
+
+    if (plane->prop_ids[kDrmPropertyFbDamageClips] == 0) {
+        return 0;
+    }
+
+    if (req->n_blobs == sizeof(req->blob_ids) / sizeof(*req->blob_ids)) {
+        return ENOSPC;
+    }
+
+    ok = drmModeCreatePropertyBlob(req->drmdev->fd, clips, n_clips * sizeof(*clips), &blob_id);
+    if (ok < 0) {
+        ok = errno;
+        perror("[modesetting] Could not create damage clips blob. drmModeCreatePropertyBlob");
+        return ok;
+    }
+
+    ok = put_cached_property(req, plane->plane->plane_id, plane->prop_ids, kDrmPropertyFbDamageClips, blob_id);
+    if (ok != 0) {
+        drmModeDestroyPropertyBlob(req->drmdev->fd, blob_id);
+        return ok;
+    }
+
+    req->blob_ids[req->n_blobs] = blob_id;
+    req->blob_planes[req->n_blobs] = plane;
+    req->n_blobs++;
+
+    return 0;
+}
+
 int drmdev_atomic_req_put_modeset_props(
     struct drmdev_atomic_req *req,
     uint32_t *flags
@@ -998,19 +1164,19 @@ int drmdev_atomic_req_put_modeset_props(
         return ok;
     }
 
-    ok = drmdev_atomic_req_put_connector_property(req, "CRTC_ID", req->drmdev->selected_crtc->crtc->crtc_id);
+    ok = drmdev_atomic_req_put_connector_prop(req, kDrmPropertyCrtcId, req->drmdev->selected_crtc->crtc->crtc_id);
     if (ok != 0) {
         drmdev_destroy_atomic_req(augment);
         return ok;
     }
 
-    ok = drmdev_atomic_req_put_crtc_property(req, "MODE_ID", req->drmdev->selected_mode_blob_id);
+    ok = drmdev_atomic_req_put_crtc_prop(req, kDrmPropertyModeId, req->drmdev->selected_mode_blob_id);
     if (ok != 0) {
         drmdev_destroy_atomic_req(augment);
         return ok;
     }
 
-    ok = drmdev_atomic_req_put_crtc_property(req, "ACTIVE", 1);
+    ok = drmdev_atomic_req_put_crtc_prop(req, kDrmPropertyActive, 1);
     if (ok != 0) {
         drmdev_destroy_atomic_req(augment);
         return ok;
@@ -1033,6 +1199,37 @@ int drmdev_atomic_req_put_modeset_props(
     return 0;
 }
 
+int drmdev_atomic_req_merge(
+    struct drmdev_atomic_req *req,
+    struct drmdev_atomic_req *newer
+) {
+    int ok, n_blobs;
+
+    n_blobs = req->n_blobs + newer->n_blobs;
+    if (n_blobs > sizeof(req->blob_ids) / sizeof(*req->blob_ids)) {
+        return ENOSPC;
+    }
+
+    ok = drmModeAtomicMerge(req->atomic_req, newer->atomic_req);
+    if (ok < 0) {
+        ok = errno;
+        perror("[modesetting] Could not merge atomic requests. drmModeAtomicMerge");
+        return ok;
+    }
+
+    memcpy(req->blob_ids + req->n_blobs, newer->blob_ids, newer->n_blobs * sizeof(*newer->blob_ids));
+    memcpy(req->blob_planes + req->n_blobs, newer->blob_planes, newer->n_blobs * sizeof(*newer->blob_planes));
+    req->n_blobs = n_blobs;
+    newer->n_blobs = 0;
+
+    // A blob ID of 0 means the whole framebuffer is damaged.
+    for (int i = 0; i < req->n_blobs; i++) {
+        put_cached_property(req, req->blob_planes[i]->plane->plane_id, req->blob_planes[i]->prop_ids, kDrmPropertyFbDamageClips, 0);
+    }
+
+    return 0;
+}
+
 int drmdev_atomic_req_commit(
     struct drmdev_atomic_req *req,
     uint32_t flags,
@@ -0,0 +1,159 @@
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#	include <arm_neon.h>
+#	define PIXEL_COPY_USE_NEON
+#elif defined(__SSE2__)
+#	include <emmintrin.h>
+#	define PIXEL_COPY_USE_SSE2
+#endif
+
+#include <pixel_copy.h>
+
+#define PIXEL_AT(buffer, stride, x, y) ((uint32_t*) ((uint8_t*) (buffer) + (y) * (stride)) + (x))
+
+/// Reverses the pixels of every row. Used for 180 degrees, together with reversing the row order.
+static void copy_row_reversed(uint32_t *dst, const uint32_t *src, int width) {
+	int x = 0;
+
+#if defined(PIXEL_COPY_USE_NEON)
+	for (; x + 4 <= width; x += 4) {
+		uint32x4_t v = vrev64q_u32(vld1q_u32(src + x));
+		vst1q_u32(dst + width - x - 4, vcombine_u32(vget_high_u32(v), vget_low_u32(v)));
+	}
+#elif defined(PIXEL_COPY_USE_SSE2)
+	for (; x + 4 <= width; x += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i*) (src + x));
+		_mm_storeu_si128((__m128i*) (dst + width - x - 4), _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3)));
+	}
+#endif
+
+	for (; x < width; x++) {
+		dst[width - x - 1] = src[x];
+	}
+}
+
+/// Copies the 4x4 tile at (x, y) of src to its rotated position in dst.
+/// Column j of the tile becomes a row of dst, reversed for 90 degrees.
+static inline void copy_tile_transposed(
+	void *dst, size_t dst_stride,
+	const void *src, size_t src_stride,
+	int x, int y,
+	int width, int height,
+	int rotation
+) {
+#if defined(PIXEL_COPY_USE_NEON)
+	uint32x4_t r0 = vld1q_u32(PIXEL_AT(src, src_stride, x, y));
+	uint32x4_t r1 = vld1q_u32(PIXEL_AT(src, src_stride, x, y + 1));
+	uint32x4_t r2 = vld1q_u32(PIXEL_AT(src, src_stride, x, y + 2));
+	uint32x4_t r3 = vld1q_u32(PIXEL_AT(src, src_stride, x, y + 3));
+
+	uint32x4x2_t a = vtrnq_u32(r0, r1);
+	uint32x4x2_t b = vtrnq_u32(r2, r3);
+
+	uint32x4_t c[4] = {
+		vcombine_u32(vget_low_u32(a.val[0]), vget_low_u32(b.val[0])),
+		vcombine_u32(vget_low_u32(a.val[1]), vget_low_u32(b.val[1])),
+		vcombine_u32(vget_high_u32(a.val[0]), vget_high_u32(b.val[0])),
+		vcombine_u32(vget_high_u32(a.val[1]), vget_high_u32(b.val[1]))
+	};
+
+	for (int j = 0; j < 4; j++) {
+		if (rotation == 90) {
+			uint32x4_t v = vrev64q_u32(c[j]);
+			vst1q_u32(PIXEL_AT(dst, dst_stride, height - y - 4, x + j), vcombine_u32(vget_high_u32(v), vget_low_u32(v)));
+		} else {
+			vst1q_u32(PIXEL_AT(dst, dst_stride, y, width - x - j - 1), c[j]);
+		}
+	}
+#elif defined(PIXEL_COPY_USE_SSE2)
+	__m128i r0 = _mm_loadu_si128((const __m128i*) PIXEL_AT(src, src_stride, x, y));
+	__m128i r1 = _mm_loadu_si128((const __m128i*) PIXEL_AT(src, src_stride, x, y + 1));
+	__m128i r2 = _mm_loadu_si128((const __m128i*) PIXEL_AT(src, src_stride, x, y + 2));
+	__m128i r3 = _mm_loadu_si128((const __m128i*) PIXEL_AT(src, src_stride, x, y + 3));
+
+	__m128i t0 = _mm_unpacklo_epi32(r0, r1);
+	__m128i t1 = _mm_unpacklo_epi32(r2, r3);
+	__m128i t2 = _mm_unpackhi_epi32(r0, r1);
+	__m128i t3 = _mm_unpackhi_epi32(r2, r3);
+
+	__m128i c[4] = {
+		_mm_unpacklo_epi64(t0, t1),
+		_mm_unpackhi_epi64(t0, t1),
+		_mm_unpacklo_epi64(t2, t3),
+		_mm_unpackhi_epi64(t2, t3)
+	};
+
+	for (int j = 0; j < 4; j++) {
+		if (rotation == 90) {
+			_mm_storeu_si128((__m128i*) PIXEL_AT(dst, dst_stride, height - y - 4, x + j), _mm_shuffle_epi32(c[j], _MM_SHUFFLE(0, 1, 2, 3)));
+		} else {
+			_mm_storeu_si128((__m128i*) PIXEL_AT(dst, dst_stride, y, width - x - j - 1), c[j]);
+		}
+	}
+#else
+	for (int j = 0; j < 4; j++) {
+		for (int i = 0; i < 4; i++) {
+			if (rotation == 90) {
+				*PIXEL_AT(dst, dst_stride, height - y - i - 1, x + j) = *PIXEL_AT(src, src_stride, x + j, y + i);
+			} else {
+				*PIXEL_AT(dst, dst_stride, y + i, width - x - j - 1) = *PIXEL_AT(src, src_stride, x + j, y + i);
+			}
+		}
+	}
+#endif
+}
+
+/// Copies a single pixel to its rotated position. Used for the edges that don't fill a whole tile.
+static inline void copy_pixel_transposed(
+	void *dst, size_t dst_stride,
+	const void *src, size_t src_stride,
+	int x, int y,
+	int width, int height,
+	int rotation
+) {
+	if (rotation == 90) {
+		*PIXEL_AT(dst, dst_stride, height - y - 1, x) = *PIXEL_AT(src, src_stride, x, y);
+	} else {
+		*PIXEL_AT(dst, dst_stride, y, width - x - 1) = *PIXEL_AT(src, src_stride, x, y);
+	}
+}
+
+void pixel_copy_rotated_32(
+	void *dst,
+	size_t dst_stride,
+	const void *src,
+	size_t src_stride,
+	int width,
+	int height,
+	int rotation
+) {
+	int x, y;
+
+	if (rotation == 0) {
+		for (y = 0; y < height; y++) {
+			memcpy(PIXEL_AT(dst, dst_stride, 0, y), PIXEL_AT(src, src_stride, 0, y), width * 4);
+		}
+	} else if (rotation == 180) {
+		for (y = 0; y < height; y++) {
+			copy_row_reversed(PIXEL_AT(dst, dst_stride, 0, height - y - 1), PIXEL_AT(src, src_stride, 0, y), width);
+		}
+	} else if ((rotation == 90) || (rotation == 270)) {
+		for (y = 0; y + 4 <= height; y += 4) {
+			for (x = 0; x + 4 <= width; x += 4) {
+				copy_tile_transposed(dst, dst_stride, src, src_stride, x, y, width, height, rotation);
+			}
+			for (; x < width; x++) {
+				for (int i = 0; i < 4; i++) {
+					copy_pixel_transposed(dst, dst_stride, src, src_stride, x, y + i, width, height, rotation);
+				}
+			}
+		}
+		for (; y < height; y++) {
+			for (x = 0; x < width; x++) {
+				copy_pixel_transposed(dst, dst_stride, src, src_stride, x, y, width, height, rotation);
+			}
+		}
+	}
+}
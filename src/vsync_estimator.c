@@ -0,0 +1,179 @@
+#include <errno.h>
+#include <string.h>
+
+#include <vsync_estimator.h>
+
+void vsync_estimator_init(
+	struct vsync_estimator *estimator,
+	uint64_t nominal_period_ns
+) {
+	memset(estimator, 0, sizeof *estimator);
+
+	estimator->nominal_period_ns = nominal_period_ns;
+	estimator->period_ns = nominal_period_ns;
+}
+
+static void reset_history(struct vsync_estimator *estimator) {
+	estimator->n_samples = 0;
+	estimator->next_index = 0;
+	estimator->is_valid = false;
+	estimator->n_resets++;
+}
+
+/// Fits a line through the samples in the history.
+static void update_fit(struct vsync_estimator *estimator) {
+	unsigned int n, i, index, newest_index;
+	uint64_t sequence0, timestamp0;
+	double x, y, mean_x, mean_y, var_x, cov_xy, slope, intercept;
+
+	n = estimator->n_samples;
+	if (n < VSYNC_ESTIMATOR_MIN_SAMPLES) {
+		estimator->is_valid = false;
+		return;
+	}
+
+	newest_index = (estimator->next_index + VSYNC_ESTIMATOR_N_SAMPLES - 1) % VSYNC_ESTIMATOR_N_SAMPLES;
+
+	// make everything relative to the oldest sample,
+	// so the values fit into a double without losing precision.
+	index = (estimator->next_index + VSYNC_ESTIMATOR_N_SAMPLES - n) % VSYNC_ESTIMATOR_N_SAMPLES;
+	sequence0 = estimator->sequences[index];
+	timestamp0 = estimator->timestamps[index];
+
+	mean_x = 0;
+	mean_y = 0;
+	for (i = 0; i < n; i++, index = (index + 1) % VSYNC_ESTIMATOR_N_SAMPLES) {
+		mean_x += (double) (estimator->sequences[index] - sequence0);
+		mean_y += (double) (estimator->timestamps[index] - timestamp0);
+	}
+	mean_x /= n;
+	mean_y /= n;
+
+	var_x = 0;
+	cov_xy = 0;
+	index = (estimator->next_index + VSYNC_ESTIMATOR_N_SAMPLES - n) % VSYNC_ESTIMATOR_N_SAMPLES;
+	for (i = 0; i < n; i++, index = (index + 1) % VSYNC_ESTIMATOR_N_SAMPLES) {
+		x = (double) (estimator->sequences[index] - sequence0) - mean_x;
+		y = (double) (estimator->timestamps[index] - timestamp0) - mean_y;
+		var_x += x * x;
+		cov_xy += x * y;
+	}
+
+	if (var_x <= 0) {
+		estimator->is_valid = false;
+		return;
+	}
+
+	slope = cov_xy / var_x;
+
+	// don't trust estimates that are way off from the display mode.
+	if ((slope < estimator->nominal_period_ns * 0.5) || (slope > estimator->nominal_period_ns * 1.5)) {
+		estimator->is_valid = false;
+		return;
+	}
+
+	intercept = mean_y - slope * mean_x;
+
+	estimator->period_ns = slope;
+	estimator->anchor_ns = timestamp0 + (uint64_t) (intercept + slope * (double) (estimator->sequences[newest_index] - sequence0));
+	estimator->is_valid = true;
+}
+
+void vsync_estimator_add_vblank(
+	struct vsync_estimator *estimator,
+	uint64_t sequence,
+	uint64_t timestamp_ns
+) {
+	unsigned int newest_index;
+	uint64_t newest_sequence, newest_timestamp, expected;
+	double period, error;
+
+	if (estimator->n_samples > 0) {
+		newest_index = (estimator->next_index + VSYNC_ESTIMATOR_N_SAMPLES - 1) % VSYNC_ESTIMATOR_N_SAMPLES;
+		newest_sequence = estimator->sequences[newest_index];
+		newest_timestamp = estimator->timestamps[newest_index];
+
+		if ((sequence <= newest_sequence) || (timestamp_ns <= newest_timestamp)) {
+			// the vblank counter or the clock went backwards.
+			reset_history(estimator);
+		} else {
+			// check whether this vblank is roughly where we expected it.
+			period = vsync_estimator_get_period_ns(estimator);
+			expected = newest_timestamp + (uint64_t) (period * (double) (sequence - newest_sequence));
+			error = (double) timestamp_ns - (double) expected;
+
+			if ((error > period / 2) || (error < -period / 2)) {
+				reset_history(estimator);
+			}
+		}
+	}
+
+	estimator->sequences[estimator->next_index] = sequence;
+	estimator->timestamps[estimator->next_index] = timestamp_ns;
+	estimator->next_index = (estimator->next_index + 1) % VSYNC_ESTIMATOR_N_SAMPLES;
+	if (estimator->n_samples < VSYNC_ESTIMATOR_N_SAMPLES) {
+		estimator->n_samples++;
+	}
+
+	update_fit(estimator);
+}
+
+void vsync_estimator_add_vblank_timestamp(
+	struct vsync_estimator *estimator,
+	uint64_t timestamp_ns
+) {
+	unsigned int newest_index;
+	uint64_t newest_sequence, newest_timestamp, period, n_periods;
+
+	if (estimator->n_samples == 0) {
+		vsync_estimator_add_vblank(estimator, 1, timestamp_ns);
+		return;
+	}
+
+	newest_index = (estimator->next_index + VSYNC_ESTIMATOR_N_SAMPLES - 1) % VSYNC_ESTIMATOR_N_SAMPLES;
+	newest_sequence = estimator->sequences[newest_index];
+	newest_timestamp = estimator->timestamps[newest_index];
+
+	n_periods = 1;
+	if (timestamp_ns > newest_timestamp) {
+		period = vsync_estimator_get_period_ns(estimator);
+		n_periods = (timestamp_ns - newest_timestamp + period / 2) / period;
+		if (n_periods == 0) {
+			n_periods = 1;
+		}
+	}
+
+	vsync_estimator_add_vblank(estimator, newest_sequence + n_periods, timestamp_ns);
+}
+
+int vsync_estimator_predict(
+	struct vsync_estimator *estimator,
+	uint64_t now_ns,
+	uint64_t *last_vblank_ns_out,
+	uint64_t *next_vblank_ns_out
+) {
+	uint64_t n_periods, last_vblank;
+
+	if (!estimator->is_valid) {
+		return EAGAIN;
+	}
+
+	if (now_ns >= estimator->anchor_ns) {
+		n_periods = (uint64_t) ((double) (now_ns - estimator->anchor_ns) / estimator->period_ns);
+		last_vblank = estimator->anchor_ns + (uint64_t) (n_periods * estimator->period_ns);
+	} else {
+		// the anchor (the fitted timestamp of the last flip) can be
+		// slightly in the future compared to the actual flip.
+		last_vblank = estimator->anchor_ns - (uint64_t) estimator->period_ns;
+	}
+
+	if (last_vblank_ns_out != NULL) {
+		*last_vblank_ns_out = last_vblank;
+	}
+
+	if (next_vblank_ns_out != NULL) {
+		*next_vblank_ns_out = last_vblank + (uint64_t) estimator->period_ns;
+	}
+
+	return 0;
+}